@@ -50,7 +50,70 @@ extern "C" {
 #define ISCSI_HEADER_SIZE(hdr_digest) (ISCSI_RAW_HEADER_SIZE	\
   + (hdr_digest == ISCSI_HEADER_DIGEST_NONE?0:ISCSI_DIGEST_SIZE))
 
-#define SMALL_ALLOC_MAX_FREE (128) /* must be power of 2 */
+/* size of the data digest that follows DATA_SIZE bytes of payload */
+#define ISCSI_DATA_DIGEST_SIZE(data_digest, data_size)			\
+  ((data_digest) == ISCSI_DATA_DIGEST_NONE || (data_size) == 0		\
+   ? 0 : ISCSI_DIGEST_SIZE)
+
+/* Size classes of the small allocation slab, 64 bytes up to 4 kbyte.
+ * Larger allocations bypass the free lists.
+ */
+#define ISCSI_SLAB_MIN_SHIFT			6
+#define ISCSI_SLAB_CLASSES			7
+
+struct iscsi_slab_class {
+	void *free;                /* free list of objects */
+	uint32_t total;            /* objects carved from chunks */
+	uint32_t cached;           /* objects on the free list */
+	uint32_t in_use;
+	uint64_t allocs;
+	uint64_t hits;             /* allocations that did not call malloc */
+};
+
+/* Like the timer wheel this never points into the context itself. */
+struct iscsi_slab {
+	struct iscsi_slab_class classes[ISCSI_SLAB_CLASSES];
+	struct iscsi_slab_class large;
+	void *chunks;
+};
+
+/* Size of the per-context receive buffer. Incoming PDUs that fit are
+ * parsed in place straight out of this buffer so that a single recv()
+ * can deliver many PDUs without any per-PDU allocations.
+ */
+#define ISCSI_RX_BUFFER_SIZE			(64 * 1024)
+/* Data-In payloads at least this large that are not yet fully buffered
+ * are read directly into the task's user iovectors instead.
+ */
+#define ISCSI_RX_DIRECT_MIN			(32 * 1024)
+
+/* Timer wheel geometry. Level 0 has 1ms slots and the four levels
+ * together cover 2^24 ms (~4.6 hours) before timers are parked.
+ */
+#define ISCSI_TIMER_BITS			6
+#define ISCSI_TIMER_SLOTS			(1 << ISCSI_TIMER_BITS)
+#define ISCSI_TIMER_LEVELS			4
+
+typedef void (*iscsi_timer_cb)(struct iscsi_context *iscsi,
+			       void *private_data);
+
+struct iscsi_timer {
+	struct iscsi_timer *next;
+	struct iscsi_timer *prev;
+	uint64_t expires;          /* absolute, iscsi_monotonic_ms() */
+	int slot;                  /* 0 when not armed, else wheel slot + 1 */
+	iscsi_timer_cb cb;
+	void *private_data;
+};
+
+/* Only holds pointers to timers, never to itself, so it survives the
+ * context being memcpy()ed around during reconnect.
+ */
+struct iscsi_timer_wheel {
+	uint64_t now;              /* next tick that has not been processed */
+	int count;
+	struct iscsi_timer *slots[ISCSI_TIMER_LEVELS * ISCSI_TIMER_SLOTS];
+};
 
 struct iscsi_in_pdu {
 	struct iscsi_in_pdu *next;
@@ -60,6 +123,15 @@ struct iscsi_in_pdu {
 
 	long long data_pos;
 	unsigned char *data;
+
+	/* header storage for PDUs that are read directly from the socket */
+	unsigned char hdr_buf[ISCSI_RAW_HEADER_SIZE + ISCSI_DIGEST_SIZE];
+
+	/* running data digest and the received digest, only used when
+	 * DataDigest is negotiated
+	 */
+	uint32_t data_crc;
+	unsigned char data_digest[ISCSI_DIGEST_SIZE];
 };
 void iscsi_free_iscsi_in_pdu(struct iscsi_context *iscsi, struct iscsi_in_pdu *in);
 
@@ -82,6 +154,10 @@ struct iscsi_context {
 	char target_address[MAX_STRING_SIZE+1];  /* If a redirect */
 	char connected_portal[MAX_STRING_SIZE+1];
 	char portal[MAX_STRING_SIZE+1];
+	/* where the target has permanently moved portal to, logins go
+	 * there instead until it fails.
+	 */
+	char redirect_portal[MAX_STRING_SIZE+1];
 	char alias[MAX_STRING_SIZE+1];
 	char bind_interfaces[MAX_STRING_SIZE+1];
 
@@ -115,6 +191,8 @@ struct iscsi_context {
 	enum iscsi_header_digest want_header_digest;
     // 头部摘要大小
 	enum iscsi_header_digest header_digest;
+	enum iscsi_data_digest want_data_digest;
+	enum iscsi_data_digest data_digest;
 
 	int fd;
 	int is_connected;
@@ -149,22 +227,85 @@ struct iscsi_context {
 	void *connect_data;
 
 	struct iscsi_pdu *outqueue;
+	/* ends of the outqueue segments, see iscsi_add_to_outqueue() */
+	struct iscsi_pdu *outqueue_last_imm;
+	struct iscsi_pdu *outqueue_last_dataout;
+	struct iscsi_pdu *outqueue_tail;
+	uint32_t outqueue_count;
     // 当前输出队列
 	struct iscsi_pdu *outqueue_current;
 	struct iscsi_pdu *waitpdu;
+	struct iscsi_pdu *waitpdu_tail;
+	uint32_t waitpdu_count;
+	/* waitpdu hashed by itt, see iscsi_waitpdu_find() */
+	struct iscsi_pdu **itt_table;
+	uint32_t itt_table_size;
 
 	struct iscsi_in_pdu *incoming;
 
+	/* receive buffer, bytes [rx_pos, rx_len) are not yet parsed */
+	unsigned char *rxbuf;
+	size_t rx_pos;
+	size_t rx_len;
+	int rx_busy;	/* a PDU inside rxbuf is being processed */
+	int rx_more;	/* the last read stopped before the socket was drained */
+
 	uint32_t max_burst_length;
 	uint32_t first_burst_length;
     // 发起者最大接收数据段长度
 	uint32_t initiator_max_recv_data_segment_length;
     // 目标最大接收数据段长度
 	uint32_t target_max_recv_data_segment_length;
+	/* what we offer at login, kept across reconnects */
+	uint32_t want_max_burst_length;
+	uint32_t want_first_burst_length;
+	uint32_t want_max_recv_data_segment_length;
+	int autotune;
 	enum iscsi_initial_r2t want_initial_r2t;
 	enum iscsi_initial_r2t use_initial_r2t;
 	enum iscsi_immediate_data want_immediate_data;
 	enum iscsi_immediate_data use_immediate_data;
+	uint32_t want_max_outstanding_r2t;
+	uint32_t max_outstanding_r2t;
+	int want_error_recovery_level;
+	int error_recovery_level;
+	uint32_t time2retain;
+	/* ErrorRecoveryLevel 2. Until the deadline a reconnect logs in a
+	 * new connection to the same session instead of a new session, and
+	 * the tasks the target already has, those below the ExpCmdSN of the
+	 * login, are reassigned to it. See iscsi_reconnect_cb().
+	 */
+	uint64_t recovery_deadline;
+	uint32_t recovery_expcmdsn;
+
+	/* splitting of large READ16/WRITE16, see split.c */
+	int split_io;
+	uint32_t max_xfer_len;	/* in blocks from the Block Limits VPD, 0 is no limit */
+	struct iscsi_split_io *split_ios;
+
+	/* merging of adjacent READ16/WRITE16, see merge.c */
+	uint32_t merge_max_bytes;	/* 0 is disabled */
+	int merge_hold_ms;
+	struct iscsi_merge_io *merge_pending;
+	struct iscsi_merge_io *merge_ios;
+
+	/* commands from other threads, see submit.c */
+	struct iscsi_submit_queue *submit;
+
+	/* full duplex, a thread of its own writes to the socket. See
+	 * iscsi_tx_handoff() in socket.c.
+	 */
+	int want_full_duplex;
+	struct iscsi_tx_thread *tx;
+
+	/* the event engine driving the session, see event_engine.c */
+	struct iscsi_engine_entry *engine_entry;
+
+	/* the executor shard owning the session, see executor.c */
+	struct iscsi_exec_session *exec;
+
+	/* completions of commands sent with ISCSI_CQ, see completion.c */
+	struct iscsi_cq *cq;
 
 	int lun;
     // 没有开启自动重新连接
@@ -185,20 +326,61 @@ struct iscsi_context {
 	int frees;
     // 分配计数
 	int smallocs;
-	void* smalloc_ptrs[SMALL_ALLOC_MAX_FREE];
-	int smalloc_free;
-	size_t smalloc_size;
+	struct iscsi_slab slab;
 	int cache_allocations;
 
     // 下一次重新连接时间
-	time_t next_reconnect;
-	int scsi_timeout;
+	uint64_t next_reconnect;   /* iscsi_monotonic_ms() */
+	/* see iscsi_set_reconnect_backoff() */
+	int reconnect_initial_ms;
+	int reconnect_max_ms;
+	int reconnect_jitter;
+	uint64_t reconnect_started; /* when the connection was lost */
+	struct iscsi_reconnect_stats reconnect_stats;
+	int scsi_timeout;          /* in ms, 0 == no timeout */
+	struct iscsi_timer_wheel timers;
     // 旧上下文
 	struct iscsi_context *old_iscsi;
 	int retry_cnt;
 	int no_ua_on_reconnect;
+
+	/* Multiple connections per session. Every additional connection
+	 * is a context of its own that points back to the leading
+	 * connection, see iscsi_session(). The leading connection owns
+	 * the CmdSN window, the ITT space and the slab allocator of the
+	 * session and keeps the additional connections on a list.
+	 */
+	struct iscsi_context *leader;
+	struct iscsi_context *connections;
+	struct iscsi_context *next_connection;
+	int want_max_connections;
+	int max_connections;	/* as negotiated, 1 if the target did not say */
+	int restore_connections;	/* to add again after a reconnect */
+	int connection_failed;
+	uint16_t cid;
+	uint16_t next_cid;
+	uint16_t tsih;
 };
 
+/* The leading connection of the session this connection belongs to. */
+static inline struct iscsi_context *
+iscsi_session(struct iscsi_context *iscsi)
+{
+	return iscsi->leader ? iscsi->leader : iscsi;
+}
+
+#define ISCSI_MAX_CONNECTIONS 16
+
+/* login redirects followed before giving up */
+#define ISCSI_MAX_REDIRECTS 8
+
+/* seconds, offered with ErrorRecoveryLevel 2 */
+#define ISCSI_DEFAULT_TIME2RETAIN 20
+
+#define ISCSI_DEFAULT_RECONNECT_INITIAL_MS 1000
+#define ISCSI_DEFAULT_RECONNECT_MAX_MS     30000
+#define ISCSI_DEFAULT_RECONNECT_JITTER     10
+
 #define ISCSI_PDU_IMMEDIATE		       0x40
 
 #define ISCSI_PDU_TEXT_FINAL		       0x80
@@ -238,6 +420,7 @@ enum iscsi_opcode {
 	ISCSI_PDU_TEXT_REQUEST                   = 0x04,
 	ISCSI_PDU_DATA_OUT                       = 0x05,
 	ISCSI_PDU_LOGOUT_REQUEST                 = 0x06,
+	ISCSI_PDU_SNACK_REQUEST                  = 0x10,
 	ISCSI_PDU_NOP_IN                         = 0x20,
 	ISCSI_PDU_SCSI_RESPONSE                  = 0x21,
 	ISCSI_PDU_SCSI_TASK_MANAGEMENT_RESPONSE  = 0x22,
@@ -261,6 +444,8 @@ struct iscsi_scsi_cbdata {
 
 struct iscsi_pdu {
 	struct iscsi_pdu *next;
+	struct iscsi_pdu *prev;		/* only valid while on outqueue/waitpdu */
+	struct iscsi_pdu *itt_next;	/* itt hash chain */
 
 /* There will not be a response to this pdu, so delete it once it is sent on the wire. Don't put it on the wait-queue */
 #define ISCSI_PDU_DELETE_WHEN_SENT	0x00000001
@@ -270,6 +455,8 @@ struct iscsi_pdu {
 #define ISCSI_PDU_DROP_ON_RECONNECT	0x00000004
 /* stop sending after this PDU has been sent */
 #define ISCSI_PDU_CORK_WHEN_SENT	0x00000008
+/* internal, set while the PDU is on the outqueue */
+#define ISCSI_PDU_IN_OUTQUEUE		0x00000100
 
 	uint32_t flags;
 
@@ -284,22 +471,66 @@ struct iscsi_pdu {
 	void *private_data;
 
 	/* Used to track writing the iscsi header to the socket */
-	struct iscsi_data outdata; /* Header for PDU to send */
+	struct iscsi_data outdata; /* Header for PDU to send, points to
+				      hdr_buf unless data was added */
 	size_t outdata_written;	   /* How much of the header we have written */
 
 	/* Used to track writing the payload data to the socket */
 	uint32_t payload_offset;   /* Offset of payload data to write */
 	uint32_t payload_len;      /* Amount of payload data to write */
-	uint32_t payload_written;  /* How much of the payload we have written */
-
+	uint32_t payload_written;  /* How much of the payload, padding and
+				      data digest we have written */
+	/* DATA-OUT sequences are sent from a single pdu. payload_offset,
+	 * payload_len and datasn describe the current segment, this is what
+	 * is left of the sequence after it.
+	 */
+	uint32_t dataout_remaining;
+	/* Data digest of the current segment. data_crc covers the first
+	 * data_crc_pos bytes of the payload, data_digest is sent after
+	 * the padding once all of it has been covered.
+	 */
+	uint32_t data_crc;
+	uint32_t data_crc_pos;
+	unsigned char data_digest[ISCSI_DIGEST_SIZE];
 
 	struct iscsi_data indata;
+	/* next DataSN/R2TSN we expect for the command and, with
+	 * ErrorRecoveryLevel 1, what we asked the target to send again.
+	 * See snack.c.
+	 */
+	uint32_t exp_datasn;
+	struct iscsi_snack *snack;
 
 	struct iscsi_scsi_cbdata scsi_cbdata;
-	time_t scsi_timeout;
+	uint64_t scsi_timeout;     /* deadline, iscsi_monotonic_ms(), 0 == none */
+	struct iscsi_timer timer;
 	uint32_t expxferlen;
+
+	/* BHS and header digest, so that PDUs without a data segment
+	 * need no allocation besides the pdu itself.
+	 */
+	unsigned char hdr_buf[ISCSI_RAW_HEADER_SIZE + ISCSI_DIGEST_SIZE];
+
+	/* Full duplex. The transmit thread owns the pdu, apart from the
+	 * waitpdu linkage, until it has written tx_seq pdus. For a command
+	 * this includes the DATA-OUT handed over for it.
+	 */
+	uint64_t tx_seq;
+	struct iscsi_pdu *tx_next;
 };
 
+/* DATA-OUT and SNACK belong to a command that has already been sent.
+ * They are queued with the CmdSN of that command but do not carry one.
+ */
+static inline int
+iscsi_pdu_follows_command(const struct iscsi_pdu *pdu)
+{
+	unsigned char opcode = pdu->outdata.data[0] & 0x3f;
+
+	return opcode == ISCSI_PDU_DATA_OUT ||
+		opcode == ISCSI_PDU_SNACK_REQUEST;
+}
+
 struct iscsi_pdu *iscsi_allocate_pdu(struct iscsi_context *iscsi,
 				     enum iscsi_opcode opcode,
 				     enum iscsi_opcode response_opcode,
@@ -324,12 +555,16 @@ int iscsi_pdu_add_data(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
 int iscsi_queue_pdu(struct iscsi_context *iscsi, struct iscsi_pdu *pdu);
 int iscsi_add_data(struct iscsi_context *iscsi, struct iscsi_data *data,
 		   const unsigned char *dptr, int dsize, int pdualignment);
+int iscsi_add_data_at(struct iscsi_context *iscsi, struct iscsi_data *data,
+		      uint32_t offset, const unsigned char *dptr, int dsize);
 
 struct scsi_task;
 void iscsi_pdu_set_cdb(struct iscsi_pdu *pdu, struct scsi_task *task);
 
 int iscsi_get_pdu_data_size(const unsigned char *hdr);
 int iscsi_get_pdu_padding_size(const unsigned char *hdr);
+int iscsi_verify_header_digest(struct iscsi_context *iscsi,
+			       struct iscsi_in_pdu *in);
 int iscsi_process_pdu(struct iscsi_context *iscsi, struct iscsi_in_pdu *in);
 
 int iscsi_process_login_reply(struct iscsi_context *iscsi,
@@ -365,6 +600,8 @@ void iscsi_set_error(struct iscsi_context *iscsi, const char *error_string,
 struct scsi_iovector *iscsi_get_scsi_task_iovector_in(struct iscsi_context *iscsi, struct iscsi_in_pdu *in);
 struct scsi_iovector *iscsi_get_scsi_task_iovector_out(struct iscsi_context *iscsi, struct iscsi_pdu *pdu);
 void scsi_task_reset_iov(struct scsi_iovector *iovector);
+void scsi_task_set_read16_cdb(struct scsi_task *task, uint64_t lba, uint32_t xferlen, int blocksize, int rdprotect, int dpo, int fua, int fua_nv, int group_number);
+void scsi_task_set_write16_cdb(struct scsi_task *task, uint64_t lba, uint32_t xferlen, int blocksize, int wrprotect, int dpo, int fua, int fua_nv, int group_number);
 
 void* iscsi_malloc(struct iscsi_context *iscsi, size_t size);
 void* iscsi_zmalloc(struct iscsi_context *iscsi, size_t size);
@@ -373,9 +610,23 @@ void iscsi_free(struct iscsi_context *iscsi, void* ptr);
 char* iscsi_strdup(struct iscsi_context *iscsi, const char* str);
 void* iscsi_smalloc(struct iscsi_context *iscsi, size_t size);
 void* iscsi_szmalloc(struct iscsi_context *iscsi, size_t size);
+void* iscsi_srealloc(struct iscsi_context *iscsi, void* ptr, size_t size);
 void iscsi_sfree(struct iscsi_context *iscsi, void* ptr);
+uint32_t iscsi_slab_in_use(struct iscsi_context *iscsi);
+void iscsi_slab_destroy(struct iscsi_context *iscsi);
 
 uint32_t crc32c(uint8_t *buf, int len);
+/* raw crc32c state update, no pre/post inversion */
+uint32_t crc32c_update(uint32_t crc, const uint8_t *buf, size_t len);
+/* memcpy that also folds the copied bytes into a raw crc32c state */
+uint32_t crc32c_copy(uint32_t crc, uint8_t *dst, const uint8_t *src, size_t len);
+
+struct crc32c_impl {
+	const char *name;
+	uint32_t (*update)(uint32_t crc, const uint8_t *buf, size_t len);
+};
+/* the implementations usable on this cpu, the last one is the default */
+const struct crc32c_impl *crc32c_get_impls(int *count);
 
 struct scsi_task *iscsi_scsi_get_task_from_pdu(struct iscsi_pdu *pdu);
 
@@ -393,11 +644,25 @@ iscsi_log_message(struct iscsi_context *iscsi, int level, const char *format, ..
 
 void
 iscsi_add_to_outqueue(struct iscsi_context *iscsi, struct iscsi_pdu *pdu);
+void
+iscsi_remove_from_outqueue(struct iscsi_context *iscsi, struct iscsi_pdu *pdu);
 
 int iscsi_serial32_compare(uint32_t s1, uint32_t s2);
 
 uint32_t iscsi_itt_post_increment(struct iscsi_context *iscsi);
 
+void iscsi_waitpdu_add(struct iscsi_context *iscsi, struct iscsi_pdu *pdu);
+int iscsi_waitpdu_remove(struct iscsi_context *iscsi, struct iscsi_pdu *pdu);
+struct iscsi_pdu *iscsi_waitpdu_find(struct iscsi_context *iscsi, uint32_t itt);
+
+uint64_t iscsi_monotonic_ms(void);
+void iscsi_timer_add(struct iscsi_context *iscsi, struct iscsi_timer *timer,
+		     uint64_t expires, iscsi_timer_cb cb, void *private_data);
+void iscsi_timer_del(struct iscsi_context *iscsi, struct iscsi_timer *timer);
+void iscsi_timer_run(struct iscsi_context *iscsi, uint64_t now);
+int iscsi_timer_next(struct iscsi_context *iscsi, uint64_t now);
+
+void iscsi_pdu_arm_timeout(struct iscsi_context *iscsi, struct iscsi_pdu *pdu);
 void iscsi_timeout_scan(struct iscsi_context *iscsi);
 
 void iscsi_reconnect_cb(struct iscsi_context *iscsi, int status,
@@ -411,6 +676,74 @@ void iscsi_tcp_free_pdu(struct iscsi_context *iscsi, struct iscsi_pdu *pdu);
 
 int iscsi_service_reconnect_if_loggedin(struct iscsi_context *iscsi);
 
+struct iscsi_context *iscsi_mcs_pick_connection(struct iscsi_context *iscsi);
+void iscsi_mcs_connection_failed(struct iscsi_context *iscsi);
+void iscsi_mcs_drop_connections(struct iscsi_context *iscsi, int requeue);
+void iscsi_mcs_release_cmdsn(struct iscsi_context *iscsi, struct iscsi_pdu *pdu);
+
+int iscsi_split_needed(struct iscsi_context *iscsi, uint32_t datalen,
+		       int blocksize);
+struct scsi_task *iscsi_split_rw16_task(struct iscsi_context *iscsi, int lun,
+		int write, uint64_t lba, unsigned char *data, uint32_t datalen,
+		int blocksize, int protect, int dpo, int fua, int fua_nv,
+		int group_number, iscsi_command_cb cb, void *private_data,
+		struct scsi_iovec *iov, int niov);
+int iscsi_split_cancel_task(struct iscsi_context *iscsi, struct scsi_task *task);
+
+int iscsi_merge_wanted(struct iscsi_context *iscsi, uint32_t datalen,
+		       int protect, int fua, int fua_nv);
+struct scsi_task *iscsi_merge_rw16_task(struct iscsi_context *iscsi, int lun,
+		int write, uint64_t lba, unsigned char *data, uint32_t datalen,
+		int blocksize, int dpo, int group_number, iscsi_command_cb cb,
+		void *private_data, struct scsi_iovec *iov, int niov);
+void iscsi_merge_flush(struct iscsi_context *iscsi);
+int iscsi_merge_cancel_task(struct iscsi_context *iscsi, struct scsi_task *task);
+
+int iscsi_submit_drain(struct iscsi_context *iscsi);
+void iscsi_submit_destroy(struct iscsi_context *iscsi);
+
+/* wakes up a thread sleeping in poll(), see submit.c */
+struct iscsi_wakeup {
+	int fd[2];
+	int signalled;
+};
+
+int iscsi_wakeup_open(struct iscsi_wakeup *w);
+void iscsi_wakeup_close(struct iscsi_wakeup *w);
+void iscsi_wakeup_signal(struct iscsi_wakeup *w);
+void iscsi_wakeup_clear(struct iscsi_wakeup *w);
+
+int iscsi_tx_start(struct iscsi_context *iscsi);
+void iscsi_tx_stop(struct iscsi_context *iscsi);
+int iscsi_tx_busy(struct iscsi_context *iscsi, struct iscsi_pdu *pdu);
+void iscsi_tx_wait(struct iscsi_context *iscsi, struct iscsi_pdu *pdu);
+
+/* tell the event engine, if any, that the events or the descriptors the
+ * session wants may have changed. See event_engine.c.
+ */
+void iscsi_engine_touch(struct iscsi_context *iscsi);
+void iscsi_engine_fd_closing(struct iscsi_context *iscsi, int fd);
+void iscsi_engine_fd_replaced(struct iscsi_context *iscsi, int fd);
+void iscsi_engine_forget(struct iscsi_context *iscsi);
+int iscsi_engine_add_wakeup(struct iscsi_event_engine *engine, int fd);
+
+void iscsi_exec_forget(struct iscsi_context *iscsi);
+
+void iscsi_cq_destroy(struct iscsi_context *iscsi);
+
+int iscsi_snack_check_sn(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
+			 struct iscsi_in_pdu *in);
+int iscsi_snack_hold_status(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
+			    struct iscsi_in_pdu *in);
+struct iscsi_in_pdu *iscsi_snack_release_status(struct iscsi_pdu *pdu);
+int iscsi_snack_data_digest_error(struct iscsi_context *iscsi,
+				  struct iscsi_in_pdu *in);
+void iscsi_snack_free(struct iscsi_context *iscsi, struct iscsi_pdu *pdu);
+uint32_t iscsi_snack_first_missing(struct iscsi_pdu *pdu);
+
+int iscsi_task_reassign(struct iscsi_context *iscsi, struct iscsi_pdu *old_pdu);
+int iscsi_reissue_command(struct iscsi_context *iscsi, struct iscsi_pdu *pdu);
+
 void iscsi_dump_pdu_header(struct iscsi_context *iscsi, unsigned char *data);
 
 union socket_address;
@@ -42,6 +42,22 @@ struct scsi_iovec;
 #define LIBISCSI_FEATURE_IOVECTOR (1)
 #define LIBISCSI_FEATURE_NOP_COUNTER (1)
 #define LIBISCSI_FEATURE_ISER (1)
+#define LIBISCSI_FEATURE_TIMEOUT_MS (1)
+#define LIBISCSI_FEATURE_DATA_DIGEST (1)
+#define LIBISCSI_FEATURE_ALLOC_STATS (1)
+#define LIBISCSI_FEATURE_REARM_TASK (1)
+#define LIBISCSI_FEATURE_MCS (1)
+#define LIBISCSI_FEATURE_SESSION_GROUP (1)
+#define LIBISCSI_FEATURE_SPLIT_IO (1)
+#define LIBISCSI_FEATURE_MERGE_IO (1)
+#define LIBISCSI_FEATURE_ERROR_RECOVERY_LEVEL (1)
+#define LIBISCSI_FEATURE_TASK_REASSIGN (1)
+#define LIBISCSI_FEATURE_RECONNECT_BACKOFF (1)
+#define LIBISCSI_FEATURE_THREADED_SUBMIT (1)
+#define LIBISCSI_FEATURE_FULL_DUPLEX (1)
+#define LIBISCSI_FEATURE_EVENT_ENGINE (1)
+#define LIBISCSI_FEATURE_EXECUTOR (1)
+#define LIBISCSI_FEATURE_COMPLETION_RING (1)
 
 // 最大字符串大小
 #define MAX_STRING_SIZE (255)
@@ -61,6 +77,39 @@ enum iscsi_transport_type {
 
 EXTERN void iscsi_set_cache_allocations(struct iscsi_context *iscsi, int ca);
 
+/*
+ * Statistics for the small allocation cache of a context. PDUs, their
+ * data segments and incoming PDU state are allocated from per-context
+ * free lists, one per power of two size class. Once the lists have grown
+ * to the queue depth in use, sending a command does not call malloc().
+ *
+ * size   : object size of the class, 0 for the last entry which counts
+ *          allocations too large for any class, or all allocations when
+ *          iscsi_set_cache_allocations(iscsi, 0) is used.
+ * allocs : number of allocations from this class.
+ * hits   : allocations served from the free list without calling malloc().
+ * in_use : objects currently allocated.
+ * cached : objects on the free list.
+ * total  : objects the class has grown to.
+ */
+struct iscsi_alloc_stats {
+	uint32_t size;
+	uint32_t in_use;
+	uint32_t cached;
+	uint32_t total;
+	uint64_t allocs;
+	uint64_t hits;
+};
+
+#define ISCSI_ALLOC_STATS_MAX 8
+
+/*
+ * Fill in up to max entries of stats, one per size class in ascending
+ * order. Returns the number of entries filled in.
+ */
+EXTERN int iscsi_get_alloc_stats(struct iscsi_context *iscsi,
+				 struct iscsi_alloc_stats *stats, int max);
+
 /*
  * The following three functions are used to integrate libiscsi in an event
  * system.
@@ -95,7 +144,6 @@ EXTERN int iscsi_queue_length(struct iscsi_context *iscsi);
  */
 EXTERN int iscsi_out_queue_length(struct iscsi_context *iscsi);
 
-
 /************************************************************
  * Timeout Handling.
  * Libiscsi does not use or interface with any system timers.
@@ -106,7 +154,8 @@ EXTERN int iscsi_out_queue_length(struct iscsi_context *iscsi);
  * device your application to call out to iscsi_service() at regular
  * intervals.
  * An easy way to do this is calling iscsi_service(iscsi, 0), i.e.
- * by passing 0 as the revents arguments once every second or so.
+ * by passing 0 as the revents arguments once every second or so,
+ * or when the time returned by iscsi_get_next_timeout_ms() has passed.
  ************************************************************/
 
 /*
@@ -138,6 +187,29 @@ EXTERN int iscsi_out_queue_length(struct iscsi_context *iscsi);
  */
 EXTERN int iscsi_set_timeout(struct iscsi_context *iscsi, int timeout);
 
+/*
+ * Same as iscsi_set_timeout() but with millisecond granularity.
+ *
+ * Default is 0 == no timeout.
+ */
+EXTERN int iscsi_set_timeout_ms(struct iscsi_context *iscsi, int timeout_ms);
+
+/*
+ * Returns the number of milliseconds until libiscsi next needs
+ * iscsi_service() to be called even if there is no activity on the
+ * socket, e.g. because a task is about to time out or a reconnect
+ * attempt is due. Returns 0 if that is already the case and -1 if
+ * nothing is pending.
+ *
+ * This can be passed straight to poll() as the timeout argument:
+ *
+ * pfd.fd = iscsi_get_fd(iscsi);
+ * pfd.events = iscsi_which_events(iscsi);
+ * ret = poll(&pfd, 1, iscsi_get_next_timeout_ms(iscsi));
+ * iscsi_service(iscsi, ret > 0 ? pfd.revents : 0);
+ */
+EXTERN int iscsi_get_next_timeout_ms(struct iscsi_context *iscsi);
+
 /*
  * To set tcp keepalive for the session.
  * Only options supported by given platform (if any) are set.
@@ -187,6 +259,155 @@ enum iscsi_initial_r2t {
 EXTERN int
 iscsi_set_initial_r2t(struct iscsi_context *iscsi, enum iscsi_initial_r2t initial_r2t);
 
+/*
+ * This function is used to set how many R2Ts the target may have
+ * outstanding for a single write, 1 to 65535. This can be set on a
+ * context before it has been logged in to the target. With more than
+ * one the target can ask for several bursts of data at once instead of
+ * one burst per round trip.
+ *
+ * Default is for libiscsi to offer MaxOutstandingR2T=1
+ */
+EXTERN int
+iscsi_set_max_outstanding_r2t(struct iscsi_context *iscsi, int count);
+/*
+ * Returns the MaxOutstandingR2T negotiated with the target.
+ */
+EXTERN int
+iscsi_get_max_outstanding_r2t(struct iscsi_context *iscsi);
+
+/*
+ * This function is used to set the ErrorRecoveryLevel to offer during
+ * login, 0, 1 or 2. This can be set on a context before it has been logged
+ * in to the target. At level 1 a Data-In or R2T that went missing, or a
+ * Data-In that failed its data digest, is asked for again with a SNACK
+ * and the connection is kept. At level 0 the connection is dropped and
+ * the commands in flight are sent again once the session has been
+ * reconnected. A failed header digest always drops the connection.
+ * At level 2 a session with a single connection is not reconnected but
+ * continued on a new connection, and commands the target has already
+ * received are moved over to it with TASK REASSIGN instead of being sent
+ * again. Only data that did not make it is transferred again.
+ * Levels 1 and 2 are not offered over iSER.
+ *
+ * Default is for libiscsi to offer ErrorRecoveryLevel=0
+ */
+EXTERN int
+iscsi_set_error_recovery_level(struct iscsi_context *iscsi, int level);
+/*
+ * Returns the ErrorRecoveryLevel negotiated with the target.
+ */
+EXTERN int
+iscsi_get_error_recovery_level(struct iscsi_context *iscsi);
+
+/*
+ * These functions are used to set the MaxBurstLength and
+ * FirstBurstLength to offer and the MaxRecvDataSegmentLength to declare
+ * during login, 512 to 16777215 bytes. They can be set on a context
+ * before it has been logged in to the target and are used again when
+ * the session is reconnected.
+ *
+ * Default is 262144 for all three.
+ */
+EXTERN int
+iscsi_set_max_burst_length(struct iscsi_context *iscsi, int len);
+EXTERN int
+iscsi_set_first_burst_length(struct iscsi_context *iscsi, int len);
+EXTERN int
+iscsi_set_max_recv_data_segment_length(struct iscsi_context *iscsi, int len);
+/*
+ * Return the MaxBurstLength and FirstBurstLength negotiated with the
+ * target and the MaxRecvDataSegmentLength we declared.
+ */
+EXTERN int
+iscsi_get_max_burst_length(struct iscsi_context *iscsi);
+EXTERN int
+iscsi_get_first_burst_length(struct iscsi_context *iscsi);
+EXTERN int
+iscsi_get_max_recv_data_segment_length(struct iscsi_context *iscsi);
+
+/*
+ * Auto-tune MaxBurstLength and MaxRecvDataSegmentLength for a logged in
+ * normal session. A range of lengths from 64kb to 1Mb is tried, each
+ * with a new login followed by ~100ms of reads from the start of the
+ * LUN, and the session is left logged in with the fastest one. The
+ * result can be read back with the getters above. FirstBurstLength is
+ * capped to the chosen MaxBurstLength. Writes are not used, so the data
+ * on the LUN is not touched.
+ *
+ * Returns:
+ *  0 if the session is logged in with the fastest lengths.
+ * <0 if there was an error. The lengths from before are used again.
+ */
+EXTERN int
+iscsi_autotune_sync(struct iscsi_context *iscsi, int lun);
+/*
+ * When enabled, iscsi_full_connect_sync() runs iscsi_autotune_sync()
+ * on the LUN once it has logged in to a normal session.
+ *
+ * Default is disabled.
+ */
+EXTERN void
+iscsi_set_autotune(struct iscsi_context *iscsi, int enable);
+
+/*
+ * Split large READ16 and WRITE16 commands.
+ *
+ * When enabled, iscsi_full_connect_[a]sync() reads the Block Limits VPD
+ * page of the LUN after every login, and iscsi_read16_[iov_]task() and
+ * iscsi_write16_[iov_]task() split a transfer longer than its MAXIMUM
+ * TRANSFER LENGTH into several commands that are all sent at once. The
+ * callback is invoked a single time once all of them have completed,
+ * with the first status that was not GOOD, its sense data and the sum
+ * of the residuals. The pieces are independent commands, a failed
+ * transfer may have been partially carried out. The task can be
+ * cancelled with iscsi_scsi_cancel_task() like any other task.
+ *
+ * Default is disabled. Must be set before logging in.
+ *
+ * Returns:
+ *  0 on success.
+ * <0 if already logged in.
+ */
+EXTERN int
+iscsi_set_split_io(struct iscsi_context *iscsi, int enable);
+/*
+ * The MAXIMUM TRANSFER LENGTH in blocks used for splitting, 0 if splitting
+ * is disabled or the LUN has no limit.
+ */
+EXTERN uint32_t
+iscsi_get_max_transfer_length(struct iscsi_context *iscsi);
+
+/*
+ * Merge adjacent READ16 and WRITE16 commands.
+ *
+ * When enabled, iscsi_read16_[iov_]task() and iscsi_write16_[iov_]task()
+ * hold a command back for up to hold_ms milliseconds. Commands that follow
+ * on the same LUN, in the same direction and start where the previous one
+ * ended are sent together with it as a single command of at most
+ * max_bytes, using an iovector that gathers all their buffers. Commands
+ * with FUA or protection information are never merged, and any other
+ * command sends the held back ones first.
+ *
+ * Every command still gets its own callback. If the merged command fails
+ * with a SCSI status the commands are sent again one by one so each gets
+ * its own status and sense data.
+ *
+ * The hold time is driven by iscsi_service(), applications that use this
+ * must wait no longer than iscsi_get_next_timeout_ms() in poll(). With a
+ * hold time of 0 the commands submitted before the next iscsi_service()
+ * are merged.
+ *
+ * Default is disabled. A max_bytes of 0 disables merging.
+ *
+ * Returns:
+ *  0 on success.
+ * <0 if hold_ms is negative.
+ */
+EXTERN int
+iscsi_set_merge_io(struct iscsi_context *iscsi, uint32_t max_bytes,
+		   int hold_ms);
+
 
 /*
  * This function is used to parse an iSCSI URL into a iscsi_url structure.
@@ -292,7 +513,9 @@ EXTERN int iscsi_set_targetname(struct iscsi_context *iscsi, const char *targetn
 
 /*
  * This function returns any target address supplied in a login response when
- * the target has moved.
+ * the target has moved. Logins follow such a redirect on their own. After
+ * a permanent one, later logins and reconnects of the context go straight
+ * to the new address until a login there fails.
  */
 EXTERN const char *iscsi_get_target_address(struct iscsi_context *iscsi);
 
@@ -341,6 +564,31 @@ enum iscsi_header_digest {
 EXTERN int iscsi_set_header_digest(struct iscsi_context *iscsi,
 			    enum iscsi_header_digest header_digest);
 
+/*
+ * Types of data digest we support. Default is NONE
+ */
+enum iscsi_data_digest {
+	ISCSI_DATA_DIGEST_NONE        = 0,
+	ISCSI_DATA_DIGEST_NONE_CRC32C = 1,
+	ISCSI_DATA_DIGEST_CRC32C_NONE = 2,
+	ISCSI_DATA_DIGEST_CRC32C      = 3,
+	ISCSI_DATA_DIGEST_LAST        = ISCSI_DATA_DIGEST_CRC32C
+};
+
+/*
+ * Set the desired data digest for a scsi context.
+ * The data digest covers the payload of every PDU that carries data,
+ * DATA-IN, DATA-OUT, immediate data and text/login payloads.
+ * Data digest can only be set/changed before the context
+ * is logged in to the target. It is never used for iSER.
+ *
+ * Returns:
+ *  0: success
+ * <0: error
+ */
+EXTERN int iscsi_set_data_digest(struct iscsi_context *iscsi,
+			    enum iscsi_data_digest data_digest);
+
 /*
  * Specify the username and password to use for chap authentication
  */
@@ -509,6 +757,10 @@ EXTERN int iscsi_reconnect_sync(struct iscsi_context *iscsi);
  * connection is not progressing.  It does not over-ride any existing re-try
  * backoff or max retries state.
  *
+ * At ErrorRecoveryLevel 2 it does not continue the session on a new
+ * connection but always logs in a new session, negotiating all parameters
+ * again.
+ *
  * Returns:
  *  0 reconnect was successful
  * <0 error
@@ -580,6 +832,98 @@ EXTERN int iscsi_logout_async(struct iscsi_context *iscsi, iscsi_command_cb cb,
 EXTERN int iscsi_logout_sync(struct iscsi_context *iscsi);
 
 
+/************************************************************
+ * Multiple connections per session (MC/S).
+ *
+ * A normal session over TCP can use more than one TCP connection. The
+ * connections share the CmdSN window of the session and every SCSI
+ * command is sent on the connection with the fewest commands queued or
+ * in flight. A command stays on the connection it was sent on, its
+ * DATA-OUT and its response use the same connection.
+ *
+ * Once logged in, add connections up to the number returned by
+ * iscsi_get_max_connections(). Each connection has a file descriptor
+ * of its own, all of them must be polled and serviced:
+ *
+ * n = iscsi_get_connection_count(iscsi);
+ * for (i = 0; i < n; i++) {
+ *     pfd[i].fd = iscsi_get_connection_fd(iscsi, i);
+ *     pfd[i].events = iscsi_which_connection_events(iscsi, i);
+ * }
+ * ret = poll(pfd, n, iscsi_get_next_timeout_ms(iscsi));
+ * for (i = 0; i < n; i++) {
+ *     iscsi_service_connection(iscsi, i, ret > 0 ? pfd[i].revents : 0);
+ * }
+ *
+ * Connection 0 is the leading connection, the one iscsi_get_fd(),
+ * iscsi_which_events() and iscsi_service() operate on. The indexes stay
+ * the same until the next call to iscsi_add_connection_async(), which
+ * releases connections that failed to log in. A file descriptor of -1
+ * means the connection is gone and should be left out of the poll set.
+ *
+ * With ErrorRecoveryLevel 0 the loss of any connection fails the session.
+ * The session is then reconnected like a single connection session
+ * and the additional connections are added back once it is logged in.
+ *
+ * Callbacks for commands sent on any of the connections are invoked
+ * with the context of the session.
+ ************************************************************/
+/*
+ * Set the number of connections to offer as MaxConnections during login.
+ * This can only be set before the context is logged in.
+ * Default is 1.
+ *
+ * Returns:
+ *  0: success
+ * <0: error
+ */
+EXTERN int iscsi_set_max_connections(struct iscsi_context *iscsi, int count);
+/*
+ * Returns the number of connections the target allows in the session,
+ * including the leading one.
+ */
+EXTERN int iscsi_get_max_connections(struct iscsi_context *iscsi);
+/*
+ * Asynchronous call to add a connection to a logged in session.
+ *
+ * Returns:
+ *  0 if the connection attempt was started successfully.
+ *    In this case the callback will be invoked once the connection has
+ *    logged in, or failed to.
+ * <0 if there was an error. The callback will not be invoked.
+ *
+ * Callback parameters :
+ * status can be either of :
+ *    SCSI_STATUS_GOOD     : The connection is part of the session.
+ *    SCSI_STATUS_ERROR    : Failed to connect or log in.
+ *
+ * command_data is always NULL.
+ */
+EXTERN int iscsi_add_connection_async(struct iscsi_context *iscsi,
+				      iscsi_command_cb cb, void *private_data);
+/*
+ * Synchronous call to add a connection to a logged in session.
+ *
+ * Returns:
+ *  0 if the connection has logged in.
+ * <0 if there was an error.
+ */
+EXTERN int iscsi_add_connection_sync(struct iscsi_context *iscsi);
+/*
+ * Number of connections of the session, including the leading one.
+ */
+EXTERN int iscsi_get_connection_count(struct iscsi_context *iscsi);
+/*
+ * Per connection versions of iscsi_get_fd(), iscsi_which_events() and
+ * iscsi_service(). idx is 0 for the leading connection.
+ */
+EXTERN int iscsi_get_connection_fd(struct iscsi_context *iscsi, int idx);
+EXTERN int iscsi_which_connection_events(struct iscsi_context *iscsi,
+					 int idx);
+EXTERN int iscsi_service_connection(struct iscsi_context *iscsi, int idx,
+				    int revents);
+
+
 struct iscsi_target_portal {
        struct iscsi_target_portal *next;
        char *portal;
@@ -824,6 +1168,250 @@ EXTERN int iscsi_scsi_command_async(struct iscsi_context *iscsi, int lun,
 			     struct scsi_task *task, iscsi_command_cb cb,
 			     struct iscsi_data *data, void *private_data);
 
+/*
+ * Submitting commands from other threads.
+ *
+ * A context is not thread safe, all calls are made from the one thread
+ * that services it. With threaded submission enabled other threads can
+ * hand commands to that thread with iscsi_submit_task(). It takes the
+ * same arguments as iscsi_scsi_command_async() but only puts the task on
+ * a lock free queue and wakes the service thread. The next call to
+ * iscsi_service() sends everything that was submitted, in order, and the
+ * callbacks are invoked from the service thread as usual.
+ *
+ * The tasks can be built in any thread with the scsi_cdb_*() functions
+ * of scsi-lowlevel.h. A task is owned by the library from the moment it
+ * is submitted until its callback has been invoked.
+ *
+ * iscsi_set_threaded_submit() is called by the service thread before any
+ * other thread submits. Disabling it sends what is still queued, no other
+ * thread may submit while it is called. Returns 0 on success and -1 if
+ * the platform does not support it.
+ *
+ * iscsi_get_submit_fd() returns a descriptor to poll for POLLIN next to
+ * the one of iscsi_get_fd(). When it is readable call iscsi_service(),
+ * with revents 0 if the socket itself has no events. Returns -1 if
+ * threaded submission is not enabled. The synchronous functions poll it
+ * by themselves.
+ *
+ * iscsi_submit_task() can be called from any thread. It returns 0 if the
+ * task was queued, or -1 with errno set if threaded submission is not
+ * enabled or there is no memory. iscsi_get_error() is not set since it
+ * belongs to the service thread.
+ */
+EXTERN int iscsi_set_threaded_submit(struct iscsi_context *iscsi, int enable);
+EXTERN int iscsi_get_submit_fd(struct iscsi_context *iscsi);
+EXTERN int iscsi_submit_task(struct iscsi_context *iscsi, int lun,
+			     struct scsi_task *task, iscsi_command_cb cb,
+			     struct iscsi_data *data, void *private_data);
+
+/*
+ * Full duplex.
+ *
+ * Normally iscsi_service() reads what the target sent and then writes
+ * what is queued, so a long stream of writes delays the processing of
+ * responses and a long stream of reads delays sending new commands.
+ * With full duplex enabled the library starts a transmit thread for
+ * every connection once it has logged in. That thread writes to the
+ * socket while the thread that calls iscsi_service() reads from it and
+ * processes the responses, so a session can keep two cores busy.
+ *
+ * Nothing changes for the application. The context is still serviced
+ * from a single thread, which is also where all callbacks are invoked.
+ * iscsi_which_events() only asks for POLLOUT when there are PDUs to hand
+ * over to the transmit thread.
+ *
+ * Must be set before logging in. Returns 0 on success and -1 if the
+ * platform does not support it or the context is already logged in.
+ */
+EXTERN int iscsi_set_full_duplex(struct iscsi_context *iscsi, int enable);
+
+/*
+ * Event engine.
+ *
+ * Drives any number of contexts from one thread, in place of a poll()
+ * loop over iscsi_get_fd(), iscsi_which_events() and iscsi_service().
+ * It is built on epoll and a timerfd and is only available on Linux.
+ * The sockets are registered edge-triggered and their registration is
+ * only changed when the events a context waits for change. The cost of
+ * an iteration depends on the number of contexts that have something to
+ * do, not on the number of contexts.
+ *
+ * iscsi_event_engine_add() hands a context, the leading connection of a
+ * session, to the engine, including its additional connections and its
+ * submit queue. It can be added before or after it connects. If
+ * iscsi_service() fails for it the engine removes it and invokes cb with
+ * SCSI_STATUS_ERROR, the application may destroy it from there.
+ * Destroying a context removes it from its engine.
+ *
+ * iscsi_event_engine_run_once() waits up to timeout_ms, -1 to wait
+ * forever, for events and timeouts and services the contexts that have
+ * any. All callbacks are invoked from it. Commands that are queued
+ * outside of a callback are sent on its next call. It returns the number
+ * of contexts it serviced, or -1 if epoll failed.
+ *
+ * iscsi_event_engine_get_fd() returns a descriptor that is readable when
+ * iscsi_event_engine_run_once() has work to do, so that the engine can
+ * be nested inside another event loop. Commands queued outside of a
+ * callback are not seen by it, call iscsi_event_engine_run_once() with
+ * a timeout of 0 after queueing them.
+ *
+ * An engine is used from a single thread. iscsi_event_engine_create()
+ * returns NULL if the platform does not support it.
+ * iscsi_event_engine_destroy() removes the contexts that are still on
+ * the engine but does not destroy them.
+ */
+struct iscsi_event_engine;
+
+EXTERN struct iscsi_event_engine *iscsi_event_engine_create(void);
+EXTERN void iscsi_event_engine_destroy(struct iscsi_event_engine *engine);
+EXTERN int iscsi_event_engine_add(struct iscsi_event_engine *engine,
+				  struct iscsi_context *iscsi,
+				  iscsi_command_cb cb, void *private_data);
+EXTERN int iscsi_event_engine_remove(struct iscsi_event_engine *engine,
+				     struct iscsi_context *iscsi);
+EXTERN int iscsi_event_engine_run_once(struct iscsi_event_engine *engine,
+				       int timeout_ms);
+EXTERN int iscsi_event_engine_get_fd(struct iscsi_event_engine *engine);
+
+/*
+ * Executor.
+ *
+ * Runs sessions on a number of shards, each a thread of its own with its
+ * own event engine, so that the load of many sessions can be spread over
+ * the cores. A session is owned by one shard while it is on the
+ * executor. All its callbacks are invoked on that shard's thread and no
+ * other thread touches the context. Pin each shard to a core with
+ * iscsi_executor_set_affinity() for a thread-per-core design. It is only
+ * available on Linux.
+ *
+ * iscsi_executor_create() creates num_shards shards, at most
+ * ISCSI_EXECUTOR_MAX_SHARDS, iscsi_executor_start() starts them.
+ * iscsi_executor_destroy() stops them, must not be called from a shard,
+ * and gives the sessions that are still on the executor back to the
+ * caller without destroying them. Commands that were not sent yet are
+ * completed with SCSI_STATUS_CANCELLED, functions that did not run yet
+ * are dropped.
+ *
+ * iscsi_executor_add() hands a context, the leading connection of a
+ * session, to a shard, or to the shard with the fewest sessions if shard
+ * is -1. The context can be connected already or be connected from a
+ * function run on the shard. It must not be used afterwards other than
+ * from its shard or through the executor. If the session fails, or it
+ * cannot be put on the shard, it is taken off the executor again and cb
+ * is invoked on the shard with SCSI_STATUS_ERROR. group is -1 or the
+ * number of the session group, below ISCSI_EXECUTOR_MAX_GROUPS, that it
+ * is part of. iscsi_executor_remove() takes a context back, from the
+ * shard that owns it. A context must be removed before it is destroyed.
+ *
+ * iscsi_executor_call() runs fn on a shard. iscsi_executor_submit()
+ * sends a command on a session. On the shard that owns the session it
+ * is iscsi_scsi_command_async(). From anywhere else the command is
+ * passed to the shard through a ring, one for every pair of shards and
+ * one shared by all other threads, and if sending it fails later cb is
+ * invoked with SCSI_STATUS_ERROR. Both fail with errno EAGAIN if the
+ * ring is full.
+ *
+ * The sessions of a group can serve the same commands, for example
+ * several sessions to the same LUN. iscsi_executor_submit_group() queues
+ * a command for any session of the group, on the calling shard if it has
+ * sessions of the group or else on the least busy shard that has. A shard
+ * sends queued commands while its sessions of the group have less than
+ * the queue depth, iscsi_executor_set_queue_depth(), default 64, in
+ * flight. A shard that has room and no commands of its own takes half of
+ * the queue of the shard that has most queued. The callback is invoked
+ * on the shard that sent the command. Submitting fails with errno ENOENT
+ * if the group has no sessions. When the last session of a group is
+ * removed, also by iscsi_executor_destroy(), the commands still queued
+ * for the group are completed with SCSI_STATUS_CANCELLED and that
+ * session's context.
+ *
+ * iscsi_executor_current_shard() returns the shard the calling thread
+ * runs, or -1.
+ *
+ * Unless noted otherwise these return 0 on success or -1 and set errno.
+ * iscsi_executor_create() returns NULL if the platform does not support
+ * it and iscsi_executor_add() sets the error string of the context.
+ */
+#define ISCSI_EXECUTOR_MAX_SHARDS 64
+#define ISCSI_EXECUTOR_MAX_GROUPS 64
+
+struct iscsi_executor;
+
+typedef void (*iscsi_executor_cb)(struct iscsi_executor *ex, int shard,
+				  void *private_data);
+
+EXTERN struct iscsi_executor *iscsi_executor_create(int num_shards);
+EXTERN void iscsi_executor_destroy(struct iscsi_executor *ex);
+EXTERN int iscsi_executor_set_affinity(struct iscsi_executor *ex, int shard,
+				       int cpu);
+EXTERN int iscsi_executor_set_queue_depth(struct iscsi_executor *ex,
+					  int depth);
+EXTERN int iscsi_executor_start(struct iscsi_executor *ex);
+EXTERN int iscsi_executor_current_shard(struct iscsi_executor *ex);
+EXTERN int iscsi_executor_add(struct iscsi_executor *ex, int shard,
+			      struct iscsi_context *iscsi, int group,
+			      iscsi_command_cb cb, void *private_data);
+EXTERN int iscsi_executor_remove(struct iscsi_executor *ex,
+				 struct iscsi_context *iscsi);
+EXTERN int iscsi_executor_call(struct iscsi_executor *ex, int shard,
+			       iscsi_executor_cb fn, void *private_data);
+EXTERN int iscsi_executor_submit(struct iscsi_executor *ex,
+				 struct iscsi_context *iscsi, int lun,
+				 struct scsi_task *task, iscsi_command_cb cb,
+				 struct iscsi_data *d, void *private_data);
+EXTERN int iscsi_executor_submit_group(struct iscsi_executor *ex, int group,
+				       int lun, struct scsi_task *task,
+				       iscsi_command_cb cb,
+				       struct iscsi_data *d,
+				       void *private_data);
+
+/*
+ * Completion ring.
+ *
+ * Instead of having a callback invoked for every command while
+ * iscsi_service() processes the response, an application can have the
+ * completions queued on a ring of the context and collect them in
+ * batches. iscsi_set_completion_ring() creates a ring of at least
+ * <entries> entries, rounded up to a power of two and at most
+ * ISCSI_CQ_MAX_ENTRIES. It is called before logging in and the ring stays
+ * with the context, also across reconnects, until it is destroyed.
+ *
+ * Commands are sent with ISCSI_CQ as their callback, either with
+ * iscsi_scsi_command_async() or any of the iscsi_*_task() functions, and
+ * whatever was passed as private_data is handed back as user_data. When
+ * the command completes its task, status and user_data are added to the
+ * ring and no application code is called.
+ *
+ * iscsi_reap_completions() copies up to <max> completions, oldest first,
+ * into <entries> and returns how many it copied, 0 if there are none and
+ * -1 if the context has no ring. The task of every entry is owned by the
+ * application again and is freed with scsi_free_scsi_task() as usual. It
+ * is safe to send new commands while reaping. The ring never drops a
+ * completion; if it is full further ones are held back until there is
+ * room again, at the cost of an allocation each.
+ *
+ * Call iscsi_reap_completions() after every iscsi_service() or
+ * iscsi_event_engine_run_once(). The ring belongs to the thread that
+ * services the context. Tasks that are still in the ring when the
+ * context is destroyed are freed with it.
+ */
+#define ISCSI_CQ_MAX_ENTRIES (1 << 20)
+
+struct iscsi_completion {
+	struct scsi_task *task;
+	int status;
+	void *user_data;
+};
+
+EXTERN int iscsi_set_completion_ring(struct iscsi_context *iscsi,
+				     int entries);
+EXTERN void iscsi_cq_cb(struct iscsi_context *iscsi, int status,
+			void *command_data, void *private_data);
+#define ISCSI_CQ iscsi_cq_cb
+EXTERN int iscsi_reap_completions(struct iscsi_context *iscsi,
+				  struct iscsi_completion *entries, int max);
+
 /*
  * Async commands for SCSI
  *
@@ -991,6 +1579,30 @@ iscsi_write16_iov_task(struct iscsi_context *iscsi, int lun, uint64_t lba,
 		   unsigned char *data, uint32_t datalen, int blocksize,
 		   int wrprotect, int dpo, int fua, int fua_nv, int group_number,
 		   iscsi_command_cb cb, void *private_data, struct scsi_iovec *iov, int niov);
+
+/*
+ * Reuse a task that was set up with scsi_task_init() for a new READ16 or
+ * WRITE16, without allocating anything once the task and context have
+ * warmed up. The task must not be in flight, i.e. either be freshly
+ * initialised or its callback must have been invoked. iov may be NULL,
+ * in which case read data is returned in task->datain and write data
+ * is taken from data.
+ *
+ * Returns 0 if the command was queued and -1 on error.
+ */
+EXTERN int
+iscsi_read16_rearm_task(struct iscsi_context *iscsi, struct scsi_task *task,
+			int lun, uint64_t lba, uint32_t datalen, int blocksize,
+			int rdprotect, int dpo, int fua, int fua_nv,
+			int group_number, iscsi_command_cb cb,
+			void *private_data, struct scsi_iovec *iov, int niov);
+EXTERN int
+iscsi_write16_rearm_task(struct iscsi_context *iscsi, struct scsi_task *task,
+			 int lun, uint64_t lba, unsigned char *data,
+			 uint32_t datalen, int blocksize, int wrprotect,
+			 int dpo, int fua, int fua_nv, int group_number,
+			 iscsi_command_cb cb, void *private_data,
+			 struct scsi_iovec *iov, int niov);
 EXTERN struct scsi_task *
 iscsi_writeatomic16_task(struct iscsi_context *iscsi, int lun, uint64_t lba,
 			 unsigned char *data, uint32_t datalen, int blocksize,
@@ -1564,6 +2176,175 @@ iscsi_scsi_cancel_task(struct iscsi_context *iscsi,
 EXTERN void
 iscsi_scsi_cancel_all_tasks(struct iscsi_context *iscsi);
 
+
+/************************************************************
+ * Session groups.
+ *
+ * A session group is a number of independent sessions to the same
+ * target and LUN, each with its own ISID. SCSI commands are submitted
+ * to the group, which sends each of them on the logged in session with
+ * the fewest commands (or bytes) outstanding.
+ *
+ * When a session is lost and starts to reconnect, the commands queued
+ * on it are taken back and sent on the other sessions, and so are reads
+ * that were already in flight. Other commands the target may have seen
+ * stay and are sent again once the session is reinstated, so a write
+ * can not overtake a later one. If no other session is logged in all
+ * commands wait for the reconnect, like they would with a single
+ * session. If the session gives up reconnecting, its commands move to
+ * the other sessions.
+ *
+ * Every session has a file descriptor of its own, all of them must be
+ * polled and serviced:
+ *
+ * n = iscsi_session_group_get_count(group);
+ * for (i = 0; i < n; i++) {
+ *     pfd[i].fd = iscsi_session_group_get_fd(group, i);
+ *     pfd[i].events = iscsi_session_group_which_events(group, i);
+ * }
+ * ret = poll(pfd, n, iscsi_session_group_get_next_timeout_ms(group));
+ * for (i = 0; i < n; i++) {
+ *     iscsi_session_group_service(group, i, ret > 0 ? pfd[i].revents : 0);
+ * }
+ *
+ * Callbacks are invoked with the context of the session the command
+ * completed on.
+ ************************************************************/
+struct iscsi_session_group;
+
+enum iscsi_session_group_policy {
+	ISCSI_SESSION_GROUP_LEAST_COMMANDS = 0,
+	ISCSI_SESSION_GROUP_LEAST_BYTES    = 1
+};
+
+/*
+ * Create a group of count sessions. The sessions are not connected.
+ * Settings such as timeouts, digests or CHAP that are not part of the
+ * URL can be applied to each context from
+ * iscsi_session_group_get_context() before connecting.
+ */
+EXTERN struct iscsi_session_group *
+iscsi_create_session_group(const char *initiator_name, int count);
+
+/*
+ * Destroy the group and all of its sessions. Commands still outstanding
+ * complete with SCSI_STATUS_CANCELLED.
+ */
+EXTERN void iscsi_destroy_session_group(struct iscsi_session_group *group);
+
+EXTERN const char *
+iscsi_session_group_get_error(struct iscsi_session_group *group);
+
+EXTERN int iscsi_session_group_get_count(struct iscsi_session_group *group);
+
+/*
+ * The context of session idx of the group, NULL if idx is out of range.
+ */
+EXTERN struct iscsi_context *
+iscsi_session_group_get_context(struct iscsi_session_group *group, int idx);
+
+/*
+ * Select how the session for a command is chosen. Default is
+ * ISCSI_SESSION_GROUP_LEAST_COMMANDS.
+ */
+EXTERN int
+iscsi_session_group_set_policy(struct iscsi_session_group *group,
+			       enum iscsi_session_group_policy policy);
+
+/*
+ * Asynchronous call to connect and log in all sessions of the group to
+ * the target and LUN of the URL.
+ *
+ * Returns:
+ *  0 if the connects were started. The callback is invoked once all
+ *    sessions have logged in or failed to.
+ * <0 if there was an error. The callback will not be invoked.
+ *
+ * Callback parameters :
+ * status can be either of :
+ *    SCSI_STATUS_GOOD     : All sessions are logged in.
+ *    SCSI_STATUS_ERROR    : At least one session failed to log in.
+ *
+ * command_data is always NULL.
+ */
+EXTERN int
+iscsi_session_group_full_connect_async(struct iscsi_session_group *group,
+				       const char *url, iscsi_command_cb cb,
+				       void *private_data);
+/*
+ * Synchronous version of iscsi_session_group_full_connect_async().
+ *
+ * Returns:
+ *  0 if all sessions are logged in.
+ * <0 if there was an error.
+ */
+EXTERN int
+iscsi_session_group_full_connect_sync(struct iscsi_session_group *group,
+				      const char *url);
+/*
+ * Log out all sessions of the group.
+ *
+ * Returns:
+ *  0 if all sessions logged out.
+ * <0 if there was an error.
+ */
+EXTERN int
+iscsi_session_group_logout_sync(struct iscsi_session_group *group);
+
+/*
+ * Per session versions of iscsi_get_fd(), iscsi_which_events() and
+ * iscsi_service(). iscsi_session_group_service() returns <0 only if the
+ * session failed and there is no other session to use.
+ */
+EXTERN int iscsi_session_group_get_fd(struct iscsi_session_group *group,
+				      int idx);
+EXTERN int iscsi_session_group_which_events(struct iscsi_session_group *group,
+					    int idx);
+EXTERN int iscsi_session_group_service(struct iscsi_session_group *group,
+				       int idx, int revents);
+EXTERN int
+iscsi_session_group_get_next_timeout_ms(struct iscsi_session_group *group);
+
+/*
+ * Number of commands the group has outstanding on session idx.
+ */
+EXTERN int
+iscsi_session_group_queue_length(struct iscsi_session_group *group, int idx);
+
+/*
+ * Send a SCSI command on one of the sessions of the group. Same as
+ * iscsi_scsi_command_async(), see there for the parameters.
+ */
+EXTERN int
+iscsi_session_group_scsi_command_async(struct iscsi_session_group *group,
+				       int lun, struct scsi_task *task,
+				       iscsi_command_cb cb,
+				       struct iscsi_data *data,
+				       void *private_data);
+
+EXTERN struct scsi_task *
+iscsi_session_group_read16_task(struct iscsi_session_group *group, int lun,
+				uint64_t lba, uint32_t datalen, int blocksize,
+				int rdprotect, int dpo, int fua, int fua_nv,
+				int group_number, iscsi_command_cb cb,
+				void *private_data);
+
+EXTERN struct scsi_task *
+iscsi_session_group_write16_task(struct iscsi_session_group *group, int lun,
+				 uint64_t lba, unsigned char *data,
+				 uint32_t datalen, int blocksize,
+				 int wrprotect, int dpo, int fua, int fua_nv,
+				 int group_number, iscsi_command_cb cb,
+				 void *private_data);
+
+/*
+ * Cancel a command sent through the group. Same as
+ * iscsi_scsi_cancel_task().
+ */
+EXTERN int
+iscsi_session_group_cancel_task(struct iscsi_session_group *group,
+				struct scsi_task *task);
+
 /*
  * This function is to set the debugging level where level is
  *
@@ -1648,6 +2429,49 @@ iscsi_set_noautoreconnect(struct iscsi_context *iscsi, int state);
 EXTERN void
 iscsi_set_reconnect_max_retries(struct iscsi_context *iscsi, int count);
 
+/*
+ * Set how long to wait between tries when a reconnect fails, in
+ * milliseconds. The first retry waits initial_ms and every further one
+ * twice as long as the one before, up to max_ms. Each wait is made up to
+ * jitter percent shorter or longer at random so that the initiators of a
+ * target that comes back do not all log in at the same time. A session
+ * is also not reconnected more often than once every initial_ms.
+ *
+ * Default is initial_ms=1000, max_ms=30000 and jitter=10.
+ *
+ * Returns 0 on success, or -1 if the values are out of range.
+ */
+EXTERN int
+iscsi_set_reconnect_backoff(struct iscsi_context *iscsi, int initial_ms,
+			    int max_ms, int jitter);
+
+/*
+ * Reconnect statistics of a session.
+ *
+ * reconnects        : reconnects that succeeded.
+ * failed_attempts   : logins that failed while reconnecting.
+ * replayed          : commands sent again after a reconnect.
+ * reassigned        : commands moved to a new connection with TASK REASSIGN
+ *                     at ErrorRecoveryLevel 2, without sending them again.
+ * last_recovery_ms  : time from losing the connection until the session
+ *                     was logged in again, for the last reconnect.
+ * max_recovery_ms   : the longest of these.
+ * total_recovery_ms : all of them added up.
+ */
+struct iscsi_reconnect_stats {
+	uint32_t reconnects;
+	uint32_t failed_attempts;
+	uint64_t replayed;
+	uint64_t reassigned;
+	uint64_t last_recovery_ms;
+	uint64_t max_recovery_ms;
+	uint64_t total_recovery_ms;
+};
+
+EXTERN void
+iscsi_get_reconnect_stats(struct iscsi_context *iscsi,
+			  struct iscsi_reconnect_stats *stats);
+
 /* Set to true to have libiscsi use TESTUNITREADY and consume any/all
    UnitAttentions that may have triggered in the target.
  */
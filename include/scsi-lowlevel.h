@@ -36,6 +36,7 @@ extern "C" {
 #endif
 
 #define SCSI_CDB_MAX_SIZE			16
+#define SCSI_TASK_ARENA_SIZE			512
 
 enum scsi_opcode {
 	SCSI_OPCODE_TESTUNITREADY      = 0x00,
@@ -336,6 +337,13 @@ struct scsi_task {
 
 	struct scsi_iovector iovector_in;
 	struct scsi_iovector iovector_out;
+
+	/* private. Small scsi_malloc() allocations, such as the iovector
+	   for a data buffer or an unmarshalled cdb, are carved from
+	   the arena instead of the heap. */
+	int caller_owned;
+	size_t arena_used;
+	uint64_t arena[SCSI_TASK_ARENA_SIZE / sizeof(uint64_t)];
 };
 
 
@@ -348,9 +356,26 @@ EXTERN struct scsi_task *scsi_create_task(int cdb_size, unsigned char *cdb,
 /* This function will free a scsi task structure.
    You may NOT cancel a task until the callback has been invoked
    and the command has completed on the transport layer.
+   For a task set up with scsi_task_init() this frees everything the
+   task holds on to, but not the task itself.
 */
 EXTERN void scsi_free_scsi_task(struct scsi_task *task);
 
+/* Initialise a task in storage owned by the caller, e.g. embedded in
+   the application's own per-I/O structure, so that issuing a command
+   does not need to allocate one. Such a task can be reused for a new
+   command with iscsi_read16_rearm_task()/iscsi_write16_rearm_task() once
+   the callback for the previous command has been invoked.
+   Release it with scsi_free_scsi_task() when it is no longer needed.
+*/
+EXTERN void scsi_task_init(struct scsi_task *task);
+
+/* Release what a caller-owned task allocated for its previous command,
+   including task->datain, and reset it so it can carry a new command.
+   The private pointer is preserved.
+*/
+EXTERN void scsi_task_rearm(struct scsi_task *task);
+
 EXTERN void scsi_set_task_private_ptr(struct scsi_task *task, void *ptr);
 EXTERN void *scsi_get_task_private_ptr(struct scsi_task *task);
 
@@ -0,0 +1,233 @@
+/*
+   Copyright (C) 2010 by Ronnie Sahlberg <ronniesahlberg@gmail.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "iscsi.h"
+#include "iscsi-private.h"
+#include "scsi-lowlevel.h"
+
+/*
+ * Completion ring.
+ *
+ * Commands sent with ISCSI_CQ as their callback do not call back into the
+ * application. When their response is processed iscsi_cq_cb() only
+ * appends {task, status, private_data} to a ring owned by the session and
+ * the application collects them later, as many at a time as it likes,
+ * with iscsi_reap_completions(). That is also the place where it can
+ * submit new commands without nesting inside the processing of a PDU.
+ *
+ * The ring is only touched by the thread that services the context so it
+ * is a plain array with a free running head and tail. Should it fill up,
+ * because the application submits more commands than there are entries
+ * and does not reap in between, further completions are kept on an
+ * overflow list and moved into the ring as it drains. Entries never get
+ * lost and are reaped in the order they completed.
+ *
+ * After a reconnect the old connection shares the ring with the new one
+ * so that commands completed or cancelled there are still reaped.
+ */
+
+struct iscsi_cq_overflow {
+	struct iscsi_cq_overflow *next;
+	struct iscsi_completion c;
+};
+
+struct iscsi_cq {
+	struct iscsi_completion *entries;
+	uint32_t mask;
+	uint32_t head;
+	uint32_t tail;
+
+	struct iscsi_cq_overflow *overflow;
+	struct iscsi_cq_overflow *overflow_tail;
+	int overflowed;
+};
+
+int
+iscsi_set_completion_ring(struct iscsi_context *iscsi, int entries)
+{
+	struct iscsi_cq *cq;
+	uint32_t size;
+
+	if (iscsi->is_loggedin) {
+		iscsi_set_error(iscsi, "trying to set the completion ring "
+				"while logged in");
+		return -1;
+	}
+	if (iscsi->cq != NULL) {
+		iscsi_set_error(iscsi, "the context already has a completion "
+				"ring");
+		return -1;
+	}
+	if (entries < 1 || entries > ISCSI_CQ_MAX_ENTRIES) {
+		iscsi_set_error(iscsi, "invalid completion ring size %d",
+				entries);
+		return -1;
+	}
+
+	for (size = 1; size < (uint32_t)entries; size <<= 1) {
+	}
+
+	cq = iscsi_zmalloc(iscsi, sizeof(struct iscsi_cq));
+	if (cq == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: Failed to allocate "
+				"completion ring");
+		return -1;
+	}
+	cq->entries = iscsi_malloc(iscsi, size * sizeof(struct iscsi_completion));
+	if (cq->entries == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: Failed to allocate "
+				"%u completion ring entries", size);
+		iscsi_free(iscsi, cq);
+		return -1;
+	}
+	cq->mask = size - 1;
+	iscsi->cq = cq;
+
+	ISCSI_LOG(iscsi, 2, "completion ring of %u entries enabled", size);
+	return 0;
+}
+
+void
+iscsi_cq_cb(struct iscsi_context *iscsi, int status,
+	    void *command_data, void *private_data)
+{
+	struct iscsi_cq *cq = iscsi->cq;
+	struct iscsi_cq_overflow *o;
+	struct iscsi_completion *c;
+
+	if (cq == NULL) {
+		ISCSI_LOG(iscsi, 2, "completion for task %p with status %d "
+			  "dropped, the context has no completion ring",
+			  command_data, status);
+		return;
+	}
+
+	/* once something overflowed everything queues behind it to keep
+	 * the order
+	 */
+	if (cq->overflow == NULL && cq->tail - cq->head <= cq->mask) {
+		c = &cq->entries[cq->tail & cq->mask];
+		c->task = command_data;
+		c->status = status;
+		c->user_data = private_data;
+		cq->tail++;
+		return;
+	}
+
+	o = iscsi_malloc(iscsi, sizeof(struct iscsi_cq_overflow));
+	if (o == NULL) {
+		ISCSI_LOG(iscsi, 1, "out of memory, completion for task %p "
+			  "with status %d dropped", command_data, status);
+		return;
+	}
+	o->next = NULL;
+	o->c.task = command_data;
+	o->c.status = status;
+	o->c.user_data = private_data;
+	if (cq->overflow == NULL) {
+		cq->overflow = o;
+	} else {
+		cq->overflow_tail->next = o;
+	}
+	cq->overflow_tail = o;
+	if (cq->overflowed++ == 0) {
+		ISCSI_LOG(iscsi, 2, "completion ring of %u entries is full, "
+			  "reap more often or make it larger", cq->mask + 1);
+	}
+}
+
+/* move overflowed completions into the room the application made */
+static void
+iscsi_cq_refill(struct iscsi_context *iscsi, struct iscsi_cq *cq)
+{
+	struct iscsi_cq_overflow *o;
+
+	while (cq->overflow != NULL && cq->tail - cq->head <= cq->mask) {
+		o = cq->overflow;
+		cq->overflow = o->next;
+		cq->entries[cq->tail & cq->mask] = o->c;
+		cq->tail++;
+		iscsi_free(iscsi, o);
+	}
+}
+
+int
+iscsi_reap_completions(struct iscsi_context *iscsi,
+		       struct iscsi_completion *entries, int max)
+{
+	struct iscsi_cq *cq = iscsi->cq;
+	uint32_t n, first;
+	int count = 0;
+
+	if (cq == NULL) {
+		iscsi_set_error(iscsi, "the context has no completion ring");
+		return -1;
+	}
+
+	while (count < max && cq->tail != cq->head) {
+		n = cq->tail - cq->head;
+		if (n > (uint32_t)(max - count)) {
+			n = max - count;
+		}
+		/* at most two copies, up to the end of the array and the
+		 * rest from its start
+		 */
+		first = cq->head & cq->mask;
+		if (n > cq->mask + 1 - first) {
+			n = cq->mask + 1 - first;
+		}
+		memcpy(&entries[count], &cq->entries[first],
+		       n * sizeof(struct iscsi_completion));
+		cq->head += n;
+		count += n;
+
+		if (cq->overflow != NULL) {
+			iscsi_cq_refill(iscsi, cq);
+		}
+	}
+
+	return count;
+}
+
+/* the tasks of completions that were never reaped are freed with the
+ * context
+ */
+void
+iscsi_cq_destroy(struct iscsi_context *iscsi)
+{
+	struct iscsi_cq *cq = iscsi->cq;
+	struct iscsi_cq_overflow *o;
+
+	for (; cq->head != cq->tail; cq->head++) {
+		scsi_free_scsi_task(cq->entries[cq->head & cq->mask].task);
+	}
+	while ((o = cq->overflow) != NULL) {
+		cq->overflow = o->next;
+		scsi_free_scsi_task(o->c.task);
+		iscsi_free(iscsi, o);
+	}
+	iscsi_free(iscsi, cq->entries);
+	iscsi_free(iscsi, cq);
+	iscsi->cq = NULL;
+}
@@ -43,6 +43,7 @@ struct connect_task {
 	void *private_data;
 	int lun;
 	int num_uas;
+	int redirects;
 };
 
 static void
@@ -76,6 +77,67 @@ iscsi_testunitready_connect(struct iscsi_context *iscsi, int lun,
 	return task;
 }
 
+static void
+iscsi_block_limits_cb(struct iscsi_context *iscsi, int status,
+		      void *command_data, void *private_data)
+{
+	struct connect_task *ct = private_data;
+	struct scsi_task *task = command_data;
+	struct scsi_inquiry_block_limits *bl;
+
+	if (status == SCSI_STATUS_CANCELLED || status == SCSI_STATUS_ERROR ||
+	    status == SCSI_STATUS_TIMEOUT) {
+		iscsi_set_error(iscsi, "Block Limits VPD failed: %s",
+				iscsi_get_error(iscsi));
+		ct->cb(iscsi, SCSI_STATUS_ERROR, NULL, ct->private_data);
+		scsi_free_scsi_task(task);
+		iscsi_free(iscsi, ct);
+		return;
+	}
+
+	/* a device without the page does not have a limit */
+	iscsi->max_xfer_len = 0;
+	if (status == SCSI_STATUS_GOOD) {
+		bl = scsi_datain_unmarshall(task);
+		if (bl != NULL) {
+			iscsi->max_xfer_len = bl->max_xfer_len;
+		}
+	}
+	ISCSI_LOG(iscsi, 2, "maximum transfer length is %u blocks",
+		  iscsi->max_xfer_len);
+
+	ct->cb(iscsi, SCSI_STATUS_GOOD, NULL, ct->private_data);
+	scsi_free_scsi_task(task);
+	iscsi_free(iscsi, ct);
+}
+
+/* Once logged in, read the MAXIMUM TRANSFER LENGTH for splitting large
+ * READ16/WRITE16 before telling the application.
+ */
+static void
+iscsi_connect_done(struct iscsi_context *iscsi, struct connect_task *ct,
+		   int status)
+{
+	struct iscsi_context *old_iscsi = iscsi->old_iscsi;
+	struct scsi_task *task;
+
+	if (status == SCSI_STATUS_GOOD && iscsi->split_io && ct->lun != -1) {
+		iscsi->old_iscsi = NULL;
+		task = iscsi_inquiry_task(iscsi, ct->lun, 1,
+					  SCSI_INQUIRY_PAGECODE_BLOCK_LIMITS,
+					  255, iscsi_block_limits_cb, ct);
+		iscsi->old_iscsi = old_iscsi;
+		if (task != NULL) {
+			return;
+		}
+		iscsi_set_error(iscsi, "iscsi_inquiry_task failed.");
+		status = SCSI_STATUS_ERROR;
+	}
+
+	ct->cb(iscsi, status, NULL, ct->private_data);
+	iscsi_free(iscsi, ct);
+}
+
 static void
 iscsi_testunitready_cb(struct iscsi_context *iscsi, int status,
 		       void *command_data, void *private_data)
@@ -137,9 +199,29 @@ iscsi_testunitready_cb(struct iscsi_context *iscsi, int status,
 		status = 0;
 	}
 
-	ct->cb(iscsi, status?SCSI_STATUS_ERROR:SCSI_STATUS_GOOD, NULL,
-	       ct->private_data);
 	scsi_free_scsi_task(task);
+	iscsi_connect_done(iscsi, ct,
+			   status ? SCSI_STATUS_ERROR : SCSI_STATUS_GOOD);
+}
+
+/* the portal the target moved to may be gone again, the next login asks
+ * the one we were given
+ */
+static void
+iscsi_forget_redirect(struct iscsi_context *iscsi)
+{
+	if (iscsi->redirect_portal[0]) {
+		ISCSI_LOG(iscsi, 2, "forgetting the redirect to %s",
+			  iscsi->redirect_portal);
+		iscsi->redirect_portal[0] = 0;
+	}
+}
+
+static void
+iscsi_connect_failed(struct iscsi_context *iscsi, struct connect_task *ct)
+{
+	iscsi_forget_redirect(iscsi);
+	ct->cb(iscsi, SCSI_STATUS_ERROR, NULL, ct->private_data);
 	iscsi_free(iscsi, ct);
 }
 
@@ -150,18 +232,24 @@ iscsi_login_cb(struct iscsi_context *iscsi, int status, void *command_data,
 	struct connect_task *ct = private_data;
 
 	if (status == SCSI_STATUS_REDIRECT && iscsi->target_address[0]) {
+		if (++ct->redirects > ISCSI_MAX_REDIRECTS) {
+			iscsi_set_error(iscsi, "Too many login redirects, the "
+					"last one to %s", iscsi->target_address);
+			iscsi_connect_failed(iscsi, ct);
+			return;
+		}
 		iscsi_disconnect(iscsi);
 		if (iscsi->bind_interfaces[0]) iscsi_decrement_iface_rr();
-		if (iscsi_connect_async(iscsi, iscsi->target_address, iscsi_connect_cb, iscsi->connect_data) != 0) {
-			iscsi_free(iscsi, ct);
+		if (iscsi_connect_async(iscsi, iscsi->target_address,
+					iscsi_connect_cb, ct) != 0) {
+			iscsi_connect_failed(iscsi, ct);
 			return;
 		}
 		return;
 	}
 
 	if (status != 0) {
-		ct->cb(iscsi, SCSI_STATUS_ERROR, NULL, ct->private_data);
-		iscsi_free(iscsi, ct);
+		iscsi_connect_failed(iscsi, ct);
 		return;
 	}
 
@@ -178,8 +266,7 @@ iscsi_login_cb(struct iscsi_context *iscsi, int status, void *command_data,
 			iscsi_free(iscsi, ct);
 		}
 	} else {
-		ct->cb(iscsi, SCSI_STATUS_GOOD, NULL, ct->private_data);
-		iscsi_free(iscsi, ct);
+		iscsi_connect_done(iscsi, ct, SCSI_STATUS_GOOD);
 	}
 }
 
@@ -192,16 +279,14 @@ iscsi_connect_cb(struct iscsi_context *iscsi, int status, void *command_data,
 	if (status != 0) {
 		iscsi_set_error(iscsi, "Failed to connect to iSCSI socket. "
 				"%s", iscsi_get_error(iscsi));
-		ct->cb(iscsi, SCSI_STATUS_ERROR, NULL, ct->private_data);
-		iscsi_free(iscsi, ct);
+		iscsi_connect_failed(iscsi, ct);
 		return;
 	}
 
 	if (iscsi_login_async(iscsi, iscsi_login_cb, ct) != 0) {
 		iscsi_set_error(iscsi, "iscsi_login_async failed: %s",
 				iscsi_get_error(iscsi));
-		ct->cb(iscsi, SCSI_STATUS_ERROR, NULL, ct->private_data);
-		iscsi_free(iscsi, ct);
+		iscsi_connect_failed(iscsi, ct);
 	}
 }
 
@@ -214,8 +299,17 @@ iscsi_full_connect_async(struct iscsi_context *iscsi, const char *portal,
 
 	iscsi->lun = lun;
 	if (iscsi->portal != portal) {
+		/* a permanent redirect only applies to the portal it came from */
+		if (strcmp(iscsi->portal, portal)) {
+			iscsi->redirect_portal[0] = 0;
+		}
 		strncpy(iscsi->portal, portal, MAX_STRING_SIZE);
 	}
+	if (iscsi->redirect_portal[0]) {
+		ISCSI_LOG(iscsi, 2, "%s has moved to %s", iscsi->portal,
+			  iscsi->redirect_portal);
+		portal = iscsi->redirect_portal;
+	}
 
 	ct = iscsi_malloc(iscsi, sizeof(struct connect_task));
 	if (ct == NULL) {
@@ -226,8 +320,10 @@ iscsi_full_connect_async(struct iscsi_context *iscsi, const char *portal,
 	ct->cb           = cb;
 	ct->lun          = lun;
 	ct->num_uas      = 0;
+	ct->redirects    = 0;
 	ct->private_data = private_data;
 	if (iscsi_connect_async(iscsi, portal, iscsi_connect_cb, ct) != 0) {
+		iscsi_forget_redirect(iscsi);
 		iscsi_free(iscsi, ct);
 		return -ENOMEM;
 	}
@@ -267,38 +363,134 @@ void iscsi_set_reconnect_max_retries(struct iscsi_context *iscsi, int count)
 	iscsi->reconnect_max_retries = count;
 }
 
+int
+iscsi_set_reconnect_backoff(struct iscsi_context *iscsi, int initial_ms,
+			    int max_ms, int jitter)
+{
+	if (initial_ms < 0 || max_ms < initial_ms ||
+	    jitter < 0 || jitter > 100) {
+		iscsi_set_error(iscsi, "Invalid reconnect backoff %d..%d ms "
+				"with %d%% jitter", initial_ms, max_ms, jitter);
+		return -1;
+	}
+	iscsi->reconnect_initial_ms = initial_ms;
+	iscsi->reconnect_max_ms = max_ms;
+	iscsi->reconnect_jitter = jitter;
+	return 0;
+}
+
+void
+iscsi_get_reconnect_stats(struct iscsi_context *iscsi,
+			  struct iscsi_reconnect_stats *stats)
+{
+	*stats = iscsi_session(iscsi)->reconnect_stats;
+}
+
+/* How long to wait after the retry'th failed try to reconnect, in ms. */
+static int
+iscsi_reconnect_backoff(struct iscsi_context *iscsi, int retry)
+{
+	int64_t backoff = iscsi->reconnect_initial_ms;
+	int jitter;
+
+	while (--retry > 0 && backoff < iscsi->reconnect_max_ms) {
+		backoff *= 2;
+	}
+	if (backoff > iscsi->reconnect_max_ms) {
+		backoff = iscsi->reconnect_max_ms;
+	}
+
+	jitter = backoff * iscsi->reconnect_jitter / 100;
+	if (jitter > 0) {
+		backoff += rand() % (2 * jitter + 1) - jitter;
+	}
+	return backoff;
+}
+
 // 延迟重新连接
 void iscsi_defer_reconnect(struct iscsi_context *iscsi)
 {
 	iscsi->reconnect_deferred = 1;
+	iscsi->reconnect_started = 0;
 
 	ISCSI_LOG(iscsi, 2, "reconnect deferred, cancelling all tasks");
 
 	iscsi_cancel_pdus(iscsi);
 }
 
+/* Send a SCSI command of a failed connection again as a new task. */
+int
+iscsi_reissue_command(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
+{
+	scsi_task_reset_iov(&pdu->scsi_cbdata.task->iovector_in);
+	scsi_task_reset_iov(&pdu->scsi_cbdata.task->iovector_out);
+
+	/* We pass NULL as 'd' since any databuffer has already
+	 * been converted to a task-> iovector first time this
+	 * PDU was sent.
+	 */
+	return iscsi_scsi_command_async(iscsi, pdu->lun,
+					pdu->scsi_cbdata.task,
+					pdu->scsi_cbdata.callback,
+					NULL,
+					pdu->scsi_cbdata.private_data);
+}
+
+static int
+iscsi_replay_cmdsn_compare(const void *p1, const void *p2)
+{
+	const struct iscsi_pdu *pdu1 = *(struct iscsi_pdu * const *)p1;
+	const struct iscsi_pdu *pdu2 = *(struct iscsi_pdu * const *)p2;
+
+	return iscsi_serial32_compare(pdu1->cmdsn, pdu2->cmdsn);
+}
+
+/* Hand a SCSI command of the failed connection to the new one. */
+static void
+iscsi_replay_command(struct iscsi_context *iscsi,
+		     struct iscsi_context *old_iscsi, struct iscsi_pdu *pdu,
+		     int recovered)
+{
+	/* The target has every command below the ExpCmdSN of the
+	 * login and keeps it for us, whatever of it is done is not
+	 * done again. The others never made it and are sent again.
+	 */
+	if (recovered &&
+	    iscsi_serial32_compare(pdu->cmdsn,
+				   iscsi->recovery_expcmdsn) < 0 &&
+	    iscsi_task_reassign(iscsi, pdu) == 0) {
+		iscsi->drv->free_pdu(old_iscsi, pdu);
+		return;
+	}
+
+	if (iscsi_reissue_command(iscsi, pdu)) {
+		/* not much we can really do at this point */
+	}
+	iscsi->reconnect_stats.replayed++;
+	iscsi->drv->free_pdu(old_iscsi, pdu);
+}
+
 void iscsi_reconnect_cb(struct iscsi_context *iscsi, int status,
                         void *command_data, void *private_data)
 {
 	struct iscsi_context *old_iscsi;
-	int i;
+	struct iscsi_reconnect_stats *stats = &iscsi->reconnect_stats;
+	struct iscsi_pdu **replay;
+	int recovered, count, i;
+	uint64_t now;
 
 	if (status != SCSI_STATUS_GOOD) {
-		int backoff = ++iscsi->old_iscsi->retry_cnt;
-		if (backoff > 10) {
-			backoff += rand() % 10;
-			backoff -= 5;
-		}
-		if (backoff > 30) {
-			backoff = 30;
-		}
+		int backoff = iscsi_reconnect_backoff(iscsi,
+						++iscsi->old_iscsi->retry_cnt);
 		if (iscsi->reconnect_max_retries != -1 &&
 		    iscsi->old_iscsi->retry_cnt > iscsi->reconnect_max_retries) {
 			/* we will exit iscsi_service with -1 the next time we enter it. */
 			backoff = 0;
 		}
-		ISCSI_LOG(iscsi, 1, "reconnect try %d failed, waiting %d seconds", iscsi->old_iscsi->retry_cnt, backoff);
-		iscsi->next_reconnect = time(NULL) + backoff;
+		stats->failed_attempts++;
+		iscsi_forget_redirect(iscsi);
+		ISCSI_LOG(iscsi, 1, "reconnect try %d failed, waiting %d ms", iscsi->old_iscsi->retry_cnt, backoff);
+		iscsi->next_reconnect = iscsi_monotonic_ms() + backoff;
 		iscsi->pending_reconnect = 1;
 		return;
 	}
@@ -306,16 +498,32 @@ void iscsi_reconnect_cb(struct iscsi_context *iscsi, int status,
 	old_iscsi = iscsi->old_iscsi;
 	iscsi->old_iscsi = NULL;
 
+	/* the new connection continues the session, see reconnect() */
+	recovered = iscsi->recovery_deadline != 0;
+	iscsi->recovery_deadline = 0;
+
 	while (old_iscsi->outqueue) {
 		struct iscsi_pdu *pdu = old_iscsi->outqueue;
-		ISCSI_LIST_REMOVE(&old_iscsi->outqueue, pdu);
-		ISCSI_LIST_ADD_END(&old_iscsi->waitpdu, pdu);
+		iscsi_remove_from_outqueue(old_iscsi, pdu);
+		iscsi_waitpdu_add(old_iscsi, pdu);
+	}
+
+	/* The commands are sent again in the order of their CmdSN, the
+	 * order the target got them in the first time, and are all queued
+	 * before any of them is written out. If there is no memory to sort
+	 * them they go in the order of the list.
+	 */
+	count = 0;
+	replay = NULL;
+	if (old_iscsi->waitpdu_count > 0) {
+		replay = iscsi_malloc(iscsi, old_iscsi->waitpdu_count *
+				      sizeof(struct iscsi_pdu *));
 	}
 
 	while (old_iscsi->waitpdu) {
 		struct iscsi_pdu *pdu = old_iscsi->waitpdu;
 
-		ISCSI_LIST_REMOVE(&old_iscsi->waitpdu, pdu);
+		iscsi_waitpdu_remove(old_iscsi, pdu);
 		if (pdu->itt == 0xffffffff) {
 			iscsi->drv->free_pdu(old_iscsi, pdu);
 			continue;
@@ -335,26 +543,28 @@ void iscsi_reconnect_cb(struct iscsi_context *iscsi, int status,
 			continue;
 		}
 
-		scsi_task_reset_iov(&pdu->scsi_cbdata.task->iovector_in);
-		scsi_task_reset_iov(&pdu->scsi_cbdata.task->iovector_out);
-
-		/* We pass NULL as 'd' since any databuffer has already
-		 * been converted to a task-> iovector first time this
-		 * PDU was sent.
-		 */
-		if (iscsi_scsi_command_async(iscsi, pdu->lun,
-					     pdu->scsi_cbdata.task,
-					     pdu->scsi_cbdata.callback,
-					     NULL,
-					     pdu->scsi_cbdata.private_data)) {
-			/* not much we can really do at this point */
+		if (replay == NULL) {
+			iscsi_replay_command(iscsi, old_iscsi, pdu, recovered);
+			continue;
 		}
-		iscsi->drv->free_pdu(old_iscsi, pdu);
+		replay[count++] = pdu;
+	}
+
+	if (replay != NULL) {
+		qsort(replay, count, sizeof(struct iscsi_pdu *),
+		      iscsi_replay_cmdsn_compare);
+		for (i = 0; i < count; i++) {
+			iscsi_replay_command(iscsi, old_iscsi, replay[i],
+					     recovered);
+		}
+		iscsi_free(iscsi, replay);
 	}
 
 	if (old_iscsi->incoming != NULL) {
 		iscsi_free_iscsi_in_pdu(old_iscsi, old_iscsi->incoming);
 	}
+	iscsi_free(old_iscsi, old_iscsi->rxbuf);
+	iscsi_free(old_iscsi, old_iscsi->itt_table);
 
 	if (old_iscsi->outqueue_current != NULL && old_iscsi->outqueue_current->flags & ISCSI_PDU_DELETE_WHEN_SENT) {
 		iscsi->drv->free_pdu(old_iscsi, old_iscsi->outqueue_current);
@@ -362,33 +572,132 @@ void iscsi_reconnect_cb(struct iscsi_context *iscsi, int status,
 
 	iscsi_free(old_iscsi, old_iscsi->opaque);
 
-	for (i = 0; i < old_iscsi->smalloc_free; i++) {
-		iscsi_free(old_iscsi, old_iscsi->smalloc_ptrs[i]);
-	}
+	iscsi_slab_destroy(old_iscsi);
 
 	iscsi->mallocs += old_iscsi->mallocs;
 	iscsi->frees += old_iscsi->frees;
 
 	free(old_iscsi);
-	
-	/* avoid a reconnect faster than 3 seconds */
-	iscsi->next_reconnect = time(NULL) + 3;
 
-	ISCSI_LOG(iscsi, 2, "reconnect was successful");
+	now = iscsi_monotonic_ms();
+
+	stats->reconnects++;
+	stats->last_recovery_ms = now - iscsi->reconnect_started;
+	stats->total_recovery_ms += stats->last_recovery_ms;
+	if (stats->last_recovery_ms > stats->max_recovery_ms) {
+		stats->max_recovery_ms = stats->last_recovery_ms;
+	}
+	iscsi->reconnect_started = 0;
+
+	/* rate limit a session that keeps failing */
+	iscsi->next_reconnect = now + iscsi->reconnect_initial_ms;
+
+	ISCSI_LOG(iscsi, 2, "reconnect was successful after %llu ms",
+		  (unsigned long long)stats->last_recovery_ms);
 
 	iscsi->pending_reconnect = 0;
+
+	/* bring back the connections the session had before */
+	while (iscsi->restore_connections > 0) {
+		iscsi->restore_connections--;
+		if (iscsi_get_connection_count(iscsi) >= iscsi->max_connections) {
+			continue;
+		}
+		if (iscsi_add_connection_async(iscsi, NULL, NULL) != 0) {
+			ISCSI_LOG(iscsi, 1, "failed to restore connection: %s",
+				  iscsi_get_error(iscsi));
+		}
+	}
+}
+
+/*
+ * ErrorRecoveryLevel 2. The target keeps the tasks of a failed connection
+ * for DefaultTime2Retain seconds. Until then a session with a single
+ * connection is continued by logging in a new connection with the same
+ * ISID, TSIH and CID, the session wide state carries over.
+ *
+ * Only a connection that failed is recovered. A forced reconnect is a
+ * login the application asked for, usually to negotiate new parameters,
+ * and always starts a new session. The new context has no deadline and a
+ * TSIH of 0 for that.
+ */
+static void
+iscsi_prepare_connection_recovery(struct iscsi_context *iscsi,
+				  struct iscsi_context *tmp_iscsi, int force)
+{
+	uint64_t now = iscsi_monotonic_ms();
+
+	if (force) {
+		if (iscsi->recovery_deadline != 0) {
+			ISCSI_LOG(iscsi, 2, "forced reconnect, not continuing "
+				  "session 0x%04x", iscsi->tsih);
+		}
+		return;
+	}
+
+	if (iscsi->old_iscsi == NULL) {
+		if (iscsi->error_recovery_level < 2 || iscsi->tsih == 0 ||
+		    iscsi->time2retain == 0 || iscsi->restore_connections) {
+			return;
+		}
+		tmp_iscsi->recovery_deadline = now + iscsi->time2retain * 1000;
+	} else if (iscsi->recovery_deadline > now) {
+		tmp_iscsi->recovery_deadline = iscsi->recovery_deadline;
+	} else {
+		return;
+	}
+
+	memcpy(tmp_iscsi->isid, iscsi->isid, sizeof(tmp_iscsi->isid));
+	tmp_iscsi->tsih = iscsi->tsih;
+	tmp_iscsi->cid = iscsi->cid;
+	tmp_iscsi->itt = iscsi->itt;
+	tmp_iscsi->cmdsn = iscsi->cmdsn;
+	tmp_iscsi->expcmdsn = iscsi->expcmdsn;
+	tmp_iscsi->maxcmdsn = iscsi->maxcmdsn;
+	/* ExpStatSN of the login acknowledges the old connection */
+	tmp_iscsi->statsn = iscsi->statsn;
+
+	tmp_iscsi->error_recovery_level = iscsi->error_recovery_level;
+	tmp_iscsi->time2retain = iscsi->time2retain;
+	tmp_iscsi->max_connections = iscsi->max_connections;
+	tmp_iscsi->use_initial_r2t = iscsi->use_initial_r2t;
+	tmp_iscsi->use_immediate_data = iscsi->use_immediate_data;
+	tmp_iscsi->max_outstanding_r2t = iscsi->max_outstanding_r2t;
+	tmp_iscsi->max_burst_length = iscsi->max_burst_length;
+	tmp_iscsi->first_burst_length = iscsi->first_burst_length;
+
+	ISCSI_LOG(iscsi, 2, "continuing session 0x%04x on a new connection",
+		  iscsi->tsih);
 }
 
 static int reconnect(struct iscsi_context *iscsi, int force)
 {
 	struct iscsi_context *tmp_iscsi;
 
+	/* nothing more is written to the failed connection */
+	iscsi_tx_stop(iscsi);
+
+	/* an additional connection of the session has failed, the
+	 * session is recovered through the leading connection.
+	 */
+	if (iscsi->leader) {
+		iscsi_mcs_connection_failed(iscsi);
+		return 0;
+	}
+
 	/* if there is already a deferred reconnect do not try again */
 	if (iscsi->reconnect_deferred) {
 		ISCSI_LOG(iscsi, 2, "reconnect initiated, but reconnect is already deferred");
 		return -1;
 	}
 
+	/* the new session starts out with a single connection, commands
+	 * in flight on the others are re-issued along with our own.
+	 */
+	if (iscsi->connections) {
+		iscsi_mcs_drop_connections(iscsi, !iscsi->no_auto_reconnect);
+	}
+
 	/* This is mainly for tests, where we do not want to automatically
 	   reconnect but rather want the commands to fail with an error
 	   if the target drops the session.
@@ -402,7 +711,12 @@ static int reconnect(struct iscsi_context *iscsi, int force)
 		return 0;
 	}
 
-	if (time(NULL) < iscsi->next_reconnect) {
+	/* the time to recover counts from here, including any backoff */
+	if (iscsi->reconnect_started == 0) {
+		iscsi->reconnect_started = iscsi_monotonic_ms();
+	}
+
+	if (iscsi_monotonic_ms() < iscsi->next_reconnect) {
 		iscsi->pending_reconnect = 1;
 		return 0;
 	}
@@ -413,6 +727,9 @@ static int reconnect(struct iscsi_context *iscsi, int force)
 		return -1;
 	}
 
+	/* held back commands are sent again with the others */
+	iscsi_merge_flush(iscsi);
+
     // 创建 tmp iscsi
 	tmp_iscsi = iscsi_create_context(iscsi->initiator_name);
 	if (tmp_iscsi == NULL) {
@@ -433,6 +750,7 @@ static int reconnect(struct iscsi_context *iscsi, int force)
 	iscsi_set_targetname(tmp_iscsi, iscsi->target_name);
 
 	iscsi_set_header_digest(tmp_iscsi, iscsi->want_header_digest);
+	iscsi_set_data_digest(tmp_iscsi, iscsi->want_data_digest);
 
 	iscsi_set_initiator_username_pwd(tmp_iscsi, iscsi->user, iscsi->passwd);
 	iscsi_set_target_username_pwd(tmp_iscsi, iscsi->target_user, iscsi->target_passwd);
@@ -442,6 +760,8 @@ static int reconnect(struct iscsi_context *iscsi, int force)
 	tmp_iscsi->lun = iscsi->lun;
 
 	strncpy(tmp_iscsi->portal, iscsi->portal, MAX_STRING_SIZE);
+	strncpy(tmp_iscsi->redirect_portal, iscsi->redirect_portal,
+		MAX_STRING_SIZE);
 	
 	strncpy(tmp_iscsi->bind_interfaces, iscsi->bind_interfaces, MAX_STRING_SIZE);
 	tmp_iscsi->bind_interfaces_cnt = iscsi->bind_interfaces_cnt;
@@ -458,13 +778,43 @@ static int reconnect(struct iscsi_context *iscsi, int force)
 	tmp_iscsi->no_ua_on_reconnect = iscsi->no_ua_on_reconnect;
 
 	tmp_iscsi->reconnect_max_retries = iscsi->reconnect_max_retries;
+	tmp_iscsi->reconnect_initial_ms = iscsi->reconnect_initial_ms;
+	tmp_iscsi->reconnect_max_ms = iscsi->reconnect_max_ms;
+	tmp_iscsi->reconnect_jitter = iscsi->reconnect_jitter;
+	tmp_iscsi->reconnect_started = iscsi->reconnect_started;
+	tmp_iscsi->reconnect_stats = iscsi->reconnect_stats;
+	tmp_iscsi->want_max_connections = iscsi->want_max_connections;
+	tmp_iscsi->want_max_outstanding_r2t = iscsi->want_max_outstanding_r2t;
+	tmp_iscsi->want_error_recovery_level = iscsi->want_error_recovery_level;
+	tmp_iscsi->want_max_burst_length = iscsi->want_max_burst_length;
+	tmp_iscsi->max_burst_length = iscsi->want_max_burst_length;
+	tmp_iscsi->want_first_burst_length = iscsi->want_first_burst_length;
+	tmp_iscsi->first_burst_length = iscsi->want_first_burst_length;
+	tmp_iscsi->want_max_recv_data_segment_length =
+		iscsi->want_max_recv_data_segment_length;
+	tmp_iscsi->initiator_max_recv_data_segment_length =
+		iscsi->want_max_recv_data_segment_length;
+	tmp_iscsi->autotune = iscsi->autotune;
+	tmp_iscsi->split_io = iscsi->split_io;
+	tmp_iscsi->max_xfer_len = iscsi->max_xfer_len;
+	tmp_iscsi->split_ios = iscsi->split_ios;
+	tmp_iscsi->merge_max_bytes = iscsi->merge_max_bytes;
+	tmp_iscsi->merge_hold_ms = iscsi->merge_hold_ms;
+	tmp_iscsi->merge_ios = iscsi->merge_ios;
+	tmp_iscsi->submit = iscsi->submit;
+	tmp_iscsi->want_full_duplex = iscsi->want_full_duplex;
+	tmp_iscsi->engine_entry = iscsi->engine_entry;
+	tmp_iscsi->exec = iscsi->exec;
+	tmp_iscsi->cq = iscsi->cq;
+	tmp_iscsi->restore_connections = iscsi->restore_connections;
+
+	iscsi_prepare_connection_recovery(iscsi, tmp_iscsi, force);
 
 	if (iscsi->old_iscsi) {
-		int i;
-		for (i = 0; i < iscsi->smalloc_free; i++) {
-			iscsi_free(iscsi, iscsi->smalloc_ptrs[i]);
-		}
+		iscsi_slab_destroy(iscsi);
 		iscsi_free(iscsi, iscsi->opaque);
+		iscsi_free(iscsi, iscsi->rxbuf);
+		iscsi_free(iscsi, iscsi->itt_table);
 
 		iscsi->old_iscsi->mallocs += iscsi->mallocs;
 		iscsi->old_iscsi->frees += iscsi->frees;
@@ -477,6 +827,17 @@ static int reconnect(struct iscsi_context *iscsi, int force)
 		}
 		memcpy(tmp_iscsi->old_iscsi, iscsi, sizeof(struct iscsi_context));
 	}
+	/* split and merged transfers and the submit queue stay with the
+	 * session
+	 */
+	tmp_iscsi->old_iscsi->split_ios = NULL;
+	tmp_iscsi->old_iscsi->merge_ios = NULL;
+	tmp_iscsi->old_iscsi->submit = NULL;
+	tmp_iscsi->old_iscsi->engine_entry = NULL;
+	tmp_iscsi->old_iscsi->exec = NULL;
+	/* the completion ring is shared, commands that complete or are
+	 * cancelled on the old connection still go to it
+	 */
     // 覆盖内存
 	memcpy(iscsi, tmp_iscsi, sizeof(struct iscsi_context));
 	free(tmp_iscsi);
@@ -14,14 +14,31 @@
    You should have received a copy of the GNU Lesser General Public License
    along with this program; if not, see <http://www.gnu.org/licenses/>.
 */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #if defined(_WIN32)
 #else
 #include <unistd.h>
 #endif
 
+#include <stddef.h>
+#include <string.h>
 #include "iscsi.h"
 #include "iscsi-private.h"
 
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_PTHREAD_CREATE)
+#define CRC32C_HAVE_ONCE
+#include <pthread.h>
+#endif
+
+#ifdef HAVE_CRC32C_X86
+#include <cpuid.h>
+#include <nmmintrin.h>
+#include <wmmintrin.h>
+#endif
+
 /*****************************************************************/
 /*                                                               */
 /* CRC LOOKUP TABLE                                              */
@@ -109,12 +126,387 @@ uint32_t crctable[256] = {
  0xBE2DA0A5L, 0x4C4623A6L, 0x5F16D052L, 0xAD7D5351L
 };
 
-uint32_t crc32c(uint8_t *buf, int len)
+/* reflected Castagnoli polynomial */
+#define CRC32C_POLY 0x82F63B78
+
+/* block size used by crc32c_copy() */
+#define CRC32C_COPY_BLOCK (16 * 1024)
+
+static uint32_t
+crc32c_bytewise(uint32_t crc, const uint8_t *buf, size_t len)
 {
-	uint32_t crc = 0xffffffff;
 	while (len-- > 0) {
 		crc = (crc>>8) ^ crctable[(crc ^ (*buf++)) & 0xFF];
 	}
-	return crc^0xffffffff;
+	return crc;
+}
+
+/*
+ * Slicing-by-8, crc32c_slice[0] is crctable and crc32c_slice[k][n] is
+ * the crc of byte n followed by k zero bytes.
+ */
+static uint32_t crc32c_slice[8][256];
+
+static void
+crc32c_slice_init(void)
+{
+	int n, k;
+
+	for (n = 0; n < 256; n++) {
+		crc32c_slice[0][n] = crctable[n];
+	}
+	for (k = 1; k < 8; k++) {
+		for (n = 0; n < 256; n++) {
+			uint32_t c = crc32c_slice[k - 1][n];
+
+			crc32c_slice[k][n] = (c >> 8) ^ crctable[c & 0xff];
+		}
+	}
+}
+
+static uint32_t
+crc32c_slice8(uint32_t crc, const uint8_t *buf, size_t len)
+{
+	while (len >= 8) {
+		uint32_t lo = crc ^ ((uint32_t)buf[0] |
+				     (uint32_t)buf[1] << 8 |
+				     (uint32_t)buf[2] << 16 |
+				     (uint32_t)buf[3] << 24);
+		uint32_t hi = (uint32_t)buf[4] |
+			      (uint32_t)buf[5] << 8 |
+			      (uint32_t)buf[6] << 16 |
+			      (uint32_t)buf[7] << 24;
+
+		crc = crc32c_slice[7][lo & 0xff] ^
+		      crc32c_slice[6][(lo >> 8) & 0xff] ^
+		      crc32c_slice[5][(lo >> 16) & 0xff] ^
+		      crc32c_slice[4][lo >> 24] ^
+		      crc32c_slice[3][hi & 0xff] ^
+		      crc32c_slice[2][(hi >> 8) & 0xff] ^
+		      crc32c_slice[1][(hi >> 16) & 0xff] ^
+		      crc32c_slice[0][hi >> 24];
+		buf += 8;
+		len -= 8;
+	}
+	return crc32c_bytewise(crc, buf, len);
+}
+
+#ifdef HAVE_CRC32C_X86
+/*
+ * The crc32 instruction has a latency of three cycles but a throughput
+ * of one per cycle, so large buffers are split into three streams that
+ * are checksummed in parallel and then combined. Combining needs the crc
+ * of a stream shifted over the bytes that follow it, i.e. multiplied by
+ * x^(8*n) modulo the polynomial.
+ */
+#define CRC32C_LONG	8192
+#define CRC32C_SHORT	256
+
+/* a * b modulo the polynomial, both in reflected form */
+static uint32_t
+crc32c_multmodp(uint32_t a, uint32_t b)
+{
+	uint32_t m = (uint32_t)1 << 31, p = 0;
+
+	for (;;) {
+		if (a & m) {
+			p ^= b;
+			if ((a & (m - 1)) == 0) {
+				break;
+			}
+		}
+		m >>= 1;
+		b = b & 1 ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+	}
+	return p;
+}
+
+/* x^n modulo the polynomial */
+static uint32_t
+crc32c_xpow(uint64_t n)
+{
+	uint32_t p = (uint32_t)1 << 31, x = (uint32_t)1 << 30;
+
+	while (n) {
+		if (n & 1) {
+			p = crc32c_multmodp(p, x);
+		}
+		x = crc32c_multmodp(x, x);
+		n >>= 1;
+	}
+	return p;
+}
+
+/* shift constants for one and two stream lengths */
+static uint32_t crc32c_long_k1, crc32c_long_k2;
+static uint32_t crc32c_short_k1, crc32c_short_k2;
+
+/* x^(8n - 33) for use with pclmulqdq, see crc32c_shift_clmul() */
+static uint64_t crc32c_long_c1, crc32c_long_c2;
+static uint64_t crc32c_short_c1, crc32c_short_c2;
+
+static void
+crc32c_x86_init(void)
+{
+	crc32c_long_k1  = crc32c_xpow(8ULL * CRC32C_LONG);
+	crc32c_long_k2  = crc32c_xpow(8ULL * CRC32C_LONG * 2);
+	crc32c_short_k1 = crc32c_xpow(8ULL * CRC32C_SHORT);
+	crc32c_short_k2 = crc32c_xpow(8ULL * CRC32C_SHORT * 2);
+
+	crc32c_long_c1  = crc32c_xpow(8ULL * CRC32C_LONG - 33);
+	crc32c_long_c2  = crc32c_xpow(8ULL * CRC32C_LONG * 2 - 33);
+	crc32c_short_c1 = crc32c_xpow(8ULL * CRC32C_SHORT - 33);
+	crc32c_short_c2 = crc32c_xpow(8ULL * CRC32C_SHORT * 2 - 33);
+}
+
+static inline uint64_t
+crc32c_load64(const uint8_t *buf)
+{
+	uint64_t v;
+
+	memcpy(&v, buf, sizeof(v));
+	return v;
 }
 
+/*
+ * Run the three streams of 'block' bytes each. Returns the three partial
+ * crcs, the first one seeded with crc and the others with zero.
+ */
+__attribute__((target("sse4.2")))
+static inline void
+crc32c_sse42_3way(uint32_t crc, const uint8_t *buf, size_t block,
+		  uint64_t *c0, uint64_t *c1, uint64_t *c2)
+{
+	const uint8_t *end = buf + block;
+	uint64_t a = crc, b = 0, c = 0;
+
+	do {
+		a = _mm_crc32_u64(a, crc32c_load64(buf));
+		b = _mm_crc32_u64(b, crc32c_load64(buf + block));
+		c = _mm_crc32_u64(c, crc32c_load64(buf + 2 * block));
+		buf += 8;
+	} while (buf < end);
+
+	*c0 = a;
+	*c1 = b;
+	*c2 = c;
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t
+crc32c_sse42_tail(uint64_t crc, const uint8_t *buf, size_t len)
+{
+	while (len >= 8) {
+		crc = _mm_crc32_u64(crc, crc32c_load64(buf));
+		buf += 8;
+		len -= 8;
+	}
+	while (len-- > 0) {
+		crc = _mm_crc32_u8((uint32_t)crc, *buf++);
+	}
+	return (uint32_t)crc;
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t
+crc32c_sse42(uint32_t crc, const uint8_t *buf, size_t len)
+{
+	uint64_t c0, c1, c2;
+
+	/* align the streams */
+	while (len > 0 && ((uintptr_t)buf & 7)) {
+		crc = _mm_crc32_u8(crc, *buf++);
+		len--;
+	}
+
+	while (len >= 3 * CRC32C_LONG) {
+		crc32c_sse42_3way(crc, buf, CRC32C_LONG, &c0, &c1, &c2);
+		crc = crc32c_multmodp(crc32c_long_k2, (uint32_t)c0) ^
+		      crc32c_multmodp(crc32c_long_k1, (uint32_t)c1) ^
+		      (uint32_t)c2;
+		buf += 3 * CRC32C_LONG;
+		len -= 3 * CRC32C_LONG;
+	}
+	while (len >= 3 * CRC32C_SHORT) {
+		crc32c_sse42_3way(crc, buf, CRC32C_SHORT, &c0, &c1, &c2);
+		crc = crc32c_multmodp(crc32c_short_k2, (uint32_t)c0) ^
+		      crc32c_multmodp(crc32c_short_k1, (uint32_t)c1) ^
+		      (uint32_t)c2;
+		buf += 3 * CRC32C_SHORT;
+		len -= 3 * CRC32C_SHORT;
+	}
+
+	return crc32c_sse42_tail(crc, buf, len);
+}
+
+/*
+ * Fold the first two streams onto the third with carry-less multiplies
+ * instead of the bit-serial crc32c_multmodp(). In reflected form the
+ * 64-bit product a * x^(8n - 33) carries an extra factor of x, so it is
+ * congruent to a * x^(8n - 32) and running it through the crc32
+ * instruction multiplies it by the remaining x^32.
+ */
+__attribute__((target("sse4.2,pclmul")))
+static inline uint32_t
+crc32c_shift_clmul(uint64_t c0, uint64_t k2, uint64_t c1, uint64_t k1)
+{
+	__m128i a = _mm_clmulepi64_si128(_mm_cvtsi64_si128((long long)c0),
+					 _mm_cvtsi64_si128((long long)k2), 0x00);
+	__m128i b = _mm_clmulepi64_si128(_mm_cvtsi64_si128((long long)c1),
+					 _mm_cvtsi64_si128((long long)k1), 0x00);
+
+	return (uint32_t)_mm_crc32_u64(0, (uint64_t)_mm_cvtsi128_si64(_mm_xor_si128(a, b)));
+}
+
+__attribute__((target("sse4.2,pclmul")))
+static uint32_t
+crc32c_pclmul(uint32_t crc, const uint8_t *buf, size_t len)
+{
+	uint64_t c0, c1, c2;
+
+	while (len > 0 && ((uintptr_t)buf & 7)) {
+		crc = _mm_crc32_u8(crc, *buf++);
+		len--;
+	}
+
+	while (len >= 3 * CRC32C_LONG) {
+		crc32c_sse42_3way(crc, buf, CRC32C_LONG, &c0, &c1, &c2);
+		crc = crc32c_shift_clmul(c0, crc32c_long_c2, c1, crc32c_long_c1) ^
+		      (uint32_t)c2;
+		buf += 3 * CRC32C_LONG;
+		len -= 3 * CRC32C_LONG;
+	}
+	while (len >= 3 * CRC32C_SHORT) {
+		crc32c_sse42_3way(crc, buf, CRC32C_SHORT, &c0, &c1, &c2);
+		crc = crc32c_shift_clmul(c0, crc32c_short_c2, c1, crc32c_short_c1) ^
+		      (uint32_t)c2;
+		buf += 3 * CRC32C_SHORT;
+		len -= 3 * CRC32C_SHORT;
+	}
+
+	return crc32c_sse42_tail(crc, buf, len);
+}
+#endif /* HAVE_CRC32C_X86 */
+
+static struct crc32c_impl crc32c_impls[5];
+static int crc32c_nimpls;
+
+typedef uint32_t (*crc32c_update_fn)(uint32_t crc, const uint8_t *buf,
+				     size_t len);
+
+static uint32_t crc32c_resolve(uint32_t crc, const uint8_t *buf, size_t len);
+static crc32c_update_fn crc32c_fn = crc32c_resolve;
+
+/*
+ * Digests are computed by submitting threads, transmit threads and
+ * executor shards all at once. crc32c_fn is only stored after the tables
+ * the implementation uses are set up and is loaded with acquire
+ * semantics so no thread can call it and see them half written.
+ */
+#ifdef HAVE_ATOMIC_BUILTINS
+#define crc32c_publish(fn) __atomic_store_n(&crc32c_fn, fn, __ATOMIC_RELEASE)
+#define crc32c_get_fn() __atomic_load_n(&crc32c_fn, __ATOMIC_ACQUIRE)
+#else
+#define crc32c_publish(fn) (crc32c_fn = (fn))
+#define crc32c_get_fn() (crc32c_fn)
+#endif
+
+/* Pick the fastest implementation the cpu supports. */
+static void
+crc32c_setup(void)
+{
+	int n = 0;
+
+	crc32c_slice_init();
+	crc32c_impls[n].name   = "bytewise";
+	crc32c_impls[n++].update = crc32c_bytewise;
+	crc32c_impls[n].name   = "slice8";
+	crc32c_impls[n++].update = crc32c_slice8;
+
+#ifdef HAVE_CRC32C_X86
+	{
+		unsigned int eax, ebx, ecx, edx;
+
+		if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) &&
+		    (ecx & bit_SSE4_2)) {
+			crc32c_x86_init();
+			crc32c_impls[n].name   = "sse4.2";
+			crc32c_impls[n++].update = crc32c_sse42;
+			if (ecx & bit_PCLMUL) {
+				crc32c_impls[n].name   = "sse4.2+pclmul";
+				crc32c_impls[n++].update = crc32c_pclmul;
+			}
+		}
+	}
+#endif
+
+	crc32c_nimpls = n;
+	crc32c_publish(crc32c_impls[n - 1].update);
+}
+
+#ifdef CRC32C_HAVE_ONCE
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static void
+crc32c_init(void)
+{
+	pthread_once(&crc32c_once, crc32c_setup);
+}
+#else
+/* without threads there is nobody to race with */
+static void
+crc32c_init(void)
+{
+	if (!crc32c_nimpls) {
+		crc32c_setup();
+	}
+}
+#endif
+
+static uint32_t
+crc32c_resolve(uint32_t crc, const uint8_t *buf, size_t len)
+{
+	crc32c_init();
+	return crc32c_get_fn()(crc, buf, len);
+}
+
+const struct crc32c_impl *
+crc32c_get_impls(int *count)
+{
+	crc32c_init();
+	*count = crc32c_nimpls;
+	return crc32c_impls;
+}
+
+uint32_t
+crc32c_update(uint32_t crc, const uint8_t *buf, size_t len)
+{
+	return crc32c_get_fn()(crc, buf, len);
+}
+
+/*
+ * Copy LEN bytes from SRC to DST and fold them into CRC. The copy and
+ * the crc are done in blocks small enough to stay in the cache so the
+ * data is only pulled in from memory once.
+ */
+uint32_t
+crc32c_copy(uint32_t crc, uint8_t *dst, const uint8_t *src, size_t len)
+{
+	crc32c_update_fn update = crc32c_get_fn();
+	size_t n;
+
+	while (len > 0) {
+		n = MIN(len, CRC32C_COPY_BLOCK);
+		memcpy(dst, src, n);
+		crc = update(crc, dst, n);
+		dst += n;
+		src += n;
+		len -= n;
+	}
+	return crc;
+}
+
+uint32_t crc32c(uint8_t *buf, int len)
+{
+	return crc32c_get_fn()(0xffffffff, buf, len)^0xffffffff;
+}
@@ -0,0 +1,949 @@
+/*
+   Copyright (C) 2010 by Ronnie Sahlberg <ronniesahlberg@gmail.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#ifdef HAVE_POLL_H
+#include <poll.h>
+#endif
+
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_SYS_TIMERFD_H)
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#define ISCSI_HAVE_EVENT_ENGINE
+#endif
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "iscsi.h"
+#include "iscsi-private.h"
+
+#ifdef ISCSI_HAVE_EVENT_ENGINE
+
+/*
+ * An event loop for many contexts, built on epoll.
+ *
+ * Every connection of a context, and its submit queue, is registered
+ * edge-triggered for the events iscsi_which_events() asks for, and the
+ * registration is only changed when those events do. The library marks
+ * the context dirty whenever something happens that may change them, a
+ * PDU is queued, a timer is added or a socket is opened or closed, and
+ * the engine only looks at contexts that are dirty or had events. The
+ * next timeout of every context is kept in a heap and the earliest one
+ * arms a single timerfd. Each iteration costs O(log n) per context that
+ * is ready and nothing for those that are not.
+ *
+ * An edge that is not consumed is not reported again. iscsi_service()
+ * writes until the socket is full or there is nothing left to send, and
+ * reads until the socket is drained unless rx_more says it stopped
+ * early. When POLLOUT, or POLLIN with rx_more, is still wanted after
+ * such an edge the registration is modified anyway, which makes epoll
+ * look at the socket again.
+ *
+ * The epoll data of a registration holds the slot of the context, a
+ * generation and the index of the source, so that events collected for
+ * a context that has been removed since are ignored. A registration is
+ * only ever deleted while its descriptor is still open, the socket code
+ * tells us before it closes one, so a descriptor number that has been
+ * reused for something else is never touched.
+ */
+
+#define ISCSI_ENGINE_MAX_SOURCES	(ISCSI_MAX_CONNECTIONS + 1)
+#define ISCSI_ENGINE_SOURCE_BITS	5
+#define ISCSI_ENGINE_SOURCE_MASK	((1 << ISCSI_ENGINE_SOURCE_BITS) - 1)
+#define ISCSI_ENGINE_MAX_EVENTS		256
+#define ISCSI_ENGINE_TIMER_KEY		UINT64_MAX
+#define ISCSI_ENGINE_WAKEUP_KEY		(UINT64_MAX - 1)
+
+#define ISCSI_ENGINE_DIRTY	0x01	/* on the dirty list */
+#define ISCSI_ENGINE_READY	0x02	/* on the ready list */
+
+struct iscsi_engine_source {
+	int fd;		/* -1 if not registered */
+	int events;	/* POLLIN/POLLOUT as registered */
+	int revents;	/* collected, not serviced yet */
+	int fired;	/* serviced since the last epoll_ctl() */
+};
+
+struct iscsi_engine_entry {
+	struct iscsi_event_engine *engine;
+	struct iscsi_context *iscsi;	/* NULL once removed */
+	iscsi_command_cb cb;
+	void *private_data;
+	uint32_t slot;
+	uint32_t gen;
+	int flags;
+	int timed;	/* the deadline has passed */
+	struct iscsi_engine_entry *next_dirty;
+	struct iscsi_engine_entry *next_ready;
+	int heap_idx;	/* -1 if there is no deadline */
+	uint64_t deadline;
+	struct iscsi_engine_source src[ISCSI_ENGINE_MAX_SOURCES];
+};
+
+struct iscsi_event_engine {
+	int epfd;
+	int timerfd;
+	uint64_t armed;		/* what the timerfd is set to, 0 if nothing */
+	uint32_t gen;
+
+	struct iscsi_engine_entry **slots;
+	uint32_t *free_slots;
+	uint32_t num_slots;
+	uint32_t num_free;
+	uint32_t count;
+
+	struct iscsi_engine_entry **heap;
+	uint32_t heap_len;
+
+	struct iscsi_engine_entry *dirty;
+	struct iscsi_engine_entry *ready;
+};
+
+static void
+iscsi_engine_heap_swap(struct iscsi_event_engine *engine, uint32_t a,
+		       uint32_t b)
+{
+	struct iscsi_engine_entry *e = engine->heap[a];
+
+	engine->heap[a] = engine->heap[b];
+	engine->heap[b] = e;
+	engine->heap[a]->heap_idx = a;
+	engine->heap[b]->heap_idx = b;
+}
+
+static void
+iscsi_engine_heap_fix(struct iscsi_event_engine *engine, uint32_t i)
+{
+	struct iscsi_engine_entry **heap = engine->heap;
+	uint32_t child;
+
+	while (i > 0 && heap[i]->deadline < heap[(i - 1) / 2]->deadline) {
+		iscsi_engine_heap_swap(engine, i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+	for (;;) {
+		child = 2 * i + 1;
+		if (child >= engine->heap_len) {
+			break;
+		}
+		if (child + 1 < engine->heap_len &&
+		    heap[child + 1]->deadline < heap[child]->deadline) {
+			child++;
+		}
+		if (heap[i]->deadline <= heap[child]->deadline) {
+			break;
+		}
+		iscsi_engine_heap_swap(engine, i, child);
+		i = child;
+	}
+}
+
+static void
+iscsi_engine_heap_remove(struct iscsi_event_engine *engine,
+			 struct iscsi_engine_entry *e)
+{
+	uint32_t i = e->heap_idx;
+
+	if (e->heap_idx < 0) {
+		return;
+	}
+	e->heap_idx = -1;
+	if (i != --engine->heap_len) {
+		engine->heap[i] = engine->heap[engine->heap_len];
+		engine->heap[i]->heap_idx = i;
+		iscsi_engine_heap_fix(engine, i);
+	}
+}
+
+/* deadline 0 is no deadline */
+static void
+iscsi_engine_set_deadline(struct iscsi_engine_entry *e, uint64_t deadline)
+{
+	struct iscsi_event_engine *engine = e->engine;
+
+	if (deadline == 0) {
+		iscsi_engine_heap_remove(engine, e);
+		return;
+	}
+	e->deadline = deadline;
+	if (e->heap_idx < 0) {
+		/* the heap has room for every slot */
+		e->heap_idx = engine->heap_len++;
+		engine->heap[e->heap_idx] = e;
+	}
+	iscsi_engine_heap_fix(engine, e->heap_idx);
+}
+
+static int
+iscsi_engine_ctl(struct iscsi_engine_entry *e, int op, int idx, int events)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLET;
+	if (events & POLLIN) {
+		ev.events |= EPOLLIN;
+	}
+	if (events & POLLOUT) {
+		ev.events |= EPOLLOUT;
+	}
+	ev.data.u64 = ((uint64_t)e->gen << 32) |
+		(e->slot << ISCSI_ENGINE_SOURCE_BITS) | idx;
+	return epoll_ctl(e->engine->epfd, op, e->src[idx].fd, &ev);
+}
+
+static void
+iscsi_engine_unregister(struct iscsi_engine_entry *e, int idx)
+{
+	struct iscsi_engine_source *s = &e->src[idx];
+
+	epoll_ctl(e->engine->epfd, EPOLL_CTL_DEL, s->fd, NULL);
+	memset(s, 0, sizeof(*s));
+	s->fd = -1;
+}
+
+static void
+iscsi_engine_register(struct iscsi_engine_entry *e, int idx, int fd,
+		      int events, int add)
+{
+	struct iscsi_engine_source *s = &e->src[idx];
+	int ret;
+
+	s->fd = fd;
+	ret = iscsi_engine_ctl(e, add ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, idx,
+			       events);
+	if (ret != 0 && errno == (add ? EEXIST : ENOENT)) {
+		ret = iscsi_engine_ctl(e, add ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+				       idx, events);
+	}
+	if (ret != 0) {
+		ISCSI_LOG(e->iscsi, 1, "event engine failed to register "
+			  "fd %d: %s", fd, strerror(errno));
+		s->fd = -1;
+		return;
+	}
+	s->events = events;
+	s->fired = 0;
+}
+
+static void
+iscsi_engine_mark(struct iscsi_engine_entry *e, int flag)
+{
+	if (e->flags & flag) {
+		return;
+	}
+	e->flags |= flag;
+	if (flag == ISCSI_ENGINE_DIRTY) {
+		e->next_dirty = e->engine->dirty;
+		e->engine->dirty = e;
+	} else {
+		e->next_ready = e->engine->ready;
+		e->engine->ready = e;
+	}
+}
+
+static void
+iscsi_engine_unmark(struct iscsi_engine_entry *e, int flag)
+{
+	e->flags &= ~flag;
+	/* removed while it was on a list */
+	if (e->iscsi == NULL && e->flags == 0) {
+		free(e);
+	}
+}
+
+/*
+ * Bring the registrations and the deadline of a context up to date with
+ * what it wants now.
+ */
+static void
+iscsi_engine_refresh(struct iscsi_engine_entry *e)
+{
+	struct iscsi_context *iscsi = e->iscsi, *conn;
+	struct iscsi_context *ctx[ISCSI_ENGINE_MAX_SOURCES];
+	int fd[ISCSI_ENGINE_MAX_SOURCES], events[ISCSI_ENGINE_MAX_SOURCES];
+	struct iscsi_engine_source *s;
+	int i, j, n = 0, timeout;
+
+	if (iscsi->fd != -1) {
+		ctx[n] = iscsi;
+		fd[n] = iscsi->fd;
+		events[n++] = iscsi_which_events(iscsi);
+	}
+	for (conn = iscsi->connections; conn; conn = conn->next_connection) {
+		if (conn->connection_failed || conn->fd == -1 ||
+		    n == ISCSI_ENGINE_MAX_SOURCES - 1) {
+			continue;
+		}
+		ctx[n] = conn;
+		fd[n] = conn->fd;
+		events[n++] = iscsi_which_events(conn);
+	}
+	if (iscsi_get_submit_fd(iscsi) != -1) {
+		ctx[n] = NULL;
+		fd[n] = iscsi_get_submit_fd(iscsi);
+		events[n++] = POLLIN;
+	}
+
+	/* drop what is no longer wanted */
+	for (i = 0; i < ISCSI_ENGINE_MAX_SOURCES; i++) {
+		s = &e->src[i];
+		if (s->fd == -1) {
+			continue;
+		}
+		for (j = 0; j < n; j++) {
+			if (fd[j] == s->fd) {
+				break;
+			}
+		}
+		if (j == n || events[j] == 0) {
+			iscsi_engine_unregister(e, i);
+		}
+	}
+
+	for (j = 0; j < n; j++) {
+		if (events[j] == 0) {
+			continue;
+		}
+		for (i = 0; i < ISCSI_ENGINE_MAX_SOURCES; i++) {
+			if (e->src[i].fd == fd[j]) {
+				break;
+			}
+		}
+		if (i < ISCSI_ENGINE_MAX_SOURCES) {
+			s = &e->src[i];
+			/* re-arm an edge we have used up but whose
+			 * condition may still be there
+			 */
+			if (s->events != events[j] ||
+			    (s->fired & events[j] & POLLOUT) ||
+			    ((s->fired & events[j] & POLLIN) &&
+			     ctx[j] != NULL && ctx[j]->rx_more)) {
+				iscsi_engine_register(e, i, fd[j], events[j],
+						      0);
+			}
+			s->fired = 0;
+			continue;
+		}
+		for (i = 0; i < ISCSI_ENGINE_MAX_SOURCES; i++) {
+			if (e->src[i].fd == -1) {
+				iscsi_engine_register(e, i, fd[j], events[j],
+						      1);
+				break;
+			}
+		}
+	}
+
+	timeout = iscsi_get_next_timeout_ms(iscsi);
+	iscsi_engine_set_deadline(e, timeout < 0 ? 0 :
+				  iscsi_monotonic_ms() + timeout);
+}
+
+static void
+iscsi_engine_flush(struct iscsi_event_engine *engine)
+{
+	struct iscsi_engine_entry *e;
+
+	while ((e = engine->dirty) != NULL) {
+		engine->dirty = e->next_dirty;
+		if (e->iscsi != NULL) {
+			iscsi_engine_refresh(e);
+		}
+		iscsi_engine_unmark(e, ISCSI_ENGINE_DIRTY);
+	}
+}
+
+/* Arm the timerfd for the earliest deadline if it is not already. */
+static void
+iscsi_engine_arm(struct iscsi_event_engine *engine, uint64_t now)
+{
+	struct itimerspec its;
+	uint64_t deadline, ms;
+
+	if (engine->heap_len == 0) {
+		return;
+	}
+	deadline = engine->heap[0]->deadline;
+	if (deadline <= now ||
+	    (engine->armed != 0 && engine->armed <= deadline)) {
+		return;
+	}
+	ms = deadline - now;
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec  = ms / 1000;
+	its.it_value.tv_nsec = (ms % 1000) * 1000000;
+	if (timerfd_settime(engine->timerfd, 0, &its, NULL) == 0) {
+		engine->armed = deadline;
+	}
+}
+
+static int
+iscsi_engine_connection_index(struct iscsi_context *iscsi, int fd)
+{
+	struct iscsi_context *conn;
+	int idx = 0;
+
+	if (iscsi->fd == fd) {
+		return 0;
+	}
+	for (conn = iscsi->connections; conn; conn = conn->next_connection) {
+		idx++;
+		if (conn->fd == fd) {
+			return idx;
+		}
+	}
+	return -1;
+}
+
+static void iscsi_engine_detach(struct iscsi_engine_entry *e);
+
+static int
+iscsi_engine_service(struct iscsi_engine_entry *e)
+{
+	struct iscsi_context *iscsi = e->iscsi;
+	struct iscsi_engine_source *s;
+	int i, idx, revents, count, timed = e->timed;
+
+	e->timed = 0;
+	for (i = 0; i < ISCSI_ENGINE_MAX_SOURCES; i++) {
+		s = &e->src[i];
+		if (s->fd == -1 || s->revents == 0) {
+			continue;
+		}
+		revents = s->revents;
+		s->revents = 0;
+		s->fired |= revents;
+
+		idx = iscsi_engine_connection_index(iscsi, s->fd);
+		if (idx < 0) {
+			/* the submit queue, draining it is part of
+			 * servicing the session
+			 */
+			idx = 0;
+			revents = 0;
+		}
+		if (iscsi_service_connection(iscsi, idx, revents) < 0) {
+			return -1;
+		}
+		if (e->iscsi == NULL) {
+			/* removed from a callback */
+			return 0;
+		}
+	}
+
+	if (timed) {
+		count = iscsi_get_connection_count(iscsi);
+		for (idx = 0; idx < count; idx++) {
+			if (iscsi_service_connection(iscsi, idx, 0) < 0) {
+				return -1;
+			}
+			if (e->iscsi == NULL) {
+				return 0;
+			}
+		}
+	}
+	return 0;
+}
+
+struct iscsi_event_engine *
+iscsi_event_engine_create(void)
+{
+	struct iscsi_event_engine *engine;
+	struct epoll_event ev;
+
+	engine = calloc(1, sizeof(struct iscsi_event_engine));
+	if (engine == NULL) {
+		return NULL;
+	}
+	engine->timerfd = -1;
+
+	engine->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (engine->epfd == -1) {
+		goto failed;
+	}
+	engine->timerfd = timerfd_create(CLOCK_MONOTONIC,
+					 TFD_NONBLOCK | TFD_CLOEXEC);
+	if (engine->timerfd == -1) {
+		goto failed;
+	}
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.u64 = ISCSI_ENGINE_TIMER_KEY;
+	if (epoll_ctl(engine->epfd, EPOLL_CTL_ADD, engine->timerfd,
+		      &ev) != 0) {
+		goto failed;
+	}
+	return engine;
+
+ failed:
+	if (engine->timerfd != -1) {
+		close(engine->timerfd);
+	}
+	if (engine->epfd != -1) {
+		close(engine->epfd);
+	}
+	free(engine);
+	return NULL;
+}
+
+void
+iscsi_event_engine_destroy(struct iscsi_event_engine *engine)
+{
+	uint32_t i;
+
+	if (engine == NULL) {
+		return;
+	}
+	for (i = 0; i < engine->num_slots; i++) {
+		if (engine->slots[i] != NULL) {
+			iscsi_engine_detach(engine->slots[i]);
+		}
+	}
+	/* frees the entries that were still on the dirty list */
+	iscsi_engine_flush(engine);
+
+	close(engine->timerfd);
+	close(engine->epfd);
+	free(engine->slots);
+	free(engine->free_slots);
+	free(engine->heap);
+	free(engine);
+}
+
+int
+iscsi_event_engine_get_fd(struct iscsi_event_engine *engine)
+{
+	return engine->epfd;
+}
+
+static int
+iscsi_engine_grow(struct iscsi_event_engine *engine)
+{
+	struct iscsi_engine_entry **slots, **heap;
+	uint32_t *free_slots;
+	uint32_t i, num = engine->num_slots ? 2 * engine->num_slots : 64;
+
+	if (num >= 1U << (32 - ISCSI_ENGINE_SOURCE_BITS)) {
+		return -1;
+	}
+	slots = realloc(engine->slots, num * sizeof(*slots));
+	if (slots == NULL) {
+		return -1;
+	}
+	engine->slots = slots;
+	heap = realloc(engine->heap, num * sizeof(*heap));
+	if (heap == NULL) {
+		return -1;
+	}
+	engine->heap = heap;
+	free_slots = realloc(engine->free_slots, num * sizeof(*free_slots));
+	if (free_slots == NULL) {
+		return -1;
+	}
+	engine->free_slots = free_slots;
+
+	/* hand out the low slots first */
+	for (i = num; i > engine->num_slots; i--) {
+		engine->slots[i - 1] = NULL;
+		engine->free_slots[engine->num_free++] = i - 1;
+	}
+	engine->num_slots = num;
+	return 0;
+}
+
+int
+iscsi_event_engine_add(struct iscsi_event_engine *engine,
+		       struct iscsi_context *iscsi, iscsi_command_cb cb,
+		       void *private_data)
+{
+	struct iscsi_engine_entry *e;
+	int i;
+
+	if (iscsi->engine_entry != NULL) {
+		iscsi_set_error(iscsi, "Context is already driven by an "
+				"event engine");
+		return -1;
+	}
+	if (iscsi->leader != NULL) {
+		iscsi_set_error(iscsi, "Only the leading connection of a "
+				"session can be added to an event engine");
+		return -1;
+	}
+	if (iscsi->transport != TCP_TRANSPORT) {
+		iscsi_set_error(iscsi, "The event engine only supports the "
+				"TCP transport");
+		return -1;
+	}
+
+	if (engine->num_free == 0 && iscsi_engine_grow(engine) != 0) {
+		iscsi_set_error(iscsi, "Out-of-memory: failed to grow the "
+				"event engine");
+		return -1;
+	}
+	e = calloc(1, sizeof(struct iscsi_engine_entry));
+	if (e == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: failed to allocate "
+				"event engine entry");
+		return -1;
+	}
+	e->engine       = engine;
+	e->iscsi        = iscsi;
+	e->cb           = cb;
+	e->private_data = private_data;
+	e->slot         = engine->free_slots[--engine->num_free];
+	e->gen          = ++engine->gen;
+	e->heap_idx     = -1;
+	for (i = 0; i < ISCSI_ENGINE_MAX_SOURCES; i++) {
+		e->src[i].fd = -1;
+	}
+	engine->slots[e->slot] = e;
+	engine->count++;
+
+	iscsi->engine_entry = e;
+	iscsi_engine_mark(e, ISCSI_ENGINE_DIRTY);
+	return 0;
+}
+
+static void
+iscsi_engine_detach(struct iscsi_engine_entry *e)
+{
+	struct iscsi_event_engine *engine = e->engine;
+	int i;
+
+	for (i = 0; i < ISCSI_ENGINE_MAX_SOURCES; i++) {
+		if (e->src[i].fd != -1) {
+			iscsi_engine_unregister(e, i);
+		}
+	}
+	iscsi_engine_heap_remove(engine, e);
+	engine->slots[e->slot] = NULL;
+	engine->free_slots[engine->num_free++] = e->slot;
+	engine->count--;
+
+	e->iscsi->engine_entry = NULL;
+	e->iscsi = NULL;
+	if (e->flags == 0) {
+		free(e);
+	}
+}
+
+int
+iscsi_event_engine_remove(struct iscsi_event_engine *engine,
+			  struct iscsi_context *iscsi)
+{
+	struct iscsi_engine_entry *e = iscsi->engine_entry;
+
+	if (e == NULL || e->engine != engine) {
+		iscsi_set_error(iscsi, "Context is not driven by this event "
+				"engine");
+		return -1;
+	}
+	iscsi_engine_detach(e);
+	return 0;
+}
+
+int
+iscsi_event_engine_run_once(struct iscsi_event_engine *engine,
+			    int timeout_ms)
+{
+	struct epoll_event events[ISCSI_ENGINE_MAX_EVENTS];
+	struct iscsi_engine_entry *e;
+	struct iscsi_engine_source *s;
+	struct iscsi_context *iscsi;
+	iscsi_command_cb cb;
+	void *private_data;
+	uint64_t key, now, expirations;
+	uint32_t slot;
+	int i, n, count = 0;
+	ssize_t ret;
+
+	/* what changed since the last iteration */
+	iscsi_engine_flush(engine);
+
+	now = iscsi_monotonic_ms();
+	if (engine->heap_len > 0 && engine->heap[0]->deadline <= now) {
+		timeout_ms = 0;
+	}
+	iscsi_engine_arm(engine, now);
+
+	n = epoll_wait(engine->epfd, events, ISCSI_ENGINE_MAX_EVENTS,
+		       timeout_ms);
+	if (n < 0) {
+		if (errno != EINTR) {
+			return -1;
+		}
+		n = 0;
+	}
+
+	for (i = 0; i < n; i++) {
+		key = events[i].data.u64;
+		if (key == ISCSI_ENGINE_TIMER_KEY) {
+			ret = read(engine->timerfd, &expirations,
+				   sizeof(expirations));
+			(void)ret;
+			engine->armed = 0;
+			continue;
+		}
+		if (key == ISCSI_ENGINE_WAKEUP_KEY) {
+			/* only there to end epoll_wait() */
+			continue;
+		}
+		slot = (uint32_t)key >> ISCSI_ENGINE_SOURCE_BITS;
+		if (slot >= engine->num_slots) {
+			continue;
+		}
+		e = engine->slots[slot];
+		if (e == NULL || e->gen != (uint32_t)(key >> 32)) {
+			continue;
+		}
+		s = &e->src[key & ISCSI_ENGINE_SOURCE_MASK];
+		if (s->fd == -1) {
+			continue;
+		}
+		if (events[i].events & EPOLLIN) {
+			s->revents |= POLLIN;
+		}
+		if (events[i].events & EPOLLOUT) {
+			s->revents |= POLLOUT;
+		}
+		if (events[i].events & EPOLLERR) {
+			s->revents |= POLLERR;
+		}
+		if (events[i].events & EPOLLHUP) {
+			s->revents |= POLLHUP;
+		}
+		iscsi_engine_mark(e, ISCSI_ENGINE_READY);
+	}
+
+	/* contexts whose next timeout has come */
+	now = iscsi_monotonic_ms();
+	while (engine->heap_len > 0 && engine->heap[0]->deadline <= now) {
+		e = engine->heap[0];
+		iscsi_engine_heap_remove(engine, e);
+		e->timed = 1;
+		iscsi_engine_mark(e, ISCSI_ENGINE_READY);
+	}
+
+	while ((e = engine->ready) != NULL) {
+		engine->ready = e->next_ready;
+		if (e->iscsi != NULL) {
+			count++;
+			if (iscsi_engine_service(e) != 0) {
+				/* the context is of no more use, hand it
+				 * back to the application
+				 */
+				iscsi = e->iscsi;
+				cb = e->cb;
+				private_data = e->private_data;
+				ISCSI_LOG(iscsi, 1, "event engine: "
+					  "iscsi_service failed with: %s",
+					  iscsi_get_error(iscsi));
+				iscsi_engine_detach(e);
+				if (cb != NULL) {
+					cb(iscsi, SCSI_STATUS_ERROR, NULL,
+					   private_data);
+				}
+			} else if (e->iscsi != NULL) {
+				iscsi_engine_mark(e, ISCSI_ENGINE_DIRTY);
+			}
+		}
+		iscsi_engine_unmark(e, ISCSI_ENGINE_READY);
+	}
+
+	iscsi_engine_flush(engine);
+	return count;
+}
+
+/*
+ * Make the engine return from epoll_wait() when fd becomes readable, the
+ * caller resets it. Used by the executor to wake up a shard.
+ */
+int
+iscsi_engine_add_wakeup(struct iscsi_event_engine *engine, int fd)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.u64 = ISCSI_ENGINE_WAKEUP_KEY;
+	return epoll_ctl(engine->epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+void
+iscsi_engine_touch(struct iscsi_context *iscsi)
+{
+	struct iscsi_engine_entry *e = iscsi_session(iscsi)->engine_entry;
+
+	if (e != NULL) {
+		iscsi_engine_mark(e, ISCSI_ENGINE_DIRTY);
+	}
+}
+
+static struct iscsi_engine_source *
+iscsi_engine_find_fd(struct iscsi_engine_entry *e, int fd)
+{
+	int i;
+
+	for (i = 0; i < ISCSI_ENGINE_MAX_SOURCES; i++) {
+		if (e->src[i].fd == fd) {
+			return &e->src[i];
+		}
+	}
+	return NULL;
+}
+
+void
+iscsi_engine_fd_closing(struct iscsi_context *iscsi, int fd)
+{
+	struct iscsi_engine_entry *e = iscsi_session(iscsi)->engine_entry;
+	struct iscsi_engine_source *s;
+
+	if (e == NULL || fd == -1) {
+		return;
+	}
+	s = iscsi_engine_find_fd(e, fd);
+	if (s != NULL) {
+		iscsi_engine_unregister(e, s - e->src);
+	}
+	iscsi_engine_mark(e, ISCSI_ENGINE_DIRTY);
+}
+
+void
+iscsi_engine_fd_replaced(struct iscsi_context *iscsi, int fd)
+{
+	struct iscsi_engine_entry *e = iscsi_session(iscsi)->engine_entry;
+	struct iscsi_engine_source *s;
+
+	if (e == NULL || fd == -1) {
+		return;
+	}
+	/* the file it was registered for has been closed and with it
+	 * the registration
+	 */
+	s = iscsi_engine_find_fd(e, fd);
+	if (s != NULL) {
+		memset(s, 0, sizeof(*s));
+		s->fd = -1;
+	}
+	iscsi_engine_mark(e, ISCSI_ENGINE_DIRTY);
+}
+
+/* the context is being destroyed */
+void
+iscsi_engine_forget(struct iscsi_context *iscsi)
+{
+	iscsi_engine_detach(iscsi->engine_entry);
+}
+
+#else /* ISCSI_HAVE_EVENT_ENGINE */
+
+struct iscsi_event_engine *
+iscsi_event_engine_create(void)
+{
+	errno = ENOSYS;
+	return NULL;
+}
+
+void
+iscsi_event_engine_destroy(struct iscsi_event_engine *engine)
+{
+	(void)engine;
+}
+
+int
+iscsi_event_engine_get_fd(struct iscsi_event_engine *engine)
+{
+	(void)engine;
+	return -1;
+}
+
+int
+iscsi_event_engine_add(struct iscsi_event_engine *engine,
+		       struct iscsi_context *iscsi, iscsi_command_cb cb,
+		       void *private_data)
+{
+	(void)engine; (void)cb; (void)private_data;
+
+	iscsi_set_error(iscsi, "The event engine is not supported on this "
+			"platform");
+	return -1;
+}
+
+int
+iscsi_event_engine_remove(struct iscsi_event_engine *engine,
+			  struct iscsi_context *iscsi)
+{
+	(void)engine;
+
+	iscsi_set_error(iscsi, "The event engine is not supported on this "
+			"platform");
+	return -1;
+}
+
+int
+iscsi_event_engine_run_once(struct iscsi_event_engine *engine,
+			    int timeout_ms)
+{
+	(void)engine; (void)timeout_ms;
+
+	errno = ENOSYS;
+	return -1;
+}
+
+int
+iscsi_engine_add_wakeup(struct iscsi_event_engine *engine, int fd)
+{
+	(void)engine; (void)fd;
+
+	errno = ENOSYS;
+	return -1;
+}
+
+void
+iscsi_engine_touch(struct iscsi_context *iscsi)
+{
+	(void)iscsi;
+}
+
+void
+iscsi_engine_fd_closing(struct iscsi_context *iscsi, int fd)
+{
+	(void)iscsi; (void)fd;
+}
+
+void
+iscsi_engine_fd_replaced(struct iscsi_context *iscsi, int fd)
+{
+	(void)iscsi; (void)fd;
+}
+
+void
+iscsi_engine_forget(struct iscsi_context *iscsi)
+{
+	(void)iscsi;
+}
+
+#endif /* ISCSI_HAVE_EVENT_ENGINE */
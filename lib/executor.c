@@ -0,0 +1,1320 @@
+/*
+   Copyright (C) 2010 by Ronnie Sahlberg <ronniesahlberg@gmail.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#define _GNU_SOURCE
+
+#if defined(HAVE_ATOMIC_BUILTINS) && defined(HAVE_PTHREAD_H) && \
+    defined(HAVE_PTHREAD_CREATE) && defined(HAVE_SYS_EPOLL_H) && \
+    defined(HAVE_SYS_TIMERFD_H)
+#define ISCSI_HAVE_EXECUTOR
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#endif
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "iscsi.h"
+#include "iscsi-private.h"
+#include "scsi-lowlevel.h"
+
+#ifdef ISCSI_HAVE_EXECUTOR
+
+/*
+ * A thread per shard, each with its own event engine.
+ *
+ * A session belongs to one shard from the moment it is added until it
+ * is removed, and only the thread of that shard touches the context, so
+ * none of the context, including its slab allocator, is shared between
+ * cores. Everything that crosses shards is a message on a ring owned by
+ * the receiving shard. There is one ring for every other shard, with a
+ * single producer and a single consumer so neither side takes a lock,
+ * and one more for threads that are not shards, whose producers take
+ * ext_lock. Rings are allocated by their producer on first use.
+ *
+ * A shard that has nothing to do sets sleeping and goes to sleep in
+ * epoll_wait(), where its wakeup descriptor is registered next to the
+ * sessions. A producer only writes to the descriptor when it sees
+ * sleeping set, so a busy shard is not woken up at all. sleeping and the
+ * tail of a ring are each written before the other side's is read, with
+ * a full barrier in between, so either the producer sees the shard
+ * asleep or the shard sees the message.
+ *
+ * Commands for a session group sit on a queue per shard and group, under
+ * work_lock. The shard sends them while its sessions of the group have
+ * room below the queue depth. When its own queue is empty it takes half
+ * of the queue of the shard that has most queued, and a shard that
+ * cannot keep up wakes a sleeping one that has room. The entries for the
+ * queue are carved from the task, so queueing does not allocate.
+ *
+ * Commands are only queued for a group that has sessions, which is
+ * checked under work_lock. When the last session of a group leaves the
+ * executor, what is still queued for the group is cancelled through its
+ * context, so a callback is never invoked without one.
+ */
+
+#define ISCSI_EXEC_RING_SIZE	1024
+#define ISCSI_EXEC_RING_MASK	(ISCSI_EXEC_RING_SIZE - 1)
+#define ISCSI_EXEC_CACHELINE	64
+
+/* sessions that are not in a group are kept in this list */
+#define ISCSI_EXEC_NO_GROUP	ISCSI_EXECUTOR_MAX_GROUPS
+
+#define ISCSI_EXEC_DEFAULT_QUEUE_DEPTH	64
+
+enum iscsi_exec_msg_type {
+	ISCSI_EXEC_CALL,
+	ISCSI_EXEC_SUBMIT,
+	ISCSI_EXEC_ADD
+};
+
+struct iscsi_exec_msg {
+	enum iscsi_exec_msg_type type;
+	int lun;
+	int has_data;
+	struct iscsi_context *iscsi;
+	struct scsi_task *task;
+	iscsi_command_cb cb;
+	iscsi_executor_cb fn;
+	void *private_data;
+	struct iscsi_data data;
+};
+
+struct iscsi_exec_ring {
+	/* written by the producer */
+	uint32_t tail;
+	uint32_t head_seen;	/* last head the producer read */
+	char pad1[ISCSI_EXEC_CACHELINE - 2 * sizeof(uint32_t)];
+	/* written by the consumer */
+	uint32_t head;
+	char pad2[ISCSI_EXEC_CACHELINE - sizeof(uint32_t)];
+	struct iscsi_exec_msg msgs[ISCSI_EXEC_RING_SIZE];
+};
+
+struct iscsi_exec_work {
+	struct iscsi_exec_work *next;
+	struct scsi_task *task;
+	int lun;
+	iscsi_command_cb cb;
+	void *private_data;
+	int has_data;
+	struct iscsi_data data;
+};
+
+struct iscsi_exec_session {
+	struct iscsi_executor *ex;
+	struct iscsi_context *iscsi;
+	int shard;
+	int group;
+	int attached;	/* on the shard's engine */
+	iscsi_command_cb cb;
+	void *private_data;
+	struct iscsi_exec_session *next;
+};
+
+struct iscsi_exec_group {
+	/* under work_lock, queued is also read without */
+	struct iscsi_exec_work *head;
+	struct iscsi_exec_work *tail;
+	int queued;
+	/* only touched by the shard */
+	struct iscsi_exec_session *sessions;
+};
+
+struct iscsi_exec_shard {
+	struct iscsi_executor *ex;
+	int idx;
+	int cpu;		/* -1 for any */
+	pthread_t thread;
+	struct iscsi_event_engine *engine;
+
+	/* by the producer, the last one for threads that are not shards */
+	struct iscsi_exec_ring **rings;
+	pthread_mutex_t ext_lock;
+
+	struct iscsi_wakeup wakeup;
+	int sleeping;
+	uint64_t spare;		/* groups it has room for while sleeping */
+	int num_sessions;
+
+	uint64_t groups_here;	/* groups with sessions on this shard */
+	pthread_mutex_t work_lock;
+	struct iscsi_exec_group groups[ISCSI_EXECUTOR_MAX_GROUPS + 1];
+};
+
+struct iscsi_executor {
+	int num_shards;
+	int running;
+	int stop;
+	int queue_depth;
+	/* the shards that have sessions of a group */
+	uint64_t group_shards[ISCSI_EXECUTOR_MAX_GROUPS];
+	struct iscsi_exec_shard **shards;
+};
+
+static __thread struct iscsi_exec_shard *iscsi_exec_self;
+
+static struct iscsi_exec_shard *
+iscsi_exec_current(struct iscsi_executor *ex)
+{
+	struct iscsi_exec_shard *shard = iscsi_exec_self;
+
+	return shard != NULL && shard->ex == ex ? shard : NULL;
+}
+
+/* Wake the shard up if it is, or is about to be, asleep. */
+static void
+iscsi_exec_kick(struct iscsi_exec_shard *shard)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&shard->sleeping, __ATOMIC_RELAXED)) {
+		iscsi_wakeup_signal(&shard->wakeup);
+	}
+}
+
+static int
+iscsi_exec_ring_push(struct iscsi_exec_shard *to, int src,
+		     struct iscsi_exec_msg *msg)
+{
+	struct iscsi_exec_ring *r = to->rings[src];
+	uint32_t tail;
+
+	if (r == NULL) {
+		r = calloc(1, sizeof(struct iscsi_exec_ring));
+		if (r == NULL) {
+			errno = ENOMEM;
+			return -1;
+		}
+		__atomic_store_n(&to->rings[src], r, __ATOMIC_RELEASE);
+	}
+
+	tail = r->tail;
+	if (tail - r->head_seen == ISCSI_EXEC_RING_SIZE) {
+		r->head_seen = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		if (tail - r->head_seen == ISCSI_EXEC_RING_SIZE) {
+			errno = EAGAIN;
+			return -1;
+		}
+	}
+	r->msgs[tail & ISCSI_EXEC_RING_MASK] = *msg;
+	__atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+static int
+iscsi_exec_post(struct iscsi_executor *ex, int dst,
+		struct iscsi_exec_msg *msg)
+{
+	struct iscsi_exec_shard *self = iscsi_exec_current(ex);
+	struct iscsi_exec_shard *to = ex->shards[dst];
+	int ret;
+
+	if (self != NULL) {
+		ret = iscsi_exec_ring_push(to, self->idx, msg);
+	} else {
+		pthread_mutex_lock(&to->ext_lock);
+		ret = iscsi_exec_ring_push(to, ex->num_shards, msg);
+		pthread_mutex_unlock(&to->ext_lock);
+	}
+	if (ret != 0) {
+		return -1;
+	}
+	if (to != self) {
+		iscsi_exec_kick(to);
+	}
+	return 0;
+}
+
+static int
+iscsi_exec_rings_pending(struct iscsi_exec_shard *shard)
+{
+	struct iscsi_exec_ring *r;
+	int i;
+
+	for (i = 0; i <= shard->ex->num_shards; i++) {
+		r = __atomic_load_n(&shard->rings[i], __ATOMIC_ACQUIRE);
+		if (r != NULL &&
+		    __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) != r->head) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void
+iscsi_exec_link(struct iscsi_exec_shard *shard,
+		struct iscsi_exec_session *s)
+{
+	struct iscsi_exec_group *grp = &shard->groups[s->group];
+
+	s->next = grp->sessions;
+	grp->sessions = s;
+	if (s->group != ISCSI_EXEC_NO_GROUP) {
+		shard->groups_here |= 1ULL << s->group;
+		__atomic_or_fetch(&shard->ex->group_shards[s->group],
+				  1ULL << shard->idx, __ATOMIC_RELEASE);
+	}
+}
+
+/* Returns 1 if it was the last session of its group in the executor. */
+static int
+iscsi_exec_unlink(struct iscsi_exec_shard *shard,
+		  struct iscsi_exec_session *s)
+{
+	struct iscsi_exec_group *grp = &shard->groups[s->group];
+	struct iscsi_exec_session **sp;
+
+	for (sp = &grp->sessions; *sp != NULL; sp = &(*sp)->next) {
+		if (*sp == s) {
+			*sp = s->next;
+			break;
+		}
+	}
+	if (grp->sessions == NULL && s->group != ISCSI_EXEC_NO_GROUP) {
+		shard->groups_here &= ~(1ULL << s->group);
+		return __atomic_and_fetch(&shard->ex->group_shards[s->group],
+					  ~(1ULL << shard->idx),
+					  __ATOMIC_SEQ_CST) == 0;
+	}
+	return 0;
+}
+
+/* Take all commands off a queue. */
+static struct iscsi_exec_work *
+iscsi_exec_take_all(struct iscsi_exec_shard *from, int group)
+{
+	struct iscsi_exec_group *grp = &from->groups[group];
+	struct iscsi_exec_work *list;
+
+	pthread_mutex_lock(&from->work_lock);
+	list = grp->head;
+	grp->head = grp->tail = NULL;
+	__atomic_store_n(&grp->queued, 0, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&from->work_lock);
+	return list;
+}
+
+/*
+ * The last session of the group has left, nobody can send what is queued
+ * for it any more. Cancel it through the context that left. Nothing is
+ * queued for the group after this, see iscsi_exec_queue().
+ */
+static void
+iscsi_exec_cancel_list(struct iscsi_exec_work *w, struct iscsi_context *iscsi)
+{
+	struct iscsi_exec_work *next;
+
+	for (; w != NULL; w = next) {
+		/* the entry lives in the task, which the callback may free */
+		next = w->next;
+		w->cb(iscsi, SCSI_STATUS_CANCELLED, w->task, w->private_data);
+	}
+}
+
+static void
+iscsi_exec_cancel_group(struct iscsi_executor *ex, int group,
+			struct iscsi_context *iscsi)
+{
+	int i;
+
+	for (i = 0; i < ex->num_shards; i++) {
+		iscsi_exec_cancel_list(iscsi_exec_take_all(ex->shards[i],
+							   group), iscsi);
+	}
+}
+
+/* Take the session off the executor, it belongs to the caller again. */
+static void
+iscsi_exec_release(struct iscsi_exec_session *s)
+{
+	struct iscsi_executor *ex = s->ex;
+	struct iscsi_exec_shard *shard = ex->shards[s->shard];
+	struct iscsi_context *iscsi = s->iscsi;
+	int group = s->group, last = 0;
+
+	if (s->attached) {
+		last = iscsi_exec_unlink(shard, s);
+	}
+	__atomic_sub_fetch(&shard->num_sessions, 1, __ATOMIC_RELAXED);
+	iscsi->exec = NULL;
+	free(s);
+
+	if (last) {
+		iscsi_exec_cancel_group(ex, group, iscsi);
+	}
+}
+
+static void
+iscsi_exec_session_failed(struct iscsi_context *iscsi, int status,
+			  void *command_data, void *private_data)
+{
+	struct iscsi_exec_session *s = private_data;
+	iscsi_command_cb cb = s->cb;
+	void *cb_data = s->private_data;
+
+	(void)command_data;
+
+	/* the engine has removed it already */
+	iscsi_exec_release(s);
+	if (cb != NULL) {
+		cb(iscsi, status, NULL, cb_data);
+	}
+}
+
+static void
+iscsi_exec_attach(struct iscsi_exec_shard *shard,
+		  struct iscsi_exec_session *s)
+{
+	struct iscsi_context *iscsi = s->iscsi;
+	iscsi_command_cb cb = s->cb;
+	void *cb_data = s->private_data;
+
+	if (iscsi_event_engine_add(shard->engine, iscsi,
+				   iscsi_exec_session_failed, s) != 0) {
+		iscsi_exec_release(s);
+		if (cb != NULL) {
+			cb(iscsi, SCSI_STATUS_ERROR, NULL, cb_data);
+		}
+		return;
+	}
+	s->attached = 1;
+	iscsi_exec_link(shard, s);
+}
+
+static void
+iscsi_exec_handle(struct iscsi_exec_shard *shard, struct iscsi_exec_msg *m)
+{
+	switch (m->type) {
+	case ISCSI_EXEC_CALL:
+		m->fn(shard->ex, shard->idx, m->private_data);
+		break;
+	case ISCSI_EXEC_SUBMIT:
+		if (iscsi_scsi_command_async(m->iscsi, m->lun, m->task, m->cb,
+					     m->has_data ? &m->data : NULL,
+					     m->private_data) != 0) {
+			m->cb(m->iscsi, SCSI_STATUS_ERROR, m->task,
+			      m->private_data);
+		}
+		break;
+	case ISCSI_EXEC_ADD:
+		iscsi_exec_attach(shard, m->private_data);
+		break;
+	}
+}
+
+/* Handle what the other threads have sent so far. */
+static void
+iscsi_exec_drain(struct iscsi_exec_shard *shard)
+{
+	struct iscsi_exec_ring *r;
+	struct iscsi_exec_msg m;
+	uint32_t head, tail;
+	int i;
+
+	for (i = 0; i <= shard->ex->num_shards; i++) {
+		r = __atomic_load_n(&shard->rings[i], __ATOMIC_ACQUIRE);
+		if (r == NULL) {
+			continue;
+		}
+		head = r->head;
+		tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+		while (head != tail) {
+			m = r->msgs[head & ISCSI_EXEC_RING_MASK];
+			/* the slot can be reused while we handle it */
+			__atomic_store_n(&r->head, ++head, __ATOMIC_RELEASE);
+			iscsi_exec_handle(shard, &m);
+		}
+	}
+}
+
+/* How many more commands the sessions of the group have room for. */
+static int
+iscsi_exec_room(struct iscsi_exec_shard *shard, int group)
+{
+	struct iscsi_exec_session *s;
+	int depth = __atomic_load_n(&shard->ex->queue_depth, __ATOMIC_RELAXED);
+	int len, room = 0;
+
+	for (s = shard->groups[group].sessions; s != NULL; s = s->next) {
+		len = iscsi_queue_length(s->iscsi);
+		if (len < depth) {
+			room += depth - len;
+		}
+	}
+	return room;
+}
+
+static struct iscsi_exec_session *
+iscsi_exec_least_loaded(struct iscsi_exec_shard *shard, int group)
+{
+	struct iscsi_exec_session *s, *best = NULL;
+	int len, best_len = 0;
+
+	for (s = shard->groups[group].sessions; s != NULL; s = s->next) {
+		len = iscsi_queue_length(s->iscsi);
+		if (best == NULL || len < best_len) {
+			best = s;
+			best_len = len;
+		}
+	}
+	return best;
+}
+
+/* Take up to max commands off the head of a queue. */
+static struct iscsi_exec_work *
+iscsi_exec_take(struct iscsi_exec_shard *from, int group, int max)
+{
+	struct iscsi_exec_group *grp = &from->groups[group];
+	struct iscsi_exec_work *list, *w;
+	int n;
+
+	if (__atomic_load_n(&grp->queued, __ATOMIC_RELAXED) == 0) {
+		return NULL;
+	}
+	pthread_mutex_lock(&from->work_lock);
+	list = w = grp->head;
+	for (n = 1; w != NULL && n < max; n++) {
+		w = w->next;
+	}
+	if (w == NULL) {
+		grp->head = grp->tail = NULL;
+		n = grp->queued;
+	} else {
+		grp->head = w->next;
+		if (grp->head == NULL) {
+			grp->tail = NULL;
+		}
+		w->next = NULL;
+	}
+	__atomic_store_n(&grp->queued, grp->queued - n, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&from->work_lock);
+	return list;
+}
+
+/* Take half of the queue of the shard that has most queued. */
+static struct iscsi_exec_work *
+iscsi_exec_steal(struct iscsi_exec_shard *shard, int group, int max)
+{
+	struct iscsi_executor *ex = shard->ex;
+	struct iscsi_exec_shard *victim = NULL;
+	int i, queued, most = 0;
+
+	for (i = 0; i < ex->num_shards; i++) {
+		queued = __atomic_load_n(&ex->shards[i]->groups[group].queued,
+					 __ATOMIC_RELAXED);
+		if (ex->shards[i] != shard && queued > most) {
+			victim = ex->shards[i];
+			most = queued;
+		}
+	}
+	if (victim == NULL) {
+		return NULL;
+	}
+	most = (most + 1) / 2;
+	return iscsi_exec_take(victim, group, most < max ? most : max);
+}
+
+/*
+ * Append a command, or a list of them, to a queue. Fails if the group has
+ * no sessions left, the check is under work_lock so that
+ * iscsi_exec_cancel_group() either sees the commands or we see it gone.
+ */
+static int
+iscsi_exec_queue(struct iscsi_exec_shard *shard, int group,
+		 struct iscsi_exec_work *w)
+{
+	struct iscsi_exec_group *grp = &shard->groups[group];
+	struct iscsi_exec_work *last;
+	int n;
+
+	for (n = 1, last = w; last->next != NULL; n++) {
+		last = last->next;
+	}
+	pthread_mutex_lock(&shard->work_lock);
+	if (__atomic_load_n(&shard->ex->group_shards[group],
+			    __ATOMIC_SEQ_CST) == 0) {
+		pthread_mutex_unlock(&shard->work_lock);
+		return -1;
+	}
+	if (grp->tail != NULL) {
+		grp->tail->next = w;
+	} else {
+		grp->head = w;
+	}
+	grp->tail = last;
+	__atomic_store_n(&grp->queued, grp->queued + n, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&shard->work_lock);
+	return 0;
+}
+
+/* We have more than we can send, find someone who has room. */
+static void
+iscsi_exec_share(struct iscsi_exec_shard *shard, int group)
+{
+	struct iscsi_executor *ex = shard->ex;
+	struct iscsi_exec_shard *other;
+	uint64_t mask;
+	int i;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	mask = __atomic_load_n(&ex->group_shards[group], __ATOMIC_RELAXED);
+	for (i = 0; i < ex->num_shards; i++) {
+		other = ex->shards[i];
+		if (other == shard || !(mask & (1ULL << i))) {
+			continue;
+		}
+		if (__atomic_load_n(&other->sleeping, __ATOMIC_RELAXED) &&
+		    __atomic_load_n(&other->spare, __ATOMIC_RELAXED) &
+		    (1ULL << group)) {
+			iscsi_wakeup_signal(&other->wakeup);
+			return;
+		}
+	}
+}
+
+static void
+iscsi_exec_dispatch_group(struct iscsi_exec_shard *shard, int group)
+{
+	struct iscsi_exec_session *s;
+	struct iscsi_exec_work *w;
+	struct iscsi_context *iscsi;
+	int room;
+
+	room = iscsi_exec_room(shard, group);
+	if (room > 0 && __atomic_load_n(&shard->groups[group].queued,
+					 __ATOMIC_RELAXED) == 0) {
+		w = iscsi_exec_steal(shard, group, room);
+		/* can not fail while we have sessions of the group */
+		if (w != NULL && iscsi_exec_queue(shard, group, w) != 0) {
+			s = iscsi_exec_least_loaded(shard, group);
+			iscsi_exec_cancel_list(w, s->iscsi);
+		}
+	}
+
+	/* A command only leaves the queue once there is a session to send
+	 * it on. Sending can invoke callbacks, for example of held back
+	 * commands that fail, and those may remove sessions.
+	 */
+	for (; room > 0; room--) {
+		s = iscsi_exec_least_loaded(shard, group);
+		if (s == NULL) {
+			break;
+		}
+		w = iscsi_exec_take(shard, group, 1);
+		if (w == NULL) {
+			break;
+		}
+		iscsi = s->iscsi;
+		if (iscsi_scsi_command_async(iscsi, w->lun, w->task, w->cb,
+					     w->has_data ? &w->data : NULL,
+					     w->private_data) != 0) {
+			w->cb(iscsi, SCSI_STATUS_ERROR, w->task,
+			      w->private_data);
+		}
+	}
+	if (__atomic_load_n(&shard->groups[group].queued,
+			    __ATOMIC_RELAXED) > 0) {
+		iscsi_exec_share(shard, group);
+	}
+}
+
+static void
+iscsi_exec_dispatch(struct iscsi_exec_shard *shard)
+{
+	uint64_t groups = shard->groups_here;
+	int group;
+
+	while (groups != 0) {
+		group = __builtin_ctzll(groups);
+		groups &= groups - 1;
+		iscsi_exec_dispatch_group(shard, group);
+	}
+}
+
+/*
+ * Get ready to sleep. Returns 0 if there is something to do after all
+ * and the shard must not wait.
+ */
+static int
+iscsi_exec_may_sleep(struct iscsi_exec_shard *shard)
+{
+	struct iscsi_executor *ex = shard->ex;
+	uint64_t groups = shard->groups_here, spare = 0;
+	int group, i;
+
+	while (groups != 0) {
+		group = __builtin_ctzll(groups);
+		groups &= groups - 1;
+		if (iscsi_exec_room(shard, group) > 0) {
+			spare |= 1ULL << group;
+		}
+	}
+	__atomic_store_n(&shard->spare, spare, __ATOMIC_RELAXED);
+	__atomic_store_n(&shard->sleeping, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&ex->stop, __ATOMIC_RELAXED) ||
+	    iscsi_exec_rings_pending(shard)) {
+		return 0;
+	}
+	while (spare != 0) {
+		group = __builtin_ctzll(spare);
+		spare &= spare - 1;
+		for (i = 0; i < ex->num_shards; i++) {
+			if (__atomic_load_n(&ex->shards[i]->groups[group].queued,
+					    __ATOMIC_RELAXED) > 0) {
+				return 0;
+			}
+		}
+	}
+	return 1;
+}
+
+static int
+iscsi_exec_set_cpu(pthread_t thread, int cpu)
+{
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+	cpu_set_t set;
+	int i, err;
+
+	CPU_ZERO(&set);
+	if (cpu >= 0) {
+		CPU_SET(cpu, &set);
+	} else {
+		for (i = 0; i < CPU_SETSIZE; i++) {
+			CPU_SET(i, &set);
+		}
+	}
+	err = pthread_setaffinity_np(thread, sizeof(set), &set);
+	if (err != 0) {
+		errno = err;
+		return -1;
+	}
+	return 0;
+#else
+	(void)thread; (void)cpu;
+
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+static void *
+iscsi_exec_thread(void *arg)
+{
+	struct iscsi_exec_shard *shard = arg;
+	struct iscsi_executor *ex = shard->ex;
+	int timeout;
+
+	iscsi_exec_self = shard;
+
+	while (!__atomic_load_n(&ex->stop, __ATOMIC_ACQUIRE)) {
+		iscsi_wakeup_clear(&shard->wakeup);
+		iscsi_exec_drain(shard);
+		iscsi_exec_dispatch(shard);
+
+		timeout = iscsi_exec_may_sleep(shard) ? -1 : 0;
+		iscsi_event_engine_run_once(shard->engine, timeout);
+		__atomic_store_n(&shard->sleeping, 0, __ATOMIC_RELAXED);
+	}
+
+	iscsi_exec_self = NULL;
+	return NULL;
+}
+
+/*
+ * Give back everything the shard holds. Group commands that are still
+ * queued are cancelled when the last session of their group is released,
+ * so this is done for all shards before any of them is freed.
+ */
+static void
+iscsi_exec_drop_shard(struct iscsi_exec_shard *shard)
+{
+	struct iscsi_exec_session *s;
+	struct iscsi_exec_ring *r;
+	struct iscsi_exec_msg *m;
+	int i;
+
+	/* what was sent to it and not handled yet */
+	for (i = 0; shard->rings != NULL && i <= shard->ex->num_shards; i++) {
+		r = shard->rings[i];
+		if (r == NULL) {
+			continue;
+		}
+		for (; r->head != r->tail; r->head++) {
+			m = &r->msgs[r->head & ISCSI_EXEC_RING_MASK];
+			switch (m->type) {
+			case ISCSI_EXEC_CALL:
+				break;
+			case ISCSI_EXEC_SUBMIT:
+				m->cb(m->iscsi, SCSI_STATUS_CANCELLED,
+				      m->task, m->private_data);
+				break;
+			case ISCSI_EXEC_ADD:
+				iscsi_exec_release(m->private_data);
+				break;
+			}
+		}
+		free(r);
+		shard->rings[i] = NULL;
+	}
+
+	for (i = 0; i <= ISCSI_EXECUTOR_MAX_GROUPS; i++) {
+		while ((s = shard->groups[i].sessions) != NULL) {
+			iscsi_event_engine_remove(shard->engine, s->iscsi);
+			iscsi_exec_release(s);
+		}
+	}
+}
+
+static void
+iscsi_exec_free_shard(struct iscsi_exec_shard *shard)
+{
+	if (shard->engine != NULL) {
+		iscsi_event_engine_destroy(shard->engine);
+	}
+	if (shard->wakeup.fd[0] != -1) {
+		iscsi_wakeup_close(&shard->wakeup);
+	}
+	pthread_mutex_destroy(&shard->ext_lock);
+	pthread_mutex_destroy(&shard->work_lock);
+	free(shard->rings);
+	free(shard);
+}
+
+struct iscsi_executor *
+iscsi_executor_create(int num_shards)
+{
+	struct iscsi_executor *ex;
+	struct iscsi_exec_shard *shard;
+	void *mem;
+	int i;
+
+	if (num_shards < 1 || num_shards > ISCSI_EXECUTOR_MAX_SHARDS) {
+		errno = EINVAL;
+		return NULL;
+	}
+	ex = calloc(1, sizeof(struct iscsi_executor));
+	if (ex == NULL) {
+		return NULL;
+	}
+	ex->queue_depth = ISCSI_EXEC_DEFAULT_QUEUE_DEPTH;
+	ex->shards = calloc(num_shards, sizeof(struct iscsi_exec_shard *));
+	if (ex->shards == NULL) {
+		free(ex);
+		return NULL;
+	}
+
+	for (i = 0; i < num_shards; i++) {
+		/* each shard in cache lines of its own */
+		if (posix_memalign(&mem, ISCSI_EXEC_CACHELINE,
+				   sizeof(struct iscsi_exec_shard)) != 0) {
+			goto failed;
+		}
+		shard = mem;
+		memset(shard, 0, sizeof(struct iscsi_exec_shard));
+		shard->ex = ex;
+		shard->idx = i;
+		shard->cpu = -1;
+		shard->wakeup.fd[0] = -1;
+		pthread_mutex_init(&shard->ext_lock, NULL);
+		pthread_mutex_init(&shard->work_lock, NULL);
+		ex->shards[ex->num_shards++] = shard;
+
+		shard->rings = calloc(num_shards + 1,
+				      sizeof(struct iscsi_exec_ring *));
+		if (shard->rings == NULL) {
+			goto failed;
+		}
+		shard->engine = iscsi_event_engine_create();
+		if (shard->engine == NULL) {
+			goto failed;
+		}
+		if (iscsi_wakeup_open(&shard->wakeup) != 0) {
+			goto failed;
+		}
+		if (iscsi_engine_add_wakeup(shard->engine,
+					    shard->wakeup.fd[0]) != 0) {
+			goto failed;
+		}
+	}
+	return ex;
+
+ failed:
+	iscsi_executor_destroy(ex);
+	return NULL;
+}
+
+void
+iscsi_executor_destroy(struct iscsi_executor *ex)
+{
+	int i;
+
+	if (ex == NULL) {
+		return;
+	}
+	if (ex->running) {
+		__atomic_store_n(&ex->stop, 1, __ATOMIC_RELEASE);
+		for (i = 0; i < ex->num_shards; i++) {
+			iscsi_wakeup_signal(&ex->shards[i]->wakeup);
+		}
+		for (i = 0; i < ex->num_shards; i++) {
+			pthread_join(ex->shards[i]->thread, NULL);
+		}
+	}
+	for (i = 0; i < ex->num_shards; i++) {
+		iscsi_exec_drop_shard(ex->shards[i]);
+	}
+	for (i = 0; i < ex->num_shards; i++) {
+		iscsi_exec_free_shard(ex->shards[i]);
+	}
+	free(ex->shards);
+	free(ex);
+}
+
+int
+iscsi_executor_set_affinity(struct iscsi_executor *ex, int shard, int cpu)
+{
+	if (shard < 0 || shard >= ex->num_shards || cpu < -1) {
+		errno = EINVAL;
+		return -1;
+	}
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+	if (cpu >= CPU_SETSIZE) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (ex->running &&
+	    iscsi_exec_set_cpu(ex->shards[shard]->thread, cpu) != 0) {
+		return -1;
+	}
+	ex->shards[shard]->cpu = cpu;
+	return 0;
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+int
+iscsi_executor_set_queue_depth(struct iscsi_executor *ex, int depth)
+{
+	if (depth < 1) {
+		errno = EINVAL;
+		return -1;
+	}
+	__atomic_store_n(&ex->queue_depth, depth, __ATOMIC_RELAXED);
+	return 0;
+}
+
+int
+iscsi_executor_start(struct iscsi_executor *ex)
+{
+	struct iscsi_exec_shard *shard;
+	sigset_t all, old;
+	int i, err = 0;
+
+	if (ex->running) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	/* signals are for the threads of the application */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	for (i = 0; i < ex->num_shards; i++) {
+		shard = ex->shards[i];
+		err = pthread_create(&shard->thread, NULL, iscsi_exec_thread,
+				     shard);
+		if (err != 0) {
+			break;
+		}
+		if (shard->cpu != -1 &&
+		    iscsi_exec_set_cpu(shard->thread, shard->cpu) != 0) {
+			err = errno;
+			i++;
+			break;
+		}
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (err != 0) {
+		__atomic_store_n(&ex->stop, 1, __ATOMIC_RELEASE);
+		while (i-- > 0) {
+			iscsi_wakeup_signal(&ex->shards[i]->wakeup);
+			pthread_join(ex->shards[i]->thread, NULL);
+		}
+		ex->stop = 0;
+		errno = err;
+		return -1;
+	}
+	ex->running = 1;
+	return 0;
+}
+
+int
+iscsi_executor_current_shard(struct iscsi_executor *ex)
+{
+	struct iscsi_exec_shard *shard = iscsi_exec_current(ex);
+
+	return shard != NULL ? shard->idx : -1;
+}
+
+int
+iscsi_executor_add(struct iscsi_executor *ex, int shard,
+		   struct iscsi_context *iscsi, int group,
+		   iscsi_command_cb cb, void *private_data)
+{
+	struct iscsi_exec_session *s;
+	struct iscsi_exec_msg m;
+	int i, n, least = 0;
+
+	if (iscsi->exec != NULL || iscsi->engine_entry != NULL) {
+		iscsi_set_error(iscsi, "Context is already driven by an "
+				"event engine");
+		return -1;
+	}
+	if (iscsi->leader != NULL) {
+		iscsi_set_error(iscsi, "Only the leading connection of a "
+				"session can be added to an executor");
+		return -1;
+	}
+	if (iscsi->transport != TCP_TRANSPORT) {
+		iscsi_set_error(iscsi, "The executor only supports the TCP "
+				"transport");
+		return -1;
+	}
+	if (shard < -1 || shard >= ex->num_shards ||
+	    group < -1 || group >= ISCSI_EXECUTOR_MAX_GROUPS) {
+		iscsi_set_error(iscsi, "Invalid executor shard %d or group "
+				"%d", shard, group);
+		return -1;
+	}
+	if (shard == -1) {
+		for (i = 0; i < ex->num_shards; i++) {
+			n = __atomic_load_n(&ex->shards[i]->num_sessions,
+					    __ATOMIC_RELAXED);
+			if (i == 0 || n < least) {
+				shard = i;
+				least = n;
+			}
+		}
+	}
+
+	s = calloc(1, sizeof(struct iscsi_exec_session));
+	if (s == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: failed to allocate "
+				"executor session");
+		return -1;
+	}
+	s->ex           = ex;
+	s->iscsi        = iscsi;
+	s->shard        = shard;
+	s->group        = group == -1 ? ISCSI_EXEC_NO_GROUP : group;
+	s->cb           = cb;
+	s->private_data = private_data;
+	iscsi->exec = s;
+	__atomic_add_fetch(&ex->shards[shard]->num_sessions, 1,
+			   __ATOMIC_RELAXED);
+
+	/* nobody else touches the shard yet, or we are the shard */
+	if (!ex->running || iscsi_exec_current(ex) == ex->shards[shard]) {
+		if (iscsi_event_engine_add(ex->shards[shard]->engine, iscsi,
+					   iscsi_exec_session_failed, s) != 0) {
+			iscsi_exec_release(s);
+			return -1;
+		}
+		s->attached = 1;
+		iscsi_exec_link(ex->shards[shard], s);
+		return 0;
+	}
+
+	memset(&m, 0, sizeof(m));
+	m.type         = ISCSI_EXEC_ADD;
+	m.iscsi        = iscsi;
+	m.private_data = s;
+	if (iscsi_exec_post(ex, shard, &m) != 0) {
+		iscsi_set_error(iscsi, "Failed to hand the context to shard "
+				"%d: %s", shard, strerror(errno));
+		iscsi_exec_release(s);
+		return -1;
+	}
+	return 0;
+}
+
+int
+iscsi_executor_remove(struct iscsi_executor *ex, struct iscsi_context *iscsi)
+{
+	struct iscsi_exec_session *s = iscsi->exec;
+
+	if (s == NULL || s->ex != ex) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (ex->running && iscsi_exec_current(ex) != ex->shards[s->shard]) {
+		errno = EPERM;
+		return -1;
+	}
+	if (!s->attached) {
+		/* still on its way to the shard */
+		errno = EAGAIN;
+		return -1;
+	}
+	iscsi_event_engine_remove(ex->shards[s->shard]->engine, iscsi);
+	iscsi_exec_release(s);
+	return 0;
+}
+
+int
+iscsi_executor_call(struct iscsi_executor *ex, int shard,
+		    iscsi_executor_cb fn, void *private_data)
+{
+	struct iscsi_exec_msg m;
+
+	if (shard < 0 || shard >= ex->num_shards || fn == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	memset(&m, 0, sizeof(m));
+	m.type         = ISCSI_EXEC_CALL;
+	m.fn           = fn;
+	m.private_data = private_data;
+	return iscsi_exec_post(ex, shard, &m);
+}
+
+int
+iscsi_executor_submit(struct iscsi_executor *ex, struct iscsi_context *iscsi,
+		      int lun, struct scsi_task *task, iscsi_command_cb cb,
+		      struct iscsi_data *d, void *private_data)
+{
+	struct iscsi_exec_session *s = iscsi->exec;
+	struct iscsi_exec_msg m;
+
+	if (s == NULL || s->ex != ex) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (iscsi_exec_current(ex) == ex->shards[s->shard] && s->attached) {
+		if (iscsi_scsi_command_async(iscsi, lun, task, cb, d,
+					     private_data) != 0) {
+			errno = EIO;
+			return -1;
+		}
+		return 0;
+	}
+
+	memset(&m, 0, sizeof(m));
+	m.type         = ISCSI_EXEC_SUBMIT;
+	m.iscsi        = iscsi;
+	m.lun          = lun;
+	m.task         = task;
+	m.cb           = cb;
+	m.private_data = private_data;
+	m.has_data     = d != NULL;
+	if (d != NULL) {
+		m.data = *d;
+	}
+	return iscsi_exec_post(ex, s->shard, &m);
+}
+
+int
+iscsi_executor_submit_group(struct iscsi_executor *ex, int group, int lun,
+			    struct scsi_task *task, iscsi_command_cb cb,
+			    struct iscsi_data *d, void *private_data)
+{
+	struct iscsi_exec_shard *self = iscsi_exec_current(ex), *to = NULL;
+	struct iscsi_exec_work *w;
+	uint64_t mask;
+	int i, queued, least = 0;
+
+	if (group < 0 || group >= ISCSI_EXECUTOR_MAX_GROUPS) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (self != NULL && self->groups_here & (1ULL << group)) {
+		to = self;
+	} else {
+		mask = __atomic_load_n(&ex->group_shards[group],
+				       __ATOMIC_ACQUIRE);
+		for (i = 0; i < ex->num_shards; i++) {
+			if (!(mask & (1ULL << i))) {
+				continue;
+			}
+			queued = __atomic_load_n(
+				&ex->shards[i]->groups[group].queued,
+				__ATOMIC_RELAXED);
+			if (to == NULL || queued < least) {
+				to = ex->shards[i];
+				least = queued;
+			}
+		}
+		if (to == NULL) {
+			errno = ENOENT;
+			return -1;
+		}
+	}
+
+	w = scsi_malloc(task, sizeof(struct iscsi_exec_work));
+	if (w == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	w->task         = task;
+	w->lun          = lun;
+	w->cb           = cb;
+	w->private_data = private_data;
+	w->next         = NULL;
+	w->has_data     = d != NULL;
+	if (d != NULL) {
+		w->data = *d;
+	}
+	if (iscsi_exec_queue(to, group, w) != 0) {
+		/* the last session of the group has just left */
+		errno = ENOENT;
+		return -1;
+	}
+	if (to != self) {
+		iscsi_exec_kick(to);
+	}
+	return 0;
+}
+
+void
+iscsi_exec_forget(struct iscsi_context *iscsi)
+{
+	iscsi_exec_release(iscsi->exec);
+}
+
+#else /* ISCSI_HAVE_EXECUTOR */
+
+struct iscsi_executor *
+iscsi_executor_create(int num_shards)
+{
+	(void)num_shards;
+
+	errno = ENOSYS;
+	return NULL;
+}
+
+void
+iscsi_executor_destroy(struct iscsi_executor *ex)
+{
+	(void)ex;
+}
+
+int
+iscsi_executor_set_affinity(struct iscsi_executor *ex, int shard, int cpu)
+{
+	(void)ex; (void)shard; (void)cpu;
+
+	errno = ENOSYS;
+	return -1;
+}
+
+int
+iscsi_executor_set_queue_depth(struct iscsi_executor *ex, int depth)
+{
+	(void)ex; (void)depth;
+
+	errno = ENOSYS;
+	return -1;
+}
+
+int
+iscsi_executor_start(struct iscsi_executor *ex)
+{
+	(void)ex;
+
+	errno = ENOSYS;
+	return -1;
+}
+
+int
+iscsi_executor_current_shard(struct iscsi_executor *ex)
+{
+	(void)ex;
+	return -1;
+}
+
+int
+iscsi_executor_add(struct iscsi_executor *ex, int shard,
+		   struct iscsi_context *iscsi, int group,
+		   iscsi_command_cb cb, void *private_data)
+{
+	(void)ex; (void)shard; (void)group; (void)cb; (void)private_data;
+
+	iscsi_set_error(iscsi, "The executor is not supported on this "
+			"platform");
+	return -1;
+}
+
+int
+iscsi_executor_remove(struct iscsi_executor *ex, struct iscsi_context *iscsi)
+{
+	(void)ex; (void)iscsi;
+
+	errno = ENOSYS;
+	return -1;
+}
+
+int
+iscsi_executor_call(struct iscsi_executor *ex, int shard,
+		    iscsi_executor_cb fn, void *private_data)
+{
+	(void)ex; (void)shard; (void)fn; (void)private_data;
+
+	errno = ENOSYS;
+	return -1;
+}
+
+int
+iscsi_executor_submit(struct iscsi_executor *ex, struct iscsi_context *iscsi,
+		      int lun, struct scsi_task *task, iscsi_command_cb cb,
+		      struct iscsi_data *d, void *private_data)
+{
+	(void)ex; (void)iscsi; (void)lun; (void)task; (void)cb; (void)d;
+	(void)private_data;
+
+	errno = ENOSYS;
+	return -1;
+}
+
+int
+iscsi_executor_submit_group(struct iscsi_executor *ex, int group, int lun,
+			    struct scsi_task *task, iscsi_command_cb cb,
+			    struct iscsi_data *d, void *private_data)
+{
+	(void)ex; (void)group; (void)lun; (void)task; (void)cb; (void)d;
+	(void)private_data;
+
+	errno = ENOSYS;
+	return -1;
+}
+
+void
+iscsi_exec_forget(struct iscsi_context *iscsi)
+{
+	(void)iscsi;
+}
+
+#endif /* ISCSI_HAVE_EXECUTOR */
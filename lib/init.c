@@ -29,6 +29,7 @@
 
 #include <assert.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -119,44 +120,6 @@ char* iscsi_strdup(struct iscsi_context *iscsi, const char* str) {
 	return str2;
 }
 
-// 分配
-void* iscsi_smalloc(struct iscsi_context *iscsi, size_t size) {
-	void *ptr;
-	if (size > iscsi->smalloc_size) return NULL;
-	if (iscsi->smalloc_free > 0) {
-		ptr = iscsi->smalloc_ptrs[--iscsi->smalloc_free];
-		iscsi->smallocs++;
-	} else {
-		ptr = iscsi_malloc(iscsi, iscsi->smalloc_size);
-	}
-	return ptr;
-}
-
-// 分配、初始化
-void* iscsi_szmalloc(struct iscsi_context *iscsi, size_t size) {
-	void *ptr = iscsi_smalloc(iscsi, size);
-	if (ptr) {
-		memset(ptr, 0, size);
-	}
-	return ptr;
-}
-
-void iscsi_sfree(struct iscsi_context *iscsi, void* ptr) {
-	if (ptr == NULL) {
-		return;
-	}
-	if (!iscsi->cache_allocations) {
-		iscsi_free(iscsi, ptr);
-	} else if (iscsi->smalloc_free == SMALL_ALLOC_MAX_FREE) {
-		/* SMALL_ALLOC_MAX_FREE should be adjusted that this */
-		/* happens rarely */
-		ISCSI_LOG(iscsi, 6, "smalloc free == SMALLOC_MAX_FREE");
-		iscsi_free(iscsi, ptr);
-	} else {
-		iscsi->smalloc_ptrs[iscsi->smalloc_free++] = ptr;
-	}
-}
-
 static bool rd_set = false;
 static pthread_mutex_t rd_mutex = PTHREAD_MUTEX_INITIALIZER;
 
@@ -215,7 +178,6 @@ iscsi_create_context(const char *initiator_name)
 {
 	struct iscsi_context *iscsi;
     // 必须
-	size_t required = ISCSI_RAW_HEADER_SIZE + ISCSI_DIGEST_SIZE;
 	char *ca;
 
     // 判定
@@ -258,11 +220,17 @@ iscsi_create_context(const char *initiator_name)
 	iscsi->first_burst_length                     = 262144;
 	iscsi->initiator_max_recv_data_segment_length = 262144;
 	iscsi->target_max_recv_data_segment_length    = 8192;
+	iscsi->want_max_burst_length                  = 262144;
+	iscsi->want_first_burst_length                = 262144;
+	iscsi->want_max_recv_data_segment_length      = 262144;
 	iscsi->want_initial_r2t                       = ISCSI_INITIAL_R2T_NO;
 	iscsi->use_initial_r2t                        = ISCSI_INITIAL_R2T_YES;
 	iscsi->want_immediate_data                    = ISCSI_IMMEDIATE_DATA_YES;
 	iscsi->use_immediate_data                     = ISCSI_IMMEDIATE_DATA_YES;
+	iscsi->want_max_outstanding_r2t               = 1;
+	iscsi->max_outstanding_r2t                    = 1;
 	iscsi->want_header_digest                     = ISCSI_HEADER_DIGEST_NONE_CRC32C;
+	iscsi->want_data_digest                       = ISCSI_DATA_DIGEST_NONE;
 
     // tcp 保持
 	iscsi->tcp_keepcnt=3;
@@ -271,6 +239,12 @@ iscsi_create_context(const char *initiator_name)
 	iscsi->tcp_keepidle=30;
 	
 	iscsi->reconnect_max_retries = -1;
+	iscsi->reconnect_initial_ms = ISCSI_DEFAULT_RECONNECT_INITIAL_MS;
+	iscsi->reconnect_max_ms = ISCSI_DEFAULT_RECONNECT_MAX_MS;
+	iscsi->reconnect_jitter = ISCSI_DEFAULT_RECONNECT_JITTER;
+
+	iscsi->want_max_connections = 1;
+	iscsi->max_connections = 1;
 
 	if (getenv("LIBISCSI_DEBUG") != NULL) {
 		iscsi_set_log_level(iscsi, atoi(getenv("LIBISCSI_DEBUG")));
@@ -305,18 +279,6 @@ iscsi_create_context(const char *initiator_name)
 		iscsi->rdma_ack_timeout = atoi(getenv("LIBISCSI_RDMA_ACK_TIMEOUT"));
 	}
 
-	/* iscsi->smalloc_size is the size for small allocations. this should be
-	   max(ISCSI_HEADER_SIZE, sizeof(struct iscsi_pdu), sizeof(struct iscsi_in_pdu))
-	   rounded up to the next power of 2. */
-	required = MAX(required, sizeof(struct iscsi_pdu));
-	required = MAX(required, sizeof(struct iscsi_in_pdu));
-	iscsi->smalloc_size = 1;
-	while (iscsi->smalloc_size < required) {
-		iscsi->smalloc_size <<= 1;
-	}
-	ISCSI_LOG(iscsi, 5, "small allocation size is %u byte",
-                  (uint32_t)iscsi->smalloc_size);
-
     // 获取是否开启缓存分配
 	ca = getenv("LIBISCSI_CACHE_ALLOCATIONS");
 	if (!ca || atoi(ca) != 0) {
@@ -414,12 +376,25 @@ iscsi_set_targetname(struct iscsi_context *iscsi, const char *target_name)
 int
 iscsi_destroy_context(struct iscsi_context *iscsi)
 {
-	int i;
-
 	if (iscsi == NULL) {
 		return 0;
 	}
 
+	if (iscsi->exec != NULL) {
+		iscsi_exec_forget(iscsi);
+	}
+	if (iscsi->engine_entry != NULL) {
+		iscsi_engine_forget(iscsi);
+	}
+
+	iscsi_merge_flush(iscsi);
+
+	if (iscsi->submit != NULL) {
+		iscsi_submit_destroy(iscsi);
+	}
+
+	iscsi_mcs_drop_connections(iscsi, 0);
+
 	iscsi_disconnect(iscsi);
 
 	iscsi_cancel_pdus(iscsi);
@@ -431,26 +406,42 @@ iscsi_destroy_context(struct iscsi_context *iscsi)
 	if (iscsi->incoming != NULL) {
 		iscsi_free_iscsi_in_pdu(iscsi, iscsi->incoming);
 	}
+	iscsi_free(iscsi, iscsi->rxbuf);
+	iscsi_free(iscsi, iscsi->itt_table);
 
 	iscsi->connect_data = NULL;
 
-	for (i=0;i<iscsi->smalloc_free;i++) {
-		iscsi_free(iscsi, iscsi->smalloc_ptrs[i]);
+	if (iscsi_slab_in_use(iscsi) != 0) {
+		ISCSI_LOG(iscsi,1,"%u small allocations still in use at iscsi_destroy_context()",iscsi_slab_in_use(iscsi));
 	}
+	iscsi_slab_destroy(iscsi);
 
 	iscsi_free(iscsi, iscsi->opaque);
 
+	if (iscsi->old_iscsi) {
+		/* Commands still queued on the old connection are cancelled
+		 * into the completion ring we share with it. Until the
+		 * reconnect completes the ring is accounted to the old
+		 * connection so it is freed along with it.
+		 */
+		if (iscsi->old_iscsi->cq == iscsi->cq) {
+			iscsi->cq = NULL;
+		}
+		iscsi->old_iscsi->fd = -1;
+		iscsi_destroy_context(iscsi->old_iscsi);
+		iscsi->old_iscsi = NULL;
+	}
+
+	if (iscsi->cq != NULL) {
+		iscsi_cq_destroy(iscsi);
+	}
+
 	if (iscsi->mallocs != iscsi->frees) {
 		ISCSI_LOG(iscsi,1,"%d memory blocks lost at iscsi_destroy_context() after %d malloc(s), %d realloc(s), %d free(s) and %d reused small allocations",iscsi->mallocs-iscsi->frees,iscsi->mallocs,iscsi->reallocs,iscsi->frees,iscsi->smallocs);
 	} else {
 		ISCSI_LOG(iscsi,5,"memory is clean at iscsi_destroy_context() after %d mallocs, %d realloc(s), %d free(s) and %d reused small allocations",iscsi->mallocs,iscsi->reallocs,iscsi->frees,iscsi->smallocs);
 	}
 
-	if (iscsi->old_iscsi) {
-		iscsi->old_iscsi->fd = -1;
-		iscsi_destroy_context(iscsi->old_iscsi);
-	}
-
 	memset(iscsi, 0, sizeof(struct iscsi_context));
 	free(iscsi);
 
@@ -472,6 +463,12 @@ iscsi_set_error(struct iscsi_context *iscsi, const char *error_string, ...)
 	if (iscsi != NULL) {
 		strncpy(iscsi->error_string, errstr,MAX_STRING_SIZE);
 		ISCSI_LOG(iscsi, 1, "%s",iscsi->error_string);
+
+		/* the application only sees the leading connection */
+		if (iscsi->leader) {
+			strncpy(iscsi->leader->error_string, errstr,
+				MAX_STRING_SIZE);
+		}
 	}
 }
 
@@ -514,6 +511,25 @@ iscsi_set_header_digest(struct iscsi_context *iscsi,
 	return 0;
 }
 
+int
+iscsi_set_data_digest(struct iscsi_context *iscsi,
+		      enum iscsi_data_digest data_digest)
+{
+	if (iscsi->is_loggedin) {
+		iscsi_set_error(iscsi, "trying to set data digest while "
+				"logged in");
+		return -1;
+	}
+	if ((unsigned)data_digest > ISCSI_DATA_DIGEST_LAST) {
+		iscsi_set_error(iscsi, "invalid data digest value");
+		return -1;
+	}
+
+	iscsi->want_data_digest = data_digest;
+
+	return 0;
+}
+
 int
 iscsi_is_logged_in(struct iscsi_context *iscsi)
 {
@@ -637,6 +653,19 @@ iscsi_parse_url(struct iscsi_context *iscsi, const char *url, int full)
                                         return NULL;
                                 }
                         }
+                        if (!strcmp(key, "data_digest")) {
+                                if (!strcmp(value, "crc32c")) {
+                                        iscsi_set_data_digest(
+                                            iscsi, ISCSI_DATA_DIGEST_CRC32C);
+                                } else if (!strcmp(value, "none")) {
+                                        iscsi_set_data_digest(
+                                            iscsi, ISCSI_DATA_DIGEST_NONE);
+                                } else {
+                                        iscsi_set_error(iscsi,
+                                            "Invalid URL argument for data_digest: %s", value);
+                                        return NULL;
+                                }
+                        }
 			if (!strcmp(key, "target_user")) {
 				target_user = value;
 			} else if (!strcmp(key, "target_password")) {
@@ -849,9 +878,124 @@ iscsi_set_initial_r2t(struct iscsi_context *iscsi, enum iscsi_initial_r2t initia
 	return 0;
 }
 
+/* 512 to 2^24-1 bytes, RFC 7143 section 13 */
+static int
+iscsi_check_burst_length(struct iscsi_context *iscsi, const char *key,
+			 int len)
+{
+	if (iscsi->is_loggedin != 0) {
+		iscsi_set_error(iscsi, "Already logged in when trying to set "
+				"%s", key);
+		return -1;
+	}
+	if (len < 512 || len > 16777215) {
+		iscsi_set_error(iscsi, "Invalid %s %d, must be between 512 "
+				"and 16777215", key, len);
+		return -1;
+	}
+	return 0;
+}
+
+int
+iscsi_set_max_burst_length(struct iscsi_context *iscsi, int len)
+{
+	if (iscsi_check_burst_length(iscsi, "MaxBurstLength", len) != 0) {
+		return -1;
+	}
+
+	iscsi->want_max_burst_length = len;
+	iscsi->max_burst_length      = len;
+	return 0;
+}
+
+int
+iscsi_set_first_burst_length(struct iscsi_context *iscsi, int len)
+{
+	if (iscsi_check_burst_length(iscsi, "FirstBurstLength", len) != 0) {
+		return -1;
+	}
+
+	iscsi->want_first_burst_length = len;
+	iscsi->first_burst_length      = len;
+	return 0;
+}
+
+int
+iscsi_set_max_recv_data_segment_length(struct iscsi_context *iscsi, int len)
+{
+	if (iscsi_check_burst_length(iscsi, "MaxRecvDataSegmentLength",
+				     len) != 0) {
+		return -1;
+	}
+
+	iscsi->want_max_recv_data_segment_length      = len;
+	iscsi->initiator_max_recv_data_segment_length = len;
+	return 0;
+}
+
+int
+iscsi_get_max_burst_length(struct iscsi_context *iscsi)
+{
+	return iscsi->max_burst_length;
+}
+
+int
+iscsi_get_first_burst_length(struct iscsi_context *iscsi)
+{
+	return iscsi->first_burst_length;
+}
+
+int
+iscsi_get_max_recv_data_segment_length(struct iscsi_context *iscsi)
+{
+	return iscsi->initiator_max_recv_data_segment_length;
+}
+
+void
+iscsi_set_autotune(struct iscsi_context *iscsi, int enable)
+{
+	iscsi->autotune = enable;
+}
+
+int
+iscsi_set_max_outstanding_r2t(struct iscsi_context *iscsi, int count)
+{
+	if (iscsi->is_loggedin != 0) {
+		iscsi_set_error(iscsi, "Already logged in when trying to set "
+				"max_outstanding_r2t");
+		return -1;
+	}
+	if (count < 1 || count > 65535) {
+		iscsi_set_error(iscsi, "Invalid MaxOutstandingR2T %d, must be "
+				"between 1 and 65535", count);
+		return -1;
+	}
+
+	iscsi->want_max_outstanding_r2t = count;
+	return 0;
+}
+
+int
+iscsi_get_max_outstanding_r2t(struct iscsi_context *iscsi)
+{
+	return iscsi->max_outstanding_r2t;
+}
+
 int
 iscsi_set_timeout(struct iscsi_context *iscsi, int timeout)
 {
-	iscsi->scsi_timeout = timeout;
+	if (timeout > INT_MAX / 1000) {
+		timeout = INT_MAX / 1000;
+	}
+	return iscsi_set_timeout_ms(iscsi, timeout * 1000);
+}
+
+int
+iscsi_set_timeout_ms(struct iscsi_context *iscsi, int timeout_ms)
+{
+	if (timeout_ms < 0) {
+		timeout_ms = 0;
+	}
+	iscsi->scsi_timeout = timeout_ms;
 	return 0;
 }
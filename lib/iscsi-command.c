@@ -59,7 +59,8 @@ iscsi_scsi_response_cb(struct iscsi_context *iscsi, int status,
 	case SCSI_STATUS_TIMEOUT:
 		scsi_cbdata->task->status = status;
 		if (scsi_cbdata->callback) {
-			scsi_cbdata->callback(iscsi, status, scsi_cbdata->task,
+			scsi_cbdata->callback(iscsi_session(iscsi), status,
+					      scsi_cbdata->task,
 			                      scsi_cbdata->private_data);
 		}
 		return;
@@ -68,22 +69,82 @@ iscsi_scsi_response_cb(struct iscsi_context *iscsi, int status,
 		iscsi_set_error(iscsi, "Cant handle  scsi status %d yet.",
 		                status);
 		if (scsi_cbdata->callback) {
-			scsi_cbdata->callback(iscsi, SCSI_STATUS_ERROR, scsi_cbdata->task,
+			scsi_cbdata->callback(iscsi_session(iscsi),
+					      SCSI_STATUS_ERROR, scsi_cbdata->task,
 			                      scsi_cbdata->private_data);
 		}
 	}
 }
 
+/*
+ * Drop the DATA-OUT PDUs of a write that are still queued, they read
+ * straight from the buffers of the task. A segment the socket is in the
+ * middle of writing is finished but no further segments are started.
+ */
+static void
+iscsi_drop_data_out(struct iscsi_context *iscsi, struct iscsi_pdu *cmd_pdu)
+{
+	struct iscsi_pdu *pdu, *next_pdu;
+
+	if (iscsi->tx != NULL) {
+		iscsi_tx_wait(iscsi, cmd_pdu);
+	}
+	if (iscsi->outqueue_current != NULL &&
+	    iscsi->outqueue_current->itt == cmd_pdu->itt) {
+		iscsi->outqueue_current->dataout_remaining = 0;
+	}
+	for (pdu = iscsi->outqueue; pdu; pdu = next_pdu) {
+		next_pdu = pdu->next;
+
+		if (pdu == iscsi->outqueue_current ||
+		    pdu->itt != cmd_pdu->itt ||
+		    (pdu->outdata.data[0] & 0x3f) != ISCSI_PDU_DATA_OUT) {
+			continue;
+		}
+		iscsi_remove_from_outqueue(iscsi, pdu);
+		iscsi->drv->free_pdu(iscsi, pdu);
+	}
+}
+
+static void
+iscsi_fail_data_out(struct iscsi_context *iscsi, struct iscsi_pdu *cmd_pdu)
+{
+	iscsi_drop_data_out(iscsi, cmd_pdu);
+	iscsi_remove_from_outqueue(iscsi, cmd_pdu);
+	iscsi_waitpdu_remove(iscsi, cmd_pdu);
+	if (cmd_pdu->callback) {
+		cmd_pdu->callback(iscsi, SCSI_STATUS_ERROR, NULL,
+						  cmd_pdu->private_data);
+	}
+	iscsi->drv->free_pdu(iscsi, cmd_pdu);
+}
+
+/*
+ * Queue one DATA-OUT sequence, the unsolicited data or the data asked
+ * for by one R2T. DataSN starts over at 0 for every sequence, so with
+ * MaxOutstandingR2T > 1 several sequences of a task can be in flight
+ * next to each other.
+ */
 static int
 iscsi_send_data_out(struct iscsi_context *iscsi, struct iscsi_pdu *cmd_pdu,
 		    uint32_t ttt, uint32_t offset, uint32_t tot_len)
 {
+	uint32_t max_seg = iscsi->target_max_recv_data_segment_length;
+	uint32_t datasn = 0;
+
 	while (tot_len > 0) {
 		uint32_t len = tot_len;
 		struct iscsi_pdu *pdu;
 		int flags;
 
-		len = MIN(len, iscsi->target_max_recv_data_segment_length);
+		/* Over TCP the whole sequence is described by a single
+		 * DATA-OUT pdu. It starts out as the first segment and the
+		 * socket writer generates the headers for the remaining
+		 * segments as the socket can take them.
+		 */
+		if (iscsi->transport != TCP_TRANSPORT) {
+			len = MIN(len, max_seg);
+		}
 
 		pdu = iscsi_allocate_pdu(iscsi,
 					 ISCSI_PDU_DATA_OUT,
@@ -100,8 +161,14 @@ iscsi_send_data_out(struct iscsi_context *iscsi, struct iscsi_pdu *cmd_pdu,
 		 * maxcmdsn when sending to socket even if data-out pdus
 		 * do not carry a cmdsn on the wire */
 		pdu->cmdsn                    = cmd_pdu->cmdsn;
+		/* data-out pdus time out together with their command */
+		pdu->scsi_timeout             = cmd_pdu->scsi_timeout;
+
+		pdu->payload_offset    = offset;
+		pdu->payload_len       = MIN(len, max_seg);
+		pdu->dataout_remaining = len - pdu->payload_len;
 
-		if (tot_len == len) {
+		if (tot_len == pdu->payload_len) {
 			flags = ISCSI_PDU_SCSI_FINAL;
 		} else {
 			flags = 0;
@@ -116,15 +183,14 @@ iscsi_send_data_out(struct iscsi_context *iscsi, struct iscsi_pdu *cmd_pdu,
 		/* ttt */
 		iscsi_pdu_set_ttt(pdu, ttt);
 
-		/* data sn */
-		iscsi_pdu_set_datasn(pdu, cmd_pdu->datasn++);
+		/* data sn, reserve one for every segment of the sequence */
+		pdu->datasn = datasn;
+		iscsi_pdu_set_datasn(pdu, pdu->datasn);
+		datasn += DIV_ROUND_UP(len, max_seg);
 
 		/* buffer offset */
 		iscsi_pdu_set_bufferoffset(pdu, offset);
 
-		pdu->payload_offset = offset;
-		pdu->payload_len    = len;
-
 		/* update data segment length */
 		scsi_set_uint32(&pdu->outdata.data[4], pdu->payload_len);
 
@@ -141,13 +207,7 @@ iscsi_send_data_out(struct iscsi_context *iscsi, struct iscsi_pdu *cmd_pdu,
 	return 0;
 
 error:
-	ISCSI_LIST_REMOVE(&iscsi->outqueue, cmd_pdu);
-	ISCSI_LIST_REMOVE(&iscsi->waitpdu, cmd_pdu);
-	if (cmd_pdu->callback) {
-		cmd_pdu->callback(iscsi, SCSI_STATUS_ERROR, NULL,
-						  cmd_pdu->private_data);
-	}
-	iscsi->drv->free_pdu(iscsi, cmd_pdu);
+	iscsi_fail_data_out(iscsi, cmd_pdu);
 	return -1;
 }
 
@@ -171,11 +231,27 @@ iscsi_scsi_command_async(struct iscsi_context *iscsi, int lun,
 	struct iscsi_pdu *pdu;
 	int flags;
 
+	/* held back commands go first */
+	if (iscsi->merge_pending != NULL) {
+		iscsi_merge_flush(iscsi);
+	}
+
+	if (cb == iscsi_cq_cb && iscsi->cq == NULL) {
+		iscsi_set_error(iscsi, "Trying to send command to the "
+				"completion ring without one.");
+		return -1;
+	}
+
 	if (iscsi->old_iscsi) {
 		iscsi = iscsi->old_iscsi;
 		ISCSI_LOG(iscsi, 2, "iscsi_scsi_command_async: queuing cmd to old_iscsi while reconnecting");
 	}
 
+	/* stripe commands over the connections of the session */
+	if (iscsi->connections) {
+		iscsi = iscsi_mcs_pick_connection(iscsi);
+	}
+
 	if (iscsi->session_type != ISCSI_SESSION_NORMAL) {
 		iscsi_set_error(iscsi, "Trying to send command on "
 				"discovery session.");
@@ -272,7 +348,7 @@ iscsi_scsi_command_async(struct iscsi_context *iscsi, int lun,
 	iscsi_pdu_set_expxferlen(pdu, task->expxferlen);
 
 	/* cmdsn */
-	iscsi_pdu_set_cmdsn(pdu, iscsi->cmdsn);
+	iscsi_pdu_set_cmdsn(pdu, iscsi_session(iscsi)->cmdsn);
 
 	/* cdb */
 	iscsi_pdu_set_cdb(pdu, task);
@@ -286,7 +362,7 @@ iscsi_scsi_command_async(struct iscsi_context *iscsi, int lun,
 		iscsi->drv->free_pdu(iscsi, pdu);
 		return -1;
 	}
-	iscsi->cmdsn++;
+	iscsi_session(iscsi)->cmdsn++;
 
 	/* The F flag is not set. This means we haven't sent all the unsolicited
 	 * data yet. Sent as much as we are allowed as a train of DATA-OUT PDUs.
@@ -524,7 +600,8 @@ iscsi_process_scsi_data_in(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
 	uint32_t flags, status;
 	struct iscsi_scsi_cbdata *scsi_cbdata = &pdu->scsi_cbdata;
 	struct scsi_task *task = scsi_cbdata->task;
-	int dsl;
+	struct iscsi_in_pdu *held = NULL;
+	int dsl, ret;
 
 	flags = in->hdr[1];
 	if ((flags&ISCSI_PDU_DATA_ACK_REQUESTED) != 0) {
@@ -538,9 +615,14 @@ iscsi_process_scsi_data_in(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
 	}
 	dsl = scsi_get_uint32(&in->hdr[4]) & 0x00ffffff;
 
-	/* Don't add to reassembly buffer if we already have a user buffer */
-	if (task->iovector_in.iov == NULL) {
-		if (iscsi_add_data(iscsi, &pdu->indata, in->data, dsl, 0) != 0) {
+	/* Don't add to reassembly buffer if we already have a user buffer.
+	 * Data-In that was sent again during error recovery goes where its
+	 * buffer offset says.
+	 */
+	if (task->iovector_in.iov == NULL && dsl > 0) {
+		if (iscsi_add_data_at(iscsi, &pdu->indata,
+				      scsi_get_uint32(&in->hdr[40]),
+				      in->data, dsl) != 0) {
 		    iscsi_set_error(iscsi, "Out-of-memory: failed to add data "
 				"to pdu in buffer.");
 			return -1;
@@ -554,8 +636,28 @@ iscsi_process_scsi_data_in(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
 		*is_finished = 0;
 	}
 
-	if (*is_finished == 0) {
-		return 0;
+	if (*is_finished) {
+		ret = iscsi_snack_hold_status(iscsi, pdu, in);
+		if (ret != 0) {
+			*is_finished = 0;
+			return ret < 0 ? -1 : 0;
+		}
+	} else {
+		/* the last Data-In that was missing completes the status
+		 * we have been holding back.
+		 */
+		held = iscsi_snack_release_status(pdu);
+		if (held == NULL) {
+			return 0;
+		}
+		*is_finished = 1;
+		if ((held->hdr[0] & 0x3f) == ISCSI_PDU_SCSI_RESPONSE) {
+			ret = iscsi_process_scsi_reply(iscsi, pdu, held);
+			iscsi_free_iscsi_in_pdu(iscsi, held);
+			return ret;
+		}
+		in = held;
+		flags = in->hdr[1];
 	}
 
 	task->residual_status = SCSI_RESIDUAL_NO_RESIDUAL;
@@ -593,6 +695,9 @@ iscsi_process_scsi_data_in(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
 	if (pdu->callback) {
 		pdu->callback(iscsi, status, task, pdu->private_data);
 	}
+	if (held != NULL) {
+		iscsi_free_iscsi_in_pdu(iscsi, held);
+	}
 
 	return 0;
 }
@@ -607,7 +712,22 @@ iscsi_process_r2t(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
 	offset = scsi_get_uint32(&in->hdr[40]);
 	len    = scsi_get_uint32(&in->hdr[44]);
 
-	pdu->datasn = 0;
+	/* The target may have up to MaxOutstandingR2T of these open for
+	 * the task at once, each one is a sequence of its own.
+	 *
+	 * One outside of the task is a protocol error. The target still
+	 * has the task open so it can not just be completed here. Stop
+	 * sending its data and have the connection dropped, the command
+	 * stays on the waitqueue and is sent again after the reconnect.
+	 */
+	if (len == 0 || (uint64_t)offset + len > pdu->expxferlen) {
+		iscsi_drop_data_out(iscsi, pdu);
+		iscsi_set_error(iscsi, "R2T for %u bytes at offset %u is "
+				"outside of the %u bytes of the task", len,
+				offset, pdu->expxferlen);
+		return -1;
+	}
+
 	iscsi_send_data_out(iscsi, pdu, ttt, offset, len);
 	return 0;
 }
@@ -1004,6 +1124,17 @@ iscsi_read16_iov_task(struct iscsi_context *iscsi, int lun, uint64_t lba,
 		return NULL;
 	}
 
+	if (iscsi_split_needed(iscsi, datalen, blocksize)) {
+		return iscsi_split_rw16_task(iscsi, lun, 0, lba, NULL,
+				datalen, blocksize, rdprotect, dpo, fua, fua_nv,
+				group_number, cb, private_data, iov, niov);
+	}
+	if (iscsi_merge_wanted(iscsi, datalen, rdprotect, fua, fua_nv)) {
+		return iscsi_merge_rw16_task(iscsi, lun, 0, lba, NULL,
+				datalen, blocksize, dpo, group_number, cb,
+				private_data, iov, niov);
+	}
+
 	task = scsi_cdb_read16(lba, datalen, blocksize, rdprotect,
 				dpo, fua, fua_nv, group_number);
 	if (task == NULL) {
@@ -1038,6 +1169,17 @@ iscsi_read16_task(struct iscsi_context *iscsi, int lun, uint64_t lba,
 		return NULL;
 	}
 
+	if (iscsi_split_needed(iscsi, datalen, blocksize)) {
+		return iscsi_split_rw16_task(iscsi, lun, 0, lba, NULL,
+				datalen, blocksize, rdprotect, dpo, fua, fua_nv,
+				group_number, cb, private_data, NULL, 0);
+	}
+	if (iscsi_merge_wanted(iscsi, datalen, rdprotect, fua, fua_nv)) {
+		return iscsi_merge_rw16_task(iscsi, lun, 0, lba, NULL,
+				datalen, blocksize, dpo, group_number, cb,
+				private_data, NULL, 0);
+	}
+
 	task = scsi_cdb_read16(lba, datalen, blocksize, rdprotect,
 				dpo, fua, fua_nv, group_number);
 	if (task == NULL) {
@@ -1054,6 +1196,30 @@ iscsi_read16_task(struct iscsi_context *iscsi, int lun, uint64_t lba,
 	return task;
 }
 
+int
+iscsi_read16_rearm_task(struct iscsi_context *iscsi, struct scsi_task *task,
+			int lun, uint64_t lba, uint32_t datalen, int blocksize,
+			int rdprotect, int dpo, int fua, int fua_nv,
+			int group_number, iscsi_command_cb cb,
+			void *private_data, struct scsi_iovec *iov, int niov)
+{
+	if (datalen % blocksize != 0) {
+		iscsi_set_error(iscsi, "Datalen:%d is not a multiple of "
+				"the blocksize:%d.", datalen, blocksize);
+		return -1;
+	}
+
+	scsi_task_rearm(task);
+	scsi_task_set_read16_cdb(task, lba, datalen, blocksize, rdprotect,
+				 dpo, fua, fua_nv, group_number);
+
+	if (iov != NULL)
+		scsi_task_set_iov_in(task, iov, niov);
+
+	return iscsi_scsi_command_async(iscsi, lun, task, cb,
+					NULL, private_data);
+}
+
 struct scsi_task *
 iscsi_write10_task(struct iscsi_context *iscsi, int lun, uint32_t lba, 
 		   unsigned char *data, uint32_t datalen, int blocksize,
@@ -1212,6 +1378,17 @@ iscsi_write16_task(struct iscsi_context *iscsi, int lun, uint64_t lba,
 		return NULL;
 	}
 
+	if (iscsi_split_needed(iscsi, datalen, blocksize)) {
+		return iscsi_split_rw16_task(iscsi, lun, 1, lba, data,
+				datalen, blocksize, wrprotect, dpo, fua, fua_nv,
+				group_number, cb, private_data, NULL, 0);
+	}
+	if (iscsi_merge_wanted(iscsi, datalen, wrprotect, fua, fua_nv)) {
+		return iscsi_merge_rw16_task(iscsi, lun, 1, lba, data,
+				datalen, blocksize, dpo, group_number, cb,
+				private_data, NULL, 0);
+	}
+
 	task = scsi_cdb_write16(lba, datalen, blocksize, wrprotect,
 				dpo, fua, fua_nv, group_number);
 	if (task == NULL) {
@@ -1246,6 +1423,17 @@ iscsi_write16_iov_task(struct iscsi_context *iscsi, int lun, uint64_t lba,
 		return NULL;
 	}
 
+	if (iscsi_split_needed(iscsi, datalen, blocksize)) {
+		return iscsi_split_rw16_task(iscsi, lun, 1, lba, data,
+				datalen, blocksize, wrprotect, dpo, fua, fua_nv,
+				group_number, cb, private_data, iov, niov);
+	}
+	if (iscsi_merge_wanted(iscsi, datalen, wrprotect, fua, fua_nv)) {
+		return iscsi_merge_rw16_task(iscsi, lun, 1, lba, data,
+				datalen, blocksize, dpo, group_number, cb,
+				private_data, iov, niov);
+	}
+
 	task = scsi_cdb_write16(lba, datalen, blocksize, wrprotect,
 				dpo, fua, fua_nv, group_number);
 	if (task == NULL) {
@@ -1268,6 +1456,35 @@ iscsi_write16_iov_task(struct iscsi_context *iscsi, int lun, uint64_t lba,
 	return task;
 }
 
+int
+iscsi_write16_rearm_task(struct iscsi_context *iscsi, struct scsi_task *task,
+			 int lun, uint64_t lba, unsigned char *data,
+			 uint32_t datalen, int blocksize, int wrprotect,
+			 int dpo, int fua, int fua_nv, int group_number,
+			 iscsi_command_cb cb, void *private_data,
+			 struct scsi_iovec *iov, int niov)
+{
+	struct iscsi_data d;
+
+	if (datalen % blocksize != 0) {
+		iscsi_set_error(iscsi, "Datalen:%d is not a multiple of the "
+				"blocksize:%d.", datalen, blocksize);
+		return -1;
+	}
+
+	scsi_task_rearm(task);
+	scsi_task_set_write16_cdb(task, lba, datalen, blocksize, wrprotect,
+				  dpo, fua, fua_nv, group_number);
+	d.data = data;
+	d.size = datalen;
+
+	if (iov != NULL)
+		scsi_task_set_iov_out(task, iov, niov);
+
+	return iscsi_scsi_command_async(iscsi, lun, task, cb,
+					&d, private_data);
+}
+
 struct scsi_task *
 iscsi_writeatomic16_task(struct iscsi_context *iscsi, int lun, uint64_t lba,
 			 unsigned char *data, uint32_t datalen, int blocksize,
@@ -2416,12 +2633,7 @@ iscsi_get_scsi_task_iovector_in(struct iscsi_context *iscsi, struct iscsi_in_pdu
 	}
 
 	itt = scsi_get_uint32(&in->hdr[16]);
-	for (pdu = iscsi->waitpdu; pdu; pdu = pdu->next) {
-		if (pdu->itt == itt) {
-			break;
-		}
-	}
-
+	pdu = iscsi_waitpdu_find(iscsi, itt);
 	if (pdu == NULL) {
 		return NULL;
 	}
@@ -2675,25 +2887,38 @@ iscsi_scsi_get_task_from_pdu(struct iscsi_pdu *pdu)
 	return pdu->scsi_cbdata.task;
 }
 
-int
-iscsi_scsi_cancel_task(struct iscsi_context *iscsi,
-		       struct scsi_task *task)
+static int
+iscsi_scsi_cancel_connection_task(struct iscsi_context *iscsi,
+				  struct scsi_task *task)
 {
 	struct iscsi_pdu *pdu;
 	struct iscsi_pdu *next_pdu;
 	uint32_t cmdsn_gap = 0;
+	/* the callback may free the task */
+	uint32_t itt = task->itt;
+	int mcs = iscsi_session(iscsi)->connections != NULL;
 	int ret = -1;
 
-	for (pdu = iscsi->waitpdu; pdu; pdu = pdu->next) {
-		if (pdu->itt == task->itt) {
-			ISCSI_LIST_REMOVE(&iscsi->waitpdu, pdu);
-			if (pdu->callback) {
-				pdu->callback(iscsi, SCSI_STATUS_CANCELLED, NULL,
-				      pdu->private_data);
-			}
-			iscsi->drv->free_pdu(iscsi, pdu);
-			return 0;
+	pdu = iscsi_waitpdu_find(iscsi, itt);
+	if (pdu != NULL) {
+		/* do not start any further segments of a DATA-OUT sequence
+		 * we are in the middle of writing for this task.
+		 */
+		if (iscsi->outqueue_current != NULL &&
+		    iscsi->outqueue_current->itt == itt) {
+			iscsi->outqueue_current->dataout_remaining = 0;
+		}
+		/* the transmit thread finishes what it has of the task */
+		if (iscsi->tx != NULL) {
+			iscsi_tx_wait(iscsi, pdu);
+		}
+		iscsi_waitpdu_remove(iscsi, pdu);
+		if (pdu->callback) {
+			pdu->callback(iscsi, SCSI_STATUS_CANCELLED, NULL,
+			      pdu->private_data);
 		}
+		iscsi->drv->free_pdu(iscsi, pdu);
+		return 0;
 	}
 	for (pdu = iscsi->outqueue; pdu; pdu = next_pdu) {
 		next_pdu = pdu->next;
@@ -2702,26 +2927,67 @@ iscsi_scsi_cancel_task(struct iscsi_context *iscsi,
 			iscsi_pdu_set_cmdsn(pdu, pdu->cmdsn - cmdsn_gap);
 		}
 
-		if (pdu->itt == task->itt) {
-			ISCSI_LIST_REMOVE(&iscsi->outqueue, pdu);
-			if (pdu->callback) {
-				pdu->callback(iscsi, SCSI_STATUS_CANCELLED, NULL,
-				      pdu->private_data);
-			}
-			if (!(pdu->outdata.data[0] & ISCSI_PDU_IMMEDIATE) &&
-			    (pdu->outdata.data[0] & 0x3f) != ISCSI_PDU_DATA_OUT) {
-				iscsi->cmdsn--;
-				cmdsn_gap++;
-			}
-			iscsi->drv->free_pdu(iscsi, pdu);
-			ret = 0;
-			if (!cmdsn_gap) {
-				break;
+		if (pdu->itt != itt) {
+			continue;
+		}
+		ret = 0;
+		if (mcs && pdu != iscsi->outqueue_current &&
+		    !(pdu->outdata.data[0] & ISCSI_PDU_IMMEDIATE) &&
+		    !iscsi_pdu_follows_command(pdu)) {
+			iscsi_command_cb callback = pdu->callback;
+			void *private_data = pdu->private_data;
+
+			/* other connections may already have sent
+			 * later CmdSNs, keep ours with a NOP-Out and
+			 * look for unsolicited DATA-OUT of the task.
+			 */
+			iscsi_mcs_release_cmdsn(iscsi, pdu);
+			if (callback) {
+				callback(iscsi, SCSI_STATUS_CANCELLED, NULL,
+					 private_data);
 			}
+			continue;
+		}
+		iscsi_remove_from_outqueue(iscsi, pdu);
+		if (pdu->callback) {
+			pdu->callback(iscsi, SCSI_STATUS_CANCELLED, NULL,
+			      pdu->private_data);
+		}
+		if (!mcs && !(pdu->outdata.data[0] & ISCSI_PDU_IMMEDIATE) &&
+		    !iscsi_pdu_follows_command(pdu)) {
+			iscsi->cmdsn--;
+			cmdsn_gap++;
+		}
+		iscsi->drv->free_pdu(iscsi, pdu);
+		if (!cmdsn_gap && !mcs) {
+			break;
 		}
 	}
 
-	if (iscsi->old_iscsi) {
+	return ret;
+}
+
+int
+iscsi_scsi_cancel_task(struct iscsi_context *iscsi,
+		       struct scsi_task *task)
+{
+	struct iscsi_context *conn;
+	int ret;
+
+	if (iscsi_split_cancel_task(iscsi, task) == 0) {
+		return 0;
+	}
+	if (iscsi_merge_cancel_task(iscsi, task) == 0) {
+		return 0;
+	}
+
+	ret = iscsi_scsi_cancel_connection_task(iscsi, task);
+	for (conn = iscsi->connections; conn && ret != 0;
+	     conn = conn->next_connection) {
+		ret = iscsi_scsi_cancel_connection_task(conn, task);
+	}
+
+	if (ret != 0 && iscsi->old_iscsi) {
 		return iscsi_scsi_cancel_task(iscsi->old_iscsi, task);
 	}
 
@@ -2731,7 +2997,13 @@ iscsi_scsi_cancel_task(struct iscsi_context *iscsi,
 void
 iscsi_scsi_cancel_all_tasks(struct iscsi_context *iscsi)
 {
+	struct iscsi_context *conn;
+
+	iscsi_merge_flush(iscsi);
 	iscsi_cancel_pdus(iscsi);
+	for (conn = iscsi->connections; conn; conn = conn->next_connection) {
+		iscsi_cancel_pdus(conn);
+	}
 
 	if (iscsi->old_iscsi) {
 		iscsi_cancel_pdus(iscsi->old_iscsi);
@@ -105,13 +105,10 @@ iscsi_iser_service(struct iscsi_context *iscsi, int revents)
 	struct iser_conn *iser_conn = iscsi->opaque;
 
 	if (iscsi->pending_reconnect) {
-		if (time(NULL) >= iscsi->next_reconnect) {
+		if (iscsi_monotonic_ms() >= iscsi->next_reconnect) {
 			return iscsi_reconnect(iscsi);
-		} else {
-			if (iscsi->old_iscsi) {
-				return 0;
-			}
 		}
+		return 0;
 	}
 
 	if (revents == POLLIN)
@@ -556,24 +553,19 @@ iscsi_iser_free_pdu(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
 
 	iser_pdu = container_of(pdu, struct iser_pdu, iscsi_pdu);
 
+	iscsi_timer_del(iscsi, &pdu->timer);
+
 	if (iser_pdu->desc != NULL) {
 		iser_tx_desc_free(iscsi, iser_pdu->desc);
 		iser_pdu->desc = NULL;
 	}
 
-	if (pdu->outdata.size <= iscsi->smalloc_size) {
+	if (pdu->outdata.data != pdu->hdr_buf) {
 		iscsi_sfree(iscsi, pdu->outdata.data);
-	} else {
-		iscsi_free(iscsi, pdu->outdata.data);
 	}
 	pdu->outdata.data = NULL;
 
-	if (pdu->indata.size <= iscsi->smalloc_size) {
-		iscsi_sfree(iscsi, pdu->indata.data);
-	} else {
-		iscsi_free(iscsi, pdu->indata.data);
-	}
-
+	iscsi_free(iscsi, pdu->indata.data);
 	pdu->indata.data = NULL;
 
 	if (iscsi->outqueue_current == pdu) {
@@ -917,7 +909,7 @@ iscsi_iser_send_pdu(struct iscsi_context *iscsi, struct iscsi_pdu *pdu) {
 	opcode = pdu->outdata.data[0];
 
 	iscsi_pdu_set_expstatsn(pdu, iscsi->statsn + 1);
-	ISCSI_LIST_ADD_END(&iscsi->waitpdu, pdu);
+	iscsi_waitpdu_add(iscsi, pdu);
 
 	/*
          * because of async reconnection, before reconnecting successfully,
@@ -956,10 +948,10 @@ iscsi_iser_revive_queued_pdus(struct iscsi_context *iscsi) {
 		}
 
 		pdu = iscsi->outqueue;
-		ISCSI_LIST_REMOVE(&iscsi->outqueue, pdu);
+		iscsi_remove_from_outqueue(iscsi, pdu);
 
 		if (iscsi_iser_send_pdu(iscsi, pdu) < 0) {
-			ISCSI_LIST_ADD(&iscsi->outqueue, pdu);
+			iscsi_add_to_outqueue(iscsi, pdu);
 			return -1;
 		}
 	}
@@ -1320,10 +1312,7 @@ iser_rcv_completion(struct iser_rx_desc *rx_desc,
 
 	struct iscsi_pdu *iscsi_pdu;
 	struct iser_pdu *iser_pdu;
-	for (iscsi_pdu = iscsi->waitpdu ; iscsi_pdu ; iscsi_pdu = iscsi_pdu->next) {
-		if(iscsi_pdu->itt == itt)
-			break;
-	}
+	iscsi_pdu = iscsi_waitpdu_find(iscsi, itt);
 
 	iser_pdu = container_of(iscsi_pdu, struct iser_pdu, iscsi_pdu);
 
@@ -1727,11 +1716,6 @@ void iscsi_init_iser_transport(struct iscsi_context *iscsi)
 	/* Update iSCSI params as per iSER transport */
 	iscsi->initiator_max_recv_data_segment_length = ISCSI_DEF_MAX_RECV_SEG_LEN;
 	iscsi->target_max_recv_data_segment_length = ISCSI_DEF_MAX_RECV_SEG_LEN;
-
-	/* ensure smalloc_size is enough for iser_pdu */
-	while (iscsi->smalloc_size < sizeof(struct iser_pdu)) {
-		iscsi->smalloc_size <<= 1;
-	}
 }
 
 #endif
@@ -124,13 +124,27 @@ iscsi_login_add_targetname(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
 	return 0;
 }
 
+/*
+ * Session wide keys are only negotiated by the leading login. Not by a
+ * connection that is added to the session, nor by one that replaces a
+ * failed connection with ErrorRecoveryLevel 2.
+ */
+static int
+iscsi_login_joins_session(struct iscsi_context *iscsi)
+{
+	return iscsi->leader != NULL || iscsi->recovery_deadline != 0;
+}
+
 static int
 iscsi_login_add_sessiontype(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
 {
 	char str[MAX_STRING_SIZE+1];
 
-	/* We only send SessionType during opneg or the first leg of secneg */
-	if (iscsi->secneg_phase != ISCSI_LOGIN_SECNEG_PHASE_OFFER_CHAP) {
+	/* We only send SessionType during opneg or the first leg of secneg
+	 * of the leading connection.
+	 */
+	if (iscsi->secneg_phase != ISCSI_LOGIN_SECNEG_PHASE_OFFER_CHAP
+	    || iscsi_login_joins_session(iscsi)) {
 		return 0;
 	}
 
@@ -202,7 +216,29 @@ iscsi_login_add_datadigest(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
 		return 0;
 	}
 
-	strncpy(str,"DataDigest=None",MAX_STRING_SIZE);
+	/* iSER does not use digests */
+	if (iscsi->transport == ISER_TRANSPORT) {
+		iscsi->want_data_digest = ISCSI_DATA_DIGEST_NONE;
+	}
+
+	switch (iscsi->want_data_digest) {
+	case ISCSI_DATA_DIGEST_NONE:
+		strncpy(str,"DataDigest=None",MAX_STRING_SIZE);
+		break;
+	case ISCSI_DATA_DIGEST_NONE_CRC32C:
+		strncpy(str,"DataDigest=None,CRC32C",MAX_STRING_SIZE);
+		break;
+	case ISCSI_DATA_DIGEST_CRC32C_NONE:
+		strncpy(str,"DataDigest=CRC32C,None",MAX_STRING_SIZE);
+		break;
+	case ISCSI_DATA_DIGEST_CRC32C:
+		strncpy(str,"DataDigest=CRC32C",MAX_STRING_SIZE);
+		break;
+	default:
+		iscsi_set_error(iscsi, "invalid data digest value");
+		return -1;
+	}
+
 	if (iscsi_pdu_add_data(iscsi, pdu, (unsigned char *)str, strlen(str)+1)
 	    != 0) {
 		iscsi_set_error(iscsi, "Out-of-memory: pdu add data failed.");
@@ -217,8 +253,9 @@ iscsi_login_add_initialr2t(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
 {
 	char str[MAX_STRING_SIZE+1];
 
-	/* We only send InitialR2T during opneg */
-	if (iscsi->current_phase != ISCSI_PDU_LOGIN_CSG_OPNEG) {
+	/* We only send InitialR2T during opneg of the leading connection */
+	if (iscsi->current_phase != ISCSI_PDU_LOGIN_CSG_OPNEG
+	    || iscsi_login_joins_session(iscsi)) {
 		return 0;
 	}
 
@@ -242,8 +279,9 @@ iscsi_login_add_immediatedata(struct iscsi_context *iscsi, struct iscsi_pdu *pdu
 {
 	char str[MAX_STRING_SIZE+1];
 
-	/* We only send ImmediateData during opneg */
-	if (iscsi->current_phase != ISCSI_PDU_LOGIN_CSG_OPNEG) {
+	/* We only send ImmediateData during opneg of the leading connection */
+	if (iscsi->current_phase != ISCSI_PDU_LOGIN_CSG_OPNEG
+	    || iscsi_login_joins_session(iscsi)) {
 		return 0;
 	}
 
@@ -267,8 +305,9 @@ iscsi_login_add_maxburstlength(struct iscsi_context *iscsi, struct iscsi_pdu *pd
 {
 	char str[MAX_STRING_SIZE+1];
 
-	/* We only send MaxBurstLength during opneg */
-	if (iscsi->current_phase != ISCSI_PDU_LOGIN_CSG_OPNEG) {
+	/* We only send MaxBurstLength during opneg of the leading connection */
+	if (iscsi->current_phase != ISCSI_PDU_LOGIN_CSG_OPNEG
+	    || iscsi_login_joins_session(iscsi)) {
 		return 0;
 	}
 
@@ -290,8 +329,9 @@ iscsi_login_add_firstburstlength(struct iscsi_context *iscsi, struct iscsi_pdu *
 {
 	char str[MAX_STRING_SIZE+1];
 
-	/* We only send FirstBurstLength during opneg */
-	if (iscsi->current_phase != ISCSI_PDU_LOGIN_CSG_OPNEG) {
+	/* We only send FirstBurstLength during opneg of the leading connection */
+	if (iscsi->current_phase != ISCSI_PDU_LOGIN_CSG_OPNEG
+	    || iscsi_login_joins_session(iscsi)) {
 		return 0;
 	}
 
@@ -336,8 +376,9 @@ iscsi_login_add_datapduinorder(struct iscsi_context *iscsi, struct iscsi_pdu *pd
 {
 	char str[MAX_STRING_SIZE+1];
 
-	/* We only send DataPduInOrder during opneg */
-	if (iscsi->current_phase != ISCSI_PDU_LOGIN_CSG_OPNEG) {
+	/* We only send DataPduInOrder during opneg of the leading connection */
+	if (iscsi->current_phase != ISCSI_PDU_LOGIN_CSG_OPNEG
+	    || iscsi_login_joins_session(iscsi)) {
 		return 0;
 	}
 
@@ -356,8 +397,9 @@ iscsi_login_add_defaulttime2wait(struct iscsi_context *iscsi, struct iscsi_pdu *
 {
 	char str[MAX_STRING_SIZE+1];
 
-	/* We only send DefaultTime2Wait during opneg */
-	if (iscsi->current_phase != ISCSI_PDU_LOGIN_CSG_OPNEG) {
+	/* We only send DefaultTime2Wait during opneg of the leading connection */
+	if (iscsi->current_phase != ISCSI_PDU_LOGIN_CSG_OPNEG
+	    || iscsi_login_joins_session(iscsi)) {
 		return 0;
 	}
 
@@ -376,12 +418,22 @@ iscsi_login_add_defaulttime2retain(struct iscsi_context *iscsi, struct iscsi_pdu
 {
 	char str[MAX_STRING_SIZE+1];
 
-	/* We only send DefaultTime2Retain during opneg */
-	if (iscsi->current_phase != ISCSI_PDU_LOGIN_CSG_OPNEG) {
+	/* We only send DefaultTime2Retain during opneg of the leading connection */
+	if (iscsi->current_phase != ISCSI_PDU_LOGIN_CSG_OPNEG
+	    || iscsi_login_joins_session(iscsi)) {
 		return 0;
 	}
 
-	strncpy(str,"DefaultTime2Retain=0",MAX_STRING_SIZE);
+	/* with ErrorRecoveryLevel 2 the target has to keep the tasks of a
+	 * failed connection long enough for us to reassign them.
+	 */
+	if (snprintf(str, MAX_STRING_SIZE, "DefaultTime2Retain=%d",
+		     iscsi->transport == TCP_TRANSPORT &&
+		     iscsi->want_error_recovery_level == 2 ?
+		     ISCSI_DEFAULT_TIME2RETAIN : 0) == -1) {
+		iscsi_set_error(iscsi, "Out-of-memory: aprintf failed.");
+		return -1;
+	}
 	if (iscsi_pdu_add_data(iscsi, pdu, (unsigned char *)str, strlen(str)+1)
 	    != 0) {
 		iscsi_set_error(iscsi, "Out-of-memory: pdu add data failed.");
@@ -436,12 +488,17 @@ iscsi_login_add_maxconnections(struct iscsi_context *iscsi, struct iscsi_pdu *pd
 {
 	char str[MAX_STRING_SIZE+1];
 
-	/* We only send MaxConnections during opneg */
-	if (iscsi->current_phase != ISCSI_PDU_LOGIN_CSG_OPNEG) {
+	/* We only send MaxConnections during opneg of the leading connection */
+	if (iscsi->current_phase != ISCSI_PDU_LOGIN_CSG_OPNEG
+	    || iscsi_login_joins_session(iscsi)) {
 		return 0;
 	}
 
-	strncpy(str,"MaxConnections=1",MAX_STRING_SIZE);
+	if (snprintf(str, MAX_STRING_SIZE, "MaxConnections=%d",
+		     iscsi->want_max_connections) == -1) {
+		iscsi_set_error(iscsi, "Out-of-memory: aprintf failed.");
+		return -1;
+	}
 	if (iscsi_pdu_add_data(iscsi, pdu, (unsigned char *)str, strlen(str)+1)
 	    != 0) {
 		iscsi_set_error(iscsi, "Out-of-memory: pdu add data failed.");
@@ -456,12 +513,17 @@ iscsi_login_add_maxoutstandingr2t(struct iscsi_context *iscsi, struct iscsi_pdu
 {
 	char str[MAX_STRING_SIZE+1];
 
-	/* We only send MaxOutstandingR2T during opneg */
-	if (iscsi->current_phase != ISCSI_PDU_LOGIN_CSG_OPNEG) {
+	/* We only send MaxOutstandingR2T during opneg of the leading connection */
+	if (iscsi->current_phase != ISCSI_PDU_LOGIN_CSG_OPNEG
+	    || iscsi_login_joins_session(iscsi)) {
 		return 0;
 	}
 
-	strncpy(str,"MaxOutstandingR2T=1",MAX_STRING_SIZE);
+	if (snprintf(str, MAX_STRING_SIZE, "MaxOutstandingR2T=%u",
+		     iscsi->want_max_outstanding_r2t) == -1) {
+		iscsi_set_error(iscsi, "Out-of-memory: aprintf failed.");
+		return -1;
+	}
 	if (iscsi_pdu_add_data(iscsi, pdu, (unsigned char *)str, strlen(str)+1)
 	    != 0) {
 		iscsi_set_error(iscsi, "Out-of-memory: pdu add data failed.");
@@ -476,12 +538,19 @@ iscsi_login_add_errorrecoverylevel(struct iscsi_context *iscsi, struct iscsi_pdu
 {
 	char str[MAX_STRING_SIZE+1];
 
-	/* We only send ErrorRecoveryLevel during opneg */
-	if (iscsi->current_phase != ISCSI_PDU_LOGIN_CSG_OPNEG) {
+	/* We only send ErrorRecoveryLevel during opneg of the leading connection */
+	if (iscsi->current_phase != ISCSI_PDU_LOGIN_CSG_OPNEG
+	    || iscsi_login_joins_session(iscsi)) {
 		return 0;
 	}
 
-	strncpy(str,"ErrorRecoveryLevel=0",MAX_STRING_SIZE);
+	/* SNACK is only implemented for TCP */
+	if (snprintf(str, MAX_STRING_SIZE, "ErrorRecoveryLevel=%d",
+		     iscsi->transport == TCP_TRANSPORT ?
+		     iscsi->want_error_recovery_level : 0) == -1) {
+		iscsi_set_error(iscsi, "Out-of-memory: aprintf failed.");
+		return -1;
+	}
 	if (iscsi_pdu_add_data(iscsi, pdu, (unsigned char *)str, strlen(str)+1)
 	    != 0) {
 		iscsi_set_error(iscsi, "Out-of-memory: pdu add data failed.");
@@ -496,8 +565,9 @@ iscsi_login_add_datasequenceinorder(struct iscsi_context *iscsi, struct iscsi_pd
 {
 	char str[MAX_STRING_SIZE+1];
 
-	/* We only send DataSequenceInOrder during opneg */
-	if (iscsi->current_phase != ISCSI_PDU_LOGIN_CSG_OPNEG) {
+	/* We only send DataSequenceInOrder during opneg of the leading connection */
+	if (iscsi->current_phase != ISCSI_PDU_LOGIN_CSG_OPNEG
+	    || iscsi_login_joins_session(iscsi)) {
 		return 0;
 	}
 
@@ -870,17 +940,24 @@ iscsi_login_async(struct iscsi_context *iscsi, iscsi_command_cb cb,
 		return -1;
 	}
 
-	/* randomize cmdsn and itt */
+	/* randomize cmdsn and itt, an additional connection carries on
+	 * with those of its session.
+	 */
 	if (!iscsi->current_phase && !iscsi->secneg_phase) {
-		iscsi->itt = (uint32_t) rand();
-		iscsi->cmdsn = (uint32_t) rand();
-		iscsi->expcmdsn = iscsi->maxcmdsn = iscsi->min_cmdsn_waiting = iscsi->cmdsn;
+		/* only a TargetAddress of this login is a redirect */
+		iscsi->target_address[0] = 0;
+		if (!iscsi_login_joins_session(iscsi)) {
+			iscsi->itt = (uint32_t) rand();
+			iscsi->cmdsn = (uint32_t) rand();
+			iscsi->expcmdsn = iscsi->maxcmdsn = iscsi->cmdsn;
+		}
+		iscsi->min_cmdsn_waiting = iscsi_session(iscsi)->cmdsn;
 	}
 
 	pdu = iscsi_allocate_pdu(iscsi,
 				 ISCSI_PDU_LOGIN_REQUEST,
 				 ISCSI_PDU_LOGIN_RESPONSE,
-				 iscsi->itt,
+				 iscsi_session(iscsi)->itt,
 				 ISCSI_PDU_DROP_ON_RECONNECT);
 	if (pdu == NULL) {
 		iscsi_set_error(iscsi, "Out-of-memory: Failed to allocate "
@@ -891,8 +968,18 @@ iscsi_login_async(struct iscsi_context *iscsi, iscsi_command_cb cb,
 	/* login request */
 	iscsi_pdu_set_immediate(pdu);
 
+	/* tsih, non-zero when adding a connection to a session */
+	if (iscsi->leader != NULL) {
+		scsi_set_uint16(&pdu->outdata.data[14], iscsi->leader->tsih);
+	} else if (iscsi->recovery_deadline != 0) {
+		scsi_set_uint16(&pdu->outdata.data[14], iscsi->tsih);
+	}
+
+	/* cid */
+	scsi_set_uint16(&pdu->outdata.data[20], iscsi->cid);
+
 	/* cmdsn is not increased if Immediate delivery*/
-	iscsi_pdu_set_cmdsn(pdu, iscsi->cmdsn);
+	iscsi_pdu_set_cmdsn(pdu, iscsi_session(iscsi)->cmdsn);
 
 	if (!iscsi->user[0]) {
 		iscsi->current_phase = ISCSI_PDU_LOGIN_CSG_OPNEG;
@@ -1200,6 +1287,16 @@ iscsi_process_login_reply(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
 			}
 		}
 
+		if (!strncmp(ptr, "DataDigest=", 11)) {
+			if (!strcmp(ptr + 11, "CRC32C")) {
+				iscsi->want_data_digest
+				  = ISCSI_DATA_DIGEST_CRC32C;
+			} else {
+				iscsi->want_data_digest
+				  = ISCSI_DATA_DIGEST_NONE;
+			}
+		}
+
 		if (!strncmp(ptr, "FirstBurstLength=", 17)) {
 			iscsi->first_burst_length = strtol(ptr + 17, NULL, 10);
 		}
@@ -1227,6 +1324,26 @@ iscsi_process_login_reply(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
 			iscsi->max_burst_length = strtol(ptr + 15, NULL, 10);
 		}
 
+		if (!strncmp(ptr, "MaxOutstandingR2T=", 18)) {
+			iscsi->max_outstanding_r2t = MIN(strtoul(ptr + 18, NULL, 10),
+						iscsi->want_max_outstanding_r2t);
+		}
+
+		if (!strncmp(ptr, "ErrorRecoveryLevel=", 19)) {
+			iscsi->error_recovery_level = MIN(strtol(ptr + 19, NULL, 10),
+							  iscsi->want_error_recovery_level);
+		}
+
+		if (!strncmp(ptr, "DefaultTime2Retain=", 19)) {
+			iscsi->time2retain = MIN(strtoul(ptr + 19, NULL, 10),
+						 ISCSI_DEFAULT_TIME2RETAIN);
+		}
+
+		if (!strncmp(ptr, "MaxConnections=", 15)) {
+			iscsi->max_connections = MIN(strtol(ptr + 15, NULL, 10),
+						     iscsi->want_max_connections);
+		}
+
 		if (!strncmp(ptr, "MaxRecvDataSegmentLength=", 25)) {
 			iscsi->target_max_recv_data_segment_length = strtol(ptr + 25, NULL, 10);
 		}
@@ -1322,8 +1439,20 @@ iscsi_process_login_reply(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
 		size -= len + 1;
 	}
 
-	if (status == SCSI_STATUS_REDIRECT && iscsi->target_address[0]) {
-		ISCSI_LOG(iscsi, 2, "target requests redirect to %s",iscsi->target_address);
+	/* Status class 1, the target has moved. A temporary redirect is
+	 * followed for this login only, a permanent one is remembered and
+	 * later logins, including reconnects, go straight there.
+	 */
+	if ((status >> 8) == 1 && iscsi->target_address[0]) {
+		if (status == 0x0102) {
+			ISCSI_LOG(iscsi, 2, "target moved permanently to %s",
+				  iscsi->target_address);
+			strncpy(iscsi->redirect_portal, iscsi->target_address,
+				MAX_STRING_SIZE);
+		} else {
+			ISCSI_LOG(iscsi, 2, "target requests redirect to %s",
+				  iscsi->target_address);
+		}
 		if (pdu->callback) {
 			pdu->callback(iscsi, SCSI_STATUS_REDIRECT, NULL,
 			              pdu->private_data);
@@ -1334,6 +1463,12 @@ iscsi_process_login_reply(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
 	if (status != 0) {
 		iscsi_set_error(iscsi, "Failed to log in to target. Status: %s(%d)",
 				       login_error_str(status), status);
+		/* the session is gone, the next try starts a new one */
+		if (iscsi->recovery_deadline != 0) {
+			ISCSI_LOG(iscsi, 1, "target refused to continue the "
+				  "session, reconnecting with a new session");
+			iscsi->recovery_deadline = 0;
+		}
 		if (pdu->callback) {
 			pdu->callback(iscsi, SCSI_STATUS_ERROR, NULL,
 			              pdu->private_data);
@@ -1368,9 +1503,32 @@ iscsi_process_login_reply(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
 	if ((in->hdr[1] & ISCSI_PDU_LOGIN_TRANSIT)
 	&& (in->hdr[1] & ISCSI_PDU_LOGIN_NSG_FF) == ISCSI_PDU_LOGIN_NSG_FF) {
 		iscsi->is_loggedin = 1;
+		if (iscsi->recovery_deadline != 0 &&
+		    iscsi->tsih == scsi_get_uint16(&in->hdr[14])) {
+			/* commands from ExpCmdSN on never reached the
+			 * target, they are numbered again when they are
+			 * sent again.
+			 */
+			iscsi->recovery_expcmdsn = scsi_get_uint32(&in->hdr[28]);
+			iscsi->cmdsn = iscsi->recovery_expcmdsn;
+			ISCSI_LOG(iscsi, 2, "session continued on a new "
+				  "connection, ExpCmdSN %08x",
+				  iscsi->recovery_expcmdsn);
+		} else {
+			iscsi->recovery_deadline = 0;
+		}
+		if (iscsi->leader == NULL) {
+			iscsi->tsih = scsi_get_uint16(&in->hdr[14]);
+		}
 		iscsi_itt_post_increment(iscsi);
 		iscsi->header_digest  = iscsi->want_header_digest;
+		iscsi->data_digest    = iscsi->want_data_digest;
 		ISCSI_LOG(iscsi, 2, "login successful");
+		if (iscsi_session(iscsi)->want_full_duplex &&
+		    iscsi->session_type == ISCSI_SESSION_NORMAL) {
+			/* single threaded if it can not be started */
+			iscsi_tx_start(iscsi);
+		}
         // discoverylogin_cb
 		pdu->callback(iscsi, SCSI_STATUS_GOOD, NULL, pdu->private_data);
 	} else {
@@ -1399,6 +1557,14 @@ iscsi_logout_async(struct iscsi_context *iscsi, iscsi_command_cb cb,
 		return -1;
 	}
 
+	/* let held back commands go out before the logout */
+	iscsi_merge_flush(iscsi);
+
+	/* closing the session closes all of its connections, anything
+	 * still outstanding on the others is cancelled.
+	 */
+	iscsi_mcs_drop_connections(iscsi, 0);
+
 	pdu = iscsi_allocate_pdu(iscsi,
 				 ISCSI_PDU_LOGOUT_REQUEST,
 				 ISCSI_PDU_LOGOUT_RESPONSE,
@@ -1417,7 +1583,7 @@ iscsi_logout_async(struct iscsi_context *iscsi, iscsi_command_cb cb,
 	iscsi_pdu_set_pduflags(pdu, 0x80);
 
 	/* cmdsn is not increased if Immediate delivery*/
-	iscsi_pdu_set_cmdsn(pdu, iscsi->cmdsn);
+	iscsi_pdu_set_cmdsn(pdu, iscsi_session(iscsi)->cmdsn);
 
 	pdu->callback     = cb;
 	pdu->private_data = private_data;
@@ -0,0 +1,504 @@
+/*
+   Copyright (C) 2010 by Ronnie Sahlberg <ronniesahlberg@gmail.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "iscsi.h"
+#include "iscsi-private.h"
+#include "scsi-lowlevel.h"
+
+/*
+ * Multiple connections per session.
+ *
+ * The context the application created is the leading connection of the
+ * session. Every connection added to it is a context of its own, linked
+ * from iscsi->connections, whose ->leader points back to the leading
+ * connection. Connection specific state such as the socket, StatSN, the
+ * outqueue, the waitpdu list and the timers live in each connection,
+ * while CmdSN, MaxCmdSN, ExpCmdSN, the ITT counter and the slab
+ * allocator are those of the leading connection, see iscsi_session().
+ * Sharing the slab lets a PDU move from one connection to another when
+ * the session is reconnected.
+ */
+
+struct add_connection_task {
+	iscsi_command_cb cb;
+	void *private_data;
+};
+
+int
+iscsi_set_max_connections(struct iscsi_context *iscsi, int count)
+{
+	if (iscsi->is_loggedin) {
+		iscsi_set_error(iscsi, "Already logged in when setting "
+				"MaxConnections");
+		return -1;
+	}
+	if (count < 1 || count > ISCSI_MAX_CONNECTIONS) {
+		iscsi_set_error(iscsi, "MaxConnections must be between 1 "
+				"and %d", ISCSI_MAX_CONNECTIONS);
+		return -1;
+	}
+	if (count > 1 && iscsi->transport != TCP_TRANSPORT) {
+		iscsi_set_error(iscsi, "Multiple connections per session are "
+				"only supported over TCP");
+		return -1;
+	}
+
+	iscsi->want_max_connections = count;
+	return 0;
+}
+
+int
+iscsi_get_max_connections(struct iscsi_context *iscsi)
+{
+	return iscsi->max_connections;
+}
+
+int
+iscsi_get_connection_count(struct iscsi_context *iscsi)
+{
+	struct iscsi_context *conn;
+	int count = 1;
+
+	for (conn = iscsi->connections; conn; conn = conn->next_connection) {
+		count++;
+	}
+	return count;
+}
+
+static struct iscsi_context *
+iscsi_get_connection(struct iscsi_context *iscsi, int idx)
+{
+	struct iscsi_context *conn;
+
+	if (idx == 0) {
+		return iscsi;
+	}
+	for (conn = iscsi->connections; conn && --idx > 0;
+	     conn = conn->next_connection) {
+		;
+	}
+	return conn;
+}
+
+int
+iscsi_get_connection_fd(struct iscsi_context *iscsi, int idx)
+{
+	struct iscsi_context *conn;
+
+	if (idx == 0) {
+		return iscsi_get_fd(iscsi);
+	}
+	conn = iscsi_get_connection(iscsi, idx);
+	if (conn == NULL || conn->connection_failed) {
+		return -1;
+	}
+	return conn->fd;
+}
+
+int
+iscsi_which_connection_events(struct iscsi_context *iscsi, int idx)
+{
+	struct iscsi_context *conn;
+
+	if (idx == 0) {
+		return iscsi_which_events(iscsi);
+	}
+	conn = iscsi_get_connection(iscsi, idx);
+	if (conn == NULL || conn->connection_failed || conn->fd == -1) {
+		return 0;
+	}
+	return iscsi_which_events(conn);
+}
+
+int
+iscsi_service_connection(struct iscsi_context *iscsi, int idx, int revents)
+{
+	struct iscsi_context *conn;
+
+	if (idx == 0) {
+		return iscsi_service(iscsi, revents);
+	}
+	conn = iscsi_get_connection(iscsi, idx);
+	if (conn == NULL || conn->connection_failed || conn->fd == -1) {
+		return 0;
+	}
+
+	if (iscsi_service(conn, revents) < 0) {
+		iscsi_mcs_connection_failed(conn);
+	}
+	if (!conn->connection_failed) {
+		return 0;
+	}
+
+	/* The connection is done with, close it now that we are no
+	 * longer inside its own processing.
+	 */
+	if (conn->fd != -1) {
+		iscsi_disconnect(conn);
+	}
+	if (!conn->is_loggedin) {
+		/* fail the connect or login that was in progress */
+		if (conn->socket_status_cb) {
+			iscsi_command_cb cb = conn->socket_status_cb;
+
+			conn->socket_status_cb = NULL;
+			cb(conn, SCSI_STATUS_ERROR, NULL, conn->connect_data);
+		}
+		iscsi_cancel_pdus(conn);
+		return 0;
+	}
+
+	/* With ErrorRecoveryLevel 0 the loss of any connection fails
+	 * the session. Recover it as a whole.
+	 */
+	ISCSI_LOG(iscsi, 1, "connection %u of the session failed, "
+		  "reconnecting the session", conn->cid);
+	return iscsi_service_reconnect_if_loggedin(iscsi);
+}
+
+/*
+ * The connection has failed. It is closed and, if it was logged in,
+ * the session is recovered once iscsi_service_connection() returns
+ * from servicing it.
+ */
+void
+iscsi_mcs_connection_failed(struct iscsi_context *conn)
+{
+	if (!conn->connection_failed) {
+		ISCSI_LOG(conn, 2, "connection %u failed: %s", conn->cid,
+			  iscsi_get_error(conn));
+	}
+	conn->connection_failed = 1;
+}
+
+/*
+ * The connection with the fewest commands queued or waiting for a
+ * response. Ties go to the connection first on the list, so a burst of
+ * commands is spread over all of them.
+ */
+struct iscsi_context *
+iscsi_mcs_pick_connection(struct iscsi_context *iscsi)
+{
+	struct iscsi_context *conn, *best = iscsi;
+	uint32_t load, best_load;
+
+	best_load = iscsi->outqueue_count + iscsi->waitpdu_count;
+	for (conn = iscsi->connections; conn; conn = conn->next_connection) {
+		if (!conn->is_loggedin || conn->connection_failed) {
+			continue;
+		}
+		load = conn->outqueue_count + conn->waitpdu_count;
+		if (load < best_load) {
+			best = conn;
+			best_load = load;
+		}
+	}
+	return best;
+}
+
+/*
+ * A command that is dropped before it was sent leaves a hole in the
+ * CmdSN sequence. With a single connection the commands queued behind
+ * it are renumbered, but with several connections higher CmdSNs may
+ * already have been sent on another connection and the target would
+ * wait for the missing one forever. Turn the PDU into a NOP-Out that
+ * takes up the CmdSN instead. It stays on the outqueue, gets a fresh ITT
+ * so that it no longer matches the task, and the NOP-In that answers it
+ * is dropped.
+ */
+void
+iscsi_mcs_release_cmdsn(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
+{
+	uint32_t itt = iscsi_itt_post_increment(iscsi);
+
+	iscsi_timer_del(iscsi, &pdu->timer);
+
+	memset(pdu->outdata.data, 0, ISCSI_RAW_HEADER_SIZE);
+	pdu->outdata.data[0] = ISCSI_PDU_NOP_OUT;
+	pdu->outdata.size = ISCSI_HEADER_SIZE(iscsi->header_digest);
+	iscsi_pdu_set_pduflags(pdu, 0x80);
+	iscsi_pdu_set_itt(pdu, itt);
+	iscsi_pdu_set_ttt(pdu, 0xffffffff);
+	iscsi_pdu_set_cmdsn(pdu, pdu->cmdsn);
+
+	pdu->itt = itt;
+	pdu->response_opcode = ISCSI_PDU_NOP_IN;
+	pdu->flags |= ISCSI_PDU_DROP_ON_RECONNECT;
+	pdu->payload_offset = 0;
+	pdu->payload_len = 0;
+	pdu->dataout_remaining = 0;
+	pdu->expxferlen = 0;
+	pdu->callback = NULL;
+	pdu->private_data = NULL;
+}
+
+static void
+iscsi_mcs_free_connection(struct iscsi_context *iscsi,
+			  struct iscsi_context *conn)
+{
+	struct iscsi_pdu *pdu;
+
+	if (conn->fd != -1) {
+		iscsi_disconnect(conn);
+	}
+
+	/* the connection was still connecting or logging in */
+	if (conn->socket_status_cb) {
+		iscsi_command_cb cb = conn->socket_status_cb;
+
+		conn->socket_status_cb = NULL;
+		iscsi_set_error(conn, "Session is closing");
+		cb(conn, SCSI_STATUS_ERROR, NULL, conn->connect_data);
+	}
+
+	if (conn->outqueue_current != NULL &&
+	    conn->outqueue_current->flags & ISCSI_PDU_DELETE_WHEN_SENT) {
+		iscsi->drv->free_pdu(conn, conn->outqueue_current);
+	}
+	conn->outqueue_current = NULL;
+
+	while ((pdu = conn->outqueue) != NULL) {
+		iscsi_remove_from_outqueue(conn, pdu);
+		iscsi_waitpdu_add(conn, pdu);
+	}
+	while ((pdu = conn->waitpdu) != NULL) {
+		iscsi_waitpdu_remove(conn, pdu);
+		if (pdu->itt != 0xffffffff && pdu->callback) {
+			pdu->callback(conn, SCSI_STATUS_CANCELLED, NULL,
+				      pdu->private_data);
+		}
+		iscsi->drv->free_pdu(conn, pdu);
+	}
+
+	if (conn->incoming != NULL) {
+		iscsi_free_iscsi_in_pdu(conn, conn->incoming);
+	}
+	iscsi_free(conn, conn->rxbuf);
+	iscsi_free(conn, conn->itt_table);
+	iscsi_free(conn, conn->opaque);
+
+	iscsi->mallocs += conn->mallocs;
+	iscsi->reallocs += conn->reallocs;
+	iscsi->frees += conn->frees;
+
+	free(conn);
+}
+
+/*
+ * Close all additional connections of the session. If requeue is set,
+ * SCSI commands that were queued or in flight on them are moved to the
+ * waitpdu list of the leading connection, which is about to reconnect
+ * and will re-issue them. Otherwise they are cancelled.
+ */
+void
+iscsi_mcs_drop_connections(struct iscsi_context *iscsi, int requeue)
+{
+	struct iscsi_context *conn;
+	struct iscsi_pdu *pdu, *next;
+
+	while ((conn = iscsi->connections) != NULL) {
+		iscsi->connections = conn->next_connection;
+		conn->next_connection = NULL;
+		iscsi_tx_stop(conn);
+
+		if (requeue) {
+			if (conn->is_loggedin) {
+				iscsi->restore_connections++;
+			}
+			for (pdu = conn->outqueue; pdu; pdu = next) {
+				next = pdu->next;
+				if (pdu->flags & ISCSI_PDU_DROP_ON_RECONNECT ||
+				    pdu == conn->outqueue_current) {
+					continue;
+				}
+				iscsi_remove_from_outqueue(conn, pdu);
+				iscsi_timer_del(conn, &pdu->timer);
+				iscsi_waitpdu_add(iscsi, pdu);
+			}
+			for (pdu = conn->waitpdu; pdu; pdu = next) {
+				next = pdu->next;
+				if (pdu->flags & ISCSI_PDU_DROP_ON_RECONNECT ||
+				    pdu->itt == 0xffffffff) {
+					continue;
+				}
+				iscsi_waitpdu_remove(conn, pdu);
+				iscsi_timer_del(conn, &pdu->timer);
+				iscsi_waitpdu_add(iscsi, pdu);
+			}
+		}
+		iscsi_mcs_free_connection(iscsi, conn);
+	}
+}
+
+/* forget about connections that failed to log in */
+static void
+iscsi_mcs_reap_connections(struct iscsi_context *iscsi)
+{
+	struct iscsi_context **connp = &iscsi->connections;
+	struct iscsi_context *conn;
+
+	while ((conn = *connp) != NULL) {
+		if (!conn->connection_failed) {
+			connp = &conn->next_connection;
+			continue;
+		}
+		*connp = conn->next_connection;
+		iscsi_mcs_free_connection(iscsi, conn);
+	}
+}
+
+static void
+iscsi_add_connection_cb(struct iscsi_context *conn, int status,
+			void *command_data, void *private_data)
+{
+	struct add_connection_task *act = private_data;
+	struct iscsi_context *iscsi = conn->leader;
+
+	if (status != SCSI_STATUS_GOOD) {
+		iscsi_set_error(iscsi, "Failed to add connection %u to the "
+				"session: %s", conn->cid,
+				iscsi_get_error(conn));
+		iscsi_mcs_connection_failed(conn);
+		status = SCSI_STATUS_ERROR;
+	} else {
+		ISCSI_LOG(iscsi, 2, "connection %u added to the session",
+			  conn->cid);
+	}
+
+	if (act->cb) {
+		act->cb(iscsi, status, NULL, act->private_data);
+	}
+	iscsi_free(iscsi, act);
+}
+
+int
+iscsi_add_connection_async(struct iscsi_context *iscsi, iscsi_command_cb cb,
+			   void *private_data)
+{
+	struct iscsi_context *conn, **connp;
+	struct add_connection_task *act;
+
+	if (iscsi->session_type != ISCSI_SESSION_NORMAL ||
+	    !iscsi->is_loggedin || iscsi->old_iscsi) {
+		iscsi_set_error(iscsi, "Trying to add a connection while not "
+				"logged in to a normal session");
+		return -1;
+	}
+	if (iscsi->transport != TCP_TRANSPORT) {
+		iscsi_set_error(iscsi, "Multiple connections per session are "
+				"only supported over TCP");
+		return -1;
+	}
+
+	iscsi_mcs_reap_connections(iscsi);
+	if (iscsi_get_connection_count(iscsi) >= iscsi->max_connections) {
+		iscsi_set_error(iscsi, "Session allows at most %d "
+				"connections", iscsi->max_connections);
+		return -1;
+	}
+
+	conn = iscsi_create_context(iscsi->initiator_name);
+	if (conn == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: Failed to create "
+				"context for connection");
+		return -1;
+	}
+
+	act = iscsi_malloc(iscsi, sizeof(struct add_connection_task));
+	if (act == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: Failed to allocate "
+				"add_connection_task structure");
+		iscsi_destroy_context(conn);
+		return -1;
+	}
+	act->cb           = cb;
+	act->private_data = private_data;
+
+	conn->leader = iscsi;
+	if (++iscsi->next_cid == 0) {
+		iscsi->next_cid++;
+	}
+	conn->cid = iscsi->next_cid;
+
+	iscsi_set_targetname(conn, iscsi->target_name);
+	iscsi_set_alias(conn, iscsi->alias);
+	iscsi_set_session_type(conn, ISCSI_SESSION_NORMAL);
+	memcpy(conn->isid, iscsi->isid, sizeof(conn->isid));
+
+	iscsi_set_header_digest(conn, iscsi->want_header_digest);
+	iscsi_set_data_digest(conn, iscsi->want_data_digest);
+
+	iscsi_set_initiator_username_pwd(conn, iscsi->user, iscsi->passwd);
+	iscsi_set_target_username_pwd(conn, iscsi->target_user,
+				      iscsi->target_passwd);
+
+	strncpy(conn->bind_interfaces, iscsi->bind_interfaces, MAX_STRING_SIZE);
+	conn->bind_interfaces_cnt = iscsi->bind_interfaces_cnt;
+
+	conn->log_level = iscsi->log_level;
+	conn->log_fn = iscsi->log_fn;
+	conn->tcp_user_timeout = iscsi->tcp_user_timeout;
+	conn->tcp_keepidle = iscsi->tcp_keepidle;
+	conn->tcp_keepcnt = iscsi->tcp_keepcnt;
+	conn->tcp_keepintvl = iscsi->tcp_keepintvl;
+	conn->tcp_syncnt = iscsi->tcp_syncnt;
+	conn->cache_allocations = iscsi->cache_allocations;
+	conn->initiator_max_recv_data_segment_length =
+		iscsi->initiator_max_recv_data_segment_length;
+	conn->want_max_recv_data_segment_length =
+		iscsi->want_max_recv_data_segment_length;
+
+	/* session wide parameters are only negotiated by the leading
+	 * connection.
+	 */
+	conn->first_burst_length = iscsi->first_burst_length;
+	conn->max_burst_length = iscsi->max_burst_length;
+	conn->want_initial_r2t = iscsi->want_initial_r2t;
+	conn->use_initial_r2t = iscsi->use_initial_r2t;
+	conn->want_immediate_data = iscsi->want_immediate_data;
+	conn->use_immediate_data = iscsi->use_immediate_data;
+	conn->want_max_outstanding_r2t = iscsi->want_max_outstanding_r2t;
+	conn->max_outstanding_r2t = iscsi->max_outstanding_r2t;
+	conn->want_error_recovery_level = iscsi->want_error_recovery_level;
+	conn->error_recovery_level = iscsi->error_recovery_level;
+
+	for (connp = &iscsi->connections; *connp;
+	     connp = &(*connp)->next_connection) {
+		;
+	}
+	*connp = conn;
+
+	ISCSI_LOG(iscsi, 2, "adding connection %u to the session", conn->cid);
+
+	if (iscsi_full_connect_async(conn, iscsi->connected_portal, -1,
+				     iscsi_add_connection_cb, act) != 0) {
+		iscsi_set_error(iscsi, "Failed to add connection: %s",
+				iscsi_get_error(conn));
+		*connp = NULL;
+		iscsi_free(iscsi, act);
+		iscsi_mcs_free_connection(iscsi, conn);
+		return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,504 @@
+/*
+   Copyright (C) 2010 by Ronnie Sahlberg <ronniesahlberg@gmail.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_INTTYPES_H
+#include <inttypes.h>
+#else
+#define PRIu64 "llu"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "iscsi.h"
+#include "iscsi-private.h"
+#include "scsi-lowlevel.h"
+#include "slist.h"
+
+/*
+ * Merging of adjacent READ16/WRITE16 commands.
+ *
+ * A READ16 or WRITE16 is not sent straight away but starts a batch,
+ * iscsi->merge_pending. Commands that follow it on the same LUN, in the
+ * same direction and with the same flags, and that continue where the
+ * batch ends are added to it. The batch is sent as one command with an
+ * iovector gathering the buffers of all of them when it is full, when
+ * the hold time has passed, or when any other command is sent, so that
+ * nothing overtakes it.
+ *
+ * When the merged command completes with GOOD the status and residuals
+ * are handed to every command of the batch. If it fails with a SCSI
+ * status each command is sent again on its own, which gives each of them
+ * its own status and sense data.
+ */
+
+struct iscsi_merge_member {
+	struct iscsi_merge_member *next;
+	struct scsi_task *task;
+	iscsi_command_cb cb;
+	void *private_data;
+	unsigned char *data;	/* write without an iovector */
+	uint32_t len;
+};
+
+struct iscsi_merge_io {
+	struct iscsi_merge_io *next;
+	struct iscsi_context *iscsi;
+	int lun;
+	int write;
+	int blocksize;
+	int dpo;
+	int group_number;
+	uint64_t lba;
+	uint32_t len;
+	int num_members;
+	struct iscsi_merge_member *members;
+	struct iscsi_merge_member *last;
+	struct scsi_task *task;		/* the merged command once sent */
+	struct scsi_task *cancel;	/* member that is being cancelled */
+	struct iscsi_timer timer;
+};
+
+int
+iscsi_set_merge_io(struct iscsi_context *iscsi, uint32_t max_bytes,
+		   int hold_ms)
+{
+	if (hold_ms < 0) {
+		iscsi_set_error(iscsi, "Invalid hold time %d ms for merging",
+				hold_ms);
+		return -1;
+	}
+
+	iscsi_merge_flush(iscsi);
+	iscsi->merge_max_bytes = max_bytes;
+	iscsi->merge_hold_ms = hold_ms;
+	return 0;
+}
+
+int
+iscsi_merge_wanted(struct iscsi_context *iscsi, uint32_t datalen,
+		   int protect, int fua, int fua_nv)
+{
+	/* FUA and protection information are per command */
+	return iscsi->merge_max_bytes != 0 && datalen != 0 &&
+		datalen < iscsi->merge_max_bytes &&
+		!protect && !fua && !fua_nv &&
+		(iscsi->is_loggedin || iscsi->pending_reconnect);
+}
+
+static uint32_t
+iscsi_merge_limit(struct iscsi_context *iscsi, int blocksize)
+{
+	uint32_t limit = iscsi->merge_max_bytes;
+
+	if (iscsi->max_xfer_len &&
+	    iscsi->max_xfer_len < limit / (uint32_t)blocksize) {
+		limit = iscsi->max_xfer_len * blocksize;
+	}
+	return limit;
+}
+
+static void
+iscsi_merge_complete_member(struct iscsi_context *iscsi,
+			    struct iscsi_merge_member *m, int status)
+{
+	m->task->status = status;
+	m->cb(iscsi, status, m->task, m->private_data);
+	iscsi_free(iscsi, m);
+}
+
+/* Send a command of a batch on its own. */
+static void
+iscsi_merge_reissue(struct iscsi_context *iscsi, int lun,
+		    struct iscsi_merge_member *m)
+{
+	struct scsi_task *task = m->task;
+
+	if (task->xfer_dir == SCSI_XFER_READ && task->datain.data != NULL) {
+		/* we gave it a buffer, let it read into one of its own */
+		free(task->datain.data);
+		task->datain.data = NULL;
+		task->datain.size = 0;
+		scsi_task_set_iov_in(task, NULL, 0);
+	}
+	scsi_task_reset_iov(&task->iovector_in);
+	scsi_task_reset_iov(&task->iovector_out);
+
+	if (iscsi_scsi_command_async(iscsi, lun, task, m->cb, NULL,
+				     m->private_data) != 0) {
+		iscsi_merge_complete_member(iscsi, m, SCSI_STATUS_ERROR);
+		return;
+	}
+	iscsi_free(iscsi, m);
+}
+
+static void
+iscsi_merge_free(struct iscsi_merge_io *merge)
+{
+	struct iscsi_context *iscsi = merge->iscsi;
+
+	scsi_free_scsi_task(merge->task);
+	iscsi_free(iscsi, merge);
+}
+
+static void
+iscsi_merge_cb(struct iscsi_context *iscsi, int status,
+	       void *command_data, void *private_data)
+{
+	struct iscsi_merge_io *merge = private_data;
+	struct scsi_task *task = command_data;
+	struct iscsi_merge_member *m;
+	size_t received = merge->len, offset = 0, residual;
+
+	iscsi = merge->iscsi;
+	ISCSI_LIST_REMOVE(&iscsi->merge_ios, merge);
+
+	if (status == SCSI_STATUS_GOOD) {
+		if (task->residual_status == SCSI_RESIDUAL_UNDERFLOW &&
+		    task->residual < received) {
+			received -= task->residual;
+		} else if (task->residual_status == SCSI_RESIDUAL_UNDERFLOW) {
+			received = 0;
+		}
+	}
+
+	while ((m = merge->members) != NULL) {
+		merge->members = m->next;
+
+		if (merge->cancel == m->task) {
+			iscsi_merge_complete_member(iscsi, m,
+						    SCSI_STATUS_CANCELLED);
+			continue;
+		}
+
+		switch (status) {
+		case SCSI_STATUS_GOOD:
+			/* a short transfer is short at the end */
+			residual = 0;
+			if (offset + m->len > received) {
+				residual = MIN(m->len,
+					       offset + m->len - received);
+			}
+			m->task->residual_status = residual ?
+				SCSI_RESIDUAL_UNDERFLOW :
+				SCSI_RESIDUAL_NO_RESIDUAL;
+			m->task->residual = residual;
+			if (m->task->xfer_dir == SCSI_XFER_READ &&
+			    m->task->datain.data != NULL) {
+				m->task->datain.size = m->len - residual;
+			}
+			offset += m->len;
+			iscsi_merge_complete_member(iscsi, m, status);
+			break;
+		case SCSI_STATUS_CANCELLED:
+			if (merge->cancel != NULL) {
+				/* only one of them was cancelled */
+				iscsi_merge_reissue(iscsi, merge->lun, m);
+				break;
+			}
+			/* fall through */
+		case SCSI_STATUS_ERROR:
+		case SCSI_STATUS_TIMEOUT:
+			iscsi_merge_complete_member(iscsi, m, status);
+			break;
+		default:
+			iscsi_merge_reissue(iscsi, merge->lun, m);
+			break;
+		}
+	}
+
+	iscsi_merge_free(merge);
+}
+
+/* Hand the buffer of a command to the merged command. */
+static int
+iscsi_merge_add_iov(struct iscsi_merge_io *merge,
+		    struct iscsi_merge_member *m, struct scsi_iovector *v)
+{
+	struct scsi_task *task = m->task;
+	struct scsi_iovec *iov;
+	int i;
+
+	if (merge->write && m->data != NULL) {
+		iov = scsi_malloc(task, sizeof(struct scsi_iovec));
+		if (iov == NULL) {
+			return -1;
+		}
+		iov->iov_base = m->data;
+		iov->iov_len  = m->len;
+		scsi_task_set_iov_out(task, iov, 1);
+	} else if (!merge->write && task->iovector_in.iov == NULL) {
+		task->datain.data = malloc(m->len);
+		if (task->datain.data == NULL) {
+			return -1;
+		}
+		iov = scsi_malloc(task, sizeof(struct scsi_iovec));
+		if (iov == NULL) {
+			return -1;
+		}
+		iov->iov_base = task->datain.data;
+		iov->iov_len  = m->len;
+		scsi_task_set_iov_in(task, iov, 1);
+	}
+
+	if (merge->write) {
+		for (i = 0; i < task->iovector_out.niov; i++) {
+			v->iov[v->niov++] = task->iovector_out.iov[i];
+		}
+	} else {
+		for (i = 0; i < task->iovector_in.niov; i++) {
+			v->iov[v->niov++] = task->iovector_in.iov[i];
+		}
+	}
+	return 0;
+}
+
+static int
+iscsi_merge_send(struct iscsi_context *iscsi, struct iscsi_merge_io *merge)
+{
+	struct iscsi_merge_member *m;
+	struct scsi_iovector v;
+	int niov = 0;
+
+	for (m = merge->members; m; m = m->next) {
+		if (m->data != NULL || (!merge->write &&
+					m->task->iovector_in.iov == NULL)) {
+			niov++;
+		} else if (merge->write) {
+			niov += m->task->iovector_out.niov;
+		} else {
+			niov += m->task->iovector_in.niov;
+		}
+	}
+
+	if (merge->write) {
+		merge->task = scsi_cdb_write16(merge->lba, merge->len,
+					       merge->blocksize, 0, merge->dpo,
+					       0, 0, merge->group_number);
+	} else {
+		merge->task = scsi_cdb_read16(merge->lba, merge->len,
+					      merge->blocksize, 0, merge->dpo,
+					      0, 0, merge->group_number);
+	}
+	if (merge->task == NULL) {
+		return -1;
+	}
+
+	memset(&v, 0, sizeof(v));
+	v.iov = scsi_malloc(merge->task, niov * sizeof(struct scsi_iovec));
+	if (v.iov == NULL) {
+		return -1;
+	}
+	for (m = merge->members; m; m = m->next) {
+		if (iscsi_merge_add_iov(merge, m, &v) != 0) {
+			return -1;
+		}
+	}
+	if (merge->write) {
+		scsi_task_set_iov_out(merge->task, v.iov, v.niov);
+	} else {
+		scsi_task_set_iov_in(merge->task, v.iov, v.niov);
+	}
+
+	ISCSI_LIST_ADD(&iscsi->merge_ios, merge);
+	if (iscsi_scsi_command_async(iscsi, merge->lun, merge->task,
+				     iscsi_merge_cb, NULL, merge) != 0) {
+		ISCSI_LIST_REMOVE(&iscsi->merge_ios, merge);
+		return -1;
+	}
+	return 0;
+}
+
+void
+iscsi_merge_flush(struct iscsi_context *iscsi)
+{
+	struct iscsi_merge_io *merge = iscsi->merge_pending;
+	struct iscsi_merge_member *m;
+	struct iscsi_data d;
+
+	if (merge == NULL) {
+		return;
+	}
+	iscsi->merge_pending = NULL;
+	iscsi_timer_del(iscsi, &merge->timer);
+
+	/* nothing to merge it with, send it as it is */
+	if (merge->num_members == 1) {
+		m = merge->members;
+		d.data = m->data;
+		d.size = m->len;
+		if (iscsi_scsi_command_async(iscsi, merge->lun, m->task, m->cb,
+					     m->data ? &d : NULL,
+					     m->private_data) != 0) {
+			iscsi_merge_complete_member(iscsi, m,
+						    SCSI_STATUS_ERROR);
+		} else {
+			iscsi_free(iscsi, m);
+		}
+		iscsi_merge_free(merge);
+		return;
+	}
+
+	ISCSI_LOG(iscsi, 6, "merged %d %ss into one of %u bytes at lba %"
+		  PRIu64, merge->num_members, merge->write ? "write" : "read",
+		  merge->len, merge->lba);
+
+	if (iscsi_merge_send(iscsi, merge) != 0) {
+		ISCSI_LOG(iscsi, 1, "failed to send merged command: %s",
+			  iscsi_get_error(iscsi));
+		iscsi_merge_cb(iscsi, SCSI_STATUS_ERROR, merge->task, merge);
+	}
+}
+
+static void
+iscsi_merge_timer_cb(struct iscsi_context *iscsi, void *private_data)
+{
+	if (iscsi->merge_pending == private_data) {
+		iscsi_merge_flush(iscsi);
+	}
+}
+
+struct scsi_task *
+iscsi_merge_rw16_task(struct iscsi_context *iscsi, int lun, int write,
+		      uint64_t lba, unsigned char *data, uint32_t datalen,
+		      int blocksize, int dpo, int group_number,
+		      iscsi_command_cb cb, void *private_data,
+		      struct scsi_iovec *iov, int niov)
+{
+	struct iscsi_merge_io *merge = iscsi->merge_pending;
+	struct iscsi_merge_member *m;
+	struct scsi_task *task;
+
+	if (write) {
+		task = scsi_cdb_write16(lba, datalen, blocksize, 0,
+					dpo, 0, 0, group_number);
+	} else {
+		task = scsi_cdb_read16(lba, datalen, blocksize, 0,
+				       dpo, 0, 0, group_number);
+	}
+	if (task == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: Failed to create "
+				"%s16 cdb.", write ? "write" : "read");
+		return NULL;
+	}
+	if (iov != NULL) {
+		if (write) {
+			scsi_task_set_iov_out(task, iov, niov);
+		} else {
+			scsi_task_set_iov_in(task, iov, niov);
+		}
+	}
+
+	m = iscsi_zmalloc(iscsi, sizeof(struct iscsi_merge_member));
+	if (m == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: Failed to allocate "
+				"merge member.");
+		scsi_free_scsi_task(task);
+		return NULL;
+	}
+	m->task         = task;
+	m->cb           = cb;
+	m->private_data = private_data;
+	m->data         = iov == NULL ? data : NULL;
+	m->len          = datalen;
+
+	if (merge != NULL && merge->lun == lun && merge->write == write &&
+	    merge->blocksize == blocksize && merge->dpo == dpo &&
+	    merge->group_number == group_number &&
+	    merge->lba + merge->len / blocksize == lba &&
+	    merge->len + datalen <= iscsi_merge_limit(iscsi, blocksize)) {
+		merge->last->next = m;
+		merge->last = m;
+		merge->num_members++;
+		merge->len += datalen;
+		if (merge->len == iscsi_merge_limit(iscsi, blocksize)) {
+			iscsi_merge_flush(iscsi);
+		}
+		return task;
+	}
+
+	/* start a new batch */
+	iscsi_merge_flush(iscsi);
+
+	merge = iscsi_zmalloc(iscsi, sizeof(struct iscsi_merge_io));
+	if (merge == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: Failed to allocate "
+				"merge batch.");
+		iscsi_free(iscsi, m);
+		scsi_free_scsi_task(task);
+		return NULL;
+	}
+	merge->iscsi        = iscsi;
+	merge->lun          = lun;
+	merge->write        = write;
+	merge->blocksize    = blocksize;
+	merge->dpo          = dpo;
+	merge->group_number = group_number;
+	merge->lba          = lba;
+	merge->len          = datalen;
+	merge->num_members  = 1;
+	merge->members      = m;
+	merge->last         = m;
+
+	iscsi->merge_pending = merge;
+	iscsi_timer_add(iscsi, &merge->timer,
+			iscsi_monotonic_ms() + iscsi->merge_hold_ms,
+			iscsi_merge_timer_cb, merge);
+
+	return task;
+}
+
+int
+iscsi_merge_cancel_task(struct iscsi_context *iscsi, struct scsi_task *task)
+{
+	struct iscsi_merge_io *merge;
+	struct iscsi_merge_member *m;
+
+	/* once sent, a batch of one is a normal command */
+	for (m = iscsi->merge_pending ? iscsi->merge_pending->members : NULL;
+	     m; m = m->next) {
+		if (m->task == task) {
+			iscsi_merge_flush(iscsi);
+			break;
+		}
+	}
+
+	for (merge = iscsi->merge_ios; merge; merge = merge->next) {
+		for (m = merge->members; m; m = m->next) {
+			if (m->task == task) {
+				break;
+			}
+		}
+		if (m != NULL) {
+			break;
+		}
+	}
+	if (merge == NULL) {
+		return -1;
+	}
+
+	/* the others are sent again on their own */
+	merge->cancel = task;
+	if (iscsi_scsi_cancel_task(iscsi, merge->task) != 0) {
+		merge->cancel = NULL;
+		return -1;
+	}
+	return 0;
+}
@@ -69,7 +69,11 @@ iscsi_serial32_compare(uint32_t s1, uint32_t s2) {
 
 uint32_t
 iscsi_itt_post_increment(struct iscsi_context *iscsi) {
-	uint32_t old_itt = iscsi->itt;
+	uint32_t old_itt;
+
+	/* ITTs are unique across all connections of a session */
+	iscsi = iscsi_session(iscsi);
+	old_itt = iscsi->itt;
 	iscsi->itt++;
 	/* 0xffffffff is a reserved value */
 	if (iscsi->itt == 0xffffffff) {
@@ -78,6 +82,149 @@ iscsi_itt_post_increment(struct iscsi_context *iscsi) {
 	return old_itt;
 }
 
+/*
+ * PDUs that are waiting for a response are kept on the iscsi->waitpdu list,
+ * in the order they were sent, and are also hashed by ITT so that incoming
+ * PDUs can find their command without walking the list. ITTs are allocated
+ * sequentially so the low bits of the ITT make a good bucket index and the
+ * full ITT is compared on lookup.
+ */
+#define ISCSI_ITT_TABLE_MIN_SIZE	256
+
+static void
+iscsi_itt_table_insert(struct iscsi_pdu **table, uint32_t size,
+		       struct iscsi_pdu *pdu)
+{
+	struct iscsi_pdu **slot = &table[pdu->itt & (size - 1)];
+
+	/* keep the oldest pdu first in case an itt is ever reused */
+	while (*slot != NULL) {
+		slot = &(*slot)->itt_next;
+	}
+	pdu->itt_next = NULL;
+	*slot = pdu;
+}
+
+static void
+iscsi_itt_table_resize(struct iscsi_context *iscsi, uint32_t size)
+{
+	struct iscsi_pdu **table, *pdu;
+
+	table = iscsi_zmalloc(iscsi, size * sizeof(struct iscsi_pdu *));
+	if (table == NULL) {
+		/* keep using the old table, lookups will just be slower */
+		return;
+	}
+	for (pdu = iscsi->waitpdu; pdu; pdu = pdu->next) {
+		iscsi_itt_table_insert(table, size, pdu);
+	}
+	iscsi_free(iscsi, iscsi->itt_table);
+	iscsi->itt_table = table;
+	iscsi->itt_table_size = size;
+}
+
+void
+iscsi_waitpdu_add(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
+{
+	pdu->next = NULL;
+	pdu->prev = iscsi->waitpdu_tail;
+	if (iscsi->waitpdu_tail != NULL) {
+		iscsi->waitpdu_tail->next = pdu;
+	} else {
+		iscsi->waitpdu = pdu;
+	}
+	iscsi->waitpdu_tail = pdu;
+	iscsi->waitpdu_count++;
+
+	if (iscsi->waitpdu_count > iscsi->itt_table_size) {
+		iscsi_itt_table_resize(iscsi, MAX(ISCSI_ITT_TABLE_MIN_SIZE,
+						  iscsi->itt_table_size * 2));
+		/* the resize has already hashed this pdu */
+		if (iscsi->itt_table_size >= iscsi->waitpdu_count) {
+			return;
+		}
+	}
+	if (iscsi->itt_table != NULL) {
+		iscsi_itt_table_insert(iscsi->itt_table,
+				       iscsi->itt_table_size, pdu);
+	}
+}
+
+static struct iscsi_pdu **
+iscsi_waitpdu_slot(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
+{
+	struct iscsi_pdu **slot;
+
+	if (iscsi->itt_table == NULL) {
+		return NULL;
+	}
+	slot = &iscsi->itt_table[pdu->itt & (iscsi->itt_table_size - 1)];
+	while (*slot != NULL && *slot != pdu) {
+		slot = &(*slot)->itt_next;
+	}
+	return *slot ? slot : NULL;
+}
+
+/* Remove pdu from the waitpdu list. Does nothing if it is not on it. */
+int
+iscsi_waitpdu_remove(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
+{
+	struct iscsi_pdu **slot;
+
+	if (iscsi->itt_table != NULL) {
+		slot = iscsi_waitpdu_slot(iscsi, pdu);
+		if (slot == NULL) {
+			return 0;
+		}
+		*slot = pdu->itt_next;
+	} else {
+		struct iscsi_pdu *tmp;
+
+		for (tmp = iscsi->waitpdu; tmp && tmp != pdu; tmp = tmp->next)
+			;
+		if (tmp == NULL) {
+			return 0;
+		}
+	}
+
+	if (pdu->prev != NULL) {
+		pdu->prev->next = pdu->next;
+	} else {
+		iscsi->waitpdu = pdu->next;
+	}
+	if (pdu->next != NULL) {
+		pdu->next->prev = pdu->prev;
+	} else {
+		iscsi->waitpdu_tail = pdu->prev;
+	}
+	pdu->next = pdu->prev = pdu->itt_next = NULL;
+	iscsi->waitpdu_count--;
+	return 1;
+}
+
+struct iscsi_pdu *
+iscsi_waitpdu_find(struct iscsi_context *iscsi, uint32_t itt)
+{
+	struct iscsi_pdu *pdu;
+
+	if (iscsi->itt_table == NULL) {
+		for (pdu = iscsi->waitpdu; pdu; pdu = pdu->next) {
+			if (pdu->itt == itt) {
+				break;
+			}
+		}
+		return pdu;
+	}
+
+	for (pdu = iscsi->itt_table[itt & (iscsi->itt_table_size - 1)];
+	     pdu; pdu = pdu->itt_next) {
+		if (pdu->itt == itt) {
+			break;
+		}
+	}
+	return pdu;
+}
+
 void iscsi_dump_pdu_header(struct iscsi_context *iscsi, unsigned char *data) {
 	char dump[ISCSI_RAW_HEADER_SIZE*3+1]={0};
 	int i;
@@ -107,13 +254,7 @@ iscsi_allocate_pdu(struct iscsi_context *iscsi, enum iscsi_opcode opcode,
 	}
 
 	pdu->outdata.size = ISCSI_HEADER_SIZE(iscsi->header_digest);
-	pdu->outdata.data = iscsi_szmalloc(iscsi, pdu->outdata.size);
-
-	if (pdu->outdata.data == NULL) {
-		iscsi_set_error(iscsi, "failed to allocate pdu header");
-		iscsi_free(iscsi, pdu);
-		return NULL;
-	}
+	pdu->outdata.data = pdu->hdr_buf;
 
 	/* opcode */
 	pdu->outdata.data[0] = opcode;
@@ -142,20 +283,18 @@ iscsi_tcp_free_pdu(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
 		return;
 	}
 
-	if (pdu->outdata.size <= iscsi->smalloc_size) {
+	iscsi_timer_del(iscsi, &pdu->timer);
+
+	if (pdu->outdata.data != pdu->hdr_buf) {
 		iscsi_sfree(iscsi, pdu->outdata.data);
-	} else {
-		iscsi_free(iscsi, pdu->outdata.data);
 	}
 	pdu->outdata.data = NULL;
 
-	if (pdu->indata.size <= iscsi->smalloc_size) {
-		iscsi_sfree(iscsi, pdu->indata.data);
-	} else {
-		iscsi_free(iscsi, pdu->indata.data);
-	}
+	iscsi_free(iscsi, pdu->indata.data);
 	pdu->indata.data = NULL;
 
+	iscsi_snack_free(iscsi, pdu);
+
 	if (iscsi->outqueue_current == pdu) {
 		iscsi->outqueue_current = NULL;
 	}
@@ -182,16 +321,13 @@ iscsi_add_data(struct iscsi_context *iscsi, struct iscsi_data *data,
 		aligned = (aligned+3)&0xfffffffc;
 	}
 
+	/* pdu->indata is handed over to the task and free()d by the
+	 * application, so this must not come from the slab.
+	 */
 	if (data->size == 0) {
-		if (aligned <= iscsi->smalloc_size) {
-			data->data = iscsi_szmalloc(iscsi, aligned);
-		} else {
-			data->data = iscsi_malloc(iscsi, aligned);
-		}
+		data->data = iscsi_malloc(iscsi, aligned);
 	} else {
-		if (aligned > iscsi->smalloc_size) {
-			data->data = iscsi_realloc(iscsi, data->data, aligned);
-		}
+		data->data = iscsi_realloc(iscsi, data->data, aligned);
 	}
 	if (data->data == NULL) {
 		iscsi_set_error(iscsi, "failed to allocate buffer for %d "
@@ -210,10 +346,52 @@ iscsi_add_data(struct iscsi_context *iscsi, struct iscsi_data *data,
 	return 0;
 }
 
+/*
+ * Store data at a given offset of the buffer instead of at its end. Used
+ * for Data-In that arrives out of order during error recovery, anything
+ * skipped over is zeroed until it arrives.
+ */
+int
+iscsi_add_data_at(struct iscsi_context *iscsi, struct iscsi_data *data,
+		  uint32_t offset, const unsigned char *dptr, int dsize)
+{
+	size_t len = (size_t)offset + dsize;
+
+	if (offset == data->size) {
+		return iscsi_add_data(iscsi, data, dptr, dsize, 0);
+	}
+
+	if (len > data->size) {
+		unsigned char *buf;
+
+		if (data->size == 0) {
+			buf = iscsi_malloc(iscsi, len);
+		} else {
+			buf = iscsi_realloc(iscsi, data->data, len);
+		}
+		if (buf == NULL) {
+			iscsi_set_error(iscsi, "failed to allocate buffer for %d "
+					"bytes", (int) len);
+			return -1;
+		}
+		data->data = buf;
+		if (offset > data->size) {
+			memset(data->data + data->size, 0, offset - data->size);
+		}
+		data->size = len;
+	}
+	memcpy(data->data + offset, dptr, dsize);
+
+	return 0;
+}
+
 int
 iscsi_pdu_add_data(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
 		   const unsigned char *dptr, int dsize)
 {
+	unsigned char *buf;
+	size_t len, aligned;
+
 	if (pdu == NULL) {
 		iscsi_set_error(iscsi, "trying to add data to NULL pdu");
 		return -1;
@@ -224,10 +402,32 @@ iscsi_pdu_add_data(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
 		return -1;
 	}
 
-	if (iscsi_add_data(iscsi, &pdu->outdata, dptr, dsize, 1) != 0) {
+	len = pdu->outdata.size + dsize;
+	aligned = (len + 3) & 0xfffffffc;
+
+	/* the header starts out in pdu->hdr_buf, move it to the slab
+	 * the first time a data segment is added.
+	 */
+	if (pdu->outdata.data == pdu->hdr_buf) {
+		buf = iscsi_smalloc(iscsi, aligned);
+		if (buf != NULL) {
+			memcpy(buf, pdu->hdr_buf, pdu->outdata.size);
+		}
+	} else {
+		buf = iscsi_srealloc(iscsi, pdu->outdata.data, aligned);
+	}
+	if (buf == NULL) {
 		iscsi_set_error(iscsi, "failed to add data to pdu buffer");
 		return -1;
 	}
+	pdu->outdata.data = buf;
+
+	memcpy(buf + pdu->outdata.size, dptr, dsize);
+	pdu->outdata.size += dsize;
+	if (len != aligned) {
+		/* zero out any padding at the end */
+		memset(buf + len, 0, aligned - len);
+	}
 
 	/* update data segment length */
 	scsi_set_uint32(&pdu->outdata.data[4], pdu->outdata.size
@@ -361,31 +561,51 @@ int iscsi_process_reject(struct iscsi_context *iscsi,
 
 	iscsi_dump_pdu_header(iscsi, in->data);
 
-	for (pdu = iscsi->waitpdu; pdu; pdu = pdu->next) {
-		if (pdu->itt == itt) {
-			break;
-		}
-	}
-
+	pdu = iscsi_waitpdu_find(iscsi, itt);
 	if (pdu == NULL) {
 		iscsi_set_error(iscsi, "Can not match REJECT with"
 				       "any outstanding pdu with itt:0x%08x",
 				       itt);
 		return -1;
 	}
+	if (iscsi->tx != NULL) {
+		iscsi_tx_wait(iscsi, pdu);
+	}
 
 	if (pdu->callback) {
 		pdu->callback(iscsi, SCSI_STATUS_ERROR, NULL,
 		              pdu->private_data);
 	}
 
-	ISCSI_LIST_REMOVE(&iscsi->waitpdu, pdu);
+	iscsi_waitpdu_remove(iscsi, pdu);
 	iscsi->drv->free_pdu(iscsi, pdu);
 	return 0;
 }
 
+int
+iscsi_verify_header_digest(struct iscsi_context *iscsi, struct iscsi_in_pdu *in)
+{
+	uint32_t crc, crc_rcvd = 0;
+
+	if (iscsi->header_digest == ISCSI_HEADER_DIGEST_NONE) {
+		return 0;
+	}
+
+	crc = crc32c(in->hdr, ISCSI_RAW_HEADER_SIZE);
+	crc_rcvd |= in->hdr[ISCSI_RAW_HEADER_SIZE+0];
+	crc_rcvd |= in->hdr[ISCSI_RAW_HEADER_SIZE+1] << 8;
+	crc_rcvd |= in->hdr[ISCSI_RAW_HEADER_SIZE+2] << 16;
+	crc_rcvd |= in->hdr[ISCSI_RAW_HEADER_SIZE+3] << 24;
+	if (crc != crc_rcvd) {
+		iscsi_set_error(iscsi, "header checksum verification failed: calculated 0x%" PRIx32 " received 0x%" PRIx32, crc, crc_rcvd);
+		return -1;
+	}
+	return 0;
+}
+
 static void iscsi_process_pdu_serials(struct iscsi_context *iscsi, struct iscsi_in_pdu *in)
 {
+	struct iscsi_context *session = iscsi_session(iscsi);
 	uint32_t itt = scsi_get_uint32(&in->hdr[16]);
 	uint32_t statsn = scsi_get_uint32(&in->hdr[24]);
 	uint32_t maxcmdsn = scsi_get_uint32(&in->hdr[32]);
@@ -399,11 +619,12 @@ static void iscsi_process_pdu_serials(struct iscsi_context *iscsi, struct iscsi_
 		return;
 	}
 
-	if (iscsi_serial32_compare(maxcmdsn, iscsi->maxcmdsn) > 0) {
-		iscsi->maxcmdsn = maxcmdsn;
+	/* the command window is shared by all connections of the session */
+	if (iscsi_serial32_compare(maxcmdsn, session->maxcmdsn) > 0) {
+		session->maxcmdsn = maxcmdsn;
 	}
-	if (iscsi_serial32_compare(expcmdsn, iscsi->expcmdsn) > 0) {
-		iscsi->expcmdsn = expcmdsn;
+	if (iscsi_serial32_compare(expcmdsn, session->expcmdsn) > 0) {
+		session->expcmdsn = expcmdsn;
 	}
 
 	/* RFC3720 10.7.3 (StatSN is invalid if S bit unset in flags) */
@@ -428,20 +649,13 @@ iscsi_process_pdu(struct iscsi_context *iscsi, struct iscsi_in_pdu *in)
 	uint32_t itt = scsi_get_uint32(&in->hdr[16]);
 	enum iscsi_opcode opcode = in->hdr[0] & 0x3f;
 	uint8_t ahslen = in->hdr[4];
+	enum iscsi_opcode expected_response;
+	int is_finished = 1;
+	int ret;
 	struct iscsi_pdu *pdu;
 
-	/* verify header checksum */
-	if (iscsi->header_digest != ISCSI_HEADER_DIGEST_NONE) {
-		uint32_t crc, crc_rcvd = 0;
-		crc = crc32c(in->hdr, ISCSI_RAW_HEADER_SIZE);
-		crc_rcvd |= in->hdr[ISCSI_RAW_HEADER_SIZE+0];
-		crc_rcvd |= in->hdr[ISCSI_RAW_HEADER_SIZE+1] << 8;
-		crc_rcvd |= in->hdr[ISCSI_RAW_HEADER_SIZE+2] << 16;
-		crc_rcvd |= in->hdr[ISCSI_RAW_HEADER_SIZE+3] << 24;
-		if (crc != crc_rcvd) {
-			iscsi_set_error(iscsi, "header checksum verification failed: calculated 0x%" PRIx32 " received 0x%" PRIx32, crc, crc_rcvd);
-			return -1;
-		}
+	if (iscsi_verify_header_digest(iscsi, in) != 0) {
+		return -1;
 	}
 
 	if (ahslen != 0) {
@@ -481,11 +695,11 @@ iscsi_process_pdu(struct iscsi_context *iscsi, struct iscsi_in_pdu *in)
 			return 0;
 		case 0x2:
 			ISCSI_LOG(iscsi, 2, "target will drop this connection. Time2Wait is %u seconds", param2);
-			iscsi->next_reconnect = time(NULL) + param2;
+			iscsi->next_reconnect = iscsi_monotonic_ms() + param2 * 1000;
 			return 0;
 		case 0x3:
 			ISCSI_LOG(iscsi, 2, "target will drop all connections of this session. Time2Wait is %u seconds", param2);
-			iscsi->next_reconnect = time(NULL) + param2;
+			iscsi->next_reconnect = iscsi_monotonic_ms() + param2 * 1000;
 			return 0;
 		case 0x4:
 			ISCSI_LOG(iscsi, 2, "target requests parameter renogitiation.");
@@ -508,124 +722,142 @@ iscsi_process_pdu(struct iscsi_context *iscsi, struct iscsi_in_pdu *in)
 		return 0;
 	}
 
-	for (pdu = iscsi->waitpdu; pdu; pdu = pdu->next) {
-		enum iscsi_opcode expected_response = pdu->response_opcode;
-		int is_finished = 1;
+	pdu = iscsi_waitpdu_find(iscsi, itt);
+	if (pdu == NULL) {
+		return 0;
+	}
 
-		if (pdu->itt != itt) {
-			continue;
-		}
+	/* The target may answer before the transmit thread is done with
+	 * the pdu. An R2T only leads to more DATA-OUT, those are queued
+	 * behind it.
+	 */
+	if (iscsi->tx != NULL && opcode != ISCSI_PDU_R2T) {
+		iscsi_tx_wait(iscsi, pdu);
+	}
 
-		/* we have a special case with scsi-command opcodes,
-		 * they are replied to by either a scsi-response
-		 * or a data-in, or a combination of both.
-		 */
-		if (opcode == ISCSI_PDU_DATA_IN
-		    && expected_response == ISCSI_PDU_SCSI_RESPONSE) {
-			expected_response = ISCSI_PDU_DATA_IN;
-		}
+	expected_response = pdu->response_opcode;
 
-		/* Another special case is if we get a R2T.
-		 * In this case we should find the original request and just send an additional
-		 * DATAOUT segment for this task.
-		 */
-		if (opcode == ISCSI_PDU_R2T) {
-			expected_response = ISCSI_PDU_R2T;
+	/* we have a special case with scsi-command opcodes,
+	 * they are replied to by either a scsi-response
+	 * or a data-in, or a combination of both.
+	 */
+	if (opcode == ISCSI_PDU_DATA_IN
+	    && expected_response == ISCSI_PDU_SCSI_RESPONSE) {
+		expected_response = ISCSI_PDU_DATA_IN;
+	}
+
+	/* Another special case is if we get a R2T.
+	 * In this case we should find the original request and just send an additional
+	 * DATAOUT segment for this task.
+	 */
+	if (opcode == ISCSI_PDU_R2T) {
+		expected_response = ISCSI_PDU_R2T;
+	}
+
+	if (opcode != expected_response) {
+		iscsi_set_error(iscsi, "Got wrong opcode back for "
+				"itt:%d  got:%d expected %d",
+				itt, opcode, pdu->response_opcode);
+		return -1;
+	}
+
+	/* Data-In and R2Ts that went missing are asked for again, the
+	 * status of the command has to wait for them.
+	 */
+	if (opcode == ISCSI_PDU_DATA_IN || opcode == ISCSI_PDU_R2T) {
+		ret = iscsi_snack_check_sn(iscsi, pdu, in);
+		if (ret != 0) {
+			return ret < 0 ? -1 : 0;
+		}
+	}
+	if (opcode == ISCSI_PDU_SCSI_RESPONSE) {
+		ret = iscsi_snack_hold_status(iscsi, pdu, in);
+		if (ret != 0) {
+			return ret < 0 ? -1 : 0;
 		}
+	}
 
-		if (opcode != expected_response) {
-			iscsi_set_error(iscsi, "Got wrong opcode back for "
-					"itt:%d  got:%d expected %d",
-					itt, opcode, pdu->response_opcode);
+	switch (opcode) {
+	case ISCSI_PDU_LOGIN_RESPONSE:
+		if (iscsi_process_login_reply(iscsi, pdu, in) != 0) {
+			iscsi_waitpdu_remove(iscsi, pdu);
+			iscsi->drv->free_pdu(iscsi, pdu);
+			iscsi_set_error(iscsi, "iscsi login reply "
+					"failed");
 			return -1;
 		}
-		switch (opcode) {
-		case ISCSI_PDU_LOGIN_RESPONSE:
-			if (iscsi_process_login_reply(iscsi, pdu, in) != 0) {
-				ISCSI_LIST_REMOVE(&iscsi->waitpdu, pdu);
-				iscsi->drv->free_pdu(iscsi, pdu);
-				iscsi_set_error(iscsi, "iscsi login reply "
-						"failed");
-				return -1;
-			}
-			break;
-		case ISCSI_PDU_TEXT_RESPONSE:
-			if (iscsi_process_text_reply(iscsi, pdu, in) != 0) {
-				ISCSI_LIST_REMOVE(&iscsi->waitpdu, pdu);
-				iscsi->drv->free_pdu(iscsi, pdu);
-				iscsi_set_error(iscsi, "iscsi text reply "
-						"failed");
-				return -1;
-			}
-			break;
-		case ISCSI_PDU_LOGOUT_RESPONSE:
-			if (iscsi_process_logout_reply(iscsi, pdu, in) != 0) {
-				ISCSI_LIST_REMOVE(&iscsi->waitpdu, pdu);
-				iscsi->drv->free_pdu(iscsi, pdu);
-				iscsi_set_error(iscsi, "iscsi logout reply "
-						"failed");
-				return -1;
-			}
-			break;
-		case ISCSI_PDU_SCSI_RESPONSE:
-			if (iscsi_process_scsi_reply(iscsi, pdu, in) != 0) {
-				ISCSI_LIST_REMOVE(&iscsi->waitpdu, pdu);
-				iscsi->drv->free_pdu(iscsi, pdu);
-				iscsi_set_error(iscsi, "iscsi response reply "
-						"failed");
-				return -1;
-			}
-			break;
-		case ISCSI_PDU_DATA_IN:
-			if (iscsi_process_scsi_data_in(iscsi, pdu, in,
-						       &is_finished) != 0) {
-				ISCSI_LIST_REMOVE(&iscsi->waitpdu, pdu);
-				iscsi->drv->free_pdu(iscsi, pdu);
-				iscsi_set_error(iscsi, "iscsi data in "
-						"failed");
-				return -1;
-			}
-			break;
-		case ISCSI_PDU_NOP_IN:
-			if (iscsi_process_nop_out_reply(iscsi, pdu, in) != 0) {
-				ISCSI_LIST_REMOVE(&iscsi->waitpdu, pdu);
-				iscsi->drv->free_pdu(iscsi, pdu);
-				iscsi_set_error(iscsi, "iscsi nop-in failed");
-				return -1;
-			}
-			break;
-		case ISCSI_PDU_SCSI_TASK_MANAGEMENT_RESPONSE:
-			if (iscsi_process_task_mgmt_reply(iscsi, pdu,
-							  in) != 0) {
-				ISCSI_LIST_REMOVE(&iscsi->waitpdu, pdu);
-				iscsi->drv->free_pdu(iscsi, pdu);
-				iscsi_set_error(iscsi, "iscsi task-mgmt failed");
-				return -1;
-			}
-			break;
-		case ISCSI_PDU_R2T:
-			if (iscsi_process_r2t(iscsi, pdu, in) != 0) {
-				ISCSI_LIST_REMOVE(&iscsi->waitpdu, pdu);
-				iscsi->drv->free_pdu(iscsi, pdu);
-				iscsi_set_error(iscsi, "iscsi r2t "
-						"failed");
-				return -1;
-			}
-			is_finished = 0;
-			break;
-		default:
-			iscsi_set_error(iscsi, "Don't know how to handle "
-					"opcode 0x%02x", opcode);
+		break;
+	case ISCSI_PDU_TEXT_RESPONSE:
+		if (iscsi_process_text_reply(iscsi, pdu, in) != 0) {
+			iscsi_waitpdu_remove(iscsi, pdu);
+			iscsi->drv->free_pdu(iscsi, pdu);
+			iscsi_set_error(iscsi, "iscsi text reply "
+					"failed");
 			return -1;
 		}
-
-		if (is_finished && iscsi->waitpdu != NULL) {
-			ISCSI_LIST_REMOVE(&iscsi->waitpdu, pdu);
+		break;
+	case ISCSI_PDU_LOGOUT_RESPONSE:
+		if (iscsi_process_logout_reply(iscsi, pdu, in) != 0) {
+			iscsi_waitpdu_remove(iscsi, pdu);
+			iscsi->drv->free_pdu(iscsi, pdu);
+			iscsi_set_error(iscsi, "iscsi logout reply "
+					"failed");
+			return -1;
+		}
+		break;
+	case ISCSI_PDU_SCSI_RESPONSE:
+		if (iscsi_process_scsi_reply(iscsi, pdu, in) != 0) {
+			iscsi_waitpdu_remove(iscsi, pdu);
 			iscsi->drv->free_pdu(iscsi, pdu);
+			iscsi_set_error(iscsi, "iscsi response reply "
+					"failed");
+			return -1;
 		}
-		return 0;
+		break;
+	case ISCSI_PDU_DATA_IN:
+		if (iscsi_process_scsi_data_in(iscsi, pdu, in,
+					       &is_finished) != 0) {
+			iscsi_waitpdu_remove(iscsi, pdu);
+			iscsi->drv->free_pdu(iscsi, pdu);
+			iscsi_set_error(iscsi, "iscsi data in "
+					"failed");
+			return -1;
+		}
+		break;
+	case ISCSI_PDU_NOP_IN:
+		if (iscsi_process_nop_out_reply(iscsi, pdu, in) != 0) {
+			iscsi_waitpdu_remove(iscsi, pdu);
+			iscsi->drv->free_pdu(iscsi, pdu);
+			iscsi_set_error(iscsi, "iscsi nop-in failed");
+			return -1;
+		}
+		break;
+	case ISCSI_PDU_SCSI_TASK_MANAGEMENT_RESPONSE:
+		if (iscsi_process_task_mgmt_reply(iscsi, pdu,
+						  in) != 0) {
+			iscsi_waitpdu_remove(iscsi, pdu);
+			iscsi->drv->free_pdu(iscsi, pdu);
+			iscsi_set_error(iscsi, "iscsi task-mgmt failed");
+			return -1;
+		}
+		break;
+	case ISCSI_PDU_R2T:
+		if (iscsi_process_r2t(iscsi, pdu, in) != 0) {
+			/* the command is left for the reconnect */
+			return -1;
+		}
+		is_finished = 0;
+		break;
+	default:
+		iscsi_set_error(iscsi, "Don't know how to handle "
+				"opcode 0x%02x", opcode);
+		return -1;
 	}
 
+	if (is_finished && iscsi->waitpdu != NULL) {
+		iscsi_waitpdu_remove(iscsi, pdu);
+		iscsi->drv->free_pdu(iscsi, pdu);
+	}
 	return 0;
 }
 
@@ -710,62 +942,79 @@ iscsi_pdu_set_expxferlen(struct iscsi_pdu *pdu, uint32_t expxferlen)
 	scsi_set_uint32(&pdu->outdata.data[20], expxferlen);
 }
 
-void
-iscsi_timeout_scan(struct iscsi_context *iscsi)
+static void
+iscsi_pdu_timeout(struct iscsi_context *iscsi, void *private_data)
 {
-	struct iscsi_pdu *pdu;
-	struct iscsi_pdu *next_pdu;
-	time_t t = time(NULL);
-	uint32_t cmdsn_gap = 0;
-
-	for (pdu = iscsi->outqueue; pdu; pdu = next_pdu) {
-		next_pdu = pdu->next;
-
-                if (cmdsn_gap > 0) {
-			iscsi_pdu_set_cmdsn(pdu, pdu->cmdsn - cmdsn_gap);
-                }
-		if (pdu->scsi_timeout == 0) {
-			/* no timeout for this pdu */
-			continue;
-		}
-		if (t < pdu->scsi_timeout) {
-			/* not expired yet */
-			continue;
+	struct iscsi_pdu *pdu = private_data;
+	struct iscsi_pdu *tmp;
+
+	if (pdu == iscsi->outqueue_current || iscsi_tx_busy(iscsi, pdu)) {
+		/* partially written, we can not pull it out from under
+		 * the socket writer. Check again a bit later.
+		 */
+		iscsi_timer_add(iscsi, &pdu->timer, iscsi_monotonic_ms() + 1000,
+				iscsi_pdu_timeout, pdu);
+		return;
+	}
+
+	if (pdu->flags & ISCSI_PDU_IN_OUTQUEUE &&
+	    iscsi_session(iscsi)->connections != NULL &&
+	    !(pdu->outdata.data[0] & ISCSI_PDU_IMMEDIATE) &&
+	    !iscsi_pdu_follows_command(pdu)) {
+		iscsi_command_cb callback = pdu->callback;
+		void *cb_data = pdu->private_data;
+
+		/* later CmdSNs may already be in flight on other
+		 * connections, send a NOP-Out in its place.
+		 */
+		iscsi_mcs_release_cmdsn(iscsi, pdu);
+		iscsi_set_error(iscsi, "command timed out");
+		if (callback) {
+			callback(iscsi, SCSI_STATUS_TIMEOUT, NULL, cb_data);
 		}
+		return;
+	}
+
+	if (pdu->flags & ISCSI_PDU_IN_OUTQUEUE) {
+		/* close the CmdSN gap left behind by a command that
+		 * never made it to the wire.
+		 */
 		if (!(pdu->outdata.data[0] & ISCSI_PDU_IMMEDIATE) &&
-		    (pdu->outdata.data[0] & 0x3f) != ISCSI_PDU_DATA_OUT) {
+		    !iscsi_pdu_follows_command(pdu)) {
 			iscsi->cmdsn--;
-			cmdsn_gap++;
-		}
-		ISCSI_LIST_REMOVE(&iscsi->outqueue, pdu);
-		iscsi_set_error(iscsi, "command timed out");
-		iscsi_dump_pdu_header(iscsi, pdu->outdata.data);
-		if (pdu->callback) {
-			pdu->callback(iscsi, SCSI_STATUS_TIMEOUT,
-			              NULL, pdu->private_data);
+			for (tmp = pdu->next; tmp; tmp = tmp->next) {
+				iscsi_pdu_set_cmdsn(tmp, tmp->cmdsn - 1);
+			}
 		}
-		iscsi->drv->free_pdu(iscsi, pdu);
+		iscsi_remove_from_outqueue(iscsi, pdu);
+	} else if (!iscsi_waitpdu_remove(iscsi, pdu)) {
+		/* already sent and not waiting for a reply */
+		return;
 	}
-	for (pdu = iscsi->waitpdu; pdu; pdu = next_pdu) {
-		next_pdu = pdu->next;
 
-		if (pdu->scsi_timeout == 0) {
-			/* no timeout for this pdu */
-			continue;
-		}
-		if (t < pdu->scsi_timeout) {
-			/* not expired yet */
-			continue;
-		}
-		ISCSI_LIST_REMOVE(&iscsi->waitpdu, pdu);
-		iscsi_set_error(iscsi, "command timed out");
-		iscsi_dump_pdu_header(iscsi, pdu->outdata.data);
-		if (pdu->callback) {
-			pdu->callback(iscsi, SCSI_STATUS_TIMEOUT,
-			              NULL, pdu->private_data);
-		}
-		iscsi->drv->free_pdu(iscsi, pdu);
+	iscsi_set_error(iscsi, "command timed out");
+	iscsi_dump_pdu_header(iscsi, pdu->outdata.data);
+	if (pdu->callback) {
+		pdu->callback(iscsi, SCSI_STATUS_TIMEOUT,
+		              NULL, pdu->private_data);
+	}
+	iscsi->drv->free_pdu(iscsi, pdu);
+}
+
+void
+iscsi_pdu_arm_timeout(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
+{
+	if (pdu->scsi_timeout == 0) {
+		return;
 	}
+	iscsi_timer_add(iscsi, &pdu->timer, pdu->scsi_timeout,
+			iscsi_pdu_timeout, pdu);
+}
+
+void
+iscsi_timeout_scan(struct iscsi_context *iscsi)
+{
+	iscsi_timer_run(iscsi, iscsi_monotonic_ms());
 }
 
 int
@@ -779,26 +1028,53 @@ iscsi_queue_pdu(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
 void
 iscsi_cancel_pdus(struct iscsi_context *iscsi)
 {
-	struct iscsi_pdu *pdu;
-
-	while ((pdu = iscsi->outqueue)) {
-		ISCSI_LIST_REMOVE(&iscsi->outqueue, pdu);
+	struct iscsi_pdu *pdu, *next;
+	int full_duplex = iscsi->tx != NULL;
+
+	/* the transmit thread drops what it has not written yet and
+	 * starts over once everything is cancelled
+	 */
+	iscsi_tx_stop(iscsi);
+
+	for (pdu = iscsi->outqueue; pdu; pdu = next) {
+		next = pdu->next;
+		if (iscsi_session(iscsi)->connections != NULL &&
+		    pdu != iscsi->outqueue_current &&
+		    !(pdu->outdata.data[0] & ISCSI_PDU_IMMEDIATE) &&
+		    !iscsi_pdu_follows_command(pdu)) {
+			iscsi_command_cb callback = pdu->callback;
+			void *private_data = pdu->private_data;
+
+			/* keep the CmdSN sequence of the session intact */
+			iscsi_mcs_release_cmdsn(iscsi, pdu);
+			if (callback) {
+				callback(iscsi, SCSI_STATUS_CANCELLED,
+					 NULL, private_data);
+			}
+			continue;
+		}
+		iscsi_remove_from_outqueue(iscsi, pdu);
 		if (pdu->callback) {
 			pdu->callback(iscsi, SCSI_STATUS_CANCELLED,
 			              NULL, pdu->private_data);
 		}
 		if (!(pdu->outdata.data[0] & ISCSI_PDU_IMMEDIATE) &&
-		    (pdu->outdata.data[0] & 0x3f) != ISCSI_PDU_DATA_OUT) {
+		    !iscsi_pdu_follows_command(pdu) &&
+		    iscsi_session(iscsi)->connections == NULL) {
 			iscsi->cmdsn--;
 		}
 		iscsi->drv->free_pdu(iscsi, pdu);
 	}
 	while ((pdu = iscsi->waitpdu)) {
-		ISCSI_LIST_REMOVE(&iscsi->waitpdu, pdu);
+		iscsi_waitpdu_remove(iscsi, pdu);
 		if (pdu->callback) {
 			pdu->callback(iscsi, SCSI_STATUS_CANCELLED,
 			              NULL, pdu->private_data);
 		}
 		iscsi->drv->free_pdu(iscsi, pdu);
 	}
+
+	if (full_duplex && iscsi->is_loggedin) {
+		iscsi_tx_start(iscsi);
+	}
 }
@@ -58,6 +58,8 @@
 #include "scsi-lowlevel.h"
 
 void scsi_task_set_iov_out(struct scsi_task *task, struct scsi_iovec *iov, int niov);
+void scsi_task_set_read16_cdb(struct scsi_task *task, uint64_t lba, uint32_t xferlen, int blocksize, int rdprotect, int dpo, int fua, int fua_nv, int group_number);
+void scsi_task_set_write16_cdb(struct scsi_task *task, uint64_t lba, uint32_t xferlen, int blocksize, int wrprotect, int dpo, int fua, int fua_nv, int group_number);
 
 struct scsi_allocated_memory {
 	struct scsi_allocated_memory *next;
@@ -78,9 +80,34 @@ scsi_free_scsi_task(struct scsi_task *task)
 	}
 
 	free(task->datain.data);
+	if (task->caller_owned) {
+		task->datain.data = NULL;
+		task->arena_used = 0;
+		return;
+	}
 	free(task);
 }
 
+void
+scsi_task_init(struct scsi_task *task)
+{
+	memset(task, 0, sizeof(struct scsi_task));
+	task->caller_owned = 1;
+}
+
+void
+scsi_task_rearm(struct scsi_task *task)
+{
+	void *ptr = task->ptr;
+
+	scsi_free_scsi_task(task);
+
+	/* the arena is only used from the start, no need to clear it */
+	memset(task, 0, offsetof(struct scsi_task, arena));
+	task->caller_owned = 1;
+	task->ptr = ptr;
+}
+
 struct scsi_task *
 scsi_create_task(int cdb_size, unsigned char *cdb, int xfer_dir, int expxferlen)
 {
@@ -106,6 +133,15 @@ void *
 scsi_malloc(struct scsi_task *task, size_t size)
 {
 	struct scsi_allocated_memory *mem;
+	size_t aligned = (size + 15) & ~(size_t)15;
+
+	if (aligned <= sizeof(task->arena) - task->arena_used) {
+		void *ptr = (char *)task->arena + task->arena_used;
+
+		task->arena_used += aligned;
+		memset(ptr, 0, size);
+		return ptr;
+	}
 
 	mem = malloc(sizeof(struct scsi_allocated_memory) + size);
 	if (mem == NULL) {
@@ -1834,17 +1870,9 @@ scsi_cdb_read12(uint32_t lba, uint32_t xferlen, int blocksize, int rdprotect, in
 /*
  * READ16
  */
-struct scsi_task *
-scsi_cdb_read16(uint64_t lba, uint32_t xferlen, int blocksize, int rdprotect, int dpo, int fua, int fua_nv, int group_number)
+void
+scsi_task_set_read16_cdb(struct scsi_task *task, uint64_t lba, uint32_t xferlen, int blocksize, int rdprotect, int dpo, int fua, int fua_nv, int group_number)
 {
-	struct scsi_task *task;
-
-	task = malloc(sizeof(struct scsi_task));
-	if (task == NULL) {
-		return NULL;
-	}
-
-	memset(task, 0, sizeof(struct scsi_task));
 	task->cdb[0]   = SCSI_OPCODE_READ16;
 
 	task->cdb[1] |= ((rdprotect & 0x07) << 5);
@@ -1871,6 +1899,21 @@ scsi_cdb_read16(uint64_t lba, uint32_t xferlen, int blocksize, int rdprotect, in
 		task->xfer_dir = SCSI_XFER_NONE;
 	}
 	task->expxferlen = xferlen;
+}
+
+struct scsi_task *
+scsi_cdb_read16(uint64_t lba, uint32_t xferlen, int blocksize, int rdprotect, int dpo, int fua, int fua_nv, int group_number)
+{
+	struct scsi_task *task;
+
+	task = malloc(sizeof(struct scsi_task));
+	if (task == NULL) {
+		return NULL;
+	}
+
+	memset(task, 0, sizeof(struct scsi_task));
+	scsi_task_set_read16_cdb(task, lba, xferlen, blocksize, rdprotect,
+				 dpo, fua, fua_nv, group_number);
 
 	return task;
 }
@@ -1964,17 +2007,9 @@ scsi_cdb_write12(uint32_t lba, uint32_t xferlen, int blocksize, int wrprotect, i
 /*
  * WRITE16
  */
-struct scsi_task *
-scsi_cdb_write16(uint64_t lba, uint32_t xferlen, int blocksize, int wrprotect, int dpo, int fua, int fua_nv, int group_number)
+void
+scsi_task_set_write16_cdb(struct scsi_task *task, uint64_t lba, uint32_t xferlen, int blocksize, int wrprotect, int dpo, int fua, int fua_nv, int group_number)
 {
-	struct scsi_task *task;
-
-	task = malloc(sizeof(struct scsi_task));
-	if (task == NULL) {
-		return NULL;
-	}
-
-	memset(task, 0, sizeof(struct scsi_task));
 	task->cdb[0]   = SCSI_OPCODE_WRITE16;
 
 	task->cdb[1] |= ((wrprotect & 0x07) << 5);
@@ -2001,6 +2036,21 @@ scsi_cdb_write16(uint64_t lba, uint32_t xferlen, int blocksize, int wrprotect, i
 		task->xfer_dir = SCSI_XFER_NONE;
 	}
 	task->expxferlen = xferlen;
+}
+
+struct scsi_task *
+scsi_cdb_write16(uint64_t lba, uint32_t xferlen, int blocksize, int wrprotect, int dpo, int fua, int fua_nv, int group_number)
+{
+	struct scsi_task *task;
+
+	task = malloc(sizeof(struct scsi_task));
+	if (task == NULL) {
+		return NULL;
+	}
+
+	memset(task, 0, sizeof(struct scsi_task));
+	scsi_task_set_write16_cdb(task, lba, xferlen, blocksize, wrprotect,
+				  dpo, fua, fua_nv, group_number);
 
 	return task;
 }
@@ -0,0 +1,708 @@
+/*
+   Copyright (C) 2010 by Ronnie Sahlberg <ronniesahlberg@gmail.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "iscsi.h"
+#include "iscsi-private.h"
+#include "scsi-lowlevel.h"
+
+/*
+ * A session group is a set of independent sessions to the same target,
+ * each with its own ISID, that the application submits SCSI commands to
+ * as a whole. Every command goes to the least loaded session that is
+ * logged in. The group remembers which session each command went to, so
+ * that when a session drops and starts to reconnect its commands can be
+ * pulled back and sent again on one of the others.
+ */
+
+struct iscsi_group_task {
+	struct iscsi_group_task *prev;
+	struct iscsi_group_task *next;
+	struct iscsi_session_group *group;
+	int member;
+	int lun;
+	struct scsi_task *task;
+	iscsi_command_cb cb;
+	void *private_data;
+	int migrating;	/* cancelled to be sent on another session */
+	int cancelled;	/* cancelled by the application */
+};
+
+struct iscsi_group_member {
+	struct iscsi_context *iscsi;
+	struct iscsi_group_task *tasks;
+	uint32_t commands;
+	uint64_t bytes;
+	int connecting;
+};
+
+struct iscsi_session_group {
+	int count;
+	struct iscsi_group_member *members;
+	enum iscsi_session_group_policy policy;
+	int next_member;
+	int destroying;
+
+	/* completed tasks are kept for reuse */
+	struct iscsi_group_task *free_tasks;
+
+	iscsi_command_cb connect_cb;
+	void *connect_data;
+	int connect_pending;
+	int connect_failed;
+
+	char error_string[MAX_STRING_SIZE+1];
+};
+
+static void
+iscsi_session_group_set_error(struct iscsi_session_group *group,
+			      const char *error_string, ...)
+{
+	va_list ap;
+
+	va_start(ap, error_string);
+	if (vsnprintf(group->error_string, MAX_STRING_SIZE, error_string,
+		      ap) < 0) {
+		strncpy(group->error_string, "could not format error string!",
+			MAX_STRING_SIZE);
+	}
+	va_end(ap);
+}
+
+const char *
+iscsi_session_group_get_error(struct iscsi_session_group *group)
+{
+	return group ? group->error_string : "";
+}
+
+struct iscsi_session_group *
+iscsi_create_session_group(const char *initiator_name, int count)
+{
+	struct iscsi_session_group *group;
+	uint32_t rnd;
+	int i;
+
+	if (count < 1) {
+		return NULL;
+	}
+
+	group = malloc(sizeof(struct iscsi_session_group));
+	if (group == NULL) {
+		return NULL;
+	}
+	memset(group, 0, sizeof(struct iscsi_session_group));
+
+	group->members = malloc(count * sizeof(struct iscsi_group_member));
+	if (group->members == NULL) {
+		free(group);
+		return NULL;
+	}
+	memset(group->members, 0, count * sizeof(struct iscsi_group_member));
+	group->count = count;
+	group->policy = ISCSI_SESSION_GROUP_LEAST_COMMANDS;
+
+	for (i = 0; i < count; i++) {
+		group->members[i].iscsi = iscsi_create_context(initiator_name);
+		if (group->members[i].iscsi == NULL) {
+			iscsi_destroy_session_group(group);
+			return NULL;
+		}
+	}
+
+	/* The target tells sessions of the same initiator apart by the
+	 * ISID. Share one random part and number the sessions in the
+	 * qualifier so that no two of them can collide.
+	 */
+	rnd = rand();
+	for (i = 0; i < count; i++) {
+		iscsi_set_isid_random(group->members[i].iscsi, rnd, i);
+	}
+
+	return group;
+}
+
+void
+iscsi_destroy_session_group(struct iscsi_session_group *group)
+{
+	struct iscsi_group_task *gt;
+	int i;
+
+	if (group == NULL) {
+		return;
+	}
+
+	/* commands still in flight complete as cancelled */
+	group->destroying = 1;
+	for (i = 0; i < group->count; i++) {
+		if (group->members[i].iscsi != NULL) {
+			iscsi_destroy_context(group->members[i].iscsi);
+		}
+	}
+
+	while ((gt = group->free_tasks) != NULL) {
+		group->free_tasks = gt->next;
+		free(gt);
+	}
+	free(group->members);
+	free(group);
+}
+
+int
+iscsi_session_group_get_count(struct iscsi_session_group *group)
+{
+	return group->count;
+}
+
+struct iscsi_context *
+iscsi_session_group_get_context(struct iscsi_session_group *group, int idx)
+{
+	if (idx < 0 || idx >= group->count) {
+		return NULL;
+	}
+	return group->members[idx].iscsi;
+}
+
+int
+iscsi_session_group_set_policy(struct iscsi_session_group *group,
+			       enum iscsi_session_group_policy policy)
+{
+	switch (policy) {
+	case ISCSI_SESSION_GROUP_LEAST_COMMANDS:
+	case ISCSI_SESSION_GROUP_LEAST_BYTES:
+		group->policy = policy;
+		return 0;
+	}
+	iscsi_session_group_set_error(group, "Invalid session group policy %d",
+				      policy);
+	return -1;
+}
+
+/* logged in and not in the middle of a reconnect */
+static int
+iscsi_group_member_usable(struct iscsi_context *iscsi)
+{
+	return iscsi->is_loggedin && !iscsi->old_iscsi &&
+		!iscsi->pending_reconnect && !iscsi->reconnect_deferred;
+}
+
+/* reconnecting, commands are queued until it is logged in again */
+static int
+iscsi_group_member_reconnecting(struct iscsi_context *iscsi)
+{
+	return (iscsi->old_iscsi || iscsi->pending_reconnect) &&
+		!iscsi->reconnect_deferred;
+}
+
+/*
+ * The usable session with the least outstanding commands or bytes. If
+ * none is usable and reconnecting is set, the least loaded session that
+ * is reconnecting. -1 if there is none. The search starts at a different
+ * session every time so that sessions with equal load take turns.
+ */
+static int
+iscsi_group_pick(struct iscsi_session_group *group, int exclude,
+		 int reconnecting)
+{
+	struct iscsi_group_member *m;
+	uint64_t load, best_load = 0;
+	int i, idx, best = -1;
+
+	for (i = 0; i < group->count; i++) {
+		idx = (group->next_member + i) % group->count;
+		m = &group->members[idx];
+		if (idx == exclude || !iscsi_group_member_usable(m->iscsi)) {
+			continue;
+		}
+		load = group->policy == ISCSI_SESSION_GROUP_LEAST_BYTES ?
+			m->bytes : m->commands;
+		if (best < 0 || load < best_load) {
+			best = idx;
+			best_load = load;
+		}
+	}
+	group->next_member = (group->next_member + 1) % group->count;
+	if (best >= 0 || !reconnecting) {
+		return best;
+	}
+
+	for (idx = 0; idx < group->count; idx++) {
+		m = &group->members[idx];
+		if (idx == exclude ||
+		    !iscsi_group_member_reconnecting(m->iscsi)) {
+			continue;
+		}
+		if (best < 0 || m->commands < best_load) {
+			best = idx;
+			best_load = m->commands;
+		}
+	}
+	return best;
+}
+
+static void
+iscsi_group_link(struct iscsi_session_group *group,
+		 struct iscsi_group_task *gt, int idx)
+{
+	struct iscsi_group_member *m = &group->members[idx];
+
+	gt->member = idx;
+	gt->prev = NULL;
+	gt->next = m->tasks;
+	if (m->tasks) {
+		m->tasks->prev = gt;
+	}
+	m->tasks = gt;
+	m->commands++;
+	m->bytes += gt->task->expxferlen;
+}
+
+static void
+iscsi_group_unlink(struct iscsi_session_group *group,
+		   struct iscsi_group_task *gt)
+{
+	struct iscsi_group_member *m = &group->members[gt->member];
+
+	if (gt->prev) {
+		gt->prev->next = gt->next;
+	} else {
+		m->tasks = gt->next;
+	}
+	if (gt->next) {
+		gt->next->prev = gt->prev;
+	}
+	gt->prev = gt->next = NULL;
+	m->commands--;
+	m->bytes -= gt->task->expxferlen;
+}
+
+static void
+iscsi_group_free_task(struct iscsi_session_group *group,
+		      struct iscsi_group_task *gt)
+{
+	gt->next = group->free_tasks;
+	group->free_tasks = gt;
+}
+
+static void
+iscsi_group_task_cb(struct iscsi_context *iscsi, int status,
+		    void *command_data, void *private_data);
+
+static int
+iscsi_group_submit(struct iscsi_session_group *group,
+		   struct iscsi_group_task *gt, int idx, struct iscsi_data *d)
+{
+	struct iscsi_context *iscsi = group->members[idx].iscsi;
+
+	/* start over if the task has been on another session before */
+	scsi_task_reset_iov(&gt->task->iovector_in);
+	scsi_task_reset_iov(&gt->task->iovector_out);
+
+	if (iscsi_scsi_command_async(iscsi, gt->lun, gt->task,
+				     iscsi_group_task_cb, d, gt) != 0) {
+		iscsi_session_group_set_error(group, "%s",
+					      iscsi_get_error(iscsi));
+		return -1;
+	}
+	iscsi_group_link(group, gt, idx);
+	return 0;
+}
+
+static void
+iscsi_group_task_cb(struct iscsi_context *iscsi, int status,
+		    void *command_data, void *private_data)
+{
+	struct iscsi_group_task *gt = private_data;
+	struct iscsi_session_group *group = gt->group;
+	struct iscsi_context *member;
+	iscsi_command_cb cb;
+	void *cb_data;
+	int idx;
+
+	member = group->members[gt->member].iscsi;
+	iscsi_group_unlink(group, gt);
+
+	/* The session was lost, or we pulled the command back from a
+	 * session that is reconnecting. Try it on another one.
+	 */
+	if (status == SCSI_STATUS_CANCELLED && !group->destroying &&
+	    !gt->cancelled &&
+	    (gt->migrating || !iscsi_group_member_usable(member))) {
+		idx = iscsi_group_pick(group, gt->member, 1);
+		if (idx >= 0) {
+			ISCSI_LOG(member, 2, "failing over task 0x%08x from "
+				  "session %d to session %d", gt->task->itt,
+				  gt->member, idx);
+			gt->migrating = 0;
+			if (iscsi_group_submit(group, gt, idx, NULL) == 0) {
+				return;
+			}
+		}
+	}
+
+	cb = gt->cb;
+	cb_data = gt->private_data;
+	iscsi_group_free_task(group, gt);
+	if (cb) {
+		cb(iscsi, status, command_data, cb_data);
+	}
+}
+
+/*
+ * Whether the target may have seen the command. Once it has, only the
+ * session itself can tell if it is still running: a reconnect reinstates
+ * the session and ends all its tasks, another session does not.
+ */
+static int
+iscsi_group_task_sent(struct iscsi_context *iscsi, struct scsi_task *task)
+{
+	struct iscsi_pdu *pdu;
+
+	for (; iscsi; iscsi = iscsi->old_iscsi) {
+		pdu = iscsi_waitpdu_find(iscsi, task->itt);
+		if (pdu != NULL && pdu->scsi_cbdata.task == task) {
+			return 1;
+		}
+		if (iscsi->outqueue_current != NULL &&
+		    iscsi->outqueue_current->scsi_cbdata.task == task) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Pull the commands off a session that is reconnecting so they can be
+ * sent on the others. Reads can always be sent again. Anything else
+ * that has been sent already stays, so that a write can not land on
+ * the medium after a later write sent on another session.
+ */
+static void
+iscsi_group_failover(struct iscsi_session_group *group, int idx)
+{
+	struct iscsi_group_member *m = &group->members[idx];
+	struct iscsi_group_task *gt, *next;
+
+	for (gt = m->tasks; gt; gt = next) {
+		next = gt->next;
+		if (iscsi_group_pick(group, idx, 0) < 0) {
+			return;
+		}
+		if (gt->migrating ||
+		    (gt->task->xfer_dir != SCSI_XFER_READ &&
+		     iscsi_group_task_sent(m->iscsi, gt->task))) {
+			continue;
+		}
+		gt->migrating = 1;
+		if (iscsi_scsi_cancel_task(m->iscsi, gt->task) != 0) {
+			gt->migrating = 0;
+		}
+	}
+}
+
+int
+iscsi_session_group_scsi_command_async(struct iscsi_session_group *group,
+				       int lun, struct scsi_task *task,
+				       iscsi_command_cb cb,
+				       struct iscsi_data *d,
+				       void *private_data)
+{
+	struct iscsi_group_task *gt;
+	int idx;
+
+	idx = iscsi_group_pick(group, -1, 1);
+	if (idx < 0) {
+		iscsi_session_group_set_error(group, "No session of the group "
+					      "is logged in or reconnecting");
+		return -1;
+	}
+
+	gt = group->free_tasks;
+	if (gt != NULL) {
+		group->free_tasks = gt->next;
+	} else {
+		gt = malloc(sizeof(struct iscsi_group_task));
+		if (gt == NULL) {
+			iscsi_session_group_set_error(group, "Out-of-memory: "
+				"Failed to allocate group task");
+			return -1;
+		}
+	}
+	memset(gt, 0, sizeof(struct iscsi_group_task));
+	gt->group        = group;
+	gt->lun          = lun;
+	gt->task         = task;
+	gt->cb           = cb;
+	gt->private_data = private_data;
+
+	if (iscsi_group_submit(group, gt, idx, d) != 0) {
+		iscsi_group_free_task(group, gt);
+		return -1;
+	}
+	return 0;
+}
+
+struct scsi_task *
+iscsi_session_group_read16_task(struct iscsi_session_group *group, int lun,
+				uint64_t lba, uint32_t datalen, int blocksize,
+				int rdprotect, int dpo, int fua, int fua_nv,
+				int group_number, iscsi_command_cb cb,
+				void *private_data)
+{
+	struct scsi_task *task;
+
+	if (datalen % blocksize != 0) {
+		iscsi_session_group_set_error(group, "Datalen:%d is not a "
+				"multiple of the blocksize:%d.",
+				datalen, blocksize);
+		return NULL;
+	}
+
+	task = scsi_cdb_read16(lba, datalen, blocksize, rdprotect,
+				dpo, fua, fua_nv, group_number);
+	if (task == NULL) {
+		iscsi_session_group_set_error(group, "Out-of-memory: Failed "
+				"to create read16 cdb.");
+		return NULL;
+	}
+	if (iscsi_session_group_scsi_command_async(group, lun, task, cb,
+						   NULL, private_data) != 0) {
+		scsi_free_scsi_task(task);
+		return NULL;
+	}
+
+	return task;
+}
+
+struct scsi_task *
+iscsi_session_group_write16_task(struct iscsi_session_group *group, int lun,
+				 uint64_t lba, unsigned char *data,
+				 uint32_t datalen, int blocksize,
+				 int wrprotect, int dpo, int fua, int fua_nv,
+				 int group_number, iscsi_command_cb cb,
+				 void *private_data)
+{
+	struct scsi_task *task;
+	struct iscsi_data d;
+
+	if (datalen % blocksize != 0) {
+		iscsi_session_group_set_error(group, "Datalen:%d is not a "
+				"multiple of the blocksize:%d.",
+				datalen, blocksize);
+		return NULL;
+	}
+
+	task = scsi_cdb_write16(lba, datalen, blocksize, wrprotect,
+				dpo, fua, fua_nv, group_number);
+	if (task == NULL) {
+		iscsi_session_group_set_error(group, "Out-of-memory: Failed "
+				"to create write16 cdb.");
+		return NULL;
+	}
+	d.data = data;
+	d.size = datalen;
+
+	if (iscsi_session_group_scsi_command_async(group, lun, task, cb,
+						   &d, private_data) != 0) {
+		scsi_free_scsi_task(task);
+		return NULL;
+	}
+
+	return task;
+}
+
+int
+iscsi_session_group_cancel_task(struct iscsi_session_group *group,
+				struct scsi_task *task)
+{
+	struct iscsi_group_task *gt;
+	int i;
+
+	for (i = 0; i < group->count; i++) {
+		for (gt = group->members[i].tasks; gt; gt = gt->next) {
+			if (gt->task != task) {
+				continue;
+			}
+			gt->cancelled = 1;
+			return iscsi_scsi_cancel_task(group->members[i].iscsi,
+						      task);
+		}
+	}
+	iscsi_session_group_set_error(group, "Task is not in flight");
+	return -1;
+}
+
+static void
+iscsi_group_connect_cb(struct iscsi_context *iscsi, int status,
+		       void *command_data, void *private_data)
+{
+	struct iscsi_session_group *group = private_data;
+	int i;
+
+	for (i = 0; i < group->count; i++) {
+		if (group->members[i].iscsi == iscsi) {
+			break;
+		}
+	}
+	if (i == group->count || !group->members[i].connecting) {
+		return;
+	}
+	group->members[i].connecting = 0;
+
+	if (status != SCSI_STATUS_GOOD) {
+		if (!group->connect_failed) {
+			iscsi_session_group_set_error(group, "Session %d "
+				"failed to log in: %s", i,
+				iscsi_get_error(iscsi));
+		}
+		group->connect_failed++;
+	}
+
+	if (--group->connect_pending == 0 && group->connect_cb) {
+		group->connect_cb(group->members[0].iscsi,
+				  group->connect_failed ? SCSI_STATUS_ERROR
+				  : SCSI_STATUS_GOOD,
+				  NULL, group->connect_data);
+	}
+}
+
+int
+iscsi_session_group_full_connect_async(struct iscsi_session_group *group,
+				       const char *url, iscsi_command_cb cb,
+				       void *private_data)
+{
+	struct iscsi_context *iscsi;
+	struct iscsi_url *iscsi_url;
+	int i;
+
+	if (group->connect_pending) {
+		iscsi_session_group_set_error(group, "Session group is "
+					      "already connecting");
+		return -1;
+	}
+
+	group->connect_cb      = cb;
+	group->connect_data    = private_data;
+	group->connect_failed  = 0;
+
+	for (i = 0; i < group->count; i++) {
+		iscsi = group->members[i].iscsi;
+
+		iscsi_url = iscsi_parse_full_url(iscsi, url);
+		if (iscsi_url == NULL) {
+			iscsi_session_group_set_error(group, "Failed to parse "
+				"URL: %s", iscsi_get_error(iscsi));
+			break;
+		}
+		iscsi_set_session_type(iscsi, ISCSI_SESSION_NORMAL);
+
+		group->members[i].connecting = 1;
+		group->connect_pending++;
+		if (iscsi_full_connect_async(iscsi, iscsi_url->portal,
+					     iscsi_url->lun,
+					     iscsi_group_connect_cb,
+					     group) != 0) {
+			iscsi_session_group_set_error(group, "Failed to start "
+				"connect for session %d: %s", i,
+				iscsi_get_error(iscsi));
+			group->members[i].connecting = 0;
+			group->connect_pending--;
+			iscsi_destroy_url(iscsi_url);
+			break;
+		}
+		iscsi_destroy_url(iscsi_url);
+	}
+
+	if (i < group->count) {
+		/* the sessions we did start will still report back, but
+		 * the caller is not told about them.
+		 */
+		group->connect_cb = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+int
+iscsi_session_group_get_fd(struct iscsi_session_group *group, int idx)
+{
+	return iscsi_get_fd(group->members[idx].iscsi);
+}
+
+int
+iscsi_session_group_which_events(struct iscsi_session_group *group, int idx)
+{
+	return iscsi_which_events(group->members[idx].iscsi);
+}
+
+int
+iscsi_session_group_service(struct iscsi_session_group *group, int idx,
+			    int revents)
+{
+	struct iscsi_group_member *m = &group->members[idx];
+	int i, ret;
+
+	ret = iscsi_service(m->iscsi, revents);
+	if (ret < 0 && m->connecting) {
+		/* make sure a connect that died with the socket is
+		 * reported as failed.
+		 */
+		iscsi_group_connect_cb(m->iscsi, SCSI_STATUS_ERROR, NULL,
+				       group);
+	}
+
+	if (m->tasks != NULL && !iscsi_group_member_usable(m->iscsi)) {
+		iscsi_group_failover(group, idx);
+	}
+
+	if (ret < 0) {
+		/* only fatal if there is no session left to use */
+		for (i = 0; i < group->count; i++) {
+			if (iscsi_group_member_usable(group->members[i].iscsi)) {
+				return 0;
+			}
+		}
+		iscsi_session_group_set_error(group, "%s",
+					      iscsi_get_error(m->iscsi));
+	}
+	return ret;
+}
+
+int
+iscsi_session_group_get_next_timeout_ms(struct iscsi_session_group *group)
+{
+	int i, t, timeout = -1;
+
+	for (i = 0; i < group->count; i++) {
+		t = iscsi_get_next_timeout_ms(group->members[i].iscsi);
+		if (t >= 0 && (timeout < 0 || t < timeout)) {
+			timeout = t;
+		}
+	}
+	return timeout;
+}
+
+int
+iscsi_session_group_queue_length(struct iscsi_session_group *group, int idx)
+{
+	return group->members[idx].commands;
+}
@@ -0,0 +1,269 @@
+/*
+   Copyright (C) 2010 by Ronnie Sahlberg <ronniesahlberg@gmail.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "iscsi.h"
+#include "iscsi-private.h"
+
+/*
+ * Per-context slab allocator for small objects: PDUs, in-PDUs and PDU
+ * data segments such as login and text keys.
+ *
+ * There is one free list per power of two size class. When a list runs
+ * empty a new chunk is carved into objects of that class, each chunk
+ * holding as many objects as the class already has, so a class doubles
+ * in size every time it runs dry and stops calling malloc() once the
+ * queue depth it has to serve is reached. Objects are never given back
+ * to the system before the context is destroyed.
+ *
+ * Every object is preceded by a small header recording its class, so
+ * iscsi_sfree() does not need to be told the size. Allocations that are
+ * too large for any class, or all allocations when caching is disabled,
+ * are malloc()ed individually with the same header.
+ */
+
+#define SLAB_HDR_SIZE		16
+#define SLAB_CHUNK_HDR_SIZE	16
+#define SLAB_MIN_OBJS		4
+#define SLAB_MAX_CHUNK		(128 * 1024)
+#define SLAB_LARGE		ISCSI_SLAB_CLASSES
+
+struct iscsi_slab_obj {
+	struct iscsi_slab_obj *next;	/* only valid on the free list */
+	uint32_t cls;
+	uint32_t size;			/* only valid for SLAB_LARGE */
+};
+
+struct iscsi_slab_chunk {
+	struct iscsi_slab_chunk *next;
+};
+
+#define SLAB_CLASS_SIZE(cls)	((size_t)1 << ((cls) + ISCSI_SLAB_MIN_SHIFT))
+#define SLAB_OBJ(ptr)		((struct iscsi_slab_obj *)(void *)	\
+				 ((char *)(ptr) - SLAB_HDR_SIZE))
+#define SLAB_PTR(obj)		((void *)((char *)(obj) + SLAB_HDR_SIZE))
+
+static int
+iscsi_slab_class(size_t size)
+{
+	int cls = 0;
+
+	while (cls < ISCSI_SLAB_CLASSES && SLAB_CLASS_SIZE(cls) < size) {
+		cls++;
+	}
+	return cls;
+}
+
+static int
+iscsi_slab_grow(struct iscsi_context *iscsi, int cls)
+{
+	struct iscsi_slab_class *c = &iscsi->slab.classes[cls];
+	size_t objsize = SLAB_HDR_SIZE + SLAB_CLASS_SIZE(cls);
+	struct iscsi_slab_chunk *chunk;
+	uint32_t i, count;
+	char *p;
+
+	count = c->total;
+	if (count < SLAB_MIN_OBJS) {
+		count = SLAB_MIN_OBJS;
+	}
+	if (count * objsize > SLAB_MAX_CHUNK) {
+		count = SLAB_MAX_CHUNK / objsize;
+	}
+
+	chunk = iscsi_malloc(iscsi, SLAB_CHUNK_HDR_SIZE + count * objsize);
+	if (chunk == NULL) {
+		return -1;
+	}
+	chunk->next = iscsi->slab.chunks;
+	iscsi->slab.chunks = chunk;
+
+	p = (char *)chunk + SLAB_CHUNK_HDR_SIZE;
+	for (i = 0; i < count; i++, p += objsize) {
+		struct iscsi_slab_obj *obj = (struct iscsi_slab_obj *)(void *)p;
+
+		obj->cls = cls;
+		obj->next = c->free;
+		c->free = obj;
+	}
+	c->total += count;
+	c->cached += count;
+
+	ISCSI_LOG(iscsi, 6, "slab class %u byte grown by %u to %u objects",
+		  (uint32_t)SLAB_CLASS_SIZE(cls), count, c->total);
+	return 0;
+}
+
+void *
+iscsi_smalloc(struct iscsi_context *iscsi, size_t size)
+{
+	struct iscsi_slab_class *c;
+	struct iscsi_slab_obj *obj;
+	int cls, hit = 1;
+
+	/* all connections of a session share the slab of the leading
+	 * connection so that PDUs can move between them.
+	 */
+	iscsi = iscsi_session(iscsi);
+	cls = iscsi->cache_allocations ? iscsi_slab_class(size) : SLAB_LARGE;
+	if (cls == SLAB_LARGE) {
+		c = &iscsi->slab.large;
+		obj = iscsi_malloc(iscsi, SLAB_HDR_SIZE + size);
+		if (obj == NULL) {
+			return NULL;
+		}
+		obj->cls = SLAB_LARGE;
+		obj->size = size;
+		c->allocs++;
+		c->in_use++;
+		return SLAB_PTR(obj);
+	}
+
+	c = &iscsi->slab.classes[cls];
+	if (c->free == NULL) {
+		if (iscsi_slab_grow(iscsi, cls) != 0) {
+			return NULL;
+		}
+		hit = 0;
+	}
+	obj = c->free;
+	c->free = obj->next;
+	c->cached--;
+	c->in_use++;
+	c->allocs++;
+	if (hit) {
+		c->hits++;
+		iscsi->smallocs++;
+	}
+	return SLAB_PTR(obj);
+}
+
+void *
+iscsi_szmalloc(struct iscsi_context *iscsi, size_t size)
+{
+	void *ptr = iscsi_smalloc(iscsi, size);
+	if (ptr) {
+		memset(ptr, 0, size);
+	}
+	return ptr;
+}
+
+void *
+iscsi_srealloc(struct iscsi_context *iscsi, void *ptr, size_t size)
+{
+	struct iscsi_slab_obj *obj;
+	size_t old_size;
+	void *new_ptr;
+
+	iscsi = iscsi_session(iscsi);
+	if (ptr == NULL) {
+		return iscsi_smalloc(iscsi, size);
+	}
+
+	obj = SLAB_OBJ(ptr);
+	old_size = obj->cls == SLAB_LARGE ? obj->size
+					  : SLAB_CLASS_SIZE(obj->cls);
+	if (size <= old_size) {
+		return ptr;
+	}
+
+	new_ptr = iscsi_smalloc(iscsi, size);
+	if (new_ptr == NULL) {
+		return NULL;
+	}
+	memcpy(new_ptr, ptr, old_size);
+	iscsi_sfree(iscsi, ptr);
+	return new_ptr;
+}
+
+void
+iscsi_sfree(struct iscsi_context *iscsi, void *ptr)
+{
+	struct iscsi_slab_obj *obj;
+	struct iscsi_slab_class *c;
+
+	if (ptr == NULL) {
+		return;
+	}
+
+	iscsi = iscsi_session(iscsi);
+	obj = SLAB_OBJ(ptr);
+	if (obj->cls == SLAB_LARGE) {
+		iscsi->slab.large.in_use--;
+		iscsi_free(iscsi, obj);
+		return;
+	}
+
+	c = &iscsi->slab.classes[obj->cls];
+	obj->next = c->free;
+	c->free = obj;
+	c->in_use--;
+	c->cached++;
+}
+
+uint32_t
+iscsi_slab_in_use(struct iscsi_context *iscsi)
+{
+	uint32_t in_use = iscsi->slab.large.in_use;
+	int i;
+
+	for (i = 0; i < ISCSI_SLAB_CLASSES; i++) {
+		in_use += iscsi->slab.classes[i].in_use;
+	}
+	return in_use;
+}
+
+void
+iscsi_slab_destroy(struct iscsi_context *iscsi)
+{
+	struct iscsi_slab_chunk *chunk;
+
+	while ((chunk = iscsi->slab.chunks) != NULL) {
+		iscsi->slab.chunks = chunk->next;
+		iscsi_free(iscsi, chunk);
+	}
+	memset(&iscsi->slab, 0, sizeof(iscsi->slab));
+}
+
+int
+iscsi_get_alloc_stats(struct iscsi_context *iscsi,
+		      struct iscsi_alloc_stats *stats, int max)
+{
+	const struct iscsi_slab_class *c;
+	int i;
+
+	for (i = 0; i <= ISCSI_SLAB_CLASSES && i < max; i++) {
+		if (i < ISCSI_SLAB_CLASSES) {
+			c = &iscsi->slab.classes[i];
+			stats[i].size = SLAB_CLASS_SIZE(i);
+		} else {
+			c = &iscsi->slab.large;
+			stats[i].size = 0;
+		}
+		stats[i].allocs = c->allocs;
+		stats[i].hits   = c->hits;
+		stats[i].in_use = c->in_use;
+		stats[i].cached = c->cached;
+		stats[i].total  = c->total;
+	}
+	return i;
+}
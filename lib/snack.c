@@ -0,0 +1,385 @@
+/*
+   Copyright (C) 2010 by Ronnie Sahlberg <ronniesahlberg@gmail.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "iscsi.h"
+#include "iscsi-private.h"
+#include "scsi-lowlevel.h"
+
+/*
+ * Within-command recovery, ErrorRecoveryLevel 1.
+ *
+ * Every Data-In and R2T carries a DataSN/R2TSN that counts up from 0 for
+ * each command. A number that is skipped, or a Data-In that fails its data
+ * digest, is asked for again with a Data/R2T SNACK on the same connection
+ * and the connection is kept. The status of the command, whether it comes
+ * in the last Data-In or in a SCSI Response, is held back until everything
+ * that went missing has arrived. With ErrorRecoveryLevel 0 a gap fails the
+ * connection and the command is sent again after the reconnect.
+ *
+ * A PDU whose header digest fails can not be recovered like this, there is
+ * no way to tell where the next PDU starts.
+ */
+
+#define ISCSI_SNACK_TYPE_DATA_R2T	0x00
+
+struct iscsi_snack {
+	uint32_t missing;		/* DataSNs asked for, not yet here */
+	uint32_t size;			/* DataSNs the bitmap can hold */
+	unsigned char *lost;		/* bit set for each of them */
+	struct iscsi_in_pdu *status;	/* held back until missing is 0 */
+};
+
+int
+iscsi_set_error_recovery_level(struct iscsi_context *iscsi, int level)
+{
+	if (iscsi->is_loggedin) {
+		iscsi_set_error(iscsi, "Already logged in when trying to set "
+				"the error recovery level");
+		return -1;
+	}
+	if (level < 0 || level > 2) {
+		iscsi_set_error(iscsi, "Invalid ErrorRecoveryLevel %d, must be "
+				"0, 1 or 2", level);
+		return -1;
+	}
+	iscsi->want_error_recovery_level = level;
+	return 0;
+}
+
+int
+iscsi_get_error_recovery_level(struct iscsi_context *iscsi)
+{
+	return iscsi->error_recovery_level;
+}
+
+void
+iscsi_snack_free(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
+{
+	struct iscsi_snack *snack = pdu->snack;
+
+	if (snack == NULL) {
+		return;
+	}
+	if (snack->status != NULL) {
+		iscsi_free_iscsi_in_pdu(iscsi, snack->status);
+	}
+	iscsi_free(iscsi, snack->lost);
+	iscsi_free(iscsi, snack);
+	pdu->snack = NULL;
+}
+
+static int
+iscsi_send_snack(struct iscsi_context *iscsi, struct iscsi_pdu *cmd_pdu,
+		 uint32_t begrun, uint32_t runlength)
+{
+	struct iscsi_pdu *pdu;
+
+	pdu = iscsi_allocate_pdu(iscsi, ISCSI_PDU_SNACK_REQUEST,
+				 ISCSI_PDU_NO_PDU, cmd_pdu->itt,
+				 ISCSI_PDU_DROP_ON_RECONNECT|ISCSI_PDU_DELETE_WHEN_SENT);
+	if (pdu == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: Failed to allocate "
+				"snack pdu.");
+		return -1;
+	}
+	/* queued like a DATA-OUT of the command, see
+	 * iscsi_pdu_follows_command()
+	 */
+	pdu->cmdsn        = cmd_pdu->cmdsn;
+	pdu->scsi_timeout = cmd_pdu->scsi_timeout;
+
+	iscsi_pdu_set_pduflags(pdu, ISCSI_PDU_SCSI_FINAL | ISCSI_SNACK_TYPE_DATA_R2T);
+	iscsi_pdu_set_ttt(pdu, 0xffffffff);
+	scsi_set_uint32(&pdu->outdata.data[40], begrun);
+	scsi_set_uint32(&pdu->outdata.data[44], runlength);
+
+	if (iscsi_queue_pdu(iscsi, pdu) != 0) {
+		iscsi_set_error(iscsi, "Out-of-memory: failed to queue iscsi "
+				"snack pdu.");
+		iscsi->drv->free_pdu(iscsi, pdu);
+		return -1;
+	}
+	return 0;
+}
+
+/* Mark DataSNs [begrun, begrun + runlength) as lost and ask for them. */
+static int
+iscsi_snack_request(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
+		    uint32_t begrun, uint32_t runlength)
+{
+	struct iscsi_snack *snack = pdu->snack;
+	uint32_t sn, size = begrun + runlength;
+
+	/* every Data-In and R2T is for at least one byte */
+	if (size > pdu->expxferlen) {
+		iscsi_set_error(iscsi, "DataSN %u of itt 0x%08x is out of "
+				"range", size - 1, pdu->itt);
+		return -1;
+	}
+
+	if (snack == NULL) {
+		snack = iscsi_zmalloc(iscsi, sizeof(struct iscsi_snack));
+		if (snack == NULL) {
+			goto oom;
+		}
+		pdu->snack = snack;
+	}
+	if (size > snack->size) {
+		unsigned char *lost;
+
+		size = (size + 63) & ~63U;
+		lost = iscsi_zmalloc(iscsi, size / 8);
+		if (lost == NULL) {
+			goto oom;
+		}
+		if (snack->lost != NULL) {
+			memcpy(lost, snack->lost, snack->size / 8);
+			iscsi_free(iscsi, snack->lost);
+		}
+		snack->lost = lost;
+		snack->size = size;
+	}
+
+	for (sn = begrun; sn != begrun + runlength; sn++) {
+		if (!(snack->lost[sn / 8] & (1 << (sn % 8)))) {
+			snack->lost[sn / 8] |= 1 << (sn % 8);
+			snack->missing++;
+		}
+	}
+
+	ISCSI_LOG(iscsi, 2, "asking for DataSN %u-%u of itt 0x%08x again",
+		  begrun, begrun + runlength - 1, pdu->itt);
+	return iscsi_send_snack(iscsi, pdu, begrun, runlength);
+
+ oom:
+	iscsi_set_error(iscsi, "Out-of-memory: failed to track missing "
+			"Data-In.");
+	return -1;
+}
+
+/*
+ * The first DataSN that has not arrived yet. This is what a TASK REASSIGN
+ * acknowledges, the target sends everything from there on again.
+ */
+uint32_t
+iscsi_snack_first_missing(struct iscsi_pdu *pdu)
+{
+	struct iscsi_snack *snack = pdu->snack;
+	uint32_t sn;
+
+	if (snack == NULL || snack->missing == 0) {
+		return pdu->exp_datasn;
+	}
+	for (sn = 0; sn < pdu->exp_datasn && sn < snack->size; sn++) {
+		if (snack->lost[sn / 8] & (1 << (sn % 8))) {
+			return sn;
+		}
+	}
+	return pdu->exp_datasn;
+}
+
+/* Returns 1 if sn was asked for again and has now arrived. */
+static int
+iscsi_snack_arrived(struct iscsi_pdu *pdu, uint32_t sn)
+{
+	struct iscsi_snack *snack = pdu->snack;
+
+	if (snack == NULL || sn >= snack->size ||
+	    !(snack->lost[sn / 8] & (1 << (sn % 8)))) {
+		return 0;
+	}
+	snack->lost[sn / 8] &= ~(1 << (sn % 8));
+	snack->missing--;
+	return 1;
+}
+
+/*
+ * Check the DataSN of a Data-In or the R2TSN of an R2T. Returns 0 if the
+ * PDU is to be processed, 1 if it is a copy of one we already have and -1
+ * if the connection has to be dropped.
+ */
+int
+iscsi_snack_check_sn(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
+		     struct iscsi_in_pdu *in)
+{
+	enum iscsi_opcode opcode = in->hdr[0] & 0x3f;
+	uint32_t sn = scsi_get_uint32(&in->hdr[36]);
+	uint32_t exp = pdu->exp_datasn;
+
+	if (sn == exp) {
+		pdu->exp_datasn++;
+		return 0;
+	}
+	if (sn < exp) {
+		/* a PDU we asked for again. An R2T is always served, the
+		 * target may have sent it again on its own to recover
+		 * DATA-OUT it did not receive.
+		 */
+		if (iscsi_snack_arrived(pdu, sn) || opcode == ISCSI_PDU_R2T) {
+			return 0;
+		}
+		return 1;
+	}
+
+	if (iscsi->error_recovery_level < 1) {
+		iscsi_set_error(iscsi, "%s %u of itt 0x%08x is missing, got "
+				"%u", opcode == ISCSI_PDU_R2T ? "R2TSN" : "DataSN",
+				exp, pdu->itt, sn);
+		return -1;
+	}
+	pdu->exp_datasn = sn + 1;
+	if (iscsi_snack_request(iscsi, pdu, exp, sn - exp) != 0) {
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Hold back the status of a command while Data-In is still missing. For
+ * a SCSI Response, ExpDataSN tells how many Data-In the target has sent so
+ * Data-In missing at the end is asked for here. Returns 1 if the status is
+ * held, 0 if it can be processed and -1 if the connection has to be
+ * dropped.
+ */
+int
+iscsi_snack_hold_status(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
+			struct iscsi_in_pdu *in)
+{
+	struct iscsi_snack *snack;
+	struct iscsi_in_pdu *status;
+	uint32_t expdatasn;
+
+	if (iscsi->error_recovery_level < 1) {
+		return 0;
+	}
+
+	if ((in->hdr[0] & 0x3f) == ISCSI_PDU_SCSI_RESPONSE) {
+		expdatasn = scsi_get_uint32(&in->hdr[36]);
+		if (expdatasn > pdu->exp_datasn) {
+			uint32_t exp = pdu->exp_datasn;
+
+			pdu->exp_datasn = expdatasn;
+			if (iscsi_snack_request(iscsi, pdu, exp,
+						expdatasn - exp) != 0) {
+				return -1;
+			}
+		}
+	}
+
+	snack = pdu->snack;
+	if (snack == NULL || snack->missing == 0) {
+		return 0;
+	}
+	if (snack->status != NULL) {
+		/* a copy of the status we are already holding */
+		return 1;
+	}
+
+	status = iscsi_szmalloc(iscsi, sizeof(struct iscsi_in_pdu));
+	if (status == NULL) {
+		goto oom;
+	}
+	status->hdr = status->hdr_buf;
+	memcpy(status->hdr, in->hdr, ISCSI_RAW_HEADER_SIZE);
+	/* the data of a Data-In has already been stored, only the sense
+	 * data of a SCSI Response is needed again.
+	 */
+	if ((in->hdr[0] & 0x3f) == ISCSI_PDU_SCSI_RESPONSE &&
+	    in->data_pos > 0) {
+		status->data = iscsi_malloc(iscsi, in->data_pos);
+		if (status->data == NULL) {
+			iscsi_free_iscsi_in_pdu(iscsi, status);
+			goto oom;
+		}
+		memcpy(status->data, in->data, in->data_pos);
+		status->data_pos = in->data_pos;
+	}
+	snack->status = status;
+
+	ISCSI_LOG(iscsi, 2, "holding back the status of itt 0x%08x, %u "
+		  "Data-In still missing", pdu->itt, snack->missing);
+	return 1;
+
+ oom:
+	iscsi_set_error(iscsi, "Out-of-memory: failed to hold back status.");
+	return -1;
+}
+
+/*
+ * Once the last missing Data-In has arrived, hand back the status that was
+ * held back for the command. The caller frees it.
+ */
+struct iscsi_in_pdu *
+iscsi_snack_release_status(struct iscsi_pdu *pdu)
+{
+	struct iscsi_snack *snack = pdu->snack;
+	struct iscsi_in_pdu *status;
+
+	if (snack == NULL || snack->missing != 0) {
+		return NULL;
+	}
+	status = snack->status;
+	snack->status = NULL;
+	return status;
+}
+
+/*
+ * A Data-In failed its data digest. With ErrorRecoveryLevel 1 it is
+ * dropped and asked for again. Returns 0 if the connection can be kept.
+ */
+int
+iscsi_snack_data_digest_error(struct iscsi_context *iscsi,
+			      struct iscsi_in_pdu *in)
+{
+	struct iscsi_pdu *pdu;
+	uint32_t sn, exp;
+
+	if (iscsi->error_recovery_level < 1 ||
+	    (in->hdr[0] & 0x3f) != ISCSI_PDU_DATA_IN) {
+		return -1;
+	}
+	/* the header must be good for us to know what to ask for */
+	if (iscsi_verify_header_digest(iscsi, in) != 0) {
+		return -1;
+	}
+
+	pdu = iscsi_waitpdu_find(iscsi, scsi_get_uint32(&in->hdr[16]));
+	if (pdu == NULL) {
+		return 0;
+	}
+
+	sn  = scsi_get_uint32(&in->hdr[36]);
+	exp = pdu->exp_datasn;
+	ISCSI_LOG(iscsi, 2, "data digest error in DataSN %u of itt 0x%08x",
+		  sn, pdu->itt);
+	if (sn < exp) {
+		if (pdu->snack == NULL || sn >= pdu->snack->size ||
+		    !(pdu->snack->lost[sn / 8] & (1 << (sn % 8)))) {
+			/* a copy of one we already have */
+			return 0;
+		}
+		return iscsi_send_snack(iscsi, pdu, sn, 1);
+	}
+	pdu->exp_datasn = sn + 1;
+	return iscsi_snack_request(iscsi, pdu, exp, sn + 1 - exp);
+}
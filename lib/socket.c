@@ -62,18 +62,60 @@
 #include <sys/uio.h>
 #endif
 
+#ifdef HAVE_INTTYPES_H
+#include <inttypes.h>
+#else
+#define PRIx32 "x"
+#endif
+
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <time.h>
 #include "scsi-lowlevel.h"
 #include "iscsi.h"
 #include "iscsi-private.h"
 #include "slist.h"
 
+#if defined(HAVE_ATOMIC_BUILTINS) && defined(HAVE_PTHREAD_H) && \
+    defined(HAVE_PTHREAD_CREATE)
+#define ISCSI_HAVE_TX_THREAD
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#endif
+
+/* Limits on how much we gather into a single sendmsg() */
+#if defined(IOV_MAX) && IOV_MAX < 128
+#define ISCSI_TX_MAX_IOV	IOV_MAX
+#else
+#define ISCSI_TX_MAX_IOV	128
+#endif
+#define ISCSI_TX_MAX_BYTES	(256 * 1024)
+/* DATA-OUT segment headers we may generate ahead within one batch,
+ * every segment takes at least two iovecs
+ */
+#define ISCSI_TX_MAX_HDRS	(ISCSI_TX_MAX_IOV / 2)
+
+struct iscsi_tx_batch {
+	struct iovec iov[ISCSI_TX_MAX_IOV];
+	int niov;
+	/* one entry per pdu, or per DATA-OUT segment, in the batch */
+	struct iscsi_pdu *pdu[ISCSI_TX_MAX_IOV];
+	size_t len[ISCSI_TX_MAX_IOV];
+	int npdu;
+	size_t queued;
+	unsigned char hdr[ISCSI_TX_MAX_HDRS][ISCSI_RAW_HEADER_SIZE + ISCSI_DIGEST_SIZE];
+	unsigned char digest[ISCSI_TX_MAX_HDRS][ISCSI_DIGEST_SIZE];
+	int nhdr;
+};
+
+static char tx_padding_buf[3];
+
 static uint32_t iface_rr = 0;
 struct iscsi_transport;
 
@@ -85,60 +127,146 @@ union socket_address {
 	struct sockaddr sa;
 };
 
+/*
+ * The outqueue is a single doubly linked list made up of three FIFO
+ * segments, in the order they are sent:
+ *
+ *  1, immediate PDUs, ending at outqueue_last_imm.
+ *  2, DATA-OUT PDUs for commands that have already been sent, ending
+ *     at outqueue_last_dataout.
+ *  3, commands in CmdSN order, each followed by any unsolicited DATA-OUT
+ *     PDUs for it, ending at outqueue_tail.
+ *
+ * This gives the same order as inserting every PDU sorted by CmdSN but
+ * lets us enqueue in constant time since each new PDU goes at the end of
+ * its segment.
+ */
+static void
+iscsi_outqueue_insert_after(struct iscsi_context *iscsi,
+			    struct iscsi_pdu *after, struct iscsi_pdu *pdu)
+{
+	pdu->prev = after;
+	if (after != NULL) {
+		pdu->next = after->next;
+		after->next = pdu;
+	} else {
+		pdu->next = iscsi->outqueue;
+		iscsi->outqueue = pdu;
+	}
+	if (pdu->next != NULL) {
+		pdu->next->prev = pdu;
+	} else {
+		iscsi->outqueue_tail = pdu;
+	}
+	pdu->flags |= ISCSI_PDU_IN_OUTQUEUE;
+	iscsi->outqueue_count++;
+}
+
 void
 iscsi_add_to_outqueue(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
 {
-	struct iscsi_pdu *current = iscsi->outqueue;
-	struct iscsi_pdu *last = NULL;
+	struct iscsi_pdu *current, *last_dataout;
+	int is_dataout = iscsi_pdu_follows_command(pdu);
 
-	if (iscsi->scsi_timeout > 0) {
-		pdu->scsi_timeout = time(NULL) + iscsi->scsi_timeout;
-	} else {
-		pdu->scsi_timeout = 0;
-	}
+	iscsi_engine_touch(iscsi);
 
-	if (iscsi->outqueue == NULL) {
-		iscsi->outqueue = pdu;
-		pdu->next = NULL;
-		return;
+	/* DATA-OUT PDUs have already been given the deadline of their
+	 * command so there is no need to look at the clock again.
+	 */
+	if (!is_dataout) {
+		if (iscsi_session(iscsi)->scsi_timeout > 0) {
+			pdu->scsi_timeout = iscsi_monotonic_ms() +
+				iscsi_session(iscsi)->scsi_timeout;
+		} else {
+			pdu->scsi_timeout = 0;
+		}
 	}
-	
-	/* queue pdus in ascending order of CmdSN. 
-	 * ensure that pakets with the same CmdSN are kept in FIFO order.
-	 * immediate PDUs are queued in front of queue with the CmdSN
+	iscsi_pdu_arm_timeout(iscsi, pdu);
+
+	last_dataout = iscsi->outqueue_last_dataout ?
+		iscsi->outqueue_last_dataout : iscsi->outqueue_last_imm;
+
+	/* immediate PDUs are queued in front of queue with the CmdSN
 	 * of the first cmd pdu in the outqueue.
 	 */
-
 	if (pdu->outdata.data[0] & ISCSI_PDU_IMMEDIATE) {
-		do {
-			if ((current->outdata.data[0] & 0x3f) != ISCSI_PDU_DATA_OUT) {
-				iscsi_pdu_set_cmdsn(pdu, current->cmdsn);
-				break;
-			}
+		current = iscsi->outqueue_last_imm ? iscsi->outqueue :
+			(last_dataout ? last_dataout->next : iscsi->outqueue);
+		while (current != NULL &&
+		       iscsi_pdu_follows_command(current)) {
 			current = current->next;
-		} while (current != NULL);
+		}
+		if (current != NULL) {
+			iscsi_pdu_set_cmdsn(pdu, current->cmdsn);
+		}
+		iscsi_outqueue_insert_after(iscsi, iscsi->outqueue_last_imm, pdu);
+		iscsi->outqueue_last_imm = pdu;
+		return;
+	}
 
-		current = iscsi->outqueue;
+	/* the last pdu in the command segment, if there is one */
+	current = iscsi->outqueue_tail;
+	if (current == last_dataout) {
+		current = NULL;
 	}
 
-	do {
-		if (iscsi_serial32_compare(pdu->cmdsn, current->cmdsn) < 0 ||
-			(pdu->outdata.data[0] & ISCSI_PDU_IMMEDIATE && !(current->outdata.data[0] & ISCSI_PDU_IMMEDIATE))) {
-			/* insert PDU before the current */
-			if (last != NULL) {
-				last->next=pdu;
-			} else {
-				iscsi->outqueue=pdu;
-			}
-			pdu->next = current;
+	if (is_dataout) {
+		if (current != NULL &&
+		    iscsi_serial32_compare(pdu->cmdsn, current->cmdsn) >= 0) {
+			/* unsolicited data for a command that is still queued,
+			 * keep it right behind the command.
+			 */
+			iscsi_outqueue_insert_after(iscsi, current, pdu);
 			return;
 		}
-		last=current;
-		current=current->next;
-	} while (current != NULL);
-	
-	last->next = pdu;
-	pdu->next = NULL;
+		iscsi_outqueue_insert_after(iscsi, last_dataout, pdu);
+		iscsi->outqueue_last_dataout = pdu;
+		return;
+	}
+
+	/* Commands are normally queued in ascending order of CmdSN. If not,
+	 * walk back to keep the command segment sorted, keeping pdus with
+	 * the same CmdSN in FIFO order.
+	 */
+	while (current != NULL &&
+	       iscsi_serial32_compare(pdu->cmdsn, current->cmdsn) < 0) {
+		current = current->prev;
+		if (current == last_dataout) {
+			current = NULL;
+		}
+	}
+	iscsi_outqueue_insert_after(iscsi, current ? current : last_dataout, pdu);
+}
+
+/* Remove pdu from the outqueue. Does nothing if it is not queued. */
+void
+iscsi_remove_from_outqueue(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
+{
+	if (!(pdu->flags & ISCSI_PDU_IN_OUTQUEUE)) {
+		return;
+	}
+	pdu->flags &= ~ISCSI_PDU_IN_OUTQUEUE;
+	iscsi->outqueue_count--;
+
+	if (iscsi->outqueue_last_dataout == pdu) {
+		iscsi->outqueue_last_dataout =
+			pdu->prev == iscsi->outqueue_last_imm ? NULL : pdu->prev;
+	}
+	if (iscsi->outqueue_last_imm == pdu) {
+		iscsi->outqueue_last_imm = pdu->prev;
+	}
+
+	if (pdu->prev != NULL) {
+		pdu->prev->next = pdu->next;
+	} else {
+		iscsi->outqueue = pdu->next;
+	}
+	if (pdu->next != NULL) {
+		pdu->next->prev = pdu->prev;
+	} else {
+		iscsi->outqueue_tail = pdu->prev;
+	}
+	pdu->next = pdu->prev = NULL;
 }
 
 void iscsi_decrement_iface_rr() {
@@ -241,6 +369,8 @@ static int iscsi_tcp_connect(struct iscsi_context *iscsi, union socket_address *
         // 使用同一个 fd
 		iscsi->fd = iscsi->old_iscsi->fd;
 	}
+	/* a registration for the old socket went away with it */
+	iscsi_engine_fd_replaced(iscsi, iscsi->fd);
 
     // 设置非阻塞
 	iscsi->tcp_nonblocking = !set_nonblocking(iscsi->fd);
@@ -433,12 +563,15 @@ iscsi_connect_async(struct iscsi_context *iscsi, const char *portal,
 static int
 iscsi_tcp_disconnect(struct iscsi_context *iscsi)
 {
+	iscsi_tx_stop(iscsi);
+
 	if (iscsi->fd == -1) {
 		iscsi_set_error(iscsi, "Trying to disconnect "
 				"but not connected");
 		return -1;
 	}
 
+	iscsi_engine_fd_closing(iscsi, iscsi->fd);
 	close(iscsi->fd);
 
 	if (!(iscsi->pending_reconnect && iscsi->old_iscsi) &&
@@ -450,6 +583,9 @@ iscsi_tcp_disconnect(struct iscsi_context *iscsi)
 	iscsi->is_connected = 0;
 	iscsi->is_corked = 0;
 
+	/* anything still buffered belongs to the old connection */
+	iscsi->rx_pos = iscsi->rx_len = 0;
+
 	return 0;
 }
 
@@ -484,15 +620,16 @@ iscsi_tcp_which_events(struct iscsi_context *iscsi)
 {
 	int events = iscsi->is_connected ? POLLIN : POLLOUT;
 
-	if (iscsi->pending_reconnect && iscsi->old_iscsi &&
+	if (iscsi->pending_reconnect &&
         // 没到下一次重新连接时间
-		time(NULL) < iscsi->next_reconnect) {
+		iscsi_monotonic_ms() < iscsi->next_reconnect) {
 		return 0;
 	}
 
 	if (iscsi->outqueue_current != NULL ||
 	    (iscsi->outqueue != NULL && !iscsi->is_corked &&
-	     (iscsi_serial32_compare(iscsi->outqueue->cmdsn, iscsi->maxcmdsn) <= 0 ||
+	     (iscsi_serial32_compare(iscsi->outqueue->cmdsn,
+				     iscsi_session(iscsi)->maxcmdsn) <= 0 ||
 	      iscsi->outqueue->outdata.data[0] & ISCSI_PDU_IMMEDIATE)
 	    )
 	   ) {
@@ -512,18 +649,16 @@ iscsi_which_events(struct iscsi_context *iscsi)
 int
 iscsi_queue_length(struct iscsi_context *iscsi)
 {
-	int i = 0;
-	struct iscsi_pdu *pdu;
+	struct iscsi_context *conn;
+	int i;
 
-	for (pdu = iscsi->outqueue; pdu; pdu = pdu->next) {
-		i++;
-	}
-	for (pdu = iscsi->waitpdu; pdu; pdu = pdu->next) {
-		i++;
-	}
+	i = iscsi->outqueue_count + iscsi->waitpdu_count;
 	if (iscsi->is_connected == 0) {
 		i++;
 	}
+	for (conn = iscsi->connections; conn; conn = conn->next_connection) {
+		i += conn->outqueue_count + conn->waitpdu_count;
+	}
 
 	return i;
 }
@@ -531,24 +666,29 @@ iscsi_queue_length(struct iscsi_context *iscsi)
 int
 iscsi_out_queue_length(struct iscsi_context *iscsi)
 {
-	int i = 0;
-	struct iscsi_pdu *pdu;
+	struct iscsi_context *conn;
+	int i;
 
-	for (pdu = iscsi->outqueue; pdu; pdu = pdu->next) {
-		i++;
+	i = iscsi->outqueue_count;
+	for (conn = iscsi->connections; conn; conn = conn->next_connection) {
+		i += conn->outqueue_count;
 	}
 
 	return i;
 }
 
+/*
+ * If CRC is non-NULL the bytes that were read or written are folded into
+ * it straight away, while they are still in the cache.
+ */
 ssize_t
-iscsi_iovector_readv_writev(struct iscsi_context *iscsi, struct scsi_iovector *iovector, uint32_t pos, ssize_t count, int do_write)
+iscsi_iovector_readv_writev(struct iscsi_context *iscsi, struct scsi_iovector *iovector, uint32_t pos, ssize_t count, int do_write, uint32_t *crc)
 {
         struct scsi_iovec *iov, *iov2;
-        int niov;
+        int niov, i;
         uint32_t len2;
         size_t _len2;
-        ssize_t n;
+        ssize_t n, left;
 
         if (iovector->iov == NULL) {
 		errno = EINVAL;
@@ -556,10 +696,11 @@ iscsi_iovector_readv_writev(struct iscsi_context *iscsi, struct scsi_iovector *i
 	}
 
 	if (pos < iovector->offset) {
-		iscsi_set_error(iscsi, "iovector reset. pos is smaller than"
-				"current offset");
-		errno = EINVAL;
-		return -1;
+		/* data sent again during error recovery can be for an
+		 * earlier part of the buffers, start over from the first.
+		 */
+		iovector->offset = 0;
+		iovector->consumed = 0;
 	}
 
 	if (iovector->niov <= iovector->consumed) {
@@ -617,6 +758,15 @@ iscsi_iovector_readv_writev(struct iscsi_context *iscsi, struct scsi_iovector *i
 		n = readv(iscsi->fd, (struct iovec*) iov, niov);
 	}
 
+	if (crc != NULL && n > 0 && n <= count) {
+		for (i = 0, left = n; left > 0; i++) {
+			size_t len = MIN((size_t)left, iov[i].iov_len);
+
+			*crc = crc32c_update(*crc, iov[i].iov_base, len);
+			left -= len;
+		}
+	}
+
 	/* restore original values */
 	iov->iov_base = (void*) ((uintptr_t)iov->iov_base - pos);
 	iov->iov_len += pos;
@@ -630,293 +780,1444 @@ iscsi_iovector_readv_writev(struct iscsi_context *iscsi, struct scsi_iovector *i
 	return n;
 }
 
+/*
+ * Copy COUNT bytes from BUF into the iovector at byte position POS.
+ * Used for Data-In payloads that have already been read into the
+ * receive buffer. If CRC is non-NULL the data digest is updated as the
+ * data is copied.
+ */
 static int
-iscsi_read_from_socket(struct iscsi_context *iscsi)
+iscsi_iovector_copy_in(struct scsi_iovector *iovector, uint32_t pos,
+		       const unsigned char *buf, size_t count, uint32_t *crc)
 {
-	struct iscsi_in_pdu *in;
-	ssize_t hdr_size, data_size, count, padding_size;
+	struct scsi_iovec *iov;
+	size_t len;
+	int i;
 
-	do {
-		hdr_size = ISCSI_HEADER_SIZE(iscsi->header_digest);
-		if (iscsi->incoming == NULL) {
-            // 分配输入 pdu
-			iscsi->incoming = iscsi_szmalloc(iscsi, sizeof(struct iscsi_in_pdu));
-			if (iscsi->incoming == NULL) {
-				iscsi_set_error(iscsi, "Out-of-memory: failed to malloc iscsi_in_pdu");
-				return -1;
-			}
-			iscsi->incoming->hdr = iscsi_smalloc(iscsi, hdr_size);
-			if (iscsi->incoming->hdr == NULL) {
-				iscsi_set_error(iscsi, "Out-of-memory");
-				return -1;
-			}
+	if (pos < iovector->offset) {
+		/* see iscsi_iovector_readv_writev() */
+		iovector->offset = 0;
+		iovector->consumed = 0;
+	}
+
+	/* forward past any iovecs that lie entirely before pos */
+	i = iovector->consumed;
+	while (i < iovector->niov && pos >= iovector->offset + iovector->iov[i].iov_len) {
+		iovector->offset += iovector->iov[i].iov_len;
+		iovector->consumed = ++i;
+	}
+	pos -= iovector->offset;
+
+	while (count > 0) {
+		if (i >= iovector->niov) {
+			/* not enough user buffers for all the data */
+			errno = EINVAL;
+			return -1;
 		}
-		in = iscsi->incoming;
+		iov = &iovector->iov[i++];
+		len = MIN(count, iov->iov_len - pos);
+		if (crc != NULL) {
+			*crc = crc32c_copy(*crc, (unsigned char *)iov->iov_base + pos,
+					   buf, len);
+		} else {
+			memcpy((unsigned char *)iov->iov_base + pos, buf, len);
+		}
+		buf += len;
+		count -= len;
+		pos = 0;
+	}
+	return 0;
+}
 
-		/* first we must read the header, including any digests */
-		if (in->hdr_pos < hdr_size) {
-			/* try to only read the header, the socket is nonblocking, so
-			 * no need to limit the read to what is available in the socket
-			 */
-			count = hdr_size - in->hdr_pos;
-			count = recv(iscsi->fd, (void *)&in->hdr[in->hdr_pos],
-                                     count, 0);
-			if (count == 0) {
-				/* remote side has closed the socket. */
-				return -1;
-			}
-			if (count < 0) {
-				if (errno == EINTR || errno == EAGAIN) {
-					break;
-				}
-				iscsi_set_error(iscsi, "read from socket failed, "
-					"errno:%d", errno);
+/*
+ * Store COUNT bytes of payload (including any padding and data digest)
+ * that have been read for IN. Payload for a task with a user iovector is
+ * copied there, anything else is kept in in->data.
+ */
+static int
+iscsi_in_pdu_copy_data(struct iscsi_context *iscsi, struct iscsi_in_pdu *in,
+		       ssize_t data_size, ssize_t padding_size,
+		       const unsigned char *buf, ssize_t count)
+{
+	struct scsi_iovector *iovector_in;
+	uint32_t *crc = NULL;
+	ssize_t len, user;
+
+	if (iscsi->data_digest != ISCSI_DATA_DIGEST_NONE) {
+		crc = &in->data_crc;
+	}
+
+	len = MIN(count, data_size - in->data_pos);
+	iovector_in = iscsi_get_scsi_task_iovector_in(iscsi, in);
+	if (len <= 0) {
+		len = 0;
+	} else if (iovector_in != NULL) {
+		uint32_t offset = scsi_get_uint32(&in->hdr[40]);
+
+		user = MAX(0, MIN(len, data_size - padding_size - in->data_pos));
+		if (user > 0 && iscsi_iovector_copy_in(iovector_in, in->data_pos + offset, buf, user, crc) != 0) {
+			iscsi_set_error(iscsi, "Failed to copy data-in to user buffers");
+			return -1;
+		}
+		if (crc != NULL && len > user) {
+			*crc = crc32c_update(*crc, buf + user, len - user);
+		}
+	} else {
+		if (in->data == NULL) {
+			in->data = iscsi_malloc(iscsi, data_size);
+			if (in->data == NULL) {
+				iscsi_set_error(iscsi, "Out-of-memory: failed to malloc iscsi_in_pdu->data(%d)", (int)data_size);
 				return -1;
 			}
-			in->hdr_pos  += count;
 		}
-
-		if (in->hdr_pos < hdr_size) {
-			/* we don't have the full header yet, so return */
-			break;
+		if (crc != NULL) {
+			*crc = crc32c_copy(*crc, &in->data[in->data_pos], buf, len);
+		} else {
+			memcpy(&in->data[in->data_pos], buf, len);
 		}
+	}
+	in->data_pos += len;
+
+	/* anything after the padding is the data digest */
+	if (count > len) {
+		memcpy(&in->data_digest[in->data_pos - data_size], buf + len,
+		       count - len);
+		in->data_pos += count - len;
+	}
+	return 0;
+}
 
-        // 头大小
-		padding_size = iscsi_get_pdu_padding_size(&in->hdr[0]);
-        // 数据大小
-		data_size = iscsi_get_pdu_data_size(&in->hdr[0]) + padding_size;
+/* check the data digest of a received PDU */
+static int
+iscsi_verify_data_digest(struct iscsi_context *iscsi, uint32_t crc,
+			 const unsigned char *digest)
+{
+	uint32_t crc_rcvd = 0;
+
+	crc ^= 0xffffffff;
+	crc_rcvd |= digest[0];
+	crc_rcvd |= digest[1] << 8;
+	crc_rcvd |= digest[2] << 16;
+	crc_rcvd |= (uint32_t)digest[3] << 24;
+	if (crc != crc_rcvd) {
+		iscsi_set_error(iscsi, "data digest verification failed: "
+				"calculated 0x%" PRIx32 " received 0x%" PRIx32,
+				crc, crc_rcvd);
+		return -1;
+	}
+	return 0;
+}
 
-		if (data_size < 0 || data_size > (ssize_t)iscsi->initiator_max_recv_data_segment_length) {
-			iscsi_set_error(iscsi, "Invalid data size received from target (%d)", (int)data_size);
+/*
+ * Continue reading the PDU in iscsi->incoming directly from the socket.
+ * Returns 1 once the PDU has been received and processed, 0 if we need to
+ * wait for more data and -1 on error.
+ */
+static int
+iscsi_read_incoming(struct iscsi_context *iscsi)
+{
+	struct iscsi_in_pdu *in = iscsi->incoming;
+	ssize_t hdr_size, data_size, count, padding_size, digest_size;
+	uint32_t *crc = NULL;
+
+	hdr_size = ISCSI_HEADER_SIZE(iscsi->header_digest);
+
+	/* first we must read the header, including any digests */
+	if (in->hdr_pos < hdr_size) {
+		count = hdr_size - in->hdr_pos;
+		count = recv(iscsi->fd, (void *)&in->hdr[in->hdr_pos],
+			     count, 0);
+		if (count == 0) {
+			/* remote side has closed the socket. */
+			return -1;
+		}
+		if (count < 0) {
+			if (errno == EINTR || errno == EAGAIN) {
+				return 0;
+			}
+			iscsi_set_error(iscsi, "read from socket failed, "
+				"errno:%d", errno);
 			return -1;
 		}
-		if (data_size != 0) {
-			unsigned char padding_buf[3];
-			unsigned char *buf = padding_buf;
-			struct scsi_iovector * iovector_in;
+		in->hdr_pos  += count;
+	}
 
-			count = data_size - in->data_pos;
+	if (in->hdr_pos < hdr_size) {
+		/* we don't have the full header yet, so return */
+		return 0;
+	}
 
-			/* first try to see if we already have a user buffer */
-			iovector_in = iscsi_get_scsi_task_iovector_in(iscsi, in);
-			if (iovector_in != NULL && count > padding_size) {
-				uint32_t offset = scsi_get_uint32(&in->hdr[40]);
-				count = iscsi_iovector_readv_writev(iscsi, iovector_in, in->data_pos + offset, count - padding_size, 0);
-			} else {
-				if (iovector_in == NULL) {
+	padding_size = iscsi_get_pdu_padding_size(&in->hdr[0]);
+	data_size = iscsi_get_pdu_data_size(&in->hdr[0]) + padding_size;
+
+	if (data_size < 0 || data_size > (ssize_t)iscsi->initiator_max_recv_data_segment_length) {
+		iscsi_set_error(iscsi, "Invalid data size received from target (%d)", (int)data_size);
+		return -1;
+	}
+	digest_size = ISCSI_DATA_DIGEST_SIZE(iscsi->data_digest, data_size);
+	if (digest_size) {
+		crc = &in->data_crc;
+	}
+	if (in->data_pos < data_size + digest_size) {
+		unsigned char padding_buf[3];
+		unsigned char *buf = padding_buf;
+		struct scsi_iovector * iovector_in;
+		int direct = 0;
+
+		count = data_size - in->data_pos;
+
+		/* first try to see if we already have a user buffer */
+		iovector_in = iscsi_get_scsi_task_iovector_in(iscsi, in);
+		if (count <= 0) {
+			/* the data digest */
+			buf = &in->data_digest[in->data_pos - data_size];
+			count = recv(iscsi->fd, (void *)buf,
+				     data_size + digest_size - in->data_pos, 0);
+			direct = 1;
+		} else if (iovector_in != NULL && count > padding_size) {
+			uint32_t offset = scsi_get_uint32(&in->hdr[40]);
+			count = iscsi_iovector_readv_writev(iscsi, iovector_in, in->data_pos + offset, count - padding_size, 0, crc);
+			direct = 1;
+		} else {
+			if (iovector_in == NULL) {
+				if (in->data == NULL) {
+					in->data = iscsi_malloc(iscsi, data_size);
 					if (in->data == NULL) {
-                        // 分配数据存储空间
-						in->data = iscsi_malloc(iscsi, data_size);
-						if (in->data == NULL) {
-							iscsi_set_error(iscsi, "Out-of-memory: failed to malloc iscsi_in_pdu->data(%d)", (int)data_size);
-							return -1;
-						}
+						iscsi_set_error(iscsi, "Out-of-memory: failed to malloc iscsi_in_pdu->data(%d)", (int)data_size);
+						return -1;
 					}
-					buf = &in->data[in->data_pos];
 				}
-                // 读取数据
-				count = recv(iscsi->fd, (void *)buf, count, 0);
+				buf = &in->data[in->data_pos];
 			}
-			if (count == 0) {
-				/* remote side has closed the socket. */
-				return -1;
-			}
-			if (count < 0) {
-				if (errno == EINTR || errno == EAGAIN) {
-					break;
-				}
-				iscsi_set_error(iscsi, "read from socket failed, "
-						"errno:%d %s", errno,
-						iscsi_get_error(iscsi));
-				return -1;
+			count = recv(iscsi->fd, (void *)buf, count, 0);
+		}
+		if (count == 0) {
+			/* remote side has closed the socket. */
+			return -1;
+		}
+		if (count < 0) {
+			if (errno == EINTR || errno == EAGAIN) {
+				return 0;
 			}
-			in->data_pos += count;
+			iscsi_set_error(iscsi, "read from socket failed, "
+					"errno:%d %s", errno,
+					iscsi_get_error(iscsi));
+			return -1;
 		}
-
-		if (in->data_pos < data_size) {
-			break;
+		if (crc != NULL && !direct) {
+			*crc = crc32c_update(*crc, buf, count);
 		}
+		in->data_pos += count;
+	}
 
-		iscsi->incoming = NULL;
-		if (iscsi_process_pdu(iscsi, in) != 0) {
+	if (in->data_pos < data_size + digest_size) {
+		return 0;
+	}
+
+	iscsi->incoming = NULL;
+	if (digest_size && iscsi_verify_data_digest(iscsi, in->data_crc, in->data_digest) != 0) {
+		/* with ErrorRecoveryLevel 1 a Data-In is asked for again */
+		if (iscsi_snack_data_digest_error(iscsi, in) != 0) {
 			iscsi_free_iscsi_in_pdu(iscsi, in);
 			return -1;
 		}
 		iscsi_free_iscsi_in_pdu(iscsi, in);
-	} while (iscsi->tcp_nonblocking && iscsi->waitpdu && iscsi->is_loggedin);
-
-	return 0;
+		return 1;
+	}
+	if (iscsi_process_pdu(iscsi, in) != 0) {
+		iscsi_free_iscsi_in_pdu(iscsi, in);
+		return -1;
+	}
+	iscsi_free_iscsi_in_pdu(iscsi, in);
+	return 1;
 }
 
-static int iscsi_pdu_update_headerdigest(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
+/*
+ * Move whatever is left of the PDU at the head of the receive buffer into
+ * iscsi->incoming so the remainder can be read directly from the socket.
+ */
+static int
+iscsi_rx_start_incoming(struct iscsi_context *iscsi, ssize_t hdr_size)
 {
-	uint32_t crc;
+	struct iscsi_in_pdu *in;
+	ssize_t avail, count, data_size, padding_size;
 
-	if (pdu->outdata.size < ISCSI_RAW_HEADER_SIZE + ISCSI_DIGEST_SIZE) {
-		iscsi_set_error(iscsi, "PDU too small (%u) to contain header digest",
-				(unsigned int) pdu->outdata.size);
+	in = iscsi_szmalloc(iscsi, sizeof(struct iscsi_in_pdu));
+	if (in == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: failed to malloc iscsi_in_pdu");
 		return -1;
 	}
+	in->hdr = in->hdr_buf;
+	in->data_crc = 0xffffffff;
+	iscsi->incoming = in;
+
+	avail = iscsi->rx_len - iscsi->rx_pos;
+	count = MIN(avail, hdr_size);
+	memcpy(in->hdr, &iscsi->rxbuf[iscsi->rx_pos], count);
+	in->hdr_pos = count;
+	iscsi->rx_pos += count;
+	avail -= count;
+
+	if (avail == 0) {
+		return 0;
+	}
 
-	crc = crc32c(pdu->outdata.data, ISCSI_RAW_HEADER_SIZE);
+	/* the header is complete and its data size has been validated */
+	padding_size = iscsi_get_pdu_padding_size(&in->hdr[0]);
+	data_size = iscsi_get_pdu_data_size(&in->hdr[0]) + padding_size;
+	count = MIN(avail, data_size + ISCSI_DATA_DIGEST_SIZE(iscsi->data_digest, data_size));
+	if (iscsi_in_pdu_copy_data(iscsi, in, data_size, padding_size,
+				   &iscsi->rxbuf[iscsi->rx_pos], count) != 0) {
+		return -1;
+	}
+	iscsi->rx_pos += count;
 
-	pdu->outdata.data[ISCSI_RAW_HEADER_SIZE+3] = (crc >> 24);
-	pdu->outdata.data[ISCSI_RAW_HEADER_SIZE+2] = (crc >> 16);
-	pdu->outdata.data[ISCSI_RAW_HEADER_SIZE+1] = (crc >>  8);
-	pdu->outdata.data[ISCSI_RAW_HEADER_SIZE+0] = (crc);
 	return 0;
 }
 
+/*
+ * Process a PDU that is completely contained in the receive buffer, in
+ * place and without copying or allocating anything.
+ */
 static int
-iscsi_write_to_socket(struct iscsi_context *iscsi)
+iscsi_rx_process_buffered(struct iscsi_context *iscsi, ssize_t hdr_size,
+			  ssize_t data_size, ssize_t padding_size,
+			  ssize_t digest_size)
 {
-	ssize_t count;
-	size_t total;
-	struct iscsi_pdu *pdu;
-	static char padding_buf[3];
-	int socket_flags = 0;
+	struct iscsi_in_pdu in;
+	struct scsi_iovector *iovector_in;
+	uint32_t crc = 0xffffffff;
+	int busy, ret, copied = 0;
+
+	in.next     = NULL;
+	in.hdr      = &iscsi->rxbuf[iscsi->rx_pos];
+	in.hdr_pos  = hdr_size;
+	in.data     = data_size ? in.hdr + hdr_size : NULL;
+	in.data_pos = data_size;
+
+	iscsi->rx_pos += hdr_size + data_size + digest_size;
+
+	if (data_size > padding_size) {
+		iovector_in = iscsi_get_scsi_task_iovector_in(iscsi, &in);
+		if (iovector_in != NULL) {
+			if (iscsi_iovector_copy_in(iovector_in, scsi_get_uint32(&in.hdr[40]),
+						   in.data, data_size - padding_size,
+						   digest_size ? &crc : NULL) != 0) {
+				iscsi_set_error(iscsi, "Failed to copy data-in to user buffers");
+				return -1;
+			}
+			copied = data_size - padding_size;
+		}
+	}
+	if (digest_size) {
+		crc = crc32c_update(crc, in.data + copied, data_size - copied);
+		if (iscsi_verify_data_digest(iscsi, crc, in.data + data_size) != 0) {
+			return iscsi_snack_data_digest_error(iscsi, &in);
+		}
+	}
 
-#ifdef MSG_NOSIGNAL
-	socket_flags |= MSG_NOSIGNAL;
-#elif SO_NOSIGPIPE
-	socket_flags |= SO_NOSIGPIPE;
-#endif
+	/* The PDU stays in the receive buffer while it is processed so
+	 * make sure a nested read does not move or overwrite it.
+	 */
+	busy = iscsi->rx_busy;
+	iscsi->rx_busy = busy + 1;
+	ret = iscsi_process_pdu(iscsi, &in);
+	iscsi->rx_busy = busy;
 
-	if (iscsi->fd == -1) {
-		iscsi_set_error(iscsi, "trying to write but not connected");
-		return -1;
+	return ret;
+}
+
+/*
+ * Read as much as is available from the socket into the receive buffer.
+ * Returns the number of bytes read, 0 if no data was available and -1 on
+ * error.
+ */
+static ssize_t
+iscsi_rx_fill(struct iscsi_context *iscsi, int *drained)
+{
+	ssize_t count;
+	size_t space;
+
+	if (iscsi->rxbuf == NULL) {
+		iscsi->rxbuf = iscsi_malloc(iscsi, ISCSI_RX_BUFFER_SIZE);
+		if (iscsi->rxbuf == NULL) {
+			iscsi_set_error(iscsi, "Out-of-memory: failed to malloc receive buffer");
+			return -1;
+		}
+		iscsi->rx_pos = iscsi->rx_len = 0;
 	}
 
-	while (iscsi->outqueue != NULL || iscsi->outqueue_current != NULL) {
-		if (iscsi->outqueue_current == NULL) {
-			if (iscsi->is_corked) {
-				/* connection is corked we are not allowed to send
-				 * additional PDUs */
-				ISCSI_LOG(iscsi, 6, "iscsi_write_to_socket: socket is corked");
-				return 0;
-			}
-			
-			if (iscsi_serial32_compare(iscsi->outqueue->cmdsn, iscsi->maxcmdsn) > 0
-				&& !(iscsi->outqueue->outdata.data[0] & ISCSI_PDU_IMMEDIATE)) {
-				/* stop sending for non-immediate PDUs. maxcmdsn is reached */
-				ISCSI_LOG(iscsi, 6,
-				          "iscsi_write_to_socket: maxcmdsn reached (outqueue[0]->cmdsnd %08x > maxcmdsn %08x)",
-				          iscsi->outqueue->cmdsn, iscsi->maxcmdsn);
-				return 0;
-			}
+	if (!iscsi->rx_busy) {
+		if (iscsi->rx_pos == iscsi->rx_len) {
+			iscsi->rx_pos = iscsi->rx_len = 0;
+		} else if (iscsi->rx_pos > 0) {
+			memmove(iscsi->rxbuf, &iscsi->rxbuf[iscsi->rx_pos],
+				iscsi->rx_len - iscsi->rx_pos);
+			iscsi->rx_len -= iscsi->rx_pos;
+			iscsi->rx_pos = 0;
+		}
+	}
 
-			/* pop first element of the outqueue */
-			if (iscsi_serial32_compare(iscsi->outqueue->cmdsn, iscsi->expcmdsn) < 0 &&
-				(iscsi->outqueue->outdata.data[0] & 0x3f) != ISCSI_PDU_DATA_OUT) {
-				iscsi_set_error(iscsi, "iscsi_write_to_socket: outqueue[0]->cmdsn < expcmdsn (%08x < %08x) opcode %02x",
-				                iscsi->outqueue->cmdsn, iscsi->expcmdsn, iscsi->outqueue->outdata.data[0] & 0x3f);
-				return -1;
-			}
-			iscsi->outqueue_current = iscsi->outqueue;
-			
-			/* set exp statsn */
-			iscsi_pdu_set_expstatsn(iscsi->outqueue_current, iscsi->statsn + 1);
-
-			/* calculate header checksum */
-			if (iscsi->header_digest != ISCSI_HEADER_DIGEST_NONE &&
-				iscsi_pdu_update_headerdigest(iscsi, iscsi->outqueue_current) != 0) {
-				return -1;
-			}
+	space = ISCSI_RX_BUFFER_SIZE - iscsi->rx_len;
+	if (space == 0) {
+		iscsi_set_error(iscsi, "No space left in receive buffer");
+		return -1;
+	}
 
-			ISCSI_LIST_REMOVE(&iscsi->outqueue, iscsi->outqueue_current);
-			if (!(iscsi->outqueue_current->flags & ISCSI_PDU_DELETE_WHEN_SENT)) {
-				/* we have to add the pdu to the waitqueue already here
-				   since the storage might sent a R2T as soon as it has
-				   received the header. if we sent immediate data in a
-				   cmd PDU the R2T might get lost otherwise. */
-				ISCSI_LIST_ADD_END(&iscsi->waitpdu, iscsi->outqueue_current);
-			}
+	count = recv(iscsi->fd, (void *)&iscsi->rxbuf[iscsi->rx_len], space, 0);
+	if (count == 0) {
+		/* remote side has closed the socket. */
+		return -1;
+	}
+	if (count < 0) {
+		if (errno == EINTR || errno == EAGAIN) {
+			return 0;
 		}
+		iscsi_set_error(iscsi, "read from socket failed, "
+				"errno:%d", errno);
+		return -1;
+	}
+	iscsi->rx_len += count;
+	/* a short read means the socket has been drained */
+	*drained = (size_t)count < space;
 
-		pdu = iscsi->outqueue_current;
-		pdu->outdata.size = (pdu->outdata.size + 3) & 0xfffffffc;
+	return count;
+}
 
-		/* Write header and any immediate data */
-		if (pdu->outdata_written < pdu->outdata.size) {
-			count = send(iscsi->fd,
-				     (void *)(pdu->outdata.data +
-                                              pdu->outdata_written),
-				     pdu->outdata.size - pdu->outdata_written,
-				     socket_flags);
-			if (count == -1) {
-				if (errno == EAGAIN || errno == EWOULDBLOCK) {
-					return 0;
-				}
-				iscsi_set_error(iscsi, "Error when writing to "
-						"socket :%d", errno);
-				return -1;
+static int
+iscsi_read_from_socket(struct iscsi_context *iscsi)
+{
+	ssize_t hdr_size, data_size, count, padding_size, digest_size;
+	size_t avail;
+	int did_recv = 0, drained = 0, ret;
+
+	iscsi->rx_more = 0;
+	for (;;) {
+		if (iscsi->incoming != NULL) {
+			ret = iscsi_read_incoming(iscsi);
+			if (ret <= 0) {
+				return ret;
 			}
-			pdu->outdata_written += count;
-		}
-		/* if we havent written the full header yet. */
-		if (pdu->outdata_written != pdu->outdata.size) {
-			return 0;
+			did_recv = 1;
+			drained = 0;
+			continue;
 		}
 
-		/* Write any iovectors that might have been passed to us */
-		while (pdu->payload_written < pdu->payload_len) {
-			struct scsi_iovector* iovector_out;
+		hdr_size = ISCSI_HEADER_SIZE(iscsi->header_digest);
+		avail = iscsi->rx_len - iscsi->rx_pos;
+
+		if (avail >= (size_t)hdr_size) {
+			unsigned char *hdr = &iscsi->rxbuf[iscsi->rx_pos];
 
-			iovector_out = iscsi_get_scsi_task_iovector_out(iscsi, pdu);
+			padding_size = iscsi_get_pdu_padding_size(hdr);
+			data_size = iscsi_get_pdu_data_size(hdr) + padding_size;
 
-			if (iovector_out == NULL) {
-				iscsi_set_error(iscsi, "Can't find iovector data for DATA-OUT");
+			if (data_size < 0 || data_size > (ssize_t)iscsi->initiator_max_recv_data_segment_length) {
+				iscsi_set_error(iscsi, "Invalid data size received from target (%d)", (int)data_size);
 				return -1;
 			}
+			digest_size = ISCSI_DATA_DIGEST_SIZE(iscsi->data_digest, data_size);
 
-			count = iscsi_iovector_readv_writev(iscsi,
-				iovector_out,
-				pdu->payload_offset + pdu->payload_written,
-				pdu->payload_len - pdu->payload_written, 1);
-			if (count == -1) {
-				if (errno == EAGAIN || errno == EWOULDBLOCK) {
-					return 0;
+			if (avail >= (size_t)(hdr_size + data_size + digest_size)) {
+				if (iscsi_rx_process_buffered(iscsi, hdr_size, data_size, padding_size, digest_size) != 0) {
+					return -1;
 				}
-				iscsi_set_error(iscsi, "Error when writing to "
-						"socket :%d %s", errno,
-						iscsi_get_error(iscsi));
-				return -1;
+				continue;
 			}
 
-			pdu->payload_written += count;
-		}
-
-		total = pdu->payload_len;
-		total = (total + 3) & 0xfffffffc;
+			/* Large data-in payloads go directly into the user
+			 * buffers, as does anything that will not fit.
+			 */
+			if (hdr_size + data_size + digest_size > ISCSI_RX_BUFFER_SIZE - (ssize_t)(iscsi->rx_busy ? iscsi->rx_pos : 0)) {
+				if (iscsi_rx_start_incoming(iscsi, hdr_size) != 0) {
+					return -1;
+				}
+				continue;
+			}
+			if (data_size >= ISCSI_RX_DIRECT_MIN) {
+				struct iscsi_in_pdu in;
 
-		/* Write padding */
-		if (pdu->payload_written < total) {
-			count = send(iscsi->fd, padding_buf, total - pdu->payload_written, socket_flags);
-			if (count == -1) {
-				if (errno == EAGAIN || errno == EWOULDBLOCK) {
-					return 0;
+				in.hdr = hdr;
+				if (iscsi_get_scsi_task_iovector_in(iscsi, &in) != NULL) {
+					if (iscsi_rx_start_incoming(iscsi, hdr_size) != 0) {
+						return -1;
+					}
+					continue;
 				}
-				iscsi_set_error(iscsi, "Error when writing to "
-						"socket :%d", errno);
+			}
+		} else if (iscsi->rx_busy && iscsi->rx_len == ISCSI_RX_BUFFER_SIZE) {
+			/* nested read and no room to complete the header */
+			if (iscsi_rx_start_incoming(iscsi, hdr_size) != 0) {
 				return -1;
 			}
-			pdu->payload_written += count;
+			continue;
 		}
-		/* if we havent written the full padding yet. */
-		if (pdu->payload_written != total) {
+
+		/* we need more data */
+		if (iscsi->fd == -1) {
+			return 0;
+		}
+		if (did_recv && (drained || !iscsi->tcp_nonblocking
+				 || iscsi->waitpdu == NULL || !iscsi->is_loggedin)) {
+			iscsi->rx_more = !drained;
+			return 0;
+		}
+		count = iscsi_rx_fill(iscsi, &drained);
+		if (count <= 0) {
+			return count;
+		}
+		did_recv = 1;
+	}
+
+	return 0;
+}
+
+static int iscsi_pdu_update_headerdigest(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
+{
+	uint32_t crc;
+
+	if (pdu->outdata.size < ISCSI_RAW_HEADER_SIZE + ISCSI_DIGEST_SIZE) {
+		iscsi_set_error(iscsi, "PDU too small (%u) to contain header digest",
+				(unsigned int) pdu->outdata.size);
+		return -1;
+	}
+
+	crc = crc32c(pdu->outdata.data, ISCSI_RAW_HEADER_SIZE);
+
+	pdu->outdata.data[ISCSI_RAW_HEADER_SIZE+3] = (crc >> 24);
+	pdu->outdata.data[ISCSI_RAW_HEADER_SIZE+2] = (crc >> 16);
+	pdu->outdata.data[ISCSI_RAW_HEADER_SIZE+1] = (crc >>  8);
+	pdu->outdata.data[ISCSI_RAW_HEADER_SIZE+0] = (crc);
+	return 0;
+}
+
+/*
+ * Send a gathered batch of iovecs, using sendmsg() where we can so that
+ * we get MSG_NOSIGNAL.
+ */
+static ssize_t
+iscsi_tx_sendv(struct iscsi_context *iscsi, struct iovec *iov, int niov)
+{
+#if defined(_WIN32) || defined(AROS)
+	return writev(iscsi->fd, iov, niov);
+#else
+	struct msghdr msg;
+	int socket_flags = 0;
+
+#ifdef MSG_NOSIGNAL
+	socket_flags |= MSG_NOSIGNAL;
+#endif
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = niov;
+
+	return sendmsg(iscsi->fd, &msg, socket_flags);
+#endif
+}
+
+/*
+ * Data digest state of a segment that is being gathered. crc covers the
+ * first crc_pos bytes of the payload.
+ */
+struct iscsi_tx_digest {
+	uint32_t *crc;
+	uint32_t *crc_pos;
+	unsigned char *digest;
+};
+
+/*
+ * Append a header, payload, padding and data digest to the iovec array,
+ * skipping the first 'written' bytes after the header. If we run out of
+ * iovecs only part of it is added. The number of bytes added is returned
+ * in *len.
+ * If dd is non-NULL the data digest is computed while the payload is
+ * gathered, any payload that has already been written but is not yet
+ * covered by the digest is only folded into it.
+ */
+static int
+iscsi_tx_add_segment(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
+		     unsigned char *hdr, size_t hdr_len,
+		     uint32_t offset, uint32_t payload_len, uint32_t written,
+		     struct iscsi_tx_digest *dd,
+		     struct iovec *iov, int *niov, size_t *len)
+{
+	size_t total, done;
+	uint32_t crc;
+
+	*len = 0;
+
+	if (hdr_len > 0) {
+		iov[*niov].iov_base = hdr;
+		iov[*niov].iov_len  = hdr_len;
+		*len += iov[(*niov)++].iov_len;
+	}
+
+	/* Add any iovectors that might have been passed to us */
+	if (written < payload_len ||
+	    (dd != NULL && *dd->crc_pos < payload_len)) {
+		struct scsi_iovector *iovector_out;
+		uint32_t start, pos, remaining;
+		size_t base;
+		int i;
+
+		iovector_out = iscsi_get_scsi_task_iovector_out(iscsi, pdu);
+		if (iovector_out == NULL) {
+			iscsi_set_error(iscsi, "Can't find iovector data for DATA-OUT");
+			return -1;
+		}
+
+		start = written;
+		if (dd != NULL && *dd->crc_pos < start) {
+			start = *dd->crc_pos;
+		}
+		pos = offset + start;
+		remaining = payload_len - start;
+		if (pos < iovector_out->offset) {
+			iscsi_set_error(iscsi, "iovector reset. pos is smaller than"
+					"current offset");
+			return -1;
+		}
+
+		i = iovector_out->consumed;
+		base = iovector_out->offset;
+		while (remaining > 0 && *niov < ISCSI_TX_MAX_IOV) {
+			struct scsi_iovec *v;
+			size_t off, n;
+
+			if (i >= iovector_out->niov) {
+				iscsi_set_error(iscsi, "Not enough user buffers "
+						"for DATA-OUT");
+				return -1;
+			}
+			v = &iovector_out->iov[i];
+			if (pos >= base + v->iov_len) {
+				base += v->iov_len;
+				i++;
+				continue;
+			}
+			off = pos - base;
+			n = MIN(remaining, v->iov_len - off);
+			done = pos - offset;
+			if (done < written) {
+				/* already on the wire, only needs the crc */
+				n = MIN(n, written - done);
+			} else {
+				iov[*niov].iov_base = (unsigned char *)v->iov_base + off;
+				iov[*niov].iov_len  = n;
+				(*niov)++;
+				*len += n;
+			}
+			if (dd != NULL && done + n > *dd->crc_pos) {
+				*dd->crc = crc32c_update(*dd->crc,
+					(unsigned char *)v->iov_base + off +
+					(*dd->crc_pos - done),
+					done + n - *dd->crc_pos);
+				*dd->crc_pos = done + n;
+			}
+			pos += n;
+			remaining -= n;
+		}
+		if (remaining > 0) {
+			return 0;
+		}
+	}
+
+	/* Add padding */
+	total = (payload_len + 3) & 0xfffffffc;
+	if (MAX(written, payload_len) < total) {
+		if (*niov >= ISCSI_TX_MAX_IOV) {
+			return 0;
+		}
+		iov[*niov].iov_base = tx_padding_buf;
+		iov[*niov].iov_len  = total - MAX(written, payload_len);
+		*len += iov[(*niov)++].iov_len;
+	}
+
+	/* Add the data digest, the padding is covered by it too */
+	if (dd != NULL && MAX(written, total) < total + ISCSI_DIGEST_SIZE &&
+	    *niov < ISCSI_TX_MAX_IOV) {
+		crc = crc32c_update(*dd->crc, (uint8_t *)tx_padding_buf,
+				    total - payload_len) ^ 0xffffffff;
+		dd->digest[0] = (crc);
+		dd->digest[1] = (crc >>  8);
+		dd->digest[2] = (crc >> 16);
+		dd->digest[3] = (crc >> 24);
+
+		done = MAX(written, total) - total;
+		iov[*niov].iov_base = dd->digest + done;
+		iov[*niov].iov_len  = ISCSI_DIGEST_SIZE - done;
+		*len += iov[(*niov)++].iov_len;
+	}
+
+	return 0;
+}
+
+/*
+ * Size of the part of the current pdu, or DATA-OUT segment, that follows
+ * the header: the payload, padding and data digest.
+ */
+static uint32_t
+iscsi_tx_payload_size(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
+{
+	return ((pdu->payload_len + 3) & 0xfffffffc) +
+		ISCSI_DATA_DIGEST_SIZE(iscsi->data_digest,
+				       iscsi_get_pdu_data_size(pdu->outdata.data));
+}
+
+/* bytes of the current pdu, or DATA-OUT segment, still to be written */
+static size_t
+iscsi_tx_pdu_left(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
+{
+	return pdu->outdata.size - pdu->outdata_written +
+		iscsi_tx_payload_size(iscsi, pdu) - pdu->payload_written;
+}
+
+/* start the data digest for the pdu, covering any data it carries inline */
+static void
+iscsi_pdu_init_datadigest(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
+{
+	size_t hdr_size = ISCSI_HEADER_SIZE(iscsi->header_digest);
+
+	pdu->data_crc     = 0xffffffff;
+	pdu->data_crc_pos = 0;
+	if (pdu->outdata.size > hdr_size) {
+		pdu->data_crc = crc32c_update(pdu->data_crc,
+					      pdu->outdata.data + hdr_size,
+					      pdu->outdata.size - hdr_size);
+	}
+}
+
+/*
+ * Fill in the per-segment fields of a DATA-OUT header. All other fields
+ * are copied from the pdu so that a header generated ahead of time is
+ * identical to the one the pdu will hold once it reaches that segment.
+ */
+static void
+iscsi_tx_dataout_header(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
+			unsigned char *hdr, uint32_t offset, uint32_t len,
+			uint32_t datasn, int final)
+{
+	uint32_t crc;
+
+	if (hdr != pdu->outdata.data) {
+		memcpy(hdr, pdu->outdata.data, ISCSI_RAW_HEADER_SIZE);
+	}
+	hdr[1] = final ? ISCSI_PDU_SCSI_FINAL : 0;
+	scsi_set_uint32(&hdr[4], len);
+	scsi_set_uint32(&hdr[36], datasn);
+	scsi_set_uint32(&hdr[40], offset);
+
+	if (iscsi->header_digest != ISCSI_HEADER_DIGEST_NONE) {
+		crc = crc32c(hdr, ISCSI_RAW_HEADER_SIZE);
+		hdr[ISCSI_RAW_HEADER_SIZE+3] = (crc >> 24);
+		hdr[ISCSI_RAW_HEADER_SIZE+2] = (crc >> 16);
+		hdr[ISCSI_RAW_HEADER_SIZE+1] = (crc >>  8);
+		hdr[ISCSI_RAW_HEADER_SIZE+0] = (crc);
+	}
+}
+
+/* move a DATA-OUT pdu on to the next segment of its sequence */
+static void
+iscsi_tx_dataout_advance(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
+{
+	uint32_t len = MIN(pdu->dataout_remaining,
+			   iscsi->target_max_recv_data_segment_length);
+
+	pdu->payload_offset   += pdu->payload_len;
+	pdu->payload_len       = len;
+	pdu->dataout_remaining -= len;
+	pdu->datasn++;
+	pdu->outdata_written   = 0;
+	pdu->payload_written   = 0;
+	pdu->data_crc          = 0xffffffff;
+	pdu->data_crc_pos      = 0;
+
+	iscsi_tx_dataout_header(iscsi, pdu, pdu->outdata.data,
+				pdu->payload_offset, len, pdu->datasn,
+				pdu->dataout_remaining == 0);
+}
+
+/*
+ * Add whatever is left to send of a PDU to the batch. For a DATA-OUT
+ * sequence we also generate headers for as many of the following
+ * segments as fit in the batch.
+ * Returns 1 if the batch is full and the PDU did not fit completely,
+ * nothing else may be added to the batch after it in that case.
+ */
+static int
+iscsi_tx_batch_pdu(struct iscsi_context *iscsi, struct iscsi_tx_batch *b,
+		   struct iscsi_pdu *pdu)
+{
+	uint32_t offset, remaining, datasn, len, crc, crc_pos;
+	struct iscsi_tx_digest dd, *ddp = NULL;
+	unsigned char *hdr;
+	size_t added;
+
+	if (ISCSI_DATA_DIGEST_SIZE(iscsi->data_digest,
+				   iscsi_get_pdu_data_size(pdu->outdata.data))) {
+		dd.crc     = &pdu->data_crc;
+		dd.crc_pos = &pdu->data_crc_pos;
+		dd.digest  = pdu->data_digest;
+		ddp = &dd;
+	}
+	if (iscsi_tx_add_segment(iscsi, pdu,
+				 pdu->outdata.data + pdu->outdata_written,
+				 pdu->outdata.size - pdu->outdata_written,
+				 pdu->payload_offset, pdu->payload_len,
+				 pdu->payload_written, ddp,
+				 b->iov, &b->niov, &added) != 0) {
+		return -1;
+	}
+	b->pdu[b->npdu] = pdu;
+	b->len[b->npdu++] = added;
+	b->queued += added;
+
+	if (added != iscsi_tx_pdu_left(iscsi, pdu)) {
+		/* out of iovecs */
+		return 1;
+	}
+
+	offset    = pdu->payload_offset + pdu->payload_len;
+	remaining = pdu->dataout_remaining;
+	datasn    = pdu->datasn;
+	while (remaining > 0 && b->nhdr < ISCSI_TX_MAX_HDRS &&
+	       b->niov < ISCSI_TX_MAX_IOV && b->queued < ISCSI_TX_MAX_BYTES) {
+		len = MIN(remaining, iscsi->target_max_recv_data_segment_length);
+		remaining -= len;
+		datasn++;
+
+		hdr = b->hdr[b->nhdr];
+		iscsi_tx_dataout_header(iscsi, pdu, hdr, offset, len, datasn,
+					remaining == 0);
+		if (ddp != NULL) {
+			crc     = 0xffffffff;
+			crc_pos = 0;
+			dd.crc     = &crc;
+			dd.crc_pos = &crc_pos;
+			dd.digest  = b->digest[b->nhdr];
+		}
+		b->nhdr++;
+		if (iscsi_tx_add_segment(iscsi, pdu, hdr, pdu->outdata.size,
+					 offset, len, 0, ddp,
+					 b->iov, &b->niov, &added) != 0) {
+			return -1;
+		}
+		b->pdu[b->npdu] = pdu;
+		b->len[b->npdu++] = added;
+		b->queued += added;
+
+		if (added != pdu->outdata.size + ((len + 3) & 0xfffffffc) +
+		    (ddp != NULL ? ISCSI_DIGEST_SIZE : 0)) {
+			return 1;
+		}
+		offset += len;
+	}
+
+	return remaining > 0;
+}
+
+/*
+ * Checks and header fields of a PDU that is about to go on the wire.
+ * Returns 1 if it can be sent now, 0 if it has to wait and -1 on error.
+ */
+static int
+iscsi_tx_prepare_pdu(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
+{
+	struct iscsi_context *session = iscsi_session(iscsi);
+
+	if (iscsi->is_corked) {
+		/* connection is corked we are not allowed to send
+		 * additional PDUs */
+		ISCSI_LOG(iscsi, 6, "iscsi_write_to_socket: socket is corked");
+		return 0;
+	}
+
+	if (iscsi_serial32_compare(pdu->cmdsn, session->maxcmdsn) > 0
+		&& !(pdu->outdata.data[0] & ISCSI_PDU_IMMEDIATE)) {
+		/* stop sending for non-immediate PDUs. maxcmdsn is reached */
+		ISCSI_LOG(iscsi, 6,
+		          "iscsi_write_to_socket: maxcmdsn reached (outqueue[0]->cmdsnd %08x > maxcmdsn %08x)",
+		          pdu->cmdsn, session->maxcmdsn);
+		return 0;
+	}
+
+	/* With several connections an immediate PDU can be
+	 * overtaken by commands sent on another connection.
+	 */
+	if (iscsi_serial32_compare(pdu->cmdsn, session->expcmdsn) < 0 &&
+		!iscsi_pdu_follows_command(pdu) &&
+		!(session->connections != NULL &&
+		  pdu->outdata.data[0] & ISCSI_PDU_IMMEDIATE)) {
+		iscsi_set_error(iscsi, "iscsi_write_to_socket: outqueue[0]->cmdsn < expcmdsn (%08x < %08x) opcode %02x",
+		                pdu->cmdsn, session->expcmdsn, pdu->outdata.data[0] & 0x3f);
+		return -1;
+	}
+
+	/* set exp statsn */
+	iscsi_pdu_set_expstatsn(pdu, iscsi->statsn + 1);
+
+	/* calculate header checksum */
+	if (iscsi->header_digest != ISCSI_HEADER_DIGEST_NONE &&
+		iscsi_pdu_update_headerdigest(iscsi, pdu) != 0) {
+		return -1;
+	}
+
+	pdu->outdata.size = (pdu->outdata.size + 3) & 0xfffffffc;
+
+	if (iscsi->data_digest != ISCSI_DATA_DIGEST_NONE) {
+		iscsi_pdu_init_datadigest(iscsi, pdu);
+	}
+
+	return 1;
+}
+
+/*
+ * Gather as many PDUs from the outqueue as fit in ISCSI_TX_MAX_IOV iovecs
+ * and ISCSI_TX_MAX_BYTES and write them with a single sendmsg().
+ * PDUs are only removed from the outqueue once some of their bytes have
+ * made it onto the wire.
+ */
+static int
+iscsi_write_to_socket(struct iscsi_context *iscsi)
+{
+	struct iscsi_tx_batch b;
+	struct iscsi_pdu *pdu;
+	ssize_t count;
+	size_t len;
+	int i, full, ret;
+
+	if (iscsi->fd == -1) {
+		iscsi_set_error(iscsi, "trying to write but not connected");
+		return -1;
+	}
+
+	while (iscsi->outqueue != NULL || iscsi->outqueue_current != NULL) {
+		b.niov = b.npdu = b.nhdr = 0;
+		b.queued = 0;
+		full = 0;
+
+		/* finish the PDU we are in the middle of first */
+		if (iscsi->outqueue_current != NULL) {
+			full = iscsi_tx_batch_pdu(iscsi, &b, iscsi->outqueue_current);
+			if (full < 0) {
+				return -1;
+			}
+		}
+
+		for (pdu = iscsi->outqueue;
+		     pdu != NULL && !full &&
+		     b.niov < ISCSI_TX_MAX_IOV && b.queued < ISCSI_TX_MAX_BYTES;
+		     pdu = pdu->next) {
+			if (b.npdu && b.pdu[b.npdu - 1]->flags & ISCSI_PDU_CORK_WHEN_SENT) {
+				/* we must stop sending after that one */
+				break;
+			}
+			ret = iscsi_tx_prepare_pdu(iscsi, pdu);
+			if (ret < 0) {
+				return -1;
+			}
+			if (ret == 0) {
+				break;
+			}
+
+			full = iscsi_tx_batch_pdu(iscsi, &b, pdu);
+			if (full < 0) {
+				return -1;
+			}
+		}
+
+		if (b.npdu == 0 || b.queued == 0) {
+			return 0;
+		}
+
+		count = iscsi_tx_sendv(iscsi, b.iov, b.niov);
+		if (count == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return 0;
+			}
+			iscsi_set_error(iscsi, "Error when writing to "
+					"socket :%d", errno);
+			return -1;
+		}
+
+		/* account for what was written, PDU by PDU */
+		len = count;
+		for (i = 0; i < b.npdu && len > 0; i++) {
+			size_t n = MIN(len, b.len[i]);
+			size_t hdr;
+
+			pdu = b.pdu[i];
+			len -= n;
+
+			if (pdu != iscsi->outqueue_current) {
+				/* pop it off the outqueue. It has to go on the
+				   waitqueue as soon as any of it is on the wire
+				   since the storage might send a R2T as soon as
+				   it has received the header. */
+				iscsi_remove_from_outqueue(iscsi, pdu);
+				if (!(pdu->flags & ISCSI_PDU_DELETE_WHEN_SENT)) {
+					iscsi_waitpdu_add(iscsi, pdu);
+				}
+				iscsi->outqueue_current = pdu;
+			}
+
+			hdr = MIN(n, pdu->outdata.size - pdu->outdata_written);
+			pdu->outdata_written += hdr;
+			pdu->payload_written += n - hdr;
+
+			if (pdu->outdata_written != pdu->outdata.size ||
+			    pdu->payload_written != iscsi_tx_payload_size(iscsi, pdu)) {
+				/* we havent written the full PDU yet */
+				break;
+			}
+			if (pdu->dataout_remaining > 0) {
+				/* the next batch entry, if any, is the next
+				   segment of this sequence */
+				iscsi_tx_dataout_advance(iscsi, pdu);
+				continue;
+			}
+			if (pdu->flags & ISCSI_PDU_CORK_WHEN_SENT) {
+				iscsi->is_corked = 1;
+			}
+			if (pdu->flags & ISCSI_PDU_DELETE_WHEN_SENT) {
+				iscsi->drv->free_pdu(iscsi, pdu);
+			}
+			iscsi->outqueue_current = NULL;
+		}
+
+		if ((size_t)count < b.queued) {
+			/* the socket is full */
+			return 0;
+		}
+	}
+	return 0;
+}
+
+#ifdef ISCSI_HAVE_TX_THREAD
+
+/*
+ * Full duplex.
+ *
+ * Once a connection with want_full_duplex set has logged in, a thread of
+ * its own writes to the socket while the thread that calls iscsi_service()
+ * reads from it and processes what the target sends.
+ *
+ * The service thread still builds and queues every PDU. iscsi_service()
+ * hands what may be sent off the outqueue to the transmit thread: it does
+ * the checks and header fields of iscsi_tx_prepare_pdu(), puts the PDU on
+ * waitpdu, numbers it with tx_seq and pushes it onto tx->incoming, a
+ * stack it shares with the transmit thread only through compare-and-swap
+ * and exchange. From then on only the transmit thread touches what it
+ * writes, the header, the write offsets and the DATA-OUT segment state.
+ *
+ * The transmit thread writes the PDUs in the order they were handed over
+ * and counts the ones it is done with in tx->sent. A PDU with a tx_seq up
+ * to tx->sent belongs to the service thread again, the one that waits
+ * for a response could already be found on waitpdu. Anything that would
+ * complete or free such a PDU before that, a response that overtakes the
+ * last bytes of it or a cancel, waits for the transmit thread with
+ * iscsi_tx_wait(). PDUs without a response go back on tx->done for the
+ * service thread to free.
+ *
+ * A write error shuts the socket down so that the service thread sees it
+ * too and reconnects, which stops the transmit thread.
+ */
+struct iscsi_tx_thread {
+	pthread_t thread;
+	struct iscsi_wakeup wakeup;
+
+	/* shared, handed over PDUs newest first and finished
+	 * DELETE_WHEN_SENT PDUs
+	 */
+	struct iscsi_pdu *incoming;
+	struct iscsi_pdu *done;
+	uint64_t sent;
+	int stop;
+	int error;
+
+	/* service thread only */
+	uint64_t handed;
+
+	/* transmit thread only, the PDUs being written, oldest first,
+	 * and what it needs of the connection to write them
+	 */
+	struct iscsi_pdu *head;
+	struct iscsi_pdu *tail;
+	struct iscsi_context conn;
+};
+
+/* the transmit thread is done with the pdu at the head of its list */
+static void
+iscsi_tx_done(struct iscsi_tx_thread *tx, struct iscsi_pdu *pdu)
+{
+	struct iscsi_pdu *head;
+
+	tx->head = pdu->tx_next;
+	if (tx->head == NULL) {
+		tx->tail = NULL;
+	}
+	if (pdu->flags & ISCSI_PDU_DELETE_WHEN_SENT) {
+		head = __atomic_load_n(&tx->done, __ATOMIC_RELAXED);
+		do {
+			pdu->tx_next = head;
+		} while (!__atomic_compare_exchange_n(&tx->done, &head, pdu, 1,
+						      __ATOMIC_RELEASE,
+						      __ATOMIC_RELAXED));
+	}
+	/* the pdu is not ours any more */
+	__atomic_add_fetch(&tx->sent, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * The write loop of iscsi_write_to_socket() for the transmit thread. It
+ * only uses tx->conn, never the context of the service thread.
+ */
+static int
+iscsi_tx_write(struct iscsi_tx_thread *tx)
+{
+	struct iscsi_context *conn = &tx->conn;
+	struct iscsi_tx_batch b;
+	struct iscsi_pdu *pdu;
+	ssize_t count;
+	size_t len;
+	int i, full;
+
+	while (tx->head != NULL) {
+		b.niov = b.npdu = b.nhdr = 0;
+		b.queued = 0;
+		full = 0;
+
+		for (pdu = tx->head;
+		     pdu != NULL && !full &&
+		     b.niov < ISCSI_TX_MAX_IOV && b.queued < ISCSI_TX_MAX_BYTES;
+		     pdu = pdu->tx_next) {
+			full = iscsi_tx_batch_pdu(conn, &b, pdu);
+			if (full < 0) {
+				errno = EIO;
+				return -1;
+			}
+		}
+
+		count = iscsi_tx_sendv(conn, b.iov, b.niov);
+		if (count == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return 0;
+			}
+			return -1;
+		}
+
+		len = count;
+		for (i = 0; i < b.npdu && len > 0; i++) {
+			size_t n = MIN(len, b.len[i]);
+			size_t hdr;
+
+			pdu = b.pdu[i];
+			len -= n;
+
+			hdr = MIN(n, pdu->outdata.size - pdu->outdata_written);
+			pdu->outdata_written += hdr;
+			pdu->payload_written += n - hdr;
+
+			if (pdu->outdata_written != pdu->outdata.size ||
+			    pdu->payload_written != iscsi_tx_payload_size(conn, pdu)) {
+				break;
+			}
+			if (pdu->dataout_remaining > 0) {
+				iscsi_tx_dataout_advance(conn, pdu);
+				continue;
+			}
+			iscsi_tx_done(tx, pdu);
+		}
+
+		if ((size_t)count < b.queued) {
 			return 0;
 		}
+	}
+	return 0;
+}
+
+static void *
+iscsi_tx_thread(void *arg)
+{
+	struct iscsi_tx_thread *tx = arg;
+	struct iscsi_pdu *pdu, *next, *list, *last;
+	struct pollfd pfd[2];
+	int stop, failed = 0;
+
+	for (;;) {
+		/* anything handed over before stop was set is on
+		 * incoming by the time we see it
+		 */
+		stop = __atomic_load_n(&tx->stop, __ATOMIC_ACQUIRE);
+		iscsi_wakeup_clear(&tx->wakeup);
+
+		/* newest first, the first one we take ends up last */
+		list = NULL;
+		pdu = __atomic_exchange_n(&tx->incoming, NULL, __ATOMIC_ACQUIRE);
+		last = pdu;
+		for (; pdu != NULL; pdu = next) {
+			next = pdu->tx_next;
+			pdu->tx_next = list;
+			list = pdu;
+		}
+		if (list != NULL) {
+			if (tx->tail != NULL) {
+				tx->tail->tx_next = list;
+			} else {
+				tx->head = list;
+			}
+			tx->tail = last;
+		}
+
+		if (stop || failed) {
+			/* drop what is left, nothing more goes on the wire */
+			while (tx->head != NULL) {
+				iscsi_tx_done(tx, tx->head);
+			}
+			if (stop) {
+				break;
+			}
+		} else if (iscsi_tx_write(tx) != 0) {
+			failed = 1;
+			__atomic_store_n(&tx->error, errno ? errno : EIO,
+					 __ATOMIC_RELEASE);
+			/* wake up the service thread */
+			shutdown(tx->conn.fd, SHUT_RDWR);
+			continue;
+		}
+
+		pfd[0].fd      = tx->wakeup.fd[0];
+		pfd[0].events  = POLLIN;
+		pfd[0].revents = 0;
+		pfd[1].fd      = tx->conn.fd;
+		pfd[1].events  = POLLOUT;
+		pfd[1].revents = 0;
+		if (poll(pfd, (tx->head != NULL && !failed) ? 2 : 1, -1) < 0 &&
+		    errno != EINTR) {
+			failed = 1;
+			__atomic_store_n(&tx->error, errno, __ATOMIC_RELEASE);
+			shutdown(tx->conn.fd, SHUT_RDWR);
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Hand everything on the outqueue that may be sent now over to the
+ * transmit thread, in a single push.
+ */
+static int
+iscsi_tx_handoff(struct iscsi_context *iscsi)
+{
+	struct iscsi_tx_thread *tx = iscsi->tx;
+	struct iscsi_pdu *pdu, *cmd, *first = NULL, *last = NULL, *head;
+	int ret = 0;
+
+	while ((pdu = iscsi->outqueue) != NULL) {
+		ret = iscsi_tx_prepare_pdu(iscsi, pdu);
+		if (ret <= 0) {
+			break;
+		}
+		iscsi_remove_from_outqueue(iscsi, pdu);
+		if (!(pdu->flags & ISCSI_PDU_DELETE_WHEN_SENT)) {
+			iscsi_waitpdu_add(iscsi, pdu);
+		}
+		pdu->tx_seq = ++tx->handed;
+		if ((pdu->outdata.data[0] & 0x3f) == ISCSI_PDU_DATA_OUT) {
+			/* the command is not done before its data is */
+			cmd = iscsi_waitpdu_find(iscsi, pdu->itt);
+			if (cmd != NULL) {
+				cmd->tx_seq = pdu->tx_seq;
+			}
+		}
 		if (pdu->flags & ISCSI_PDU_CORK_WHEN_SENT) {
 			iscsi->is_corked = 1;
 		}
-		if (pdu->flags & ISCSI_PDU_DELETE_WHEN_SENT) {
-			iscsi->drv->free_pdu(iscsi, pdu);
+		pdu->tx_next = first;
+		first = pdu;
+		if (last == NULL) {
+			last = pdu;
 		}
-		iscsi->outqueue_current = NULL;
 	}
+
+	if (first != NULL) {
+		head = __atomic_load_n(&tx->incoming, __ATOMIC_RELAXED);
+		do {
+			last->tx_next = head;
+		} while (!__atomic_compare_exchange_n(&tx->incoming, &head,
+						      first, 1,
+						      __ATOMIC_RELEASE,
+						      __ATOMIC_RELAXED));
+		if (head == NULL) {
+			iscsi_wakeup_signal(&tx->wakeup);
+		}
+	}
+	return ret < 0 ? -1 : 0;
+}
+
+/* free the DELETE_WHEN_SENT PDUs the transmit thread is done with */
+static void
+iscsi_tx_reap(struct iscsi_context *iscsi)
+{
+	struct iscsi_pdu *pdu, *next;
+
+	if (__atomic_load_n(&iscsi->tx->done, __ATOMIC_RELAXED) == NULL) {
+		return;
+	}
+	pdu = __atomic_exchange_n(&iscsi->tx->done, NULL, __ATOMIC_ACQUIRE);
+	for (; pdu != NULL; pdu = next) {
+		next = pdu->tx_next;
+		iscsi->drv->free_pdu(iscsi, pdu);
+	}
+}
+
+static int
+iscsi_tx_service(struct iscsi_context *iscsi)
+{
+	int err;
+
+	iscsi_tx_reap(iscsi);
+
+	err = __atomic_load_n(&iscsi->tx->error, __ATOMIC_ACQUIRE);
+	if (err != 0) {
+		iscsi_set_error(iscsi, "Error when writing to "
+				"socket :%d", err);
+		return -1;
+	}
+	return iscsi_tx_handoff(iscsi);
+}
+
+int
+iscsi_tx_start(struct iscsi_context *iscsi)
+{
+	struct iscsi_tx_thread *tx;
+	sigset_t all, old;
+	int err;
+
+	if (iscsi->tx != NULL || iscsi->transport != TCP_TRANSPORT ||
+	    iscsi->fd == -1 || iscsi->outqueue_current != NULL) {
+		return 0;
+	}
+
+	tx = iscsi_zmalloc(iscsi, sizeof(struct iscsi_tx_thread));
+	if (tx == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: Failed to allocate "
+				"transmit thread");
+		return -1;
+	}
+	tx->conn.fd = iscsi->fd;
+	tx->conn.header_digest = iscsi->header_digest;
+	tx->conn.data_digest = iscsi->data_digest;
+	tx->conn.target_max_recv_data_segment_length =
+		iscsi->target_max_recv_data_segment_length;
+
+	if (iscsi_wakeup_open(&tx->wakeup) != 0) {
+		iscsi_set_error(iscsi, "Failed to create the transmit thread "
+				"wakeup fd: %s", strerror(errno));
+		iscsi_free(iscsi, tx);
+		return -1;
+	}
+
+	/* signals are for the threads of the application */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	err = pthread_create(&tx->thread, NULL, iscsi_tx_thread, tx);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (err != 0) {
+		iscsi_set_error(iscsi, "Failed to start the transmit thread: "
+				"%s", strerror(err));
+		iscsi_wakeup_close(&tx->wakeup);
+		iscsi_free(iscsi, tx);
+		return -1;
+	}
+	iscsi->tx = tx;
+
+	ISCSI_LOG(iscsi, 2, "full duplex, transmit thread started");
+	return 0;
+}
+
+void
+iscsi_tx_stop(struct iscsi_context *iscsi)
+{
+	struct iscsi_tx_thread *tx = iscsi->tx;
+	struct iscsi_pdu *pdu;
+
+	if (tx == NULL) {
+		return;
+	}
+
+	__atomic_store_n(&tx->stop, 1, __ATOMIC_RELEASE);
+	iscsi_wakeup_signal(&tx->wakeup);
+	pthread_join(tx->thread, NULL);
+
+	iscsi_tx_reap(iscsi);
+	/* whatever it did not get to write never reached the target */
+	for (pdu = iscsi->waitpdu; pdu; pdu = pdu->next) {
+		pdu->tx_seq = 0;
+	}
+
+	iscsi_wakeup_close(&tx->wakeup);
+	iscsi_free(iscsi, tx);
+	iscsi->tx = NULL;
+
+	ISCSI_LOG(iscsi, 2, "full duplex, transmit thread stopped");
+}
+
+int
+iscsi_tx_busy(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
+{
+	return iscsi->tx != NULL &&
+		pdu->tx_seq > __atomic_load_n(&iscsi->tx->sent,
+					      __ATOMIC_ACQUIRE);
+}
+
+void
+iscsi_tx_wait(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
+{
+	while (iscsi_tx_busy(iscsi, pdu)) {
+		sched_yield();
+	}
+}
+
+#else /* ISCSI_HAVE_TX_THREAD */
+
+static int
+iscsi_tx_service(struct iscsi_context *iscsi)
+{
+	(void)iscsi;
+	return 0;
+}
+
+int
+iscsi_tx_start(struct iscsi_context *iscsi)
+{
+	(void)iscsi;
 	return 0;
 }
 
+void
+iscsi_tx_stop(struct iscsi_context *iscsi)
+{
+	(void)iscsi;
+}
+
+int
+iscsi_tx_busy(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
+{
+	(void)iscsi;
+	(void)pdu;
+	return 0;
+}
+
+void
+iscsi_tx_wait(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
+{
+	(void)iscsi;
+	(void)pdu;
+}
+
+#endif /* ISCSI_HAVE_TX_THREAD */
+
 int
 iscsi_service_reconnect_if_loggedin(struct iscsi_context *iscsi)
 {
@@ -945,14 +2246,14 @@ iscsi_tcp_service(struct iscsi_context *iscsi, int revents)
 
 	if (iscsi->pending_reconnect) {
         // 等待重新连接
-		if (time(NULL) >= iscsi->next_reconnect) {
+		if (iscsi_monotonic_ms() >= iscsi->next_reconnect) {
             // 大于下次重新连接时间
 			return iscsi_reconnect(iscsi);
-		} else {
-			if (iscsi->old_iscsi) {
-				goto check_timeout;
-			}
 		}
+		/* The current connection has failed, for example on a
+		 * digest error, leave it alone until we reconnect.
+		 */
+		goto check_timeout;
 	}
 
 	if (revents & POLLERR) {
@@ -1031,7 +2332,12 @@ iscsi_tcp_service(struct iscsi_context *iscsi, int revents)
 			return iscsi_service_reconnect_if_loggedin(iscsi);
 		}
 	}
-	if (revents & POLLOUT) {
+	if (iscsi->tx != NULL) {
+		/* the transmit thread waits for the socket itself */
+		if (iscsi_tx_service(iscsi) != 0) {
+			return iscsi_service_reconnect_if_loggedin(iscsi);
+		}
+	} else if (revents & POLLOUT) {
 		if (iscsi_write_to_socket(iscsi) != 0) {
 			return iscsi_service_reconnect_if_loggedin(iscsi);
 		}
@@ -1050,6 +2356,13 @@ check_timeout:
 int
 iscsi_service(struct iscsi_context *iscsi, int revents)
 {
+	if (iscsi->submit != NULL && iscsi_submit_drain(iscsi) > 0 &&
+	    !(revents & (POLLERR | POLLHUP))) {
+		/* send what other threads submitted now instead of on
+		 * the next poll
+		 */
+		revents |= iscsi->drv->which_events(iscsi) & POLLOUT;
+	}
     // iscsi_tcp_service
 	return iscsi->drv->service(iscsi, revents);
 }
@@ -1071,7 +2384,6 @@ static int iscsi_tcp_queue_pdu(struct iscsi_context *iscsi,
 void
 iscsi_free_iscsi_in_pdu(struct iscsi_context *iscsi, struct iscsi_in_pdu *in)
 {
-	iscsi_sfree(iscsi, in->hdr);
 	iscsi_free(iscsi, in->data);
 	in->data=NULL;
 	iscsi_sfree(iscsi, in);
@@ -1148,6 +2460,25 @@ int iscsi_set_tcp_keepalive(struct iscsi_context *iscsi, int idle, int count, in
 	return 0;
 }
 
+int
+iscsi_set_full_duplex(struct iscsi_context *iscsi, int enable)
+{
+	if (iscsi->is_loggedin) {
+		iscsi_set_error(iscsi, "trying to set full duplex while "
+				"logged in");
+		return -1;
+	}
+#ifndef ISCSI_HAVE_TX_THREAD
+	if (enable) {
+		iscsi_set_error(iscsi, "full duplex is not supported on this "
+				"platform");
+		return -1;
+	}
+#endif
+	iscsi->want_full_duplex = !!enable;
+	return 0;
+}
+
 void iscsi_set_bind_interfaces(struct iscsi_context *iscsi, char * interfaces)
 {
 #if __linux
@@ -0,0 +1,383 @@
+/*
+   Copyright (C) 2010 by Ronnie Sahlberg <ronniesahlberg@gmail.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "iscsi.h"
+#include "iscsi-private.h"
+#include "scsi-lowlevel.h"
+#include "slist.h"
+
+/*
+ * Splitting of READ16/WRITE16 commands larger than the MAXIMUM TRANSFER
+ * LENGTH of the Block Limits VPD page.
+ *
+ * The task handed back to the application carries the CDB for the whole
+ * range but is never sent. Each piece is a task of its own that is sent
+ * as a normal SCSI command, all of them at the same time. When the last
+ * piece has completed the callback of the application is invoked once,
+ * with the first status that was not GOOD and the sum of the residuals.
+ * Reads that do not use an iovector land in a buffer owned by the
+ * application's task, each piece reading straight into its part of it.
+ *
+ * The bookkeeping of the pieces lives in an array of the split. Once a
+ * piece has been handed to iscsi_scsi_command_async() the private pointer
+ * of its task belongs to the library, so it is never used to find it.
+ */
+
+struct iscsi_split_io;
+
+struct iscsi_split_piece {
+	struct iscsi_split_io *split;
+	struct scsi_task *task;	/* NULL once it has completed */
+};
+
+struct iscsi_split_io {
+	struct iscsi_split_io *next;
+	struct iscsi_context *iscsi;
+	struct scsi_task *task;
+	iscsi_command_cb cb;
+	void *private_data;
+	int status;
+	size_t residual;
+	int outstanding;
+	int num_pieces;
+	struct iscsi_split_piece *pieces;
+};
+
+int
+iscsi_set_split_io(struct iscsi_context *iscsi, int enable)
+{
+	if (iscsi->is_loggedin) {
+		iscsi_set_error(iscsi, "Already logged in when enabling "
+				"splitting of large I/O");
+		return -1;
+	}
+	iscsi->split_io = !!enable;
+	return 0;
+}
+
+uint32_t
+iscsi_get_max_transfer_length(struct iscsi_context *iscsi)
+{
+	return iscsi->max_xfer_len;
+}
+
+int
+iscsi_split_needed(struct iscsi_context *iscsi, uint32_t datalen,
+		   int blocksize)
+{
+	if (!iscsi->split_io || iscsi->max_xfer_len == 0 || blocksize <= 0) {
+		return 0;
+	}
+	return datalen / blocksize > iscsi->max_xfer_len;
+}
+
+/* Point a piece at the bytes [offset, offset + len) of an iovector. */
+static struct scsi_iovec *
+iscsi_split_iov(struct scsi_task *piece, struct scsi_iovec *iov, int niov,
+		size_t offset, size_t len, int *piece_niov)
+{
+	struct scsi_iovec *piece_iov;
+	size_t pos = 0, end = offset + len;
+	int i, first = -1, n = 0;
+
+	for (i = 0; i < niov && pos < end; pos += iov[i++].iov_len) {
+		if (pos + iov[i].iov_len <= offset) {
+			continue;
+		}
+		if (first < 0) {
+			first = i;
+		}
+		n++;
+	}
+	if (n == 0) {
+		return NULL;
+	}
+
+	piece_iov = scsi_malloc(piece, n * sizeof(struct scsi_iovec));
+	if (piece_iov == NULL) {
+		return NULL;
+	}
+
+	for (pos = 0, i = 0; i < first; i++) {
+		pos += iov[i].iov_len;
+	}
+	for (i = 0; i < n; i++) {
+		size_t start = 0, stop = iov[first + i].iov_len;
+
+		if (pos < offset) {
+			start = offset - pos;
+		}
+		if (pos + stop > end) {
+			stop = end - pos;
+		}
+		piece_iov[i].iov_base = (char *)iov[first + i].iov_base + start;
+		piece_iov[i].iov_len  = stop - start;
+		pos += iov[first + i].iov_len;
+	}
+
+	*piece_niov = n;
+	return piece_iov;
+}
+
+static void
+iscsi_split_free(struct iscsi_split_io *split)
+{
+	struct iscsi_context *iscsi = split->iscsi;
+	int i;
+
+	for (i = 0; i < split->num_pieces; i++) {
+		if (split->pieces[i].task != NULL) {
+			scsi_free_scsi_task(split->pieces[i].task);
+		}
+	}
+	iscsi_free(iscsi, split->pieces);
+	iscsi_free(iscsi, split);
+}
+
+static void
+iscsi_split_complete(struct iscsi_split_io *split)
+{
+	struct iscsi_context *iscsi = split->iscsi;
+	struct scsi_task *task = split->task;
+
+	ISCSI_LIST_REMOVE(&iscsi->split_ios, split);
+
+	task->status = split->status;
+	if (split->residual) {
+		task->residual_status = SCSI_RESIDUAL_UNDERFLOW;
+		task->residual = split->residual;
+	}
+	if (task->xfer_dir == SCSI_XFER_READ && task->datain.data != NULL) {
+		task->datain.size = task->expxferlen - split->residual;
+	}
+
+	split->cb(iscsi, split->status, task, split->private_data);
+	iscsi_split_free(split);
+}
+
+static void
+iscsi_split_piece_cb(struct iscsi_context *iscsi, int status,
+		     void *command_data, void *private_data)
+{
+	struct iscsi_split_piece *sp = private_data;
+	struct iscsi_split_io *split = sp->split;
+	struct scsi_task *piece = command_data;
+
+	if (status != SCSI_STATUS_GOOD && split->status == SCSI_STATUS_GOOD) {
+		split->status = status;
+		if (status == SCSI_STATUS_CHECK_CONDITION) {
+			split->task->sense = piece->sense;
+		}
+	}
+	if (piece->residual_status == SCSI_RESIDUAL_UNDERFLOW) {
+		split->residual += piece->residual;
+	}
+
+	sp->task = NULL;
+	scsi_free_scsi_task(piece);
+
+	if (--split->outstanding == 0) {
+		iscsi_split_complete(split);
+	}
+}
+
+struct scsi_task *
+iscsi_split_rw16_task(struct iscsi_context *iscsi, int lun, int write,
+		      uint64_t lba, unsigned char *data, uint32_t datalen,
+		      int blocksize, int protect, int dpo, int fua, int fua_nv,
+		      int group_number, iscsi_command_cb cb,
+		      void *private_data, struct scsi_iovec *iov, int niov)
+{
+	struct iscsi_split_io *split;
+	struct scsi_task *task, *piece;
+	struct scsi_iovec *piece_iov;
+	struct iscsi_split_piece *sp;
+	struct iscsi_data d;
+	uint32_t max_len = iscsi->max_xfer_len * blocksize;
+	uint32_t offset, len;
+	int i, piece_niov;
+
+	if (write) {
+		task = scsi_cdb_write16(lba, datalen, blocksize, protect,
+					dpo, fua, fua_nv, group_number);
+	} else {
+		task = scsi_cdb_read16(lba, datalen, blocksize, protect,
+				       dpo, fua, fua_nv, group_number);
+	}
+	if (task == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: Failed to create "
+				"%s16 cdb.", write ? "write" : "read");
+		return NULL;
+	}
+	task->lun = lun;
+
+	split = iscsi_zmalloc(iscsi, sizeof(struct iscsi_split_io));
+	if (split == NULL) {
+		goto oom;
+	}
+	split->iscsi        = iscsi;
+	split->task         = task;
+	split->cb           = cb;
+	split->private_data = private_data;
+	split->status       = SCSI_STATUS_GOOD;
+	split->num_pieces   = (datalen + max_len - 1) / max_len;
+	split->pieces = iscsi_zmalloc(iscsi, split->num_pieces *
+				      sizeof(struct iscsi_split_piece));
+	if (split->pieces == NULL) {
+		goto oom;
+	}
+
+	if (!write && iov == NULL) {
+		task->datain.data = malloc(datalen);
+		if (task->datain.data == NULL) {
+			goto oom;
+		}
+	}
+
+	/* build all pieces before sending any of them, so that running out
+	 * of memory does not leave a partial transfer behind.
+	 */
+	for (i = 0, offset = 0; i < split->num_pieces; i++, offset += len) {
+		len = datalen - offset < max_len ? datalen - offset : max_len;
+		if (write) {
+			piece = scsi_cdb_write16(lba + offset / blocksize, len,
+						 blocksize, protect, dpo, fua,
+						 fua_nv, group_number);
+		} else {
+			piece = scsi_cdb_read16(lba + offset / blocksize, len,
+						blocksize, protect, dpo, fua,
+						fua_nv, group_number);
+		}
+		if (piece == NULL) {
+			goto oom;
+		}
+		split->pieces[i].split = split;
+		split->pieces[i].task  = piece;
+
+		if (iov != NULL) {
+			piece_iov = iscsi_split_iov(piece, iov, niov, offset,
+						    len, &piece_niov);
+			if (piece_iov == NULL) {
+				goto oom;
+			}
+			if (write) {
+				scsi_task_set_iov_out(piece, piece_iov,
+						      piece_niov);
+			} else {
+				scsi_task_set_iov_in(piece, piece_iov,
+						     piece_niov);
+			}
+		} else if (!write) {
+			piece_iov = scsi_malloc(piece,
+						sizeof(struct scsi_iovec));
+			if (piece_iov == NULL) {
+				goto oom;
+			}
+			piece_iov->iov_base = task->datain.data + offset;
+			piece_iov->iov_len  = len;
+			scsi_task_set_iov_in(piece, piece_iov, 1);
+		}
+	}
+
+	ISCSI_LIST_ADD(&iscsi->split_ios, split);
+
+	/* hold a reference so that a piece failing straight away can not
+	 * complete the whole transfer while we are still sending.
+	 */
+	split->outstanding = 1;
+	for (i = 0, offset = 0; i < split->num_pieces; i++, offset += len) {
+		len = datalen - offset < max_len ? datalen - offset : max_len;
+		sp = &split->pieces[i];
+		piece = sp->task;
+		d.data = data ? data + offset : NULL;
+		d.size = len;
+
+		split->outstanding++;
+		if (iscsi_scsi_command_async(iscsi, lun, piece,
+					     iscsi_split_piece_cb,
+					     (write && iov == NULL) ? &d : NULL,
+					     sp) == 0) {
+			continue;
+		}
+		split->outstanding--;
+		if (i == 0) {
+			ISCSI_LIST_REMOVE(&iscsi->split_ios, split);
+			iscsi_split_free(split);
+			scsi_free_scsi_task(task);
+			return NULL;
+		}
+		/* the pieces already sent complete the transfer */
+		ISCSI_LOG(iscsi, 1, "failed to send piece %d of %d of a "
+			  "split transfer: %s", i, split->num_pieces,
+			  iscsi_get_error(iscsi));
+		if (split->status == SCSI_STATUS_GOOD) {
+			split->status = SCSI_STATUS_ERROR;
+		}
+		break;
+	}
+	if (--split->outstanding == 0) {
+		iscsi_split_complete(split);
+	}
+
+	return task;
+
+ oom:
+	iscsi_set_error(iscsi, "Out-of-memory: Failed to split a %s16 of "
+			"%u bytes.", write ? "write" : "read", datalen);
+	if (split != NULL) {
+		if (split->pieces != NULL) {
+			iscsi_split_free(split);
+		} else {
+			iscsi_free(iscsi, split);
+		}
+	}
+	scsi_free_scsi_task(task);
+	return NULL;
+}
+
+int
+iscsi_split_cancel_task(struct iscsi_context *iscsi, struct scsi_task *task)
+{
+	struct iscsi_split_io *split;
+	int i;
+
+	for (split = iscsi->split_ios; split; split = split->next) {
+		if (split->task == task) {
+			break;
+		}
+	}
+	if (split == NULL) {
+		return -1;
+	}
+
+	split->outstanding++;
+	for (i = 0; i < split->num_pieces; i++) {
+		if (split->pieces[i].task != NULL) {
+			iscsi_scsi_cancel_task(iscsi, split->pieces[i].task);
+		}
+	}
+	if (--split->outstanding == 0) {
+		iscsi_split_complete(split);
+	}
+	return 0;
+}
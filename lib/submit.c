@@ -0,0 +1,339 @@
+/*
+   Copyright (C) 2010 by Ronnie Sahlberg <ronniesahlberg@gmail.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "iscsi.h"
+#include "iscsi-private.h"
+#include "scsi-lowlevel.h"
+
+/*
+ * Submission of commands from other threads than the one that services
+ * the context.
+ *
+ * A thread that wants to send a command pushes it onto q->head, a stack
+ * that any number of threads can push onto with a compare-and-swap and
+ * that the service thread empties in one go with an exchange. The entry
+ * is carved from the arena of the task itself so submitting does not
+ * allocate from the heap. Nothing else of the context is touched by the
+ * submitting thread.
+ *
+ * The thread that pushes onto an empty stack wakes the service thread
+ * through an eventfd, or a pipe where there is none, unless a wakeup is
+ * already pending. iscsi_service() takes the whole stack, turns it back
+ * into submission order and sends the commands the normal way, so the
+ * callbacks are all invoked from the service thread.
+ */
+
+struct iscsi_submission {
+	struct iscsi_submission *next;
+	struct scsi_task *task;
+	int lun;
+	iscsi_command_cb cb;
+	void *private_data;
+	int has_data;
+	struct iscsi_data data;
+};
+
+struct iscsi_submit_queue {
+	struct iscsi_submission *head;
+	struct iscsi_wakeup wakeup;
+};
+
+#ifdef HAVE_ATOMIC_BUILTINS
+
+/*
+ * A descriptor other threads use to wake up a thread that sleeps in
+ * poll(). signalled is set while it has been written and not read yet so
+ * that only the first of several wakeups costs a system call.
+ */
+int
+iscsi_wakeup_open(struct iscsi_wakeup *w)
+{
+	w->signalled = 0;
+#ifdef HAVE_SYS_EVENTFD_H
+	w->fd[0] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (w->fd[0] == -1) {
+		return -1;
+	}
+	w->fd[1] = w->fd[0];
+	return 0;
+#else
+	int i;
+
+	if (pipe(w->fd) != 0) {
+		return -1;
+	}
+	for (i = 0; i < 2; i++) {
+		fcntl(w->fd[i], F_SETFL, fcntl(w->fd[i], F_GETFL) | O_NONBLOCK);
+		fcntl(w->fd[i], F_SETFD, FD_CLOEXEC);
+	}
+	return 0;
+#endif
+}
+
+void
+iscsi_wakeup_close(struct iscsi_wakeup *w)
+{
+	close(w->fd[0]);
+	if (w->fd[1] != w->fd[0]) {
+		close(w->fd[1]);
+	}
+}
+
+void
+iscsi_wakeup_signal(struct iscsi_wakeup *w)
+{
+	uint64_t one = 1;
+	ssize_t count;
+
+	if (__atomic_exchange_n(&w->signalled, 1, __ATOMIC_ACQ_REL)) {
+		return;
+	}
+	/* a full pipe or eventfd is readable already */
+#ifdef HAVE_SYS_EVENTFD_H
+	count = write(w->fd[1], &one, sizeof(one));
+#else
+	count = write(w->fd[1], &one, 1);
+#endif
+	(void)count;
+}
+
+/*
+ * Reset the descriptor. Call it before looking for work, anything that
+ * is signalled from then on wakes the poll() again.
+ */
+void
+iscsi_wakeup_clear(struct iscsi_wakeup *w)
+{
+	char buf[64];
+
+	if (!__atomic_load_n(&w->signalled, __ATOMIC_ACQUIRE)) {
+		return;
+	}
+	while (read(w->fd[0], buf, sizeof(buf)) > 0) {
+		/* an eventfd is reset by a single read */
+		if (w->fd[0] == w->fd[1]) {
+			break;
+		}
+	}
+	__atomic_store_n(&w->signalled, 0, __ATOMIC_RELEASE);
+}
+
+/* Take everything submitted so far, oldest first. */
+static struct iscsi_submission *
+iscsi_submit_take(struct iscsi_submit_queue *q)
+{
+	struct iscsi_submission *s, *next, *list = NULL;
+
+	if (__atomic_load_n(&q->head, __ATOMIC_RELAXED) == NULL &&
+	    !__atomic_load_n(&q->wakeup.signalled, __ATOMIC_RELAXED)) {
+		return NULL;
+	}
+	/* anything pushed from now on signals again, anything pushed
+	 * before is taken below
+	 */
+	iscsi_wakeup_clear(&q->wakeup);
+
+	s = __atomic_exchange_n(&q->head, NULL, __ATOMIC_ACQUIRE);
+	while (s != NULL) {
+		next = s->next;
+		s->next = list;
+		list = s;
+		s = next;
+	}
+	return list;
+}
+
+int
+iscsi_set_threaded_submit(struct iscsi_context *iscsi, int enable)
+{
+	struct iscsi_submit_queue *q;
+
+	if (!enable) {
+		if (iscsi->submit != NULL) {
+			iscsi_submit_drain(iscsi);
+			iscsi_submit_destroy(iscsi);
+		}
+		return 0;
+	}
+	if (iscsi->submit != NULL) {
+		return 0;
+	}
+
+	q = iscsi_zmalloc(iscsi, sizeof(struct iscsi_submit_queue));
+	if (q == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: Failed to allocate "
+				"submit queue");
+		return -1;
+	}
+	if (iscsi_wakeup_open(&q->wakeup) != 0) {
+		iscsi_set_error(iscsi, "Failed to create the submit queue "
+				"wakeup fd: %s", strerror(errno));
+		iscsi_free(iscsi, q);
+		return -1;
+	}
+	iscsi->submit = q;
+	iscsi_engine_touch(iscsi);
+
+	ISCSI_LOG(iscsi, 2, "threaded submission enabled");
+	return 0;
+}
+
+int
+iscsi_submit_task(struct iscsi_context *iscsi, int lun,
+		  struct scsi_task *task, iscsi_command_cb cb,
+		  struct iscsi_data *d, void *private_data)
+{
+	struct iscsi_submit_queue *q = iscsi->submit;
+	struct iscsi_submission *s, *head;
+
+	/* not iscsi_set_error(), the error string belongs to the
+	 * service thread
+	 */
+	if (q == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	s = scsi_malloc(task, sizeof(struct iscsi_submission));
+	if (s == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	s->task         = task;
+	s->lun          = lun;
+	s->cb           = cb;
+	s->private_data = private_data;
+	s->has_data     = d != NULL;
+	if (d != NULL) {
+		s->data = *d;
+	}
+
+	head = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+	do {
+		s->next = head;
+	} while (!__atomic_compare_exchange_n(&q->head, &head, s, 1,
+					      __ATOMIC_RELEASE,
+					      __ATOMIC_RELAXED));
+	if (head == NULL) {
+		iscsi_wakeup_signal(&q->wakeup);
+	}
+	return 0;
+}
+
+int
+iscsi_get_submit_fd(struct iscsi_context *iscsi)
+{
+	return iscsi->submit ? iscsi->submit->wakeup.fd[0] : -1;
+}
+
+int
+iscsi_submit_drain(struct iscsi_context *iscsi)
+{
+	struct iscsi_submission *s, *next;
+	int count = 0;
+
+	for (s = iscsi_submit_take(iscsi->submit); s != NULL; s = next) {
+		/* the entry lives in the task, which the callback may free */
+		next = s->next;
+		count++;
+		if (iscsi_scsi_command_async(iscsi, s->lun, s->task, s->cb,
+					     s->has_data ? &s->data : NULL,
+					     s->private_data) != 0) {
+			s->cb(iscsi, SCSI_STATUS_ERROR, s->task,
+			      s->private_data);
+		}
+	}
+	return count;
+}
+
+void
+iscsi_submit_destroy(struct iscsi_context *iscsi)
+{
+	struct iscsi_submission *s, *next;
+
+	for (s = iscsi_submit_take(iscsi->submit); s != NULL; s = next) {
+		next = s->next;
+		s->cb(iscsi, SCSI_STATUS_CANCELLED, s->task, s->private_data);
+	}
+	iscsi_engine_fd_closing(iscsi, iscsi->submit->wakeup.fd[0]);
+	iscsi_wakeup_close(&iscsi->submit->wakeup);
+	iscsi_free(iscsi, iscsi->submit);
+	iscsi->submit = NULL;
+}
+
+#else /* HAVE_ATOMIC_BUILTINS */
+
+int
+iscsi_set_threaded_submit(struct iscsi_context *iscsi, int enable)
+{
+	if (!enable) {
+		return 0;
+	}
+	iscsi_set_error(iscsi, "threaded submission is not supported on "
+			"this platform");
+	return -1;
+}
+
+int
+iscsi_submit_task(struct iscsi_context *iscsi, int lun,
+		  struct scsi_task *task, iscsi_command_cb cb,
+		  struct iscsi_data *d, void *private_data)
+{
+	(void)iscsi; (void)lun; (void)task; (void)cb; (void)d;
+	(void)private_data;
+
+	errno = EINVAL;
+	return -1;
+}
+
+int
+iscsi_get_submit_fd(struct iscsi_context *iscsi)
+{
+	(void)iscsi;
+	return -1;
+}
+
+int
+iscsi_submit_drain(struct iscsi_context *iscsi)
+{
+	(void)iscsi;
+	return 0;
+}
+
+void
+iscsi_submit_destroy(struct iscsi_context *iscsi)
+{
+	(void)iscsi;
+}
+
+#endif /* HAVE_ATOMIC_BUILTINS */
@@ -50,30 +50,61 @@ struct iscsi_sync_state {
         struct scsi_task *task;
 };
 
+/* Wake up in time for the next timeout or reconnect, but at least
+ * once a second like we always have.
+ */
+static int
+sync_poll_timeout(struct iscsi_context *iscsi)
+{
+	int timeout = iscsi_get_next_timeout_ms(iscsi);
+
+	if (timeout < 0 || timeout > 1000) {
+		timeout = 1000;
+	}
+	return timeout;
+}
+
 static void
 event_loop(struct iscsi_context *iscsi, struct iscsi_sync_state *state)
 {
-        struct pollfd pfd;
-	int ret;
+        struct pollfd pfd[ISCSI_MAX_CONNECTIONS + 1];
+	int i, count, nfds, ret;
 
 	while (state->finished == 0) {
 		short revents;
 
-		pfd.fd = iscsi_get_fd(iscsi);
-		pfd.events = iscsi_which_events(iscsi);
+		/* every connection of the session */
+		count = iscsi_get_connection_count(iscsi);
+		for (i = 0; i < count; i++) {
+			pfd[i].fd = iscsi_get_connection_fd(iscsi, i);
+			pfd[i].events = iscsi_which_connection_events(iscsi, i);
+			pfd[i].revents = 0;
+		}
+		/* wake up for commands other threads submit, servicing
+		 * the session sends them
+		 */
+		nfds = count;
+		if (iscsi_get_submit_fd(iscsi) != -1) {
+			pfd[nfds].fd = iscsi_get_submit_fd(iscsi);
+			pfd[nfds].events = POLLIN;
+			pfd[nfds].revents = 0;
+			nfds++;
+		}
 
-		if ((ret = poll(&pfd, 1, 1000)) < 0) {
+		if ((ret = poll(pfd, nfds, sync_poll_timeout(iscsi))) < 0) {
 			iscsi_set_error(iscsi, "Poll failed");
 			state->status = -1;
 			return;
 		}
-		revents = (ret == 0) ? 0 : pfd.revents;
-		if (iscsi_service(iscsi, revents) < 0) {
-			iscsi_set_error(iscsi,
-				"iscsi_service failed with : %s",
-				iscsi_get_error(iscsi));
-			state->status = -1;
-			return;
+		for (i = 0; i < count; i++) {
+			revents = (ret == 0) ? 0 : pfd[i].revents;
+			if (iscsi_service_connection(iscsi, i, revents) < 0) {
+				iscsi_set_error(iscsi,
+					"iscsi_service failed with : %s",
+					iscsi_get_error(iscsi));
+				state->status = -1;
+				return;
+			}
 		}
 	}
 }
@@ -140,9 +171,19 @@ iscsi_full_connect_sync(struct iscsi_context *iscsi,
 	/* in case of error, cancel any pending pdus */
 	if (state.status != SCSI_STATUS_GOOD) {
 		iscsi_cancel_pdus(iscsi);
+		return -1;
 	}
 
-	return (state.status == SCSI_STATUS_GOOD) ? 0 : -1;
+	/* a failed auto-tune logs in again with the lengths we had
+	 * before, only fail if that did not work.
+	 */
+	if (iscsi->autotune && iscsi->session_type == ISCSI_SESSION_NORMAL &&
+	    iscsi_autotune_sync(iscsi, lun) != 0) {
+		ISCSI_LOG(iscsi, 1, "%s", iscsi_get_error(iscsi));
+		return iscsi->is_loggedin ? 0 : -1;
+	}
+
+	return 0;
 }
 
 int iscsi_login_sync(struct iscsi_context *iscsi)
@@ -162,6 +203,23 @@ int iscsi_login_sync(struct iscsi_context *iscsi)
 	return (state.status == SCSI_STATUS_GOOD) ? 0 : -1;
 }
 
+int iscsi_add_connection_sync(struct iscsi_context *iscsi)
+{
+	struct iscsi_sync_state state;
+
+	memset(&state, 0, sizeof(state));
+
+	if (iscsi_add_connection_async(iscsi, iscsi_sync_cb, &state) != 0) {
+		iscsi_set_error(iscsi, "Failed to add connection. %s",
+				iscsi_get_error(iscsi));
+		return -1;
+	}
+
+	event_loop(iscsi, &state);
+
+	return (state.status == SCSI_STATUS_GOOD) ? 0 : -1;
+}
+
 int iscsi_logout_sync(struct iscsi_context *iscsi)
 {
 	struct iscsi_sync_state state;
@@ -179,6 +237,83 @@ int iscsi_logout_sync(struct iscsi_context *iscsi)
 	return (state.status == SCSI_STATUS_GOOD) ? 0 : -1;
 }
 
+static void
+group_event_loop(struct iscsi_session_group *group,
+		 struct iscsi_sync_state *state)
+{
+	struct pollfd *pfd;
+	int i, count, timeout, ret;
+
+	count = iscsi_session_group_get_count(group);
+	pfd = malloc(count * sizeof(struct pollfd));
+	if (pfd == NULL) {
+		state->status = -1;
+		return;
+	}
+
+	while (state->finished == 0) {
+		for (i = 0; i < count; i++) {
+			pfd[i].fd = iscsi_session_group_get_fd(group, i);
+			pfd[i].events = iscsi_session_group_which_events(group,
+									 i);
+			pfd[i].revents = 0;
+		}
+
+		timeout = iscsi_session_group_get_next_timeout_ms(group);
+		if (timeout < 0 || timeout > 1000) {
+			timeout = 1000;
+		}
+		if ((ret = poll(pfd, count, timeout)) < 0) {
+			state->status = -1;
+			break;
+		}
+		/* A session that fails is reported through the callback,
+		 * keep going until all of them have.
+		 */
+		for (i = 0; i < count; i++) {
+			iscsi_session_group_service(group, i,
+					ret == 0 ? 0 : pfd[i].revents);
+		}
+	}
+	free(pfd);
+}
+
+int
+iscsi_session_group_full_connect_sync(struct iscsi_session_group *group,
+				      const char *url)
+{
+	struct iscsi_sync_state state;
+
+	memset(&state, 0, sizeof(state));
+
+	if (iscsi_session_group_full_connect_async(group, url, iscsi_sync_cb,
+						   &state) != 0) {
+		return -1;
+	}
+
+	group_event_loop(group, &state);
+
+	return (state.status == SCSI_STATUS_GOOD) ? 0 : -1;
+}
+
+int
+iscsi_session_group_logout_sync(struct iscsi_session_group *group)
+{
+	struct iscsi_context *iscsi;
+	int i, ret = 0;
+
+	for (i = 0; i < iscsi_session_group_get_count(group); i++) {
+		iscsi = iscsi_session_group_get_context(group, i);
+		if (!iscsi_is_logged_in(iscsi)) {
+			continue;
+		}
+		if (iscsi_logout_sync(iscsi) != 0) {
+			ret = -1;
+		}
+	}
+	return ret;
+}
+
 static void
 reconnect_event_loop(struct iscsi_context *iscsi, struct iscsi_sync_state *state)
 {
@@ -189,11 +324,16 @@ reconnect_event_loop(struct iscsi_context *iscsi, struct iscsi_sync_state *state
 		pfd.events = iscsi_which_events(iscsi);
 
 		if (!pfd.events) {
-			sleep(1);
+			/* waiting for the reconnect backoff to expire */
+#if defined(_WIN32)
+			Sleep(sync_poll_timeout(iscsi));
+#else
+			poll(NULL, 0, sync_poll_timeout(iscsi));
+#endif
 			continue;
 		}
 
-		if ((ret = poll(&pfd, 1, 1000)) < 0) {
+		if ((ret = poll(&pfd, 1, sync_poll_timeout(iscsi))) < 0) {
 			iscsi_set_error(iscsi, "Poll failed");
 			state->status = -1;
 			return;
@@ -242,6 +382,209 @@ int iscsi_force_reconnect_sync(struct iscsi_context *iscsi)
 	return (state.status == SCSI_STATUS_GOOD) ? 0 : -1;
 }
 
+/*
+ * Auto-tuning of MaxBurstLength and MaxRecvDataSegmentLength.
+ *
+ * Every candidate length is tried by logging in again and reading the
+ * start of the LUN for a while with a few commands in flight. Only reads
+ * are used so that the contents of the LUN are left alone.
+ */
+#define AUTOTUNE_IO_SIZE	(1024 * 1024)
+#define AUTOTUNE_QUEUE_DEPTH	4
+#define AUTOTUNE_MIN_MS		100
+#define AUTOTUNE_MAX_IOS	256
+
+static const uint32_t autotune_lengths[] = {
+	65536, 131072, 262144, 524288, 1048576
+};
+
+struct autotune_state {
+	struct iscsi_sync_state sync;
+	int lun;
+	int blocksize;
+	uint32_t io_len;
+	uint64_t io_count;	/* number of io_len sized areas */
+	uint64_t start;
+	int issued;
+	int in_flight;
+	int failed;
+	uint64_t bytes;
+};
+
+static void
+autotune_cb(struct iscsi_context *iscsi, int status,
+	    void *command_data, void *private_data);
+
+static void
+autotune_issue(struct iscsi_context *iscsi, struct autotune_state *at)
+{
+	struct scsi_task *task;
+	uint64_t lba;
+
+	while (!at->failed && at->in_flight < AUTOTUNE_QUEUE_DEPTH &&
+	       at->issued < AUTOTUNE_MAX_IOS &&
+	       iscsi_monotonic_ms() - at->start < AUTOTUNE_MIN_MS) {
+		lba = (at->issued % at->io_count) * (at->io_len / at->blocksize);
+		task = iscsi_read16_task(iscsi, at->lun, lba, at->io_len,
+					 at->blocksize, 0, 0, 0, 0, 0,
+					 autotune_cb, at);
+		if (task == NULL) {
+			at->failed = 1;
+			break;
+		}
+		at->in_flight++;
+		at->issued++;
+	}
+	if (at->in_flight == 0) {
+		at->sync.finished = 1;
+	}
+}
+
+static void
+autotune_cb(struct iscsi_context *iscsi, int status,
+	    void *command_data, void *private_data)
+{
+	struct autotune_state *at = private_data;
+	struct scsi_task *task = command_data;
+
+	at->in_flight--;
+	if (status != SCSI_STATUS_GOOD || task == NULL) {
+		at->failed = 1;
+	} else {
+		at->bytes += task->datain.size;
+	}
+	if (task != NULL) {
+		scsi_free_scsi_task(task);
+	}
+	autotune_issue(iscsi, at);
+}
+
+/* bytes per ms, 0 if the reads failed */
+static uint64_t
+autotune_measure(struct iscsi_context *iscsi, struct autotune_state *at)
+{
+	uint64_t elapsed;
+
+	memset(&at->sync, 0, sizeof(at->sync));
+	at->issued    = 0;
+	at->in_flight = 0;
+	at->failed    = 0;
+	at->bytes     = 0;
+	at->start     = iscsi_monotonic_ms();
+
+	autotune_issue(iscsi, at);
+	event_loop(iscsi, &at->sync);
+	if (at->failed || at->sync.status != 0 || at->in_flight != 0) {
+		return 0;
+	}
+
+	elapsed = iscsi_monotonic_ms() - at->start;
+	return at->bytes / (elapsed ? elapsed : 1);
+}
+
+/* log in again with new lengths */
+static int
+autotune_relogin(struct iscsi_context *iscsi, uint32_t burst,
+		 uint32_t first_burst, uint32_t segment)
+{
+	iscsi->want_max_burst_length             = burst;
+	iscsi->want_first_burst_length           = MIN(first_burst, burst);
+	iscsi->want_max_recv_data_segment_length = segment;
+
+	/* the rate limit for reconnects is there for sessions that keep
+	 * failing, not for the logins we ask for.
+	 */
+	iscsi->next_reconnect = 0;
+	return iscsi_force_reconnect_sync(iscsi);
+}
+
+int
+iscsi_autotune_sync(struct iscsi_context *iscsi, int lun)
+{
+	struct autotune_state at;
+	struct scsi_task *task;
+	struct scsi_readcapacity16 *rc16;
+	uint32_t burst, first_burst, segment, best = 0;
+	uint64_t rate, best_rate = 0, size;
+	unsigned int i;
+
+	if (iscsi->is_loggedin == 0) {
+		iscsi_set_error(iscsi, "Trying to auto-tune while not "
+				"logged in");
+		return -1;
+	}
+
+	task = iscsi_readcapacity16_sync(iscsi, lun);
+	if (task == NULL || task->status != SCSI_STATUS_GOOD) {
+		iscsi_set_error(iscsi, "Auto-tune failed to read the "
+				"capacity. %s", iscsi_get_error(iscsi));
+		if (task != NULL) {
+			scsi_free_scsi_task(task);
+		}
+		return -1;
+	}
+	rc16 = scsi_datain_unmarshall(task);
+	if (rc16 == NULL || rc16->block_length == 0) {
+		iscsi_set_error(iscsi, "Auto-tune failed to unmarshall "
+				"readcapacity16 data.");
+		scsi_free_scsi_task(task);
+		return -1;
+	}
+
+	memset(&at, 0, sizeof(at));
+	at.lun       = lun;
+	at.blocksize = rc16->block_length;
+	size         = (rc16->returned_lba + 1) * rc16->block_length;
+	scsi_free_scsi_task(task);
+
+	at.io_len = AUTOTUNE_IO_SIZE - AUTOTUNE_IO_SIZE % at.blocksize;
+	if (at.io_len == 0 || size < at.io_len) {
+		at.io_len = size;
+	}
+	at.io_count = size / at.io_len;
+	if (at.io_count > AUTOTUNE_MAX_IOS) {
+		at.io_count = AUTOTUNE_MAX_IOS;
+	}
+
+	burst       = iscsi->want_max_burst_length;
+	first_burst = iscsi->want_first_burst_length;
+	segment     = iscsi->want_max_recv_data_segment_length;
+
+	for (i = 0; i < sizeof(autotune_lengths) / sizeof(autotune_lengths[0]);
+	     i++) {
+		if (autotune_relogin(iscsi, autotune_lengths[i], first_burst,
+				     autotune_lengths[i]) != 0) {
+			goto restore;
+		}
+
+		rate = autotune_measure(iscsi, &at);
+		if (rate == 0) {
+			iscsi_set_error(iscsi, "Auto-tune reads failed. %s",
+					iscsi_get_error(iscsi));
+			goto restore;
+		}
+		ISCSI_LOG(iscsi, 2, "auto-tune: length %u reads %llu "
+			  "bytes/ms", autotune_lengths[i],
+			  (unsigned long long)rate);
+
+		/* larger is only better if it is noticeably faster */
+		if (rate > best_rate + best_rate / 20) {
+			best_rate = rate;
+			best      = autotune_lengths[i];
+		}
+	}
+
+	ISCSI_LOG(iscsi, 2, "auto-tune: using length %u", best);
+	if (best != autotune_lengths[i - 1]) {
+		return autotune_relogin(iscsi, best, first_burst, best);
+	}
+	return 0;
+
+restore:
+	autotune_relogin(iscsi, burst, first_burst, segment);
+	return -1;
+}
+
 static void
 iscsi_task_mgmt_sync_cb(struct iscsi_context *iscsi, int status,
 	      void *command_data, void *private_data)
@@ -31,15 +31,20 @@
 #endif
 
 #include <stdio.h>
+#include <string.h>
 #include "iscsi.h"
 #include "iscsi-private.h"
 #include "scsi-lowlevel.h"
 
-int
-iscsi_task_mgmt_async(struct iscsi_context *iscsi,
-		      int lun, enum iscsi_task_mgmt_funcs function, 
-		      uint32_t ritt, uint32_t rcmdsn,
-		      iscsi_command_cb cb, void *private_data)
+struct task_reassign {
+	uint32_t itt;
+};
+
+static int
+iscsi_send_task_mgmt(struct iscsi_context *iscsi,
+		     int lun, enum iscsi_task_mgmt_funcs function,
+		     uint32_t ritt, uint32_t rcmdsn, uint32_t expdatasn,
+		     iscsi_command_cb cb, void *private_data)
 {
 	struct iscsi_pdu *pdu;
 
@@ -72,11 +77,14 @@ iscsi_task_mgmt_async(struct iscsi_context *iscsi,
 	iscsi_pdu_set_ritt(pdu, ritt);
 
 	/* cmdsn is not increased if Immediate delivery*/
-	iscsi_pdu_set_cmdsn(pdu, iscsi->cmdsn);
+	iscsi_pdu_set_cmdsn(pdu, iscsi_session(iscsi)->cmdsn);
 
 	/* rcmdsn */
 	iscsi_pdu_set_rcmdsn(pdu, rcmdsn);
 
+	/* expdatasn */
+	scsi_set_uint32(&pdu->outdata.data[36], expdatasn);
+
 	pdu->callback     = cb;
 	pdu->private_data = private_data;
 
@@ -89,6 +97,136 @@ iscsi_task_mgmt_async(struct iscsi_context *iscsi,
 	return 0;
 }
 
+int
+iscsi_task_mgmt_async(struct iscsi_context *iscsi,
+		      int lun, enum iscsi_task_mgmt_funcs function, 
+		      uint32_t ritt, uint32_t rcmdsn,
+		      iscsi_command_cb cb, void *private_data)
+{
+	return iscsi_send_task_mgmt(iscsi, lun, function, ritt, rcmdsn, 0,
+				    cb, private_data);
+}
+
+static void
+iscsi_task_reassign_cb(struct iscsi_context *iscsi, int status,
+		       void *command_data, void *private_data)
+{
+	struct task_reassign *tr = private_data;
+	struct iscsi_pdu *pdu;
+	uint32_t response;
+
+	/* if the connection failed again the task is still on the
+	 * waitpdu list and the next reconnect takes care of it.
+	 */
+	if (status != SCSI_STATUS_GOOD) {
+		iscsi_free(iscsi, tr);
+		return;
+	}
+
+	response = *(uint32_t *)command_data;
+	pdu = iscsi_waitpdu_find(iscsi, tr->itt);
+	iscsi_free(iscsi, tr);
+	if (pdu == NULL) {
+		return;
+	}
+	if (response == ISCSI_TMR_FUNC_COMPLETE) {
+		iscsi->reconnect_stats.reassigned++;
+		ISCSI_LOG(iscsi, 2, "task 0x%08x reassigned to the new "
+			  "connection", pdu->itt);
+		return;
+	}
+
+	ISCSI_LOG(iscsi, 1, "target could not reassign task 0x%08x (%u), "
+		  "sending the command again", pdu->itt, response);
+	iscsi_waitpdu_remove(iscsi, pdu);
+	iscsi_reissue_command(iscsi, pdu);
+	iscsi->reconnect_stats.replayed++;
+	iscsi->drv->free_pdu(iscsi, pdu);
+}
+
+/*
+ * Continue a task of a failed connection on the new connection of the
+ * session, ErrorRecoveryLevel 2. The command is not sent again, a copy of
+ * its pdu waits for the response on the new connection and a TASK REASSIGN
+ * asks the target to move the task over. For a read the target then sends
+ * the Data-In from the first DataSN we are missing, for a write it sends
+ * R2Ts for the data it has not received yet.
+ */
+int
+iscsi_task_reassign(struct iscsi_context *iscsi, struct iscsi_pdu *old_pdu)
+{
+	struct iscsi_pdu *pdu;
+	struct task_reassign *tr;
+	uint32_t expdatasn = 0;
+
+	tr = iscsi_malloc(iscsi, sizeof(struct task_reassign));
+	if (tr == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: Failed to allocate "
+				"task_reassign structure");
+		return -1;
+	}
+	tr->itt = old_pdu->itt;
+
+	pdu = iscsi_allocate_pdu(iscsi,
+				 ISCSI_PDU_SCSI_REQUEST,
+				 ISCSI_PDU_SCSI_RESPONSE,
+				 old_pdu->itt,
+				 0);
+	if (pdu == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory, Failed to allocate "
+				"scsi pdu.");
+		iscsi_free(iscsi, tr);
+		return -1;
+	}
+	memcpy(pdu->outdata.data, old_pdu->outdata.data, ISCSI_RAW_HEADER_SIZE);
+	pdu->lun          = old_pdu->lun;
+	pdu->cmdsn        = old_pdu->cmdsn;
+	pdu->expxferlen   = old_pdu->expxferlen;
+	pdu->scsi_timeout = old_pdu->scsi_timeout;
+	pdu->scsi_cbdata  = old_pdu->scsi_cbdata;
+	pdu->callback     = old_pdu->callback;
+	pdu->private_data = old_pdu->private_data;
+	if (old_pdu->private_data == &old_pdu->scsi_cbdata) {
+		pdu->private_data = &pdu->scsi_cbdata;
+	}
+	scsi_set_task_private_ptr(pdu->scsi_cbdata.task, &pdu->scsi_cbdata);
+
+	/* keep the data that has arrived, the target only sends what
+	 * came after it
+	 */
+	if (pdu->scsi_cbdata.task->xfer_dir == SCSI_XFER_READ) {
+		expdatasn = iscsi_snack_first_missing(old_pdu);
+		pdu->exp_datasn = expdatasn;
+		pdu->indata = old_pdu->indata;
+		old_pdu->indata.data = NULL;
+		old_pdu->indata.size = 0;
+	} else {
+		pdu->exp_datasn = old_pdu->exp_datasn;
+	}
+
+	iscsi_waitpdu_add(iscsi, pdu);
+	iscsi_pdu_arm_timeout(iscsi, pdu);
+
+	if (iscsi_send_task_mgmt(iscsi, pdu->lun, ISCSI_TM_TASK_REASSIGN,
+				 pdu->itt, pdu->cmdsn, expdatasn,
+				 iscsi_task_reassign_cb, tr) != 0) {
+		iscsi_waitpdu_remove(iscsi, pdu);
+		/* the data stays with the old pdu */
+		old_pdu->indata = pdu->indata;
+		pdu->indata.data = NULL;
+		pdu->indata.size = 0;
+		scsi_set_task_private_ptr(pdu->scsi_cbdata.task,
+					  &old_pdu->scsi_cbdata);
+		iscsi->drv->free_pdu(iscsi, pdu);
+		iscsi_free(iscsi, tr);
+		return -1;
+	}
+
+	ISCSI_LOG(iscsi, 2, "reassigning task 0x%08x, ExpDataSN %u", pdu->itt,
+		  expdatasn);
+	return 0;
+}
+
 int
 iscsi_process_task_mgmt_reply(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
 			    struct iscsi_in_pdu *in)
@@ -0,0 +1,300 @@
+/*
+   Copyright (C) 2010 by Ronnie Sahlberg <ronniesahlberg@gmail.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#if defined(_WIN32)
+#include <winsock2.h>
+#include <windows.h>
+#else
+#include <sys/time.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "iscsi.h"
+#include "iscsi-private.h"
+
+/*
+ * Hierarchical timer wheel.
+ *
+ * Level 0 has one slot per millisecond, each level above that covers
+ * ISCSI_TIMER_SLOTS times the range of the level below it. Timers are
+ * placed on the lowest level that can hold their expiry and are moved
+ * down a level ("cascaded") when the wheel reaches the start of their
+ * slot. Adding and removing a timer is O(1), expiring timers costs
+ * O(1) per timer plus one cascade every ISCSI_TIMER_SLOTS ms.
+ *
+ * wheel->now is the next tick that has not been processed yet.
+ */
+
+#define TIMER_SHIFT(level)	((level) * ISCSI_TIMER_BITS)
+#define TIMER_MASK		(ISCSI_TIMER_SLOTS - 1)
+
+uint64_t
+iscsi_monotonic_ms(void)
+{
+#if defined(_WIN32)
+	return GetTickCount64();
+#elif defined(HAVE_CLOCK_GETTIME)
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+#endif
+}
+
+static void
+iscsi_timer_link(struct iscsi_timer_wheel *wheel, struct iscsi_timer *timer)
+{
+	uint64_t expires = timer->expires;
+	uint64_t delta;
+	int level, slot;
+
+	if (expires < wheel->now) {
+		expires = wheel->now;
+	}
+	delta = expires - wheel->now;
+
+	for (level = 0; level < ISCSI_TIMER_LEVELS - 1; level++) {
+		if (delta < (1ULL << TIMER_SHIFT(level + 1))) {
+			break;
+		}
+	}
+	if (delta >= (1ULL << TIMER_SHIFT(ISCSI_TIMER_LEVELS))) {
+		/* beyond the range of the wheel, park it in the furthest
+		 * slot, it will be placed correctly once it cascades.
+		 */
+		expires = wheel->now +
+			(1ULL << TIMER_SHIFT(ISCSI_TIMER_LEVELS)) - 1;
+	}
+
+	slot = level * ISCSI_TIMER_SLOTS +
+		((expires >> TIMER_SHIFT(level)) & TIMER_MASK);
+
+	timer->slot = slot + 1;
+	timer->prev = NULL;
+	timer->next = wheel->slots[slot];
+	if (timer->next != NULL) {
+		timer->next->prev = timer;
+	}
+	wheel->slots[slot] = timer;
+}
+
+static void
+iscsi_timer_unlink(struct iscsi_timer_wheel *wheel, struct iscsi_timer *timer)
+{
+	int slot = timer->slot - 1;
+
+	if (timer->prev != NULL) {
+		timer->prev->next = timer->next;
+	} else if (wheel->slots[slot] == timer) {
+		wheel->slots[slot] = timer->next;
+	}
+	if (timer->next != NULL) {
+		timer->next->prev = timer->prev;
+	}
+	timer->next = NULL;
+	timer->prev = NULL;
+	timer->slot = 0;
+}
+
+void
+iscsi_timer_add(struct iscsi_context *iscsi, struct iscsi_timer *timer,
+		uint64_t expires, iscsi_timer_cb cb, void *private_data)
+{
+	struct iscsi_timer_wheel *wheel = &iscsi->timers;
+
+	if (timer->slot) {
+		iscsi_timer_del(iscsi, timer);
+	}
+	if (wheel->count == 0) {
+		/* nothing to catch up on, resync the wheel with the clock */
+		wheel->now = iscsi_monotonic_ms();
+	}
+
+	timer->expires      = expires;
+	timer->cb           = cb;
+	timer->private_data = private_data;
+	iscsi_timer_link(wheel, timer);
+	wheel->count++;
+	iscsi_engine_touch(iscsi);
+}
+
+void
+iscsi_timer_del(struct iscsi_context *iscsi, struct iscsi_timer *timer)
+{
+	if (!timer->slot) {
+		return;
+	}
+	iscsi_timer_unlink(&iscsi->timers, timer);
+	iscsi->timers.count--;
+}
+
+static void
+iscsi_timer_cascade(struct iscsi_timer_wheel *wheel, int level)
+{
+	int slot = level * ISCSI_TIMER_SLOTS +
+		((wheel->now >> TIMER_SHIFT(level)) & TIMER_MASK);
+	struct iscsi_timer *timer;
+
+	while ((timer = wheel->slots[slot]) != NULL) {
+		iscsi_timer_unlink(wheel, timer);
+		iscsi_timer_link(wheel, timer);
+	}
+}
+
+void
+iscsi_timer_run(struct iscsi_context *iscsi, uint64_t now)
+{
+	struct iscsi_timer_wheel *wheel = &iscsi->timers;
+	struct iscsi_timer *timer;
+	uint64_t next;
+	int idx, level;
+
+	while (wheel->count > 0 && wheel->now <= now) {
+		idx = wheel->now & TIMER_MASK;
+
+		if (idx == 0) {
+			for (level = 1; level < ISCSI_TIMER_LEVELS; level++) {
+				iscsi_timer_cascade(wheel, level);
+				if ((wheel->now >> TIMER_SHIFT(level)) & TIMER_MASK) {
+					break;
+				}
+			}
+		}
+
+		if (wheel->slots[idx] == NULL) {
+			/* skip ahead to the next busy slot or the next
+			 * cascade, whichever comes first.
+			 */
+			while (idx < ISCSI_TIMER_SLOTS && wheel->slots[idx] == NULL) {
+				idx++;
+			}
+			next = (wheel->now & ~(uint64_t)TIMER_MASK) + idx;
+			wheel->now = MIN(next, now + 1);
+			continue;
+		}
+
+		/* Advance first so that timers added from a callback never
+		 * end up in the slot we are draining.
+		 */
+		wheel->now++;
+		while ((timer = wheel->slots[idx]) != NULL) {
+			iscsi_timer_unlink(wheel, timer);
+			wheel->count--;
+			timer->cb(iscsi, timer->private_data);
+		}
+	}
+
+	if (wheel->count == 0 && wheel->now <= now) {
+		wheel->now = now + 1;
+	}
+}
+
+int
+iscsi_timer_next(struct iscsi_context *iscsi, uint64_t now)
+{
+	struct iscsi_timer_wheel *wheel = &iscsi->timers;
+	uint64_t first = 0, t, base, width;
+	int level, i, idx, found = 0;
+
+	if (wheel->count == 0) {
+		return -1;
+	}
+
+	for (level = 0; level < ISCSI_TIMER_LEVELS; level++) {
+		width = 1ULL << TIMER_SHIFT(level);
+
+		/* first cascade point of this level at or after now */
+		base = (wheel->now + width - 1) & ~(width - 1);
+		idx = (base >> TIMER_SHIFT(level)) & TIMER_MASK;
+
+		for (i = 0; i < ISCSI_TIMER_SLOTS; i++) {
+			if (wheel->slots[level * ISCSI_TIMER_SLOTS +
+					 ((idx + i) & TIMER_MASK)] != NULL) {
+				break;
+			}
+		}
+		if (i == ISCSI_TIMER_SLOTS) {
+			continue;
+		}
+
+		/* timers on the higher levels expire no earlier than the
+		 * point where they cascade, use that as a lower bound.
+		 */
+		t = base + i * width;
+		if (!found || t < first) {
+			first = t;
+			found = 1;
+		}
+	}
+
+	if (first <= now) {
+		return 0;
+	}
+	if (first - now > INT32_MAX) {
+		return INT32_MAX;
+	}
+	return (int)(first - now);
+}
+
+int
+iscsi_get_next_timeout_ms(struct iscsi_context *iscsi)
+{
+	uint64_t now = iscsi_monotonic_ms();
+	struct iscsi_context *conn;
+	int timeout, t;
+
+	timeout = iscsi_timer_next(iscsi, now);
+
+	/* commands that were in flight when the session dropped still
+	 * time out on the old context until the reconnect completes.
+	 */
+	if (iscsi->old_iscsi) {
+		t = iscsi_timer_next(iscsi->old_iscsi, now);
+		if (t >= 0 && (timeout < 0 || t < timeout)) {
+			timeout = t;
+		}
+	}
+
+	for (conn = iscsi->connections; conn; conn = conn->next_connection) {
+		t = iscsi_timer_next(conn, now);
+		if (t >= 0 && (timeout < 0 || t < timeout)) {
+			timeout = t;
+		}
+	}
+
+	if (iscsi->pending_reconnect) {
+		t = 0;
+		if (iscsi->next_reconnect > now) {
+			t = MIN(iscsi->next_reconnect - now, INT32_MAX);
+		}
+		if (timeout < 0 || t < timeout) {
+			timeout = t;
+		}
+	}
+
+	return timeout;
+}
@@ -9,6 +9,10 @@ IQNTARGET=iqn.libiscsi.unittest.target
 IQNINITIATOR=iqn.libiscsi.unittest.initiator
 TGTURL=iscsi://${TGTPORTAL}/${IQNTARGET}/1
 
+# a second tgtd, for example for a target to redirect to
+TGT_IPC_SOCKET2=`pwd`/tgtd2.socket
+TGTPORTAL2=127.0.0.1:3270
+
 start_target() {
     # in case we have one still running from a previous run
     ${TGTADM} --op delete --force --mode target --tid 1 2>/dev/null
@@ -28,10 +32,50 @@ shutdown_target() {
     ${TGTADM} --op delete --mode system
 }
 
+start_second_target() {
+    # same target name and LUN as the first one, on its own portal
+    TGT_IPC_SOCKET=${TGT_IPC_SOCKET2} ${TGTADM} --op delete --force --mode target --tid 1 2>/dev/null
+    TGT_IPC_SOCKET=${TGT_IPC_SOCKET2} ${TGTADM} --op delete --mode system 2>/dev/null
+    echo "Starting second iSCSI target"
+    TGT_IPC_SOCKET=${TGT_IPC_SOCKET2} ${TGTD} --iscsi portal=${TGTPORTAL2}
+    sleep 1
+    TGT_IPC_SOCKET=${TGT_IPC_SOCKET2} ${TGTADM} --op new --mode target --tid 1 -T ${IQNTARGET}
+    TGT_IPC_SOCKET=${TGT_IPC_SOCKET2} ${TGTADM} --op bind --mode target --tid 1 -I ALL
+    TGT_IPC_SOCKET=${TGT_IPC_SOCKET2} ${TGTADM} --op new --mode logicalunit --tid 1 --lun 1 -b ${TGTLUN} --blocksize=4096
+}
+
+shutdown_second_target() {
+    echo "Shutting down second iSCSI target"
+    TGT_IPC_SOCKET=${TGT_IPC_SOCKET2} ${TGTADM} --op delete --force --mode target --tid 1
+    TGT_IPC_SOCKET=${TGT_IPC_SOCKET2} ${TGTADM} --op delete --mode system
+}
+
 enable_header_digest() {
     ${TGTADM} --op update --mode target --tid 1 -n HeaderDigest -v CRC32C
 }
 
+enable_data_digest() {
+    ${TGTADM} --op update --mode target --tid 1 -n DataDigest -v CRC32C
+}
+
+set_max_connections() {
+    ${TGTADM} --op update --mode target --tid 1 -n MaxConnections -v $1
+}
+
+set_max_outstanding_r2t() {
+    ${TGTADM} --op update --mode target --tid 1 -n MaxOutstandingR2T -v $1
+}
+
+set_redirect() {
+    ${TGTADM} --op update --mode target --tid 1 -n redirect_address -v $1
+    ${TGTADM} --op update --mode target --tid 1 -n redirect_port -v $2
+    ${TGTADM} --op update --mode target --tid 1 -n redirect_reason -v $3
+}
+
+set_max_burst_length() {
+    ${TGTADM} --op update --mode target --tid 1 -n MaxBurstLength -v $1
+}
+
 create_lun() {
     # Setup LUN
     truncate --size=100M ${TGTLUN}
@@ -84,3 +128,9 @@ failure() {
     echo "[FAILED]"
     exit 1
 }
+
+# for a test program that exits with 77, the target can not run the test
+skipped() {
+    echo "[SKIPPED]"
+    rm ${TEST_TMP} 2> /dev/null
+}
@@ -0,0 +1,222 @@
+/*
+   Copyright (C) 2015 by Ronnie Sahlberg <ronniesahlberg@gmail.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "iscsi.h"
+#include "scsi-lowlevel.h"
+
+const char *initiator = "iqn.2007-10.com.github:sahlberg:libiscsi:prog-burst-length";
+
+#define MAX_BURST_LENGTH 131072
+#define FIRST_BURST_LENGTH 32768
+#define MAX_RECV_DATA_SEGMENT_LENGTH 16384
+
+void print_usage(void)
+{
+	fprintf(stderr, "Usage: prog_burst_length [-?|--help] [--usage] "
+		"[-i|--initiator-name=iqn-name]\n"
+		"\t\t<iscsi-url>\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "This command is used to test that burst and "
+		"segment lengths are negotiated, kept across a reconnect "
+		"and can be auto-tuned.\n");
+}
+
+void print_help(void)
+{
+	fprintf(stderr, "Usage: prog_burst_length [OPTION...] <iscsi-url>\n");
+	fprintf(stderr, "  -i, --initiator-name=iqn-name     "
+		"Initiatorname to use\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Help options:\n");
+	fprintf(stderr, "  -?, --help                        "
+		"Show this help message\n");
+	fprintf(stderr, "      --usage                       "
+		"Display brief usage message\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "iSCSI URL format : %s\n", ISCSI_URL_SYNTAX);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "<host> is either of:\n");
+	fprintf(stderr, "  \"hostname\"       iscsi.example\n");
+	fprintf(stderr, "  \"ipv4-address\"   10.1.1.27\n");
+	fprintf(stderr, "  \"ipv6-address\"   [fce0::1]\n");
+}
+
+static void check_lengths(struct iscsi_context *iscsi, const char *when)
+{
+	if (iscsi_get_max_burst_length(iscsi) != MAX_BURST_LENGTH ||
+	    iscsi_get_first_burst_length(iscsi) != FIRST_BURST_LENGTH ||
+	    iscsi_get_max_recv_data_segment_length(iscsi) !=
+	    MAX_RECV_DATA_SEGMENT_LENGTH) {
+		fprintf(stderr, "Wrong lengths %s: MaxBurstLength=%d "
+			"FirstBurstLength=%d MaxRecvDataSegmentLength=%d\n",
+			when, iscsi_get_max_burst_length(iscsi),
+			iscsi_get_first_burst_length(iscsi),
+			iscsi_get_max_recv_data_segment_length(iscsi));
+		exit(10);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct iscsi_context *iscsi;
+	struct iscsi_url *iscsi_url = NULL;
+	char *url = NULL;
+	int c, len;
+	static int show_help = 0, show_usage = 0, debug = 0;
+
+	static struct option long_options[] = {
+		{"help",           no_argument,          NULL,        'h'},
+		{"usage",          no_argument,          NULL,        'u'},
+		{"debug",          no_argument,          NULL,        'd'},
+		{"initiator-name", required_argument,    NULL,        'i'},
+		{0, 0, 0, 0}
+	};
+	int option_index;
+
+	while ((c = getopt_long(argc, argv, "h?udi:", long_options,
+			&option_index)) != -1) {
+		switch (c) {
+		case 'h':
+		case '?':
+			show_help = 1;
+			break;
+		case 'u':
+			show_usage = 1;
+			break;
+		case 'd':
+			debug = 1;
+			break;
+		case 'i':
+			initiator = optarg;
+			break;
+		default:
+			fprintf(stderr, "Unrecognized option '%c'\n\n", c);
+			print_help();
+			exit(0);
+		}
+	}
+
+	if (show_help != 0) {
+		print_help();
+		exit(0);
+	}
+
+	if (show_usage != 0) {
+		print_usage();
+		exit(0);
+	}
+
+	if (optind != argc -1) {
+		print_usage();
+		exit(0);
+	}
+
+	if (argv[optind] != NULL) {
+		url = strdup(argv[optind]);
+	}
+	if (url == NULL) {
+		fprintf(stderr, "You must specify iscsi target portal.\n");
+		print_usage();
+		exit(10);
+	}
+
+	iscsi = iscsi_create_context(initiator);
+	if (iscsi == NULL) {
+		printf("Failed to create context\n");
+		exit(10);
+	}
+
+	if (debug > 0) {
+		iscsi_set_log_level(iscsi, debug);
+		iscsi_set_log_fn(iscsi, iscsi_log_to_stderr);
+	}
+
+	iscsi_url = iscsi_parse_full_url(iscsi, url);
+
+	free(url);
+
+	if (iscsi_url == NULL) {
+		fprintf(stderr, "Failed to parse URL: %s\n",
+			iscsi_get_error(iscsi));
+		exit(10);
+	}
+
+	iscsi_set_session_type(iscsi, ISCSI_SESSION_NORMAL);
+
+	if (iscsi_set_max_burst_length(iscsi, 256) == 0) {
+		fprintf(stderr, "Accepted a MaxBurstLength below 512\n");
+		exit(10);
+	}
+
+	printf("Offer smaller burst and segment lengths\n");
+	if (iscsi_set_max_burst_length(iscsi, MAX_BURST_LENGTH) != 0 ||
+	    iscsi_set_first_burst_length(iscsi, FIRST_BURST_LENGTH) != 0 ||
+	    iscsi_set_max_recv_data_segment_length(iscsi,
+			MAX_RECV_DATA_SEGMENT_LENGTH) != 0) {
+		fprintf(stderr, "Failed to set lengths. %s\n",
+			iscsi_get_error(iscsi));
+		exit(10);
+	}
+
+	if (iscsi_full_connect_sync(iscsi, iscsi_url->portal,
+				    iscsi_url->lun) != 0) {
+		fprintf(stderr, "iscsi_connect failed. %s\n",
+			iscsi_get_error(iscsi));
+		exit(10);
+	}
+	check_lengths(iscsi, "after login");
+
+	printf("Reconnect and check they are still used\n");
+	if (iscsi_force_reconnect_sync(iscsi) != 0) {
+		fprintf(stderr, "Reconnect failed. %s\n",
+			iscsi_get_error(iscsi));
+		exit(10);
+	}
+	check_lengths(iscsi, "after reconnect");
+
+	printf("Auto-tune the lengths\n");
+	if (iscsi_autotune_sync(iscsi, iscsi_url->lun) != 0) {
+		fprintf(stderr, "Auto-tune failed. %s\n",
+			iscsi_get_error(iscsi));
+		exit(10);
+	}
+	len = iscsi_get_max_recv_data_segment_length(iscsi);
+	if (len < 65536 || len > 1048576 || !iscsi_is_logged_in(iscsi)) {
+		fprintf(stderr, "Auto-tune picked MaxRecvDataSegmentLength=%d\n",
+			len);
+		exit(10);
+	}
+
+	iscsi_destroy_url(iscsi_url);
+	iscsi_logout_sync(iscsi);
+	iscsi_destroy_context(iscsi);
+
+	return 0;
+}
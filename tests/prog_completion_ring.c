@@ -0,0 +1,359 @@
+/*
+   Copyright (C) 2015 by Ronnie Sahlberg <ronniesahlberg@gmail.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <getopt.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "iscsi.h"
+#include "scsi-lowlevel.h"
+
+const char *initiator = "iqn.2007-10.com.github:sahlberg:libiscsi:prog-completion-ring";
+
+#define BLOCK_SIZE 4096
+#define COMMAND_BLOCKS 4
+#define COMMAND_SIZE (COMMAND_BLOCKS * BLOCK_SIZE)
+#define NUM_COMMANDS 256
+#define QUEUE_DEPTH 32
+#define REAP_BATCH 5
+
+static struct iscsi_context *iscsi;
+static int lun;
+static unsigned char *wbuf;
+static int done[NUM_COMMANDS];
+static int next, in_flight, failed;
+
+void print_usage(void)
+{
+	fprintf(stderr, "Usage: prog_completion_ring [-?|--help] [--usage] "
+		"[-i|--initiator-name=iqn-name] [-r|--ring=entries]\n"
+		"\t\t<iscsi-url>\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "This command is used to test reaping completions "
+		"from the completion ring.\n");
+}
+
+void print_help(void)
+{
+	fprintf(stderr, "Usage: prog_completion_ring [OPTION...] <iscsi-url>\n");
+	fprintf(stderr, "  -i, --initiator-name=iqn-name     "
+		"Initiatorname to use\n");
+	fprintf(stderr, "  -r, --ring=entries                "
+		"Size of the completion ring\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Help options:\n");
+	fprintf(stderr, "  -?, --help                        "
+		"Show this help message\n");
+	fprintf(stderr, "      --usage                       "
+		"Display brief usage message\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "iSCSI URL format : %s\n", ISCSI_URL_SYNTAX);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "<host> is either of:\n");
+	fprintf(stderr, "  \"hostname\"       iscsi.example\n");
+	fprintf(stderr, "  \"ipv4-address\"   10.1.1.27\n");
+	fprintf(stderr, "  \"ipv6-address\"   [fce0::1]\n");
+}
+
+/*
+ * Keep QUEUE_DEPTH commands in flight, more than the ring holds, so that
+ * completions have to wait for room. The commands are numbered and the
+ * number is passed as user_data.
+ */
+static void send_commands(int write)
+{
+	struct scsi_task *task;
+	int lba;
+
+	while (in_flight < QUEUE_DEPTH && next < NUM_COMMANDS) {
+		lba = next * COMMAND_BLOCKS;
+		if (write) {
+			task = iscsi_write16_task(iscsi, lun, lba,
+						  wbuf + lba * BLOCK_SIZE,
+						  COMMAND_SIZE, BLOCK_SIZE,
+						  0, 0, 0, 0, 0, ISCSI_CQ,
+						  (void *)(intptr_t)next);
+		} else {
+			task = iscsi_read16_task(iscsi, lun, lba,
+						 COMMAND_SIZE, BLOCK_SIZE,
+						 0, 0, 0, 0, 0, ISCSI_CQ,
+						 (void *)(intptr_t)next);
+		}
+		if (task == NULL) {
+			fprintf(stderr, "Failed to send command: %s\n",
+				iscsi_get_error(iscsi));
+			exit(10);
+		}
+		next++;
+		in_flight++;
+	}
+}
+
+static void check_completion(struct iscsi_completion *c, int write)
+{
+	int i = (intptr_t)c->user_data;
+
+	if (i < 0 || i >= NUM_COMMANDS || done[i]) {
+		fprintf(stderr, "Unexpected completion of command %d\n", i);
+		exit(10);
+	}
+	done[i] = 1;
+	in_flight--;
+
+	if (c->status != SCSI_STATUS_GOOD) {
+		fprintf(stderr, "Command %d failed: %s\n", i,
+			iscsi_get_error(iscsi));
+		failed++;
+	} else if (!write) {
+		if (c->task->datain.size != COMMAND_SIZE ||
+		    memcmp(c->task->datain.data,
+			   wbuf + i * COMMAND_SIZE, COMMAND_SIZE)) {
+			fprintf(stderr, "Read of command %d returned the wrong "
+				"data\n", i);
+			failed++;
+		}
+	}
+	scsi_free_scsi_task(c->task);
+}
+
+static void wait_for_socket(void)
+{
+	struct pollfd pfd;
+
+	pfd.fd = iscsi_get_fd(iscsi);
+	pfd.events = iscsi_which_events(iscsi);
+	if (poll(&pfd, 1, 1000) < 0) {
+		fprintf(stderr, "Poll failed\n");
+		exit(10);
+	}
+	if (iscsi_service(iscsi, pfd.revents) < 0) {
+		fprintf(stderr, "iscsi_service failed: %s\n",
+			iscsi_get_error(iscsi));
+		exit(10);
+	}
+}
+
+/*
+ * Run NUM_COMMANDS writes or reads. Completions are reaped a few at a
+ * time after servicing the socket and new commands are sent right from
+ * the reap loop.
+ */
+static void run(int write)
+{
+	struct iscsi_completion entries[REAP_BATCH];
+	int i, n;
+
+	memset(done, 0, sizeof(done));
+	next = 0;
+	send_commands(write);
+	while (in_flight > 0) {
+		wait_for_socket();
+		while ((n = iscsi_reap_completions(iscsi, entries,
+						   REAP_BATCH)) > 0) {
+			for (i = 0; i < n; i++) {
+				check_completion(&entries[i], write);
+			}
+			send_commands(write);
+		}
+		if (n < 0) {
+			fprintf(stderr, "Failed to reap completions: %s\n",
+				iscsi_get_error(iscsi));
+			exit(10);
+		}
+	}
+	if (failed) {
+		fprintf(stderr, "%d commands failed\n", failed);
+		exit(10);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct iscsi_context *other;
+	struct iscsi_url *iscsi_url = NULL;
+	struct iscsi_completion c;
+	struct scsi_task *task;
+	char *url = NULL;
+	int ch, i, ring = 8;
+	static int show_help = 0, show_usage = 0, debug = 0;
+
+	static struct option long_options[] = {
+		{"help",           no_argument,          NULL,        'h'},
+		{"usage",          no_argument,          NULL,        'u'},
+		{"debug",          no_argument,          NULL,        'd'},
+		{"initiator-name", required_argument,    NULL,        'i'},
+		{"ring",           required_argument,    NULL,        'r'},
+		{0, 0, 0, 0}
+	};
+	int option_index;
+
+	while ((ch = getopt_long(argc, argv, "h?udi:r:", long_options,
+			&option_index)) != -1) {
+		switch (ch) {
+		case 'h':
+		case '?':
+			show_help = 1;
+			break;
+		case 'u':
+			show_usage = 1;
+			break;
+		case 'd':
+			debug = 1;
+			break;
+		case 'i':
+			initiator = optarg;
+			break;
+		case 'r':
+			ring = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Unrecognized option '%c'\n\n", ch);
+			print_help();
+			exit(0);
+		}
+	}
+
+	if (show_help != 0) {
+		print_help();
+		exit(0);
+	}
+
+	if (show_usage != 0) {
+		print_usage();
+		exit(0);
+	}
+
+	if (optind != argc -1) {
+		print_usage();
+		exit(0);
+	}
+
+	if (argv[optind] != NULL) {
+		url = strdup(argv[optind]);
+	}
+	if (url == NULL) {
+		fprintf(stderr, "You must specify iscsi target portal.\n");
+		print_usage();
+		exit(10);
+	}
+
+	iscsi = iscsi_create_context(initiator);
+	if (iscsi == NULL) {
+		fprintf(stderr, "Failed to create context\n");
+		exit(10);
+	}
+	if (debug > 0) {
+		iscsi_set_log_level(iscsi, debug);
+		iscsi_set_log_fn(iscsi, iscsi_log_to_stderr);
+	}
+	iscsi_url = iscsi_parse_full_url(iscsi, url);
+	if (iscsi_url == NULL) {
+		fprintf(stderr, "Failed to parse URL: %s\n",
+			iscsi_get_error(iscsi));
+		exit(10);
+	}
+	free(url);
+	iscsi_set_session_type(iscsi, ISCSI_SESSION_NORMAL);
+
+	if (iscsi_set_completion_ring(iscsi, 0) == 0) {
+		fprintf(stderr, "A completion ring of 0 entries was "
+			"accepted\n");
+		exit(10);
+	}
+	if (iscsi_set_completion_ring(iscsi, ring) != 0) {
+		fprintf(stderr, "Failed to set the completion ring: %s\n",
+			iscsi_get_error(iscsi));
+		exit(10);
+	}
+
+	if (iscsi_full_connect_sync(iscsi, iscsi_url->portal,
+				    iscsi_url->lun) != 0) {
+		fprintf(stderr, "Login Failed. %s\n", iscsi_get_error(iscsi));
+		exit(10);
+	}
+	lun = iscsi_url->lun;
+
+	printf("Check that the ring can not be changed once logged in\n");
+	if (iscsi_set_completion_ring(iscsi, ring) == 0) {
+		fprintf(stderr, "The completion ring was set while logged "
+			"in\n");
+		exit(10);
+	}
+
+	printf("Check that a context without a ring refuses ISCSI_CQ\n");
+	other = iscsi_create_context(initiator);
+	if (other == NULL) {
+		fprintf(stderr, "Failed to create context\n");
+		exit(10);
+	}
+	iscsi_set_session_type(other, ISCSI_SESSION_NORMAL);
+	task = iscsi_testunitready_task(other, lun, ISCSI_CQ, NULL);
+	if (task != NULL) {
+		fprintf(stderr, "A command for the completion ring was "
+			"accepted without one\n");
+		exit(10);
+	}
+	if (iscsi_reap_completions(other, &c, 1) != -1) {
+		fprintf(stderr, "Reaping a context without a ring did not "
+			"fail\n");
+		exit(10);
+	}
+	iscsi_destroy_context(other);
+
+	wbuf = malloc(NUM_COMMANDS * COMMAND_SIZE);
+	if (wbuf == NULL) {
+		fprintf(stderr, "Failed to allocate buffers\n");
+		exit(10);
+	}
+	for (i = 0; i < NUM_COMMANDS * COMMAND_SIZE; i++) {
+		wbuf[i] = random();
+	}
+
+	printf("Write %d commands, reaping %d completions at a time from a "
+	       "ring of %d\n", NUM_COMMANDS, REAP_BATCH, ring);
+	run(1);
+
+	printf("Read them back the same way\n");
+	run(0);
+
+	printf("Destroy the context with completions left in the ring\n");
+	for (i = 0; i < QUEUE_DEPTH; i++) {
+		if (iscsi_testunitready_task(iscsi, lun, ISCSI_CQ,
+					     NULL) == NULL) {
+			fprintf(stderr, "Failed to send TESTUNITREADY: %s\n",
+				iscsi_get_error(iscsi));
+			exit(10);
+		}
+	}
+	while (iscsi_queue_length(iscsi) > 0) {
+		wait_for_socket();
+	}
+
+	iscsi_logout_sync(iscsi);
+	iscsi_destroy_url(iscsi_url);
+	iscsi_destroy_context(iscsi);
+	free(wbuf);
+
+	printf("Test was successful\n");
+	return 0;
+}
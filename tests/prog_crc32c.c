@@ -0,0 +1,221 @@
+/*
+   Copyright (C) 2015 by Ronnie Sahlberg <ronniesahlberg@gmail.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <getopt.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/time.h>
+#include "iscsi.h"
+#include "iscsi-private.h"
+
+#define BUF_SIZE (1024 * 1024 + 64)
+
+void print_usage(void)
+{
+	fprintf(stderr, "Usage: prog_crc32c [-?|--help] [--usage] "
+		"[-b|--bench]\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "This command is used to test that all crc32c "
+		"implementations available on this cpu produce the same "
+		"result, and optionally to benchmark them.\n");
+}
+
+void print_help(void)
+{
+	fprintf(stderr, "Usage: prog_crc32c [OPTION...]\n");
+	fprintf(stderr, "  -b, --bench                       "
+		"Benchmark the implementations\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Help options:\n");
+	fprintf(stderr, "  -?, --help                        "
+		"Show this help message\n");
+	fprintf(stderr, "      --usage                       "
+		"Display brief usage message\n");
+}
+
+static double
+now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static int
+verify(const struct crc32c_impl *impls, int count, uint8_t *buf)
+{
+	static const uint8_t check[] = "123456789";
+	uint32_t ref, crc;
+	size_t len, off;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		crc = impls[i].update(0xffffffff, check, 9) ^ 0xffffffff;
+		if (crc != 0xe3069283) {
+			printf("%s: check value is %08x\n", impls[i].name, crc);
+			return -1;
+		}
+	}
+
+	/* every length up to a few of the interleaved blocks, at every
+	 * alignment, and a few large buffers.
+	 */
+	for (len = 0; len < 4 * 1024 + 3 * 24 * 1024; len += len < 4096 ? 1 : 997) {
+		for (off = 0; off < 8; off++) {
+			ref = impls[0].update(0xffffffff, buf + off, len);
+			for (i = 1; i < count; i++) {
+				crc = impls[i].update(0xffffffff, buf + off, len);
+				if (crc != ref) {
+					printf("%s: len %zu offset %zu crc %08x "
+					       "expected %08x\n", impls[i].name,
+					       len, off, crc, ref);
+					return -1;
+				}
+			}
+		}
+	}
+	ref = impls[0].update(0, buf, BUF_SIZE - 64);
+	for (i = 1; i < count; i++) {
+		crc = impls[i].update(0, buf, BUF_SIZE - 64);
+		if (crc != ref) {
+			printf("%s: 1MB crc %08x expected %08x\n",
+			       impls[i].name, crc, ref);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void
+bench(const struct crc32c_impl *impls, int count, uint8_t *buf)
+{
+	static const size_t sizes[] = { 48, 512, 8192, 65536, 1024 * 1024 };
+	volatile uint32_t sink = 0;
+	unsigned int s;
+	int i;
+
+	printf("%-16s", "bytes");
+	for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		printf("%12zu", sizes[s]);
+	}
+	printf("   (MB/s)\n");
+
+	for (i = 0; i < count; i++) {
+		printf("%-16s", impls[i].name);
+		for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+			size_t total = 0;
+			double start = now(), t;
+
+			do {
+				int n;
+
+				for (n = 0; n < 64; n++) {
+					sink ^= impls[i].update(sink, buf, sizes[s]);
+					total += sizes[s];
+				}
+				t = now() - start;
+			} while (t < 0.2);
+			printf("%12.0f", total / t / (1024 * 1024));
+		}
+		printf("\n");
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	const struct crc32c_impl *impls;
+	uint8_t *buf;
+	int c, i, count;
+	static int show_help = 0, show_usage = 0, do_bench = 0;
+
+	static struct option long_options[] = {
+		{"help",           no_argument,          NULL,        'h'},
+		{"usage",          no_argument,          NULL,        'u'},
+		{"bench",          no_argument,          NULL,        'b'},
+		{0, 0, 0, 0}
+	};
+	int option_index;
+
+	while ((c = getopt_long(argc, argv, "h?ub", long_options,
+			&option_index)) != -1) {
+		switch (c) {
+		case 'h':
+		case '?':
+			show_help = 1;
+			break;
+		case 'u':
+			show_usage = 1;
+			break;
+		case 'b':
+			do_bench = 1;
+			break;
+		default:
+			fprintf(stderr, "Unrecognized option '%c'\n\n", c);
+			print_help();
+			exit(0);
+		}
+	}
+
+	if (show_help != 0) {
+		print_help();
+		exit(0);
+	}
+
+	if (show_usage != 0) {
+		print_usage();
+		exit(0);
+	}
+
+	buf = malloc(BUF_SIZE);
+	if (buf == NULL) {
+		printf("failed to allocate buffer\n");
+		exit(10);
+	}
+	srandom(1);
+	for (i = 0; i < BUF_SIZE; i++) {
+		buf[i] = random();
+	}
+
+	impls = crc32c_get_impls(&count);
+	printf("crc32c implementations:");
+	for (i = 0; i < count; i++) {
+		printf(" %s", impls[i].name);
+	}
+	printf(", using %s\n", impls[count - 1].name);
+
+	if (verify(impls, count, buf) != 0) {
+		printf("Failed. crc32c implementations disagree\n");
+		exit(10);
+	}
+
+	if (do_bench) {
+		bench(impls, count, buf);
+	}
+
+	free(buf);
+	return 0;
+}
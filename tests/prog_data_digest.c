@@ -0,0 +1,234 @@
+/*
+   Copyright (C) 2015 by Ronnie Sahlberg <ronniesahlberg@gmail.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "iscsi.h"
+#include "scsi-lowlevel.h"
+
+const char *initiator = "iqn.2007-10.com.github:sahlberg:libiscsi:prog-data-digest";
+
+#define BLOCK_SIZE 4096
+/* large enough to need several DATA-IN and DATA-OUT PDUs */
+#define DATA_SIZE (1024 * 1024 + BLOCK_SIZE)
+
+void print_usage(void)
+{
+	fprintf(stderr, "Usage: prog_data_digest [-?|--help] [--usage] "
+		"[-i|--initiator-name=iqn-name]\n"
+		"\t\t<iscsi-portal-url>\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "This command is used to test that data written and "
+		"read back with DataDigest enabled is intact, both with "
+		"and without user iovectors.\n");
+}
+
+void print_help(void)
+{
+	fprintf(stderr, "Usage: prog_data_digest [OPTION...] <iscsi-url>\n");
+	fprintf(stderr, "  -i, --initiator-name=iqn-name     "
+		"Initiatorname to use\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Help options:\n");
+	fprintf(stderr, "  -?, --help                        "
+		"Show this help message\n");
+	fprintf(stderr, "      --usage                       "
+		"Display brief usage message\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "iSCSI Portal URL format : %s\n",
+		ISCSI_PORTAL_URL_SYNTAX);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "<host> is either of:\n");
+	fprintf(stderr, "  \"hostname\"       iscsi.example\n");
+	fprintf(stderr, "  \"ipv4-address\"   10.1.1.27\n");
+	fprintf(stderr, "  \"ipv6-address\"   [fce0::1]\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct iscsi_context *iscsi;
+	struct iscsi_url *iscsi_url = NULL;
+	struct scsi_task *task;
+	struct scsi_iovec iov[3];
+	unsigned char *wbuf, *rbuf;
+	char *url = NULL;
+	int c, i, lun;
+	static int show_help = 0, show_usage = 0, debug = 0;
+
+	static struct option long_options[] = {
+		{"help",           no_argument,          NULL,        'h'},
+		{"usage",          no_argument,          NULL,        'u'},
+		{"debug",          no_argument,          NULL,        'd'},
+		{"initiator-name", required_argument,    NULL,        'i'},
+		{0, 0, 0, 0}
+	};
+	int option_index;
+
+	while ((c = getopt_long(argc, argv, "h?udi:", long_options,
+			&option_index)) != -1) {
+		switch (c) {
+		case 'h':
+		case '?':
+			show_help = 1;
+			break;
+		case 'u':
+			show_usage = 1;
+			break;
+		case 'd':
+			debug = 1;
+			break;
+		case 'i':
+			initiator = optarg;
+			break;
+		default:
+			fprintf(stderr, "Unrecognized option '%c'\n\n", c);
+			print_help();
+			exit(0);
+		}
+	}
+
+	if (show_help != 0) {
+		print_help();
+		exit(0);
+	}
+
+	if (show_usage != 0) {
+		print_usage();
+		exit(0);
+	}
+
+	if (optind != argc -1) {
+		print_usage();
+		exit(0);
+	}
+
+	if (argv[optind] != NULL) {
+		url = strdup(argv[optind]);
+	}
+	if (url == NULL) {
+		fprintf(stderr, "You must specify iscsi target portal.\n");
+		print_usage();
+		exit(10);
+	}
+
+	iscsi = iscsi_create_context(initiator);
+	if (iscsi == NULL) {
+		printf("Failed to create context\n");
+		exit(10);
+	}
+
+	if (debug > 0) {
+		iscsi_set_log_level(iscsi, debug);
+		iscsi_set_log_fn(iscsi, iscsi_log_to_stderr);
+	}
+
+	iscsi_url = iscsi_parse_full_url(iscsi, url);
+
+	free(url);
+
+	if (iscsi_url == NULL) {
+		fprintf(stderr, "Failed to parse URL: %s\n",
+			iscsi_get_error(iscsi));
+		exit(10);
+	}
+
+	iscsi_set_session_type(iscsi, ISCSI_SESSION_NORMAL);
+	printf("Enable Data Digest\n");
+	iscsi_set_data_digest(iscsi, ISCSI_DATA_DIGEST_CRC32C);
+
+	printf("Disable iscsi reconnect on session failure\n");
+	iscsi_set_noautoreconnect(iscsi, 1);
+
+	lun = iscsi_url->lun;
+	if (iscsi_full_connect_sync(iscsi, iscsi_url->portal, lun) != 0) {
+		fprintf(stderr, "iscsi_connect failed. %s\n",
+			iscsi_get_error(iscsi));
+		exit(10);
+	}
+
+	wbuf = malloc(DATA_SIZE);
+	rbuf = malloc(DATA_SIZE);
+	if (wbuf == NULL || rbuf == NULL) {
+		fprintf(stderr, "Failed to allocate buffers\n");
+		exit(10);
+	}
+	for (i = 0; i < DATA_SIZE; i++) {
+		wbuf[i] = random();
+	}
+
+	printf("Write data with Data Digest\n");
+	task = iscsi_write16_sync(iscsi, lun, 0, wbuf, DATA_SIZE, BLOCK_SIZE,
+				  0, 0, 0, 0, 0);
+	if (task == NULL || task->status != SCSI_STATUS_GOOD) {
+		fprintf(stderr, "write16 failed: %s\n", iscsi_get_error(iscsi));
+		exit(10);
+	}
+	scsi_free_scsi_task(task);
+
+	printf("Read it back into a task buffer\n");
+	task = iscsi_read16_sync(iscsi, lun, 0, DATA_SIZE, BLOCK_SIZE,
+				 0, 0, 0, 0, 0);
+	if (task == NULL || task->status != SCSI_STATUS_GOOD) {
+		fprintf(stderr, "read16 failed: %s\n", iscsi_get_error(iscsi));
+		exit(10);
+	}
+	if (task->datain.size != DATA_SIZE ||
+	    memcmp(task->datain.data, wbuf, DATA_SIZE)) {
+		fprintf(stderr, "read16 returned the wrong data\n");
+		exit(10);
+	}
+	scsi_free_scsi_task(task);
+
+	printf("Read it back into user iovectors\n");
+	memset(rbuf, 0, DATA_SIZE);
+	iov[0].iov_base = rbuf;
+	iov[0].iov_len  = 1000;
+	iov[1].iov_base = rbuf + 1000;
+	iov[1].iov_len  = DATA_SIZE / 2;
+	iov[2].iov_base = rbuf + 1000 + DATA_SIZE / 2;
+	iov[2].iov_len  = DATA_SIZE - 1000 - DATA_SIZE / 2;
+	task = iscsi_read16_iov_sync(iscsi, lun, 0, DATA_SIZE, BLOCK_SIZE,
+				     0, 0, 0, 0, 0, iov, 3);
+	if (task == NULL || task->status != SCSI_STATUS_GOOD) {
+		fprintf(stderr, "read16 failed: %s\n", iscsi_get_error(iscsi));
+		exit(10);
+	}
+	if (memcmp(rbuf, wbuf, DATA_SIZE)) {
+		fprintf(stderr, "read16 returned the wrong data\n");
+		exit(10);
+	}
+	scsi_free_scsi_task(task);
+
+	free(wbuf);
+	free(rbuf);
+	iscsi_destroy_url(iscsi_url);
+	iscsi_logout_sync(iscsi);
+	iscsi_destroy_context(iscsi);
+
+	return 0;
+}
@@ -0,0 +1,952 @@
+/*
+   Copyright (C) 2015 by Ronnie Sahlberg <ronniesahlberg@gmail.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_POLL_H
+#include <poll.h>
+#endif
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+
+#include "iscsi.h"
+#include "iscsi-private.h"
+#include "scsi-lowlevel.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+const char *initiator = "iqn.2007-10.com.github:sahlberg:libiscsi:prog-error-recovery";
+
+#define BLOCK_SIZE 4096
+#define NUM_BLOCKS 64
+/* small Data-In, a read is many of them */
+#define SEGMENT_LENGTH 8192
+/* the write and the read in flight when the connection drops */
+#define LARGE_BLOCKS 256
+/* Data-In of that read that arrive before the connection drops */
+#define DATAIN_BEFORE_DROP 4
+
+/* the target does not support the ErrorRecoveryLevel needed */
+#define EXIT_SKIPPED 77
+
+enum fault {
+	FAULT_NONE,
+	FAULT_SNACK,		/* lose one Data-In and damage another */
+	FAULT_DROP,		/* drop the connection in the middle of I/O */
+};
+
+enum relay_verdict {
+	RELAY_PASS,
+	RELAY_DROP,
+	RELAY_HOLD,
+};
+
+struct buffer {
+	unsigned char *data;
+	size_t len;
+};
+
+/*
+ * The connection to the target goes through a socket pair. The library
+ * reads and writes one end of it and the relay moves the bytes between
+ * the other end and the socket to the target, looking at every PDU the
+ * target sends on the way. That is where a PDU is lost, damaged or held
+ * back.
+ */
+static struct {
+	struct iscsi_context *iscsi;
+	int tcp;			/* the connection to the target */
+	int lib;			/* our end of the pair */
+	int eof;			/* the connection to the target is gone */
+	struct buffer from_target;	/* a PDU that is not complete yet */
+	struct buffer to_lib;
+	struct buffer to_target;
+	struct buffer held;
+	enum relay_verdict (*inspect)(unsigned char *hdr, unsigned char *data,
+				      uint32_t len);
+} relay = { .tcp = -1, .lib = -1 };
+
+static struct iscsi_transport drv;
+static struct iscsi_transport real_drv;
+
+struct transfer {
+	int finished;
+	int status;
+};
+
+/* what was seen of the read and the write the faults are injected into */
+static struct transfer rd, wr;
+static int in_flight;
+static uint32_t read_itt = 0xffffffff, write_itt = 0xffffffff;
+static int snacks, dropped, corrupted, resent, status_seen, released;
+static uint32_t next_datasn;
+/* before and after the connection was dropped */
+static int phase;
+static uint64_t data_out[2], data_in[2];
+static int datain_before, first_datasn_after = -1;
+static uint16_t tsih_before;
+
+void print_usage(void)
+{
+	fprintf(stderr, "Usage: prog_error_recovery [-?|--help] [--usage] "
+		"[-i|--initiator-name=iqn-name] [-l|--level=1|2] "
+		"[-f|--fault=snack|drop]\n"
+		"\t\t<iscsi-url>\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "This command is used to test that ErrorRecoveryLevel "
+		"is negotiated and that I/O works with it. With snack a "
+		"Data-In is lost and another one damaged, using Header and "
+		"Data Digest, and they must be asked for again without a "
+		"reconnect. With drop the connection fails while a write and "
+		"a read are in flight and the session must continue on a new "
+		"connection. The program exits with 77 if the target does "
+		"not support the ErrorRecoveryLevel needed.\n");
+}
+
+void print_help(void)
+{
+	fprintf(stderr, "Usage: prog_error_recovery [OPTION...] <iscsi-url>\n");
+	fprintf(stderr, "  -i, --initiator-name=iqn-name     "
+		"Initiatorname to use\n");
+	fprintf(stderr, "  -l, --level=1|2                   "
+		"ErrorRecoveryLevel to offer (default 1)\n");
+	fprintf(stderr, "  -f, --fault=snack|drop            "
+		"Fault to recover from\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Help options:\n");
+	fprintf(stderr, "  -?, --help                        "
+		"Show this help message\n");
+	fprintf(stderr, "      --usage                       "
+		"Display brief usage message\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "iSCSI URL format : %s\n", ISCSI_URL_SYNTAX);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "<host> is either of:\n");
+	fprintf(stderr, "  \"hostname\"       iscsi.example\n");
+	fprintf(stderr, "  \"ipv4-address\"   10.1.1.27\n");
+	fprintf(stderr, "  \"ipv6-address\"   [fce0::1]\n");
+}
+
+static void buffer_append(struct buffer *b, const unsigned char *data,
+			  size_t len)
+{
+	unsigned char *p;
+
+	if (len == 0) {
+		return;
+	}
+	p = realloc(b->data, b->len + len);
+	if (p == NULL) {
+		fprintf(stderr, "Failed to grow relay buffer\n");
+		exit(10);
+	}
+	memcpy(p + b->len, data, len);
+	b->data = p;
+	b->len += len;
+}
+
+static void buffer_consume(struct buffer *b, size_t len)
+{
+	memmove(b->data, b->data + len, b->len - len);
+	b->len -= len;
+}
+
+static void buffer_free(struct buffer *b)
+{
+	free(b->data);
+	b->data = NULL;
+	b->len = 0;
+}
+
+/* write as much of the buffer as the socket takes */
+static void relay_flush(int fd, struct buffer *b)
+{
+	ssize_t count;
+
+	while (b->len > 0) {
+		count = send(fd, b->data, b->len, MSG_NOSIGNAL);
+		if (count < 0) {
+			if (errno != EAGAIN && errno != EINTR) {
+				/* the other side is gone */
+				b->len = 0;
+			}
+			return;
+		}
+		buffer_consume(b, count);
+	}
+}
+
+/* the size of the PDU at the start of buf, 0 if not all of it is there */
+static size_t relay_pdu_size(const unsigned char *buf, size_t len)
+{
+	struct iscsi_context *iscsi = relay.iscsi;
+	size_t hdr_size, data_size;
+
+	hdr_size = ISCSI_HEADER_SIZE(iscsi->header_digest);
+	if (len < hdr_size) {
+		return 0;
+	}
+	hdr_size += buf[4] * 4;
+	data_size = (scsi_get_uint32(&buf[4]) & 0x00ffffff) + 3;
+	data_size &= ~(size_t)3;
+	data_size += ISCSI_DATA_DIGEST_SIZE(iscsi->data_digest, data_size);
+	if (len < hdr_size + data_size) {
+		return 0;
+	}
+	return hdr_size + data_size;
+}
+
+static void relay_from_target(void)
+{
+	unsigned char buf[65536], *hdr;
+	enum relay_verdict verdict;
+	size_t size, hdr_size;
+	ssize_t count;
+
+	while (!relay.eof) {
+		count = recv(relay.tcp, buf, sizeof(buf), 0);
+		if (count < 0 && (errno == EAGAIN || errno == EINTR)) {
+			break;
+		}
+		if (count <= 0) {
+			relay.eof = 1;
+			break;
+		}
+		buffer_append(&relay.from_target, buf, count);
+	}
+
+	while ((size = relay_pdu_size(relay.from_target.data,
+				      relay.from_target.len)) > 0) {
+		hdr = relay.from_target.data;
+		hdr_size = ISCSI_HEADER_SIZE(relay.iscsi->header_digest) +
+			hdr[4] * 4;
+		verdict = RELAY_PASS;
+		if (relay.inspect != NULL) {
+			verdict = relay.inspect(hdr, hdr + hdr_size,
+				scsi_get_uint32(&hdr[4]) & 0x00ffffff);
+		}
+		switch (verdict) {
+		case RELAY_PASS:
+			buffer_append(&relay.to_lib, hdr, size);
+			break;
+		case RELAY_HOLD:
+			buffer_append(&relay.held, hdr, size);
+			break;
+		case RELAY_DROP:
+			break;
+		}
+		buffer_consume(&relay.from_target, size);
+	}
+}
+
+static void relay_to_target(void)
+{
+	unsigned char buf[65536];
+	ssize_t count;
+
+	while ((count = recv(relay.lib, buf, sizeof(buf), 0)) > 0) {
+		if (!relay.eof) {
+			buffer_append(&relay.to_target, buf, count);
+		}
+	}
+	relay_flush(relay.tcp, &relay.to_target);
+}
+
+static void relay_close(void)
+{
+	if (relay.tcp != -1) {
+		close(relay.tcp);
+	}
+	if (relay.lib != -1) {
+		close(relay.lib);
+	}
+	relay.tcp = -1;
+	relay.lib = -1;
+	relay.eof = 0;
+	buffer_free(&relay.from_target);
+	buffer_free(&relay.to_lib);
+	buffer_free(&relay.to_target);
+	buffer_free(&relay.held);
+}
+
+/* the library has read everything the relay handed to it */
+static int relay_drained(struct iscsi_context *iscsi)
+{
+	int avail = 0;
+
+	if (relay.to_lib.len > 0) {
+		return 0;
+	}
+	return ioctl(iscsi->fd, FIONREAD, &avail) == 0 && avail == 0;
+}
+
+static int relay_get_fd(struct iscsi_context *iscsi)
+{
+	return relay.tcp;
+}
+
+static int relay_which_events(struct iscsi_context *iscsi)
+{
+	int events = real_drv.which_events(iscsi);
+
+	/* wake up to move what is waiting in the relay too */
+	if (relay.to_lib.len > 0 || relay.to_target.len > 0) {
+		events |= POLLOUT;
+	}
+	return events;
+}
+
+static int relay_service(struct iscsi_context *iscsi, int revents)
+{
+	struct pollfd pfd;
+	int ret;
+
+	if (revents & (POLLIN | POLLHUP | POLLERR)) {
+		relay_from_target();
+	}
+	do {
+		relay_flush(relay.lib, &relay.to_lib);
+		if (relay.eof && relay_drained(iscsi) && iscsi->is_loggedin) {
+			/* the library sees the connection drop, not the
+			 * target closing it after a logout
+			 */
+			shutdown(relay.lib, SHUT_WR);
+		}
+
+		pfd.fd = iscsi->fd;
+		pfd.events = real_drv.which_events(iscsi);
+		pfd.revents = 0;
+		if (poll(&pfd, 1, 0) < 0) {
+			fprintf(stderr, "Poll failed\n");
+			exit(10);
+		}
+		ret = real_drv.service(iscsi, pfd.revents);
+		if (iscsi->drv != &drv) {
+			/* the library has reconnected, the relay went with
+			 * the old connection
+			 */
+			relay_close();
+			return ret;
+		}
+		relay_to_target();
+	} while (ret == 0 && pfd.revents & (POLLIN | POLLOUT));
+
+	return ret;
+}
+
+static int relay_queue_pdu(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
+{
+	switch (pdu->outdata.data[0] & 0x3f) {
+	case ISCSI_PDU_SNACK_REQUEST:
+		if (pdu->itt == read_itt) {
+			snacks++;
+		}
+		break;
+	case ISCSI_PDU_DATA_OUT:
+		/* over TCP one pdu is the whole sequence */
+		if (pdu->itt == write_itt) {
+			data_out[phase] += pdu->payload_len +
+				pdu->dataout_remaining;
+		}
+		break;
+	default:
+		break;
+	}
+	return real_drv.queue_pdu(iscsi, pdu);
+}
+
+static int relay_disconnect(struct iscsi_context *iscsi)
+{
+	relay_close();
+	return real_drv.disconnect(iscsi);
+}
+
+static void relay_install(struct iscsi_context *iscsi)
+{
+	int sv[2];
+
+	relay_close();
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0 ||
+	    fcntl(sv[0], F_SETFL, O_NONBLOCK) != 0 ||
+	    fcntl(sv[1], F_SETFL, O_NONBLOCK) != 0) {
+		fprintf(stderr, "Failed to create socket pair\n");
+		exit(10);
+	}
+	relay.iscsi = iscsi;
+	relay.tcp = iscsi->fd;
+	relay.lib = sv[1];
+	iscsi->fd = sv[0];
+
+	real_drv = *iscsi->drv;
+	drv = real_drv;
+	drv.queue_pdu = relay_queue_pdu;
+	drv.service = relay_service;
+	drv.get_fd = relay_get_fd;
+	drv.which_events = relay_which_events;
+	drv.disconnect = relay_disconnect;
+	iscsi->drv = &drv;
+}
+
+static void transfer_cb(struct iscsi_context *iscsi, int status,
+			void *command_data, void *private_data)
+{
+	struct transfer *t = private_data;
+
+	t->status = status;
+	t->finished = 1;
+	in_flight--;
+}
+
+/* service the session until nothing is in flight, checking in between */
+static void run_until_done(struct iscsi_context *iscsi,
+			   void (*check)(struct iscsi_context *iscsi))
+{
+	struct pollfd pfd;
+
+	while (in_flight > 0) {
+		/* the connection the session continues on is relayed too */
+		if (iscsi->drv != &drv && iscsi->is_loggedin &&
+		    iscsi->old_iscsi == NULL) {
+			relay_install(iscsi);
+		}
+
+		pfd.fd = iscsi_get_fd(iscsi);
+		pfd.events = iscsi_which_events(iscsi);
+		if (poll(&pfd, 1, 1000) < 0) {
+			fprintf(stderr, "Poll failed\n");
+			exit(10);
+		}
+		if (iscsi_service(iscsi, pfd.revents) < 0) {
+			fprintf(stderr, "iscsi_service failed with : %s\n",
+				iscsi_get_error(iscsi));
+			exit(10);
+		}
+		check(iscsi);
+	}
+}
+
+/*
+ * Lose DataSN 1 of the read and damage the data of DataSN 3. What the
+ * target sends again is held back until the library has the status of
+ * the read, which it must not complete before all the data is there.
+ */
+static enum relay_verdict inspect_snack(unsigned char *hdr,
+					unsigned char *data, uint32_t len)
+{
+	uint32_t sn;
+
+	if (scsi_get_uint32(&hdr[16]) != read_itt) {
+		return RELAY_PASS;
+	}
+	if ((hdr[0] & 0x3f) == ISCSI_PDU_SCSI_RESPONSE) {
+		status_seen = 1;
+		return RELAY_PASS;
+	}
+	if ((hdr[0] & 0x3f) != ISCSI_PDU_DATA_IN) {
+		return RELAY_PASS;
+	}
+
+	sn = scsi_get_uint32(&hdr[36]);
+	if (sn < next_datasn) {
+		/* sent again for a SNACK */
+		resent++;
+		return released ? RELAY_PASS : RELAY_HOLD;
+	}
+	next_datasn = sn + 1;
+	if (sn == 1) {
+		dropped++;
+		return RELAY_DROP;
+	}
+	if (sn == 3 && len > 0) {
+		data[0] ^= 0xff;
+		corrupted++;
+	}
+	if (hdr[1] & ISCSI_PDU_DATA_CONTAINS_STATUS) {
+		status_seen = 1;
+	}
+	return RELAY_PASS;
+}
+
+static void check_snack(struct iscsi_context *iscsi)
+{
+	/* wait until the library has read the status */
+	if (released || !status_seen || !relay_drained(iscsi)) {
+		return;
+	}
+	if (rd.finished) {
+		fprintf(stderr, "The read completed with Data-In missing\n");
+		exit(10);
+	}
+	if (snacks < 2) {
+		fprintf(stderr, "%d SNACK sent for the lost and the damaged "
+			"Data-In\n", snacks);
+		exit(10);
+	}
+	printf("The status is held back, let the Data-In sent again "
+	       "through\n");
+	released = 1;
+	buffer_append(&relay.to_lib, relay.held.data, relay.held.len);
+	relay.held.len = 0;
+}
+
+static void test_snack(struct iscsi_context *iscsi, int lun,
+		       const unsigned char *buf)
+{
+	struct iscsi_reconnect_stats stats;
+	struct scsi_task *task;
+
+	printf("Read with a Data-In lost and one damaged\n");
+	relay.inspect = inspect_snack;
+	in_flight = 1;
+	task = iscsi_read16_task(iscsi, lun, 0, NUM_BLOCKS * BLOCK_SIZE,
+				 BLOCK_SIZE, 0, 0, 0, 0, 0, transfer_cb, &rd);
+	if (task == NULL) {
+		fprintf(stderr, "Failed to send read: %s\n",
+			iscsi_get_error(iscsi));
+		exit(10);
+	}
+	read_itt = task->itt;
+	run_until_done(iscsi, check_snack);
+
+	if (rd.status != SCSI_STATUS_GOOD) {
+		fprintf(stderr, "Read failed: %s\n", iscsi_get_error(iscsi));
+		exit(10);
+	}
+	if (dropped != 1 || corrupted != 1 || !released) {
+		fprintf(stderr, "Read was not split into enough Data-In\n");
+		exit(10);
+	}
+	if (resent != 2) {
+		fprintf(stderr, "Target sent %d Data-In again, expected 2\n",
+			resent);
+		exit(10);
+	}
+	if (task->datain.size != NUM_BLOCKS * BLOCK_SIZE
+	    || memcmp(task->datain.data, buf, NUM_BLOCKS * BLOCK_SIZE)) {
+		fprintf(stderr, "Read returned the wrong data\n");
+		exit(10);
+	}
+	scsi_free_scsi_task(task);
+
+	iscsi_get_reconnect_stats(iscsi, &stats);
+	if (stats.reconnects != 0 || stats.failed_attempts != 0) {
+		fprintf(stderr, "Reconnected %u times to recover Data-In\n",
+			stats.reconnects + stats.failed_attempts);
+		exit(10);
+	}
+}
+
+/*
+ * Let a few Data-In of the read through and R2Ts of the write until a
+ * quarter of it has been sent. What the target sends after that is lost
+ * with the connection, both commands are in the middle of their transfer
+ * when it drops. On the new connection count what the target sends and
+ * asks for again.
+ */
+static enum relay_verdict inspect_drop(unsigned char *hdr,
+				       unsigned char *data, uint32_t len)
+{
+	uint32_t itt = scsi_get_uint32(&hdr[16]);
+	int opcode = hdr[0] & 0x3f;
+
+	if (phase == 1) {
+		if (itt == read_itt && opcode == ISCSI_PDU_DATA_IN) {
+			if (first_datasn_after < 0) {
+				first_datasn_after = scsi_get_uint32(&hdr[36]);
+			}
+			data_in[1] += len;
+		}
+		return RELAY_PASS;
+	}
+
+	if (itt == read_itt && (opcode == ISCSI_PDU_DATA_IN ||
+				opcode == ISCSI_PDU_SCSI_RESPONSE)) {
+		if (datain_before >= DATAIN_BEFORE_DROP) {
+			return RELAY_DROP;
+		}
+		if (opcode == ISCSI_PDU_DATA_IN) {
+			datain_before++;
+			data_in[0] += len;
+		}
+		return RELAY_PASS;
+	}
+	if (itt == write_itt && opcode == ISCSI_PDU_R2T &&
+	    data_out[0] >= LARGE_BLOCKS * BLOCK_SIZE / 4) {
+		return RELAY_DROP;
+	}
+	return RELAY_PASS;
+}
+
+static void check_drop(struct iscsi_context *iscsi)
+{
+	if (phase == 1 || datain_before < DATAIN_BEFORE_DROP ||
+	    data_out[0] < LARGE_BLOCKS * BLOCK_SIZE / 4) {
+		return;
+	}
+	if (rd.finished || wr.finished) {
+		fprintf(stderr, "I/O finished before the connection "
+			"dropped\n");
+		exit(10);
+	}
+
+	printf("Drop the connection after %d Data-In of the read and %llu "
+	       "bytes of the write\n", datain_before,
+	       (unsigned long long)data_out[0]);
+	tsih_before = iscsi->tsih;
+	phase = 1;
+	relay.eof = 1;
+	relay.from_target.len = 0;
+	relay.to_target.len = 0;
+	shutdown(relay.tcp, SHUT_RDWR);
+}
+
+static void test_drop(struct iscsi_context *iscsi, int lun)
+{
+	struct iscsi_reconnect_stats stats;
+	struct scsi_task *rtask, *wtask, *task;
+	unsigned char *rbuf, *wbuf;
+	int i, len = LARGE_BLOCKS * BLOCK_SIZE;
+
+	rbuf = malloc(len);
+	wbuf = malloc(len);
+	if (rbuf == NULL || wbuf == NULL) {
+		fprintf(stderr, "Failed to allocate buffers\n");
+		exit(10);
+	}
+	for (i = 0; i < len; i++) {
+		rbuf[i] = random();
+		wbuf[i] = random();
+	}
+
+	task = iscsi_write16_sync(iscsi, lun, 0, rbuf, len, BLOCK_SIZE,
+				  0, 0, 0, 0, 0);
+	if (task == NULL || task->status != SCSI_STATUS_GOOD) {
+		fprintf(stderr, "Write failed: %s\n", iscsi_get_error(iscsi));
+		exit(10);
+	}
+	scsi_free_scsi_task(task);
+
+	printf("Write and read %d blocks and drop the connection\n",
+	       LARGE_BLOCKS);
+	relay.inspect = inspect_drop;
+	in_flight = 2;
+	rtask = iscsi_read16_task(iscsi, lun, 0, len, BLOCK_SIZE,
+				  0, 0, 0, 0, 0, transfer_cb, &rd);
+	if (rtask == NULL) {
+		fprintf(stderr, "Failed to send read: %s\n",
+			iscsi_get_error(iscsi));
+		exit(10);
+	}
+	read_itt = rtask->itt;
+	wtask = iscsi_write16_task(iscsi, lun, LARGE_BLOCKS, wbuf, len,
+				   BLOCK_SIZE, 0, 0, 0, 0, 0,
+				   transfer_cb, &wr);
+	if (wtask == NULL) {
+		fprintf(stderr, "Failed to send write: %s\n",
+			iscsi_get_error(iscsi));
+		exit(10);
+	}
+	write_itt = wtask->itt;
+	run_until_done(iscsi, check_drop);
+
+	if (rd.status != SCSI_STATUS_GOOD || wr.status != SCSI_STATUS_GOOD) {
+		fprintf(stderr, "I/O failed: %s\n", iscsi_get_error(iscsi));
+		exit(10);
+	}
+	if (iscsi->tsih == 0 || iscsi->tsih != tsih_before) {
+		fprintf(stderr, "Session 0x%04x was not continued, now in "
+			"0x%04x\n", tsih_before, iscsi->tsih);
+		exit(10);
+	}
+	iscsi_get_reconnect_stats(iscsi, &stats);
+	if (stats.reconnects != 1 || stats.reassigned != 2 ||
+	    stats.replayed != 0) {
+		fprintf(stderr, "%u reconnects, %llu tasks reassigned and "
+			"%llu sent again\n", stats.reconnects,
+			(unsigned long long)stats.reassigned,
+			(unsigned long long)stats.replayed);
+		exit(10);
+	}
+
+	/* only what was missing is sent again */
+	if (first_datasn_after != datain_before ||
+	    data_in[0] + data_in[1] != (uint64_t)len) {
+		fprintf(stderr, "Target sent the read again from DataSN %d "
+			"with %d Data-In received\n", first_datasn_after,
+			datain_before);
+		exit(10);
+	}
+	if (data_out[1] == 0 || data_out[1] >= (uint64_t)len) {
+		fprintf(stderr, "Sent %llu bytes of the write again\n",
+			(unsigned long long)data_out[1]);
+		exit(10);
+	}
+
+	if (rtask->datain.size != len || memcmp(rtask->datain.data, rbuf, len)) {
+		fprintf(stderr, "Read returned the wrong data\n");
+		exit(10);
+	}
+	scsi_free_scsi_task(rtask);
+	scsi_free_scsi_task(wtask);
+
+	task = iscsi_read16_sync(iscsi, lun, LARGE_BLOCKS, len, BLOCK_SIZE,
+				 0, 0, 0, 0, 0);
+	if (task == NULL || task->status != SCSI_STATUS_GOOD) {
+		fprintf(stderr, "Read failed: %s\n", iscsi_get_error(iscsi));
+		exit(10);
+	}
+	if (task->datain.size != len || memcmp(task->datain.data, wbuf, len)) {
+		fprintf(stderr, "Write stored the wrong data\n");
+		exit(10);
+	}
+	scsi_free_scsi_task(task);
+
+	free(rbuf);
+	free(wbuf);
+}
+
+int main(int argc, char *argv[])
+{
+	struct iscsi_context *iscsi;
+	struct iscsi_url *iscsi_url = NULL;
+	char *url = NULL;
+	struct scsi_task *task;
+	unsigned char *buf;
+	int c, i, level, want_level = 1;
+	enum fault fault = FAULT_NONE;
+	static int show_help = 0, show_usage = 0, debug = 0;
+
+	static struct option long_options[] = {
+		{"help",           no_argument,          NULL,        'h'},
+		{"usage",          no_argument,          NULL,        'u'},
+		{"debug",          no_argument,          NULL,        'd'},
+		{"initiator-name", required_argument,    NULL,        'i'},
+		{"level",          required_argument,    NULL,        'l'},
+		{"fault",          required_argument,    NULL,        'f'},
+		{0, 0, 0, 0}
+	};
+	int option_index;
+
+	while ((c = getopt_long(argc, argv, "h?udi:l:f:", long_options,
+			&option_index)) != -1) {
+		switch (c) {
+		case 'h':
+		case '?':
+			show_help = 1;
+			break;
+		case 'u':
+			show_usage = 1;
+			break;
+		case 'd':
+			debug = 1;
+			break;
+		case 'i':
+			initiator = optarg;
+			break;
+		case 'l':
+			want_level = atoi(optarg);
+			break;
+		case 'f':
+			if (!strcmp(optarg, "snack")) {
+				fault = FAULT_SNACK;
+			} else if (!strcmp(optarg, "drop")) {
+				fault = FAULT_DROP;
+			} else {
+				fprintf(stderr, "Unknown fault '%s'\n\n",
+					optarg);
+				print_help();
+				exit(10);
+			}
+			break;
+		default:
+			fprintf(stderr, "Unrecognized option '%c'\n\n", c);
+			print_help();
+			exit(0);
+		}
+	}
+
+	if (show_help != 0) {
+		print_help();
+		exit(0);
+	}
+
+	if (show_usage != 0) {
+		print_usage();
+		exit(0);
+	}
+
+	if (optind != argc -1) {
+		print_usage();
+		exit(0);
+	}
+
+	if (argv[optind] != NULL) {
+		url = strdup(argv[optind]);
+	}
+	if (url == NULL) {
+		fprintf(stderr, "You must specify iscsi target portal.\n");
+		print_usage();
+		exit(10);
+	}
+
+	iscsi = iscsi_create_context(initiator);
+	if (iscsi == NULL) {
+		printf("Failed to create context\n");
+		exit(10);
+	}
+
+	if (debug > 0) {
+		iscsi_set_log_level(iscsi, debug);
+		iscsi_set_log_fn(iscsi, iscsi_log_to_stderr);
+	}
+
+	iscsi_url = iscsi_parse_full_url(iscsi, url);
+
+	free(url);
+
+	if (iscsi_url == NULL) {
+		fprintf(stderr, "Failed to parse URL: %s\n",
+			iscsi_get_error(iscsi));
+		exit(10);
+	}
+
+	iscsi_set_session_type(iscsi, ISCSI_SESSION_NORMAL);
+
+	if (iscsi_get_error_recovery_level(iscsi) != 0) {
+		fprintf(stderr, "ErrorRecoveryLevel does not default to 0\n");
+		exit(10);
+	}
+	if (iscsi_set_error_recovery_level(iscsi, 3) == 0) {
+		fprintf(stderr, "Accepted ErrorRecoveryLevel 3\n");
+		exit(10);
+	}
+	printf("Offer ErrorRecoveryLevel=%d\n", want_level);
+	if (iscsi_set_error_recovery_level(iscsi, want_level) != 0) {
+		fprintf(stderr, "iscsi_set_error_recovery_level failed. %s\n",
+			iscsi_get_error(iscsi));
+		exit(10);
+	}
+	if (fault == FAULT_DROP && want_level < 2) {
+		fprintf(stderr, "Recovering a connection needs "
+			"ErrorRecoveryLevel=2\n");
+		exit(10);
+	}
+	if (fault != FAULT_NONE) {
+		iscsi_set_max_recv_data_segment_length(iscsi, SEGMENT_LENGTH);
+	}
+	if (fault == FAULT_SNACK) {
+		iscsi_set_header_digest(iscsi, ISCSI_HEADER_DIGEST_CRC32C);
+		iscsi_set_data_digest(iscsi, ISCSI_DATA_DIGEST_CRC32C);
+	}
+
+	if (iscsi_full_connect_sync(iscsi, iscsi_url->portal,
+				    iscsi_url->lun) != 0) {
+		fprintf(stderr, "iscsi_connect failed. %s\n",
+			iscsi_get_error(iscsi));
+		exit(10);
+	}
+
+	/* the target may answer with a lower level, never a higher one */
+	level = iscsi_get_error_recovery_level(iscsi);
+	printf("Negotiated ErrorRecoveryLevel=%d\n", level);
+	if (level < 0 || level > want_level) {
+		fprintf(stderr, "Negotiated ErrorRecoveryLevel=%d\n", level);
+		exit(10);
+	}
+	if (iscsi_set_error_recovery_level(iscsi, 0) == 0) {
+		fprintf(stderr, "Changed ErrorRecoveryLevel after login\n");
+		exit(10);
+	}
+	if ((fault == FAULT_SNACK && level < 1) ||
+	    (fault == FAULT_DROP && level < 2)) {
+		printf("Target does not support the ErrorRecoveryLevel "
+		       "needed, skipping\n");
+		exit(EXIT_SKIPPED);
+	}
+	if (fault == FAULT_SNACK &&
+	    (iscsi->header_digest == ISCSI_HEADER_DIGEST_NONE ||
+	     iscsi->data_digest == ISCSI_DATA_DIGEST_NONE)) {
+		fprintf(stderr, "Header and Data Digest were not "
+			"negotiated\n");
+		exit(10);
+	}
+	if (fault != FAULT_NONE) {
+		relay_install(iscsi);
+	}
+
+	buf = malloc(NUM_BLOCKS * BLOCK_SIZE);
+	if (buf == NULL) {
+		fprintf(stderr, "Failed to allocate buffer\n");
+		exit(10);
+	}
+	for (i = 0; i < NUM_BLOCKS * BLOCK_SIZE; i++) {
+		buf[i] = random();
+	}
+
+	printf("Write and read back %d blocks\n", NUM_BLOCKS);
+	task = iscsi_write16_sync(iscsi, iscsi_url->lun, 0, buf,
+				  NUM_BLOCKS * BLOCK_SIZE, BLOCK_SIZE,
+				  0, 0, 0, 0, 0);
+	if (task == NULL || task->status != SCSI_STATUS_GOOD) {
+		fprintf(stderr, "Write failed: %s\n", iscsi_get_error(iscsi));
+		exit(10);
+	}
+	scsi_free_scsi_task(task);
+
+	task = iscsi_read16_sync(iscsi, iscsi_url->lun, 0,
+				 NUM_BLOCKS * BLOCK_SIZE, BLOCK_SIZE,
+				 0, 0, 0, 0, 0);
+	if (task == NULL || task->status != SCSI_STATUS_GOOD) {
+		fprintf(stderr, "Read failed: %s\n", iscsi_get_error(iscsi));
+		exit(10);
+	}
+	if (task->datain.size != NUM_BLOCKS * BLOCK_SIZE
+	    || memcmp(task->datain.data, buf, NUM_BLOCKS * BLOCK_SIZE)) {
+		fprintf(stderr, "Read returned the wrong data\n");
+		exit(10);
+	}
+	scsi_free_scsi_task(task);
+
+	if (fault == FAULT_SNACK) {
+		test_snack(iscsi, iscsi_url->lun, buf);
+	}
+	if (fault == FAULT_DROP) {
+		test_drop(iscsi, iscsi_url->lun);
+	}
+
+	free(buf);
+	iscsi_destroy_url(iscsi_url);
+	iscsi_logout_sync(iscsi);
+	iscsi_destroy_context(iscsi);
+
+	return 0;
+}
@@ -0,0 +1,455 @@
+/*
+   Copyright (C) 2015 by Ronnie Sahlberg <ronniesahlberg@gmail.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "iscsi.h"
+#include "scsi-lowlevel.h"
+
+const char *initiator = "iqn.2007-10.com.github:sahlberg:libiscsi:prog-event-engine";
+
+#define BLOCK_SIZE 4096
+#define COMMAND_BLOCKS 8
+#define COMMAND_SIZE (COMMAND_BLOCKS * BLOCK_SIZE)
+#define NUM_COMMANDS 16
+#define CLIENT_BLOCKS (NUM_COMMANDS * COMMAND_BLOCKS)
+#define QUEUE_DEPTH 4
+
+struct client {
+	struct iscsi_context *iscsi;
+	int lun;
+	int first_lba;
+	int write;	/* writing the region, or reading it back */
+	int next;	/* the next command of the region to send */
+	int in_flight;
+	unsigned char *wbuf;
+};
+
+/* operations that have not completed yet, over all clients */
+static int pending;
+static int failed;
+
+void print_usage(void)
+{
+	fprintf(stderr, "Usage: prog_event_engine [-?|--help] [--usage] "
+		"[-i|--initiator-name=iqn-name] [-n|--sessions=count]\n"
+		"\t\t<iscsi-url>\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "This command is used to test driving many sessions "
+		"from one event engine.\n");
+}
+
+void print_help(void)
+{
+	fprintf(stderr, "Usage: prog_event_engine [OPTION...] <iscsi-url>\n");
+	fprintf(stderr, "  -i, --initiator-name=iqn-name     "
+		"Initiatorname to use\n");
+	fprintf(stderr, "  -n, --sessions=count              "
+		"Number of sessions to log in\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Help options:\n");
+	fprintf(stderr, "  -?, --help                        "
+		"Show this help message\n");
+	fprintf(stderr, "      --usage                       "
+		"Display brief usage message\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "iSCSI URL format : %s\n", ISCSI_URL_SYNTAX);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "<host> is either of:\n");
+	fprintf(stderr, "  \"hostname\"       iscsi.example\n");
+	fprintf(stderr, "  \"ipv4-address\"   10.1.1.27\n");
+	fprintf(stderr, "  \"ipv6-address\"   [fce0::1]\n");
+}
+
+static void send_commands(struct client *client);
+
+static void command_cb(struct iscsi_context *iscsi, int status,
+		       void *command_data, void *private_data)
+{
+	struct client *client = private_data;
+	struct scsi_task *task = command_data;
+	uint64_t lba;
+
+	client->in_flight--;
+	pending--;
+	if (status != SCSI_STATUS_GOOD) {
+		fprintf(stderr, "Command failed: %s\n", iscsi_get_error(iscsi));
+		failed++;
+	} else if (task->xfer_dir == SCSI_XFER_READ) {
+		lba = scsi_get_uint64(&task->cdb[2]) - client->first_lba;
+		if (task->datain.size != COMMAND_SIZE ||
+		    memcmp(task->datain.data,
+			   client->wbuf + lba * BLOCK_SIZE, COMMAND_SIZE)) {
+			fprintf(stderr, "Read of lba %d returned the wrong "
+				"data\n", (int)lba + client->first_lba);
+			failed++;
+		}
+	}
+	scsi_free_scsi_task(task);
+
+	send_commands(client);
+}
+
+/*
+ * Keep QUEUE_DEPTH commands in flight until the region is done, the
+ * writes first and then the reads. Called from the callbacks, so the
+ * commands are queued from inside the event engine.
+ */
+static void send_commands(struct client *client)
+{
+	struct scsi_task *task;
+	struct iscsi_data data;
+	int lba;
+
+	while (client->in_flight < QUEUE_DEPTH) {
+		if (client->next == NUM_COMMANDS) {
+			if (!client->write || client->in_flight > 0) {
+				return;
+			}
+			client->write = 0;
+			client->next = 0;
+		}
+		lba = client->next++ * COMMAND_BLOCKS;
+		if (client->write) {
+			task = scsi_cdb_write16(client->first_lba + lba,
+						COMMAND_SIZE, BLOCK_SIZE,
+						0, 0, 0, 0, 0);
+			data.size = COMMAND_SIZE;
+			data.data = client->wbuf + lba * BLOCK_SIZE;
+		} else {
+			task = scsi_cdb_read16(client->first_lba + lba,
+					       COMMAND_SIZE, BLOCK_SIZE,
+					       0, 0, 0, 0, 0);
+		}
+		if (task == NULL) {
+			fprintf(stderr, "Failed to create task\n");
+			exit(10);
+		}
+		if (iscsi_scsi_command_async(client->iscsi, client->lun, task,
+					     command_cb,
+					     client->write ? &data : NULL,
+					     client) != 0) {
+			fprintf(stderr, "Failed to send command: %s\n",
+				iscsi_get_error(client->iscsi));
+			exit(10);
+		}
+		client->in_flight++;
+		pending++;
+	}
+}
+
+static void connect_cb(struct iscsi_context *iscsi, int status,
+		       void *command_data, void *private_data)
+{
+	struct client *client = private_data;
+
+	(void)command_data;
+
+	pending--;
+	if (status != SCSI_STATUS_GOOD) {
+		fprintf(stderr, "Login failed: %s\n", iscsi_get_error(iscsi));
+		failed++;
+		return;
+	}
+	client->write = 1;
+	send_commands(client);
+}
+
+static void tur_cb(struct iscsi_context *iscsi, int status,
+		   void *command_data, void *private_data)
+{
+	(void)private_data;
+
+	pending--;
+	if (status != SCSI_STATUS_GOOD) {
+		fprintf(stderr, "TESTUNITREADY failed: %s\n",
+			iscsi_get_error(iscsi));
+		failed++;
+	}
+	scsi_free_scsi_task(command_data);
+}
+
+/*
+ * The target drops the connection after the logout, which the engine
+ * would report as a failed session. Take the context out of the engine,
+ * or close the socket and let destroying the context do that.
+ */
+static void logout_cb(struct iscsi_context *iscsi, int status,
+		      void *command_data, void *private_data)
+{
+	struct iscsi_event_engine *engine = private_data;
+
+	(void)command_data;
+
+	pending--;
+	if (status != SCSI_STATUS_GOOD) {
+		fprintf(stderr, "Logout failed: %s\n", iscsi_get_error(iscsi));
+		failed++;
+	}
+	if (pending % 2 == 0) {
+		if (iscsi_event_engine_remove(engine, iscsi) != 0) {
+			fprintf(stderr, "Failed to remove context: %s\n",
+				iscsi_get_error(iscsi));
+			failed++;
+		}
+	} else {
+		iscsi_disconnect(iscsi);
+	}
+}
+
+static void engine_error_cb(struct iscsi_context *iscsi, int status,
+			    void *command_data, void *private_data)
+{
+	(void)status;
+	(void)command_data;
+	(void)private_data;
+
+	fprintf(stderr, "Session failed: %s\n", iscsi_get_error(iscsi));
+	exit(10);
+}
+
+static void run(struct iscsi_event_engine *engine)
+{
+	while (pending > 0) {
+		if (iscsi_event_engine_run_once(engine, 1000) < 0) {
+			fprintf(stderr, "Event engine failed\n");
+			exit(10);
+		}
+	}
+	if (failed) {
+		fprintf(stderr, "%d operations failed\n", failed);
+		exit(10);
+	}
+}
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int main(int argc, char *argv[])
+{
+	struct iscsi_event_engine *engine;
+	struct iscsi_url *iscsi_url = NULL;
+	struct scsi_task *task;
+	struct client *clients;
+	char *url = NULL;
+	uint64_t start;
+	int c, i, j, num_clients = 64;
+	static int show_help = 0, show_usage = 0, debug = 0;
+
+	static struct option long_options[] = {
+		{"help",           no_argument,          NULL,        'h'},
+		{"usage",          no_argument,          NULL,        'u'},
+		{"debug",          no_argument,          NULL,        'd'},
+		{"initiator-name", required_argument,    NULL,        'i'},
+		{"sessions",       required_argument,    NULL,        'n'},
+		{0, 0, 0, 0}
+	};
+	int option_index;
+
+	while ((c = getopt_long(argc, argv, "h?udi:n:", long_options,
+			&option_index)) != -1) {
+		switch (c) {
+		case 'h':
+		case '?':
+			show_help = 1;
+			break;
+		case 'u':
+			show_usage = 1;
+			break;
+		case 'd':
+			debug = 1;
+			break;
+		case 'i':
+			initiator = optarg;
+			break;
+		case 'n':
+			num_clients = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Unrecognized option '%c'\n\n", c);
+			print_help();
+			exit(0);
+		}
+	}
+
+	if (show_help != 0) {
+		print_help();
+		exit(0);
+	}
+
+	if (show_usage != 0) {
+		print_usage();
+		exit(0);
+	}
+
+	if (optind != argc -1 || num_clients < 1) {
+		print_usage();
+		exit(0);
+	}
+
+	if (argv[optind] != NULL) {
+		url = strdup(argv[optind]);
+	}
+	if (url == NULL) {
+		fprintf(stderr, "You must specify iscsi target portal.\n");
+		print_usage();
+		exit(10);
+	}
+
+	engine = iscsi_event_engine_create();
+	if (engine == NULL) {
+		fprintf(stderr, "Failed to create the event engine\n");
+		exit(10);
+	}
+
+	clients = calloc(num_clients, sizeof(struct client));
+	if (clients == NULL) {
+		fprintf(stderr, "Failed to allocate clients\n");
+		exit(10);
+	}
+
+	for (i = 0; i < num_clients; i++) {
+		struct client *client = &clients[i];
+
+		client->iscsi = iscsi_create_context(initiator);
+		if (client->iscsi == NULL) {
+			fprintf(stderr, "Failed to create context\n");
+			exit(10);
+		}
+		if (debug > 0) {
+			iscsi_set_log_level(client->iscsi, debug);
+			iscsi_set_log_fn(client->iscsi, iscsi_log_to_stderr);
+		}
+		iscsi_url = iscsi_parse_full_url(client->iscsi, url);
+		if (iscsi_url == NULL) {
+			fprintf(stderr, "Failed to parse URL: %s\n",
+				iscsi_get_error(client->iscsi));
+			exit(10);
+		}
+		iscsi_set_session_type(client->iscsi, ISCSI_SESSION_NORMAL);
+
+		/* the submit queue is driven by the engine as well */
+		if (i == 0 &&
+		    iscsi_set_threaded_submit(client->iscsi, 1) != 0) {
+			fprintf(stderr, "Failed to enable threaded submit. "
+				"%s\n", iscsi_get_error(client->iscsi));
+			exit(10);
+		}
+
+		client->lun = iscsi_url->lun;
+		client->first_lba = i * CLIENT_BLOCKS;
+		client->wbuf = malloc(CLIENT_BLOCKS * BLOCK_SIZE);
+		if (client->wbuf == NULL) {
+			fprintf(stderr, "Failed to allocate buffers\n");
+			exit(10);
+		}
+		for (j = 0; j < CLIENT_BLOCKS * BLOCK_SIZE; j++) {
+			client->wbuf[j] = random();
+		}
+
+		if (iscsi_event_engine_add(engine, client->iscsi,
+					   engine_error_cb, client) != 0) {
+			fprintf(stderr, "Failed to add context: %s\n",
+				iscsi_get_error(client->iscsi));
+			exit(10);
+		}
+		if (iscsi_full_connect_async(client->iscsi, iscsi_url->portal,
+					     iscsi_url->lun, connect_cb,
+					     client) != 0) {
+			fprintf(stderr, "Failed to start login: %s\n",
+				iscsi_get_error(client->iscsi));
+			exit(10);
+		}
+		pending++;
+		iscsi_destroy_url(iscsi_url);
+	}
+	free(url);
+
+	printf("Log in %d sessions, then write and read back a region on "
+	       "each\n", num_clients);
+	run(engine);
+
+	printf("Send commands from outside of the event engine\n");
+	for (i = 0; i < num_clients; i++) {
+		task = scsi_cdb_testunitready();
+		if (task == NULL) {
+			fprintf(stderr, "Failed to create task\n");
+			exit(10);
+		}
+		if (i == 0) {
+			j = iscsi_submit_task(clients[i].iscsi, clients[i].lun,
+					      task, tur_cb, NULL, NULL);
+		} else {
+			j = iscsi_scsi_command_async(clients[i].iscsi,
+						     clients[i].lun, task,
+						     tur_cb, NULL, NULL);
+		}
+		if (j != 0) {
+			fprintf(stderr, "Failed to send TESTUNITREADY\n");
+			exit(10);
+		}
+		pending++;
+	}
+	run(engine);
+
+	printf("An idle engine waits for the timeout\n");
+	start = now_ms();
+	if (iscsi_event_engine_run_once(engine, 200) != 0 ||
+	    now_ms() - start < 150) {
+		fprintf(stderr, "Idle engine did not wait\n");
+		exit(10);
+	}
+
+	printf("Log out and destroy the sessions\n");
+	for (i = 0; i < num_clients; i++) {
+		if (iscsi_logout_async(clients[i].iscsi, logout_cb,
+				       engine) != 0) {
+			fprintf(stderr, "Failed to start logout: %s\n",
+				iscsi_get_error(clients[i].iscsi));
+			exit(10);
+		}
+		pending++;
+	}
+	run(engine);
+
+	for (i = 0; i < num_clients; i++) {
+		iscsi_destroy_context(clients[i].iscsi);
+		free(clients[i].wbuf);
+	}
+	if (iscsi_event_engine_run_once(engine, 0) != 0) {
+		fprintf(stderr, "Destroyed sessions are still serviced\n");
+		exit(10);
+	}
+
+	iscsi_event_engine_destroy(engine);
+	free(clients);
+
+	return 0;
+}
@@ -0,0 +1,644 @@
+/*
+   Copyright (C) 2015 by Ronnie Sahlberg <ronniesahlberg@gmail.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "iscsi.h"
+#include "scsi-lowlevel.h"
+
+const char *initiator = "iqn.2007-10.com.github:sahlberg:libiscsi:prog-executor";
+
+#define BLOCK_SIZE 4096
+#define COMMAND_BLOCKS 2
+#define COMMAND_SIZE (COMMAND_BLOCKS * BLOCK_SIZE)
+#define GROUP 3
+#define QUEUE_DEPTH 2
+#define CANCEL_GROUP (GROUP + 1)
+#define CANCEL_COMMANDS 16
+
+struct client {
+	struct iscsi_context *iscsi;
+	int lun;
+	int shard;
+};
+
+static struct iscsi_executor *ex;
+static struct client *clients;
+static int num_clients = 8;
+static int num_shards = 4;
+static int num_commands = 256;
+static unsigned char *wbuf;
+
+/* the only session of CANCEL_GROUP */
+static struct client lonely;
+
+/* completed commands per shard */
+static int done_on[ISCSI_EXECUTOR_MAX_SHARDS];
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static int pending;
+static int failed;
+
+void print_usage(void)
+{
+	fprintf(stderr, "Usage: prog_executor [-?|--help] [--usage] "
+		"[-i|--initiator-name=iqn-name] [-n|--sessions=count]\n"
+		"\t\t[-s|--shards=count] [-c|--commands=count] "
+		"<iscsi-url>\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "This command is used to test running sessions on "
+		"the shards of an executor.\n");
+}
+
+void print_help(void)
+{
+	fprintf(stderr, "Usage: prog_executor [OPTION...] <iscsi-url>\n");
+	fprintf(stderr, "  -i, --initiator-name=iqn-name     "
+		"Initiatorname to use\n");
+	fprintf(stderr, "  -n, --sessions=count              "
+		"Number of sessions to log in\n");
+	fprintf(stderr, "  -s, --shards=count                "
+		"Number of shards\n");
+	fprintf(stderr, "  -c, --commands=count              "
+		"Number of commands for the session group\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Help options:\n");
+	fprintf(stderr, "  -?, --help                        "
+		"Show this help message\n");
+	fprintf(stderr, "      --usage                       "
+		"Display brief usage message\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "iSCSI URL format : %s\n", ISCSI_URL_SYNTAX);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "<host> is either of:\n");
+	fprintf(stderr, "  \"hostname\"       iscsi.example\n");
+	fprintf(stderr, "  \"ipv4-address\"   10.1.1.27\n");
+	fprintf(stderr, "  \"ipv6-address\"   [fce0::1]\n");
+}
+
+static void add_pending(int count)
+{
+	pthread_mutex_lock(&lock);
+	pending += count;
+	pthread_mutex_unlock(&lock);
+}
+
+static void complete(int ok)
+{
+	pthread_mutex_lock(&lock);
+	if (!ok) {
+		failed++;
+	}
+	if (--pending == 0) {
+		pthread_cond_signal(&cond);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+static void wait_for_pending(void)
+{
+	pthread_mutex_lock(&lock);
+	while (pending > 0) {
+		pthread_cond_wait(&cond, &lock);
+	}
+	pthread_mutex_unlock(&lock);
+	if (failed) {
+		fprintf(stderr, "%d operations failed\n", failed);
+		exit(10);
+	}
+}
+
+/* TESTUNITREADY, sent to the session of the client in private_data */
+static void tur_cb(struct iscsi_context *iscsi, int status,
+		   void *command_data, void *private_data)
+{
+	struct client *client = private_data;
+	int ok = 1;
+
+	if (status != SCSI_STATUS_GOOD) {
+		fprintf(stderr, "TESTUNITREADY failed: %s\n",
+			iscsi_get_error(iscsi));
+		ok = 0;
+	}
+	if (iscsi_executor_current_shard(ex) != client->shard) {
+		fprintf(stderr, "Callback of shard %d invoked on shard %d\n",
+			client->shard, iscsi_executor_current_shard(ex));
+		ok = 0;
+	}
+	scsi_free_scsi_task(command_data);
+	complete(ok);
+}
+
+static void send_tur(struct client *client)
+{
+	struct scsi_task *task;
+
+	task = scsi_cdb_testunitready();
+	if (task == NULL) {
+		fprintf(stderr, "Failed to create task\n");
+		exit(10);
+	}
+	if (iscsi_executor_submit(ex, client->iscsi, client->lun, task,
+				  tur_cb, NULL, client) != 0) {
+		fprintf(stderr, "Failed to submit command: %s\n",
+			strerror(errno));
+		exit(10);
+	}
+}
+
+/* runs on shard 0, most of the sessions are on other shards */
+static void tur_all(struct iscsi_executor *executor, int shard,
+		    void *private_data)
+{
+	int i;
+
+	(void)private_data;
+
+	if (executor != ex || shard != 0 ||
+	    iscsi_executor_current_shard(ex) != 0) {
+		fprintf(stderr, "Function run on the wrong shard\n");
+		exit(10);
+	}
+	for (i = 0; i < num_clients; i++) {
+		send_tur(&clients[i]);
+	}
+}
+
+static struct client *client_of(struct iscsi_context *iscsi)
+{
+	int i;
+
+	for (i = 0; clients[i].iscsi != iscsi; i++) {
+		;
+	}
+	return &clients[i];
+}
+
+static void group_cb(struct iscsi_context *iscsi, int status,
+		     void *command_data, void *private_data)
+{
+	struct scsi_task *task = command_data;
+	int shard = iscsi_executor_current_shard(ex);
+	int ok = 1;
+
+	(void)private_data;
+
+	if (status != SCSI_STATUS_GOOD) {
+		fprintf(stderr, "Group command failed: %s\n",
+			iscsi_get_error(iscsi));
+		ok = 0;
+	} else if (task->xfer_dir == SCSI_XFER_READ &&
+		   (task->datain.size != COMMAND_SIZE ||
+		    memcmp(task->datain.data, wbuf +
+			   scsi_get_uint64(&task->cdb[2]) * BLOCK_SIZE,
+			   COMMAND_SIZE))) {
+		fprintf(stderr, "Read returned the wrong data\n");
+		ok = 0;
+	}
+	if (shard < 0 || shard != client_of(iscsi)->shard) {
+		fprintf(stderr, "Group callback invoked on the wrong "
+			"shard\n");
+		ok = 0;
+	} else {
+		/* only ever touched by this shard */
+		done_on[shard]++;
+	}
+	scsi_free_scsi_task(task);
+	complete(ok);
+}
+
+/*
+ * Queue all commands on shard 0, whose sessions only take QUEUE_DEPTH
+ * each. The other shards have to steal them.
+ */
+static void queue_group(struct iscsi_executor *executor, int shard,
+			void *private_data)
+{
+	struct scsi_task *task;
+	struct iscsi_data data;
+	int write = *(int *)private_data;
+	int i;
+
+	(void)executor; (void)shard;
+
+	for (i = 0; i < num_commands; i++) {
+		if (write) {
+			task = scsi_cdb_write16(i * COMMAND_BLOCKS,
+						COMMAND_SIZE, BLOCK_SIZE,
+						0, 0, 0, 0, 0);
+			data.size = COMMAND_SIZE;
+			data.data = wbuf + i * COMMAND_SIZE;
+		} else {
+			task = scsi_cdb_read16(i * COMMAND_BLOCKS,
+					       COMMAND_SIZE, BLOCK_SIZE,
+					       0, 0, 0, 0, 0);
+		}
+		if (task == NULL) {
+			fprintf(stderr, "Failed to create task\n");
+			exit(10);
+		}
+		if (iscsi_executor_submit_group(ex, GROUP, clients[0].lun,
+						task, group_cb,
+						write ? &data : NULL,
+						NULL) != 0) {
+			fprintf(stderr, "Failed to queue command: %s\n",
+				strerror(errno));
+			exit(10);
+		}
+	}
+}
+
+static void remove_sessions(struct iscsi_executor *executor, int shard,
+			    void *private_data)
+{
+	int i;
+
+	(void)private_data;
+
+	for (i = 0; i < num_clients; i++) {
+		if (clients[i].shard != shard || i % 2 == 0) {
+			continue;
+		}
+		if (iscsi_executor_remove(executor, clients[i].iscsi) != 0) {
+			fprintf(stderr, "Failed to remove session: %s\n",
+				strerror(errno));
+			complete(0);
+			continue;
+		}
+		complete(1);
+	}
+}
+
+/*
+ * Queue commands for a group with a single session and remove it before
+ * the shard gets to send them. They have to be cancelled through the
+ * context that left, here into its completion ring, and the group that
+ * is empty now must not take new ones.
+ */
+static void cancel_group(struct iscsi_executor *executor, int shard,
+			 void *private_data)
+{
+	struct scsi_task *task;
+	int i, ok = 1;
+
+	(void)shard; (void)private_data;
+
+	for (i = 0; i < CANCEL_COMMANDS; i++) {
+		task = scsi_cdb_testunitready();
+		if (task == NULL) {
+			fprintf(stderr, "Failed to create task\n");
+			exit(10);
+		}
+		if (iscsi_executor_submit_group(executor, CANCEL_GROUP,
+						lonely.lun, task, ISCSI_CQ,
+						NULL, &lonely) != 0) {
+			fprintf(stderr, "Failed to queue command: %s\n",
+				strerror(errno));
+			exit(10);
+		}
+	}
+	if (iscsi_executor_remove(executor, lonely.iscsi) != 0) {
+		fprintf(stderr, "Failed to remove session: %s\n",
+			strerror(errno));
+		ok = 0;
+	}
+
+	task = scsi_cdb_testunitready();
+	if (task == NULL) {
+		fprintf(stderr, "Failed to create task\n");
+		exit(10);
+	}
+	if (iscsi_executor_submit_group(executor, CANCEL_GROUP, lonely.lun,
+					task, ISCSI_CQ, NULL, NULL) == 0) {
+		fprintf(stderr, "A command was queued for a group without "
+			"sessions\n");
+		ok = 0;
+	} else {
+		if (errno != ENOENT) {
+			fprintf(stderr, "Queueing for a group without sessions "
+				"failed with %s\n", strerror(errno));
+			ok = 0;
+		}
+		scsi_free_scsi_task(task);
+	}
+	complete(ok);
+}
+
+static void session_failed(struct iscsi_context *iscsi, int status,
+			   void *command_data, void *private_data)
+{
+	(void)status;
+	(void)command_data;
+	(void)private_data;
+
+	fprintf(stderr, "Session failed: %s\n", iscsi_get_error(iscsi));
+	exit(10);
+}
+
+static void run_group(int write)
+{
+	int i, shards_used = 0;
+
+	memset(done_on, 0, sizeof(done_on));
+	add_pending(num_commands);
+	if (iscsi_executor_call(ex, 0, queue_group, &write) != 0) {
+		fprintf(stderr, "Failed to call shard 0\n");
+		exit(10);
+	}
+	wait_for_pending();
+	for (i = 0; i < num_shards; i++) {
+		if (done_on[i] > 0) {
+			shards_used++;
+		}
+	}
+	printf("  %d commands on %d shards\n", num_commands, shards_used);
+	if (num_clients > QUEUE_DEPTH && shards_used < 2) {
+		fprintf(stderr, "No shard took commands from shard 0\n");
+		exit(10);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct iscsi_url *iscsi_url = NULL;
+	char *url = NULL;
+	struct iscsi_completion entries[CANCEL_COMMANDS + 1];
+	int c, i, n;
+	static int show_help = 0, show_usage = 0, debug = 0;
+
+	static struct option long_options[] = {
+		{"help",           no_argument,          NULL,        'h'},
+		{"usage",          no_argument,          NULL,        'u'},
+		{"debug",          no_argument,          NULL,        'd'},
+		{"initiator-name", required_argument,    NULL,        'i'},
+		{"sessions",       required_argument,    NULL,        'n'},
+		{"shards",         required_argument,    NULL,        's'},
+		{"commands",       required_argument,    NULL,        'c'},
+		{0, 0, 0, 0}
+	};
+	int option_index;
+
+	while ((c = getopt_long(argc, argv, "h?udi:n:s:c:", long_options,
+			&option_index)) != -1) {
+		switch (c) {
+		case 'h':
+		case '?':
+			show_help = 1;
+			break;
+		case 'u':
+			show_usage = 1;
+			break;
+		case 'd':
+			debug = 1;
+			break;
+		case 'i':
+			initiator = optarg;
+			break;
+		case 'n':
+			num_clients = atoi(optarg);
+			break;
+		case 's':
+			num_shards = atoi(optarg);
+			break;
+		case 'c':
+			num_commands = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Unrecognized option '%c'\n\n", c);
+			print_help();
+			exit(0);
+		}
+	}
+
+	if (show_help != 0) {
+		print_help();
+		exit(0);
+	}
+
+	if (show_usage != 0) {
+		print_usage();
+		exit(0);
+	}
+
+	if (optind != argc -1 || num_clients < 1 || num_shards < 1 ||
+	    num_shards > ISCSI_EXECUTOR_MAX_SHARDS || num_commands < 1) {
+		print_usage();
+		exit(0);
+	}
+
+	if (argv[optind] != NULL) {
+		url = strdup(argv[optind]);
+	}
+	if (url == NULL) {
+		fprintf(stderr, "You must specify iscsi target portal.\n");
+		print_usage();
+		exit(10);
+	}
+
+	ex = iscsi_executor_create(num_shards);
+	if (ex == NULL) {
+		fprintf(stderr, "Failed to create the executor\n");
+		exit(10);
+	}
+	if (iscsi_executor_set_queue_depth(ex, QUEUE_DEPTH) != 0) {
+		fprintf(stderr, "Failed to set the queue depth\n");
+		exit(10);
+	}
+	/* every machine has a cpu 0 */
+	if (iscsi_executor_set_affinity(ex, 0, 0) != 0 && errno != ENOSYS) {
+		fprintf(stderr, "Failed to set the affinity of shard 0: %s\n",
+			strerror(errno));
+		exit(10);
+	}
+
+	wbuf = malloc(num_commands * COMMAND_SIZE);
+	clients = calloc(num_clients, sizeof(struct client));
+	if (wbuf == NULL || clients == NULL) {
+		fprintf(stderr, "Failed to allocate buffers\n");
+		exit(10);
+	}
+	for (i = 0; i < num_commands * COMMAND_SIZE; i++) {
+		wbuf[i] = random();
+	}
+
+	printf("Log in %d sessions and hand them to %d shards\n",
+	       num_clients, num_shards);
+	for (i = 0; i < num_clients; i++) {
+		struct client *client = &clients[i];
+
+		client->iscsi = iscsi_create_context(initiator);
+		if (client->iscsi == NULL) {
+			fprintf(stderr, "Failed to create context\n");
+			exit(10);
+		}
+		if (debug > 0) {
+			iscsi_set_log_level(client->iscsi, debug);
+			iscsi_set_log_fn(client->iscsi, iscsi_log_to_stderr);
+		}
+		iscsi_url = iscsi_parse_full_url(client->iscsi, url);
+		if (iscsi_url == NULL) {
+			fprintf(stderr, "Failed to parse URL: %s\n",
+				iscsi_get_error(client->iscsi));
+			exit(10);
+		}
+		iscsi_set_session_type(client->iscsi, ISCSI_SESSION_NORMAL);
+		if (iscsi_full_connect_sync(client->iscsi, iscsi_url->portal,
+					    iscsi_url->lun) != 0) {
+			fprintf(stderr, "Login failed: %s\n",
+				iscsi_get_error(client->iscsi));
+			exit(10);
+		}
+		client->lun = iscsi_url->lun;
+		client->shard = i % num_shards;
+		iscsi_destroy_url(iscsi_url);
+
+		/* half of them before the shards run, half after */
+		if (i == num_clients / 2 &&
+		    iscsi_executor_start(ex) != 0) {
+			fprintf(stderr, "Failed to start the executor: %s\n",
+				strerror(errno));
+			exit(10);
+		}
+		if (iscsi_executor_add(ex, client->shard, client->iscsi,
+				       GROUP, session_failed, client) != 0) {
+			fprintf(stderr, "Failed to add session: %s\n",
+				iscsi_get_error(client->iscsi));
+			exit(10);
+		}
+	}
+
+	lonely.iscsi = iscsi_create_context(initiator);
+	if (lonely.iscsi == NULL) {
+		fprintf(stderr, "Failed to create context\n");
+		exit(10);
+	}
+	iscsi_url = iscsi_parse_full_url(lonely.iscsi, url);
+	if (iscsi_url == NULL) {
+		fprintf(stderr, "Failed to parse URL: %s\n",
+			iscsi_get_error(lonely.iscsi));
+		exit(10);
+	}
+	iscsi_set_session_type(lonely.iscsi, ISCSI_SESSION_NORMAL);
+	if (iscsi_set_completion_ring(lonely.iscsi, CANCEL_COMMANDS) != 0 ||
+	    iscsi_full_connect_sync(lonely.iscsi, iscsi_url->portal,
+				    iscsi_url->lun) != 0) {
+		fprintf(stderr, "Login failed: %s\n",
+			iscsi_get_error(lonely.iscsi));
+		exit(10);
+	}
+	lonely.lun = iscsi_url->lun;
+	iscsi_destroy_url(iscsi_url);
+	if (iscsi_executor_add(ex, 0, lonely.iscsi, CANCEL_GROUP,
+			       session_failed, &lonely) != 0) {
+		fprintf(stderr, "Failed to add session: %s\n",
+			iscsi_get_error(lonely.iscsi));
+		exit(10);
+	}
+	free(url);
+
+	printf("Send commands from a thread that is not a shard\n");
+	add_pending(num_clients);
+	for (i = 0; i < num_clients; i++) {
+		send_tur(&clients[i]);
+	}
+	wait_for_pending();
+
+	printf("Send commands from shard 0 to the sessions of all shards\n");
+	add_pending(num_clients);
+	if (iscsi_executor_call(ex, 0, tur_all, NULL) != 0) {
+		fprintf(stderr, "Failed to call shard 0\n");
+		exit(10);
+	}
+	wait_for_pending();
+
+	printf("Queue commands for the session group on shard 0\n");
+	run_group(1);
+	run_group(0);
+
+	printf("Remove half of the sessions from their shards\n");
+	for (i = 0; i < num_clients; i++) {
+		if (i % 2 == 1) {
+			add_pending(1);
+		}
+	}
+	for (i = 0; i < num_shards; i++) {
+		if (iscsi_executor_call(ex, i, remove_sessions, NULL) != 0) {
+			fprintf(stderr, "Failed to call shard %d\n", i);
+			exit(10);
+		}
+	}
+	wait_for_pending();
+
+	printf("Cancel the commands of a group when its last session "
+	       "leaves\n");
+	add_pending(1);
+	if (iscsi_executor_call(ex, 0, cancel_group, NULL) != 0) {
+		fprintf(stderr, "Failed to call shard 0\n");
+		exit(10);
+	}
+	wait_for_pending();
+	n = iscsi_reap_completions(lonely.iscsi, entries,
+				   CANCEL_COMMANDS + 1);
+	if (n != CANCEL_COMMANDS) {
+		fprintf(stderr, "%d of %d commands were cancelled\n", n,
+			CANCEL_COMMANDS);
+		exit(10);
+	}
+	for (i = 0; i < n; i++) {
+		if (entries[i].status != SCSI_STATUS_CANCELLED ||
+		    entries[i].user_data != &lonely) {
+			fprintf(stderr, "Unexpected completion with status "
+				"0x%x\n", entries[i].status);
+			exit(10);
+		}
+		scsi_free_scsi_task(entries[i].task);
+	}
+	if (iscsi_logout_sync(lonely.iscsi) != 0) {
+		fprintf(stderr, "Logout failed: %s\n",
+			iscsi_get_error(lonely.iscsi));
+		exit(10);
+	}
+	iscsi_destroy_context(lonely.iscsi);
+
+	printf("Destroy the executor with the other half still on it\n");
+	iscsi_executor_destroy(ex);
+
+	printf("Log out\n");
+	for (i = 0; i < num_clients; i++) {
+		if (iscsi_logout_sync(clients[i].iscsi) != 0) {
+			fprintf(stderr, "Logout failed: %s\n",
+				iscsi_get_error(clients[i].iscsi));
+			exit(10);
+		}
+		iscsi_destroy_context(clients[i].iscsi);
+	}
+	free(clients);
+	free(wbuf);
+
+	printf("Test was successful\n");
+	return 0;
+}
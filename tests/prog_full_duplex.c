@@ -0,0 +1,329 @@
+/*
+   Copyright (C) 2015 by Ronnie Sahlberg <ronniesahlberg@gmail.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_POLL_H
+#include <poll.h>
+#endif
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "iscsi.h"
+#include "scsi-lowlevel.h"
+
+const char *initiator = "iqn.2007-10.com.github:sahlberg:libiscsi:prog-full-duplex";
+
+#define BLOCK_SIZE 4096
+#define COMMAND_BLOCKS 64
+#define COMMAND_SIZE (COMMAND_BLOCKS * BLOCK_SIZE)
+#define NUM_COMMANDS 128
+#define REGION_BLOCKS (NUM_COMMANDS * COMMAND_BLOCKS)
+#define QUEUE_DEPTH 32
+
+struct client {
+	struct iscsi_context *iscsi;
+	int lun;
+	pthread_t service_thread;
+	int in_flight;
+	int failed;
+	unsigned char *wbuf;
+};
+
+void print_usage(void)
+{
+	fprintf(stderr, "Usage: prog_full_duplex [-?|--help] [--usage] "
+		"[-i|--initiator-name=iqn-name]\n"
+		"\t\t<iscsi-url>\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "This command is used to test reading and writing "
+		"at the same time with full duplex enabled.\n");
+}
+
+void print_help(void)
+{
+	fprintf(stderr, "Usage: prog_full_duplex [OPTION...] <iscsi-url>\n");
+	fprintf(stderr, "  -i, --initiator-name=iqn-name     "
+		"Initiatorname to use\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Help options:\n");
+	fprintf(stderr, "  -?, --help                        "
+		"Show this help message\n");
+	fprintf(stderr, "      --usage                       "
+		"Display brief usage message\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "iSCSI URL format : %s\n", ISCSI_URL_SYNTAX);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "<host> is either of:\n");
+	fprintf(stderr, "  \"hostname\"       iscsi.example\n");
+	fprintf(stderr, "  \"ipv4-address\"   10.1.1.27\n");
+	fprintf(stderr, "  \"ipv6-address\"   [fce0::1]\n");
+}
+
+static void command_cb(struct iscsi_context *iscsi, int status,
+		       void *command_data, void *private_data)
+{
+	struct client *client = private_data;
+	struct scsi_task *task = command_data;
+	uint64_t lba;
+
+	client->in_flight--;
+	if (!pthread_equal(pthread_self(), client->service_thread)) {
+		fprintf(stderr, "Callback invoked from another thread\n");
+		client->failed++;
+	} else if (status != SCSI_STATUS_GOOD) {
+		fprintf(stderr, "Command failed: %s\n", iscsi_get_error(iscsi));
+		client->failed++;
+	} else if (task->xfer_dir == SCSI_XFER_READ) {
+		lba = scsi_get_uint64(&task->cdb[2]);
+		if (task->datain.size != COMMAND_SIZE ||
+		    memcmp(task->datain.data,
+			   client->wbuf + lba * BLOCK_SIZE, COMMAND_SIZE)) {
+			fprintf(stderr, "Read of lba %d returned the wrong "
+				"data\n", (int)lba);
+			client->failed++;
+		}
+	}
+	scsi_free_scsi_task(task);
+}
+
+static void send_command(struct client *client, int write, int lba)
+{
+	struct scsi_task *task;
+	struct iscsi_data data;
+
+	if (write) {
+		task = scsi_cdb_write16(lba, COMMAND_SIZE, BLOCK_SIZE,
+					0, 0, 0, 0, 0);
+		data.size = COMMAND_SIZE;
+		data.data = client->wbuf + lba * BLOCK_SIZE;
+	} else {
+		task = scsi_cdb_read16(lba, COMMAND_SIZE, BLOCK_SIZE,
+				       0, 0, 0, 0, 0);
+	}
+	if (task == NULL) {
+		fprintf(stderr, "Failed to create task\n");
+		exit(10);
+	}
+	if (iscsi_scsi_command_async(client->iscsi, client->lun, task,
+				     command_cb, write ? &data : NULL,
+				     client) != 0) {
+		fprintf(stderr, "Failed to send command: %s\n",
+			iscsi_get_error(client->iscsi));
+		exit(10);
+	}
+	client->in_flight++;
+}
+
+static void wait_for_room(struct client *client, int max)
+{
+	struct pollfd pfd;
+	int timeout;
+
+	while (client->in_flight > max) {
+		pfd.fd = iscsi_get_fd(client->iscsi);
+		pfd.events = iscsi_which_events(client->iscsi);
+		pfd.revents = 0;
+		timeout = iscsi_get_next_timeout_ms(client->iscsi);
+		if (timeout < 0 || timeout > 1000) {
+			timeout = 1000;
+		}
+		if (poll(&pfd, 1, timeout) < 0) {
+			fprintf(stderr, "Poll failed\n");
+			exit(10);
+		}
+		if (iscsi_service(client->iscsi, pfd.revents) < 0) {
+			fprintf(stderr, "iscsi_service failed: %s\n",
+				iscsi_get_error(client->iscsi));
+			exit(10);
+		}
+	}
+}
+
+/*
+ * Write the commands of one region while reading back those of another,
+ * alternating between the two. A region of -1 is left out.
+ */
+static void run(struct client *client, int write_region, int read_region)
+{
+	int i;
+
+	for (i = 0; i < NUM_COMMANDS; i++) {
+		if (write_region >= 0) {
+			wait_for_room(client, QUEUE_DEPTH - 1);
+			send_command(client, 1, write_region * REGION_BLOCKS +
+				     i * COMMAND_BLOCKS);
+		}
+		if (read_region >= 0) {
+			wait_for_room(client, QUEUE_DEPTH - 1);
+			send_command(client, 0, read_region * REGION_BLOCKS +
+				     i * COMMAND_BLOCKS);
+		}
+	}
+	wait_for_room(client, 0);
+}
+
+int main(int argc, char *argv[])
+{
+	struct iscsi_context *iscsi;
+	struct iscsi_url *iscsi_url = NULL;
+	char *url = NULL;
+	struct client client;
+	int c, i;
+	static int show_help = 0, show_usage = 0, debug = 0;
+
+	static struct option long_options[] = {
+		{"help",           no_argument,          NULL,        'h'},
+		{"usage",          no_argument,          NULL,        'u'},
+		{"debug",          no_argument,          NULL,        'd'},
+		{"initiator-name", required_argument,    NULL,        'i'},
+		{0, 0, 0, 0}
+	};
+	int option_index;
+
+	while ((c = getopt_long(argc, argv, "h?udi:", long_options,
+			&option_index)) != -1) {
+		switch (c) {
+		case 'h':
+		case '?':
+			show_help = 1;
+			break;
+		case 'u':
+			show_usage = 1;
+			break;
+		case 'd':
+			debug = 1;
+			break;
+		case 'i':
+			initiator = optarg;
+			break;
+		default:
+			fprintf(stderr, "Unrecognized option '%c'\n\n", c);
+			print_help();
+			exit(0);
+		}
+	}
+
+	if (show_help != 0) {
+		print_help();
+		exit(0);
+	}
+
+	if (show_usage != 0) {
+		print_usage();
+		exit(0);
+	}
+
+	if (optind != argc -1) {
+		print_usage();
+		exit(0);
+	}
+
+	if (argv[optind] != NULL) {
+		url = strdup(argv[optind]);
+	}
+	if (url == NULL) {
+		fprintf(stderr, "You must specify iscsi target portal.\n");
+		print_usage();
+		exit(10);
+	}
+
+	iscsi = iscsi_create_context(initiator);
+	if (iscsi == NULL) {
+		printf("Failed to create context\n");
+		exit(10);
+	}
+
+	if (debug > 0) {
+		iscsi_set_log_level(iscsi, debug);
+		iscsi_set_log_fn(iscsi, iscsi_log_to_stderr);
+	}
+
+	iscsi_url = iscsi_parse_full_url(iscsi, url);
+
+	free(url);
+
+	if (iscsi_url == NULL) {
+		fprintf(stderr, "Failed to parse URL: %s\n",
+			iscsi_get_error(iscsi));
+		exit(10);
+	}
+
+	iscsi_set_session_type(iscsi, ISCSI_SESSION_NORMAL);
+
+	if (iscsi_set_full_duplex(iscsi, 1) != 0) {
+		fprintf(stderr, "Failed to enable full duplex. %s\n",
+			iscsi_get_error(iscsi));
+		exit(10);
+	}
+
+	if (iscsi_full_connect_sync(iscsi, iscsi_url->portal,
+				    iscsi_url->lun) != 0) {
+		fprintf(stderr, "iscsi_connect failed. %s\n",
+			iscsi_get_error(iscsi));
+		exit(10);
+	}
+
+	if (iscsi_set_full_duplex(iscsi, 0) == 0) {
+		fprintf(stderr, "Full duplex changed while logged in\n");
+		exit(10);
+	}
+
+	memset(&client, 0, sizeof(client));
+	client.iscsi = iscsi;
+	client.lun = iscsi_url->lun;
+	client.service_thread = pthread_self();
+	client.wbuf = malloc(2 * REGION_BLOCKS * BLOCK_SIZE);
+	if (client.wbuf == NULL) {
+		fprintf(stderr, "Failed to allocate buffers\n");
+		exit(10);
+	}
+	for (i = 0; i < 2 * REGION_BLOCKS * BLOCK_SIZE; i++) {
+		client.wbuf[i] = random();
+	}
+
+	printf("Write the first region\n");
+	run(&client, 0, -1);
+
+	printf("Write the second region while reading back the first\n");
+	run(&client, 1, 0);
+
+	printf("Read back the second region\n");
+	run(&client, -1, 1);
+
+	if (client.failed) {
+		fprintf(stderr, "%d commands failed\n", client.failed);
+		exit(10);
+	}
+
+	free(client.wbuf);
+	iscsi_destroy_url(iscsi_url);
+	iscsi_logout_sync(iscsi);
+	iscsi_destroy_context(iscsi);
+
+	return 0;
+}
@@ -0,0 +1,234 @@
+/*
+   Copyright (C) 2015 by Ronnie Sahlberg <ronniesahlberg@gmail.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "iscsi.h"
+#include "iscsi-private.h"
+#include "scsi-lowlevel.h"
+
+const char *initiator = "iqn.2007-10.com.github:sahlberg:libiscsi:prog-login-redirect";
+
+/* nothing listens here */
+#define DEAD_PORTAL "127.0.0.1:1"
+
+void print_usage(void)
+{
+	fprintf(stderr, "Usage: prog_login_redirect [-?|--help] [--usage] "
+		"[-i|--initiator-name=iqn-name]\n"
+		"\t\t<iscsi-url>\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "This command is used to test that a permanent login "
+		"redirect is followed, remembered for the next login and "
+		"forgotten when a login to it fails. The target behind the "
+		"url has to redirect permanently to another portal.\n");
+}
+
+void print_help(void)
+{
+	fprintf(stderr, "Usage: prog_login_redirect [OPTION...] <iscsi-url>\n");
+	fprintf(stderr, "  -i, --initiator-name=iqn-name     "
+		"Initiatorname to use\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Help options:\n");
+	fprintf(stderr, "  -?, --help                        "
+		"Show this help message\n");
+	fprintf(stderr, "      --usage                       "
+		"Display brief usage message\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "iSCSI URL format : %s\n", ISCSI_URL_SYNTAX);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "<host> is either of:\n");
+	fprintf(stderr, "  \"hostname\"       iscsi.example\n");
+	fprintf(stderr, "  \"ipv4-address\"   10.1.1.27\n");
+	fprintf(stderr, "  \"ipv6-address\"   [fce0::1]\n");
+}
+
+static struct iscsi_context *new_context(void)
+{
+	struct iscsi_context *iscsi;
+
+	iscsi = iscsi_create_context(initiator);
+	if (iscsi == NULL) {
+		fprintf(stderr, "Failed to create context\n");
+		exit(10);
+	}
+	iscsi_set_session_type(iscsi, ISCSI_SESSION_NORMAL);
+	return iscsi;
+}
+
+static void log_out(struct iscsi_context *iscsi)
+{
+	if (iscsi_logout_sync(iscsi) != 0) {
+		fprintf(stderr, "Logout failed: %s\n", iscsi_get_error(iscsi));
+		exit(10);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct iscsi_context *iscsi, *retry;
+	struct iscsi_url *iscsi_url = NULL;
+	char moved_to[MAX_STRING_SIZE + 1];
+	char *url = NULL;
+	int c;
+	static int show_help = 0, show_usage = 0, debug = 0;
+
+	static struct option long_options[] = {
+		{"help",           no_argument,          NULL,        'h'},
+		{"usage",          no_argument,          NULL,        'u'},
+		{"debug",          no_argument,          NULL,        'd'},
+		{"initiator-name", required_argument,    NULL,        'i'},
+		{0, 0, 0, 0}
+	};
+	int option_index;
+
+	while ((c = getopt_long(argc, argv, "h?udi:", long_options,
+			&option_index)) != -1) {
+		switch (c) {
+		case 'h':
+		case '?':
+			show_help = 1;
+			break;
+		case 'u':
+			show_usage = 1;
+			break;
+		case 'd':
+			debug = 1;
+			break;
+		case 'i':
+			initiator = optarg;
+			break;
+		default:
+			fprintf(stderr, "Unrecognized option '%c'\n\n", c);
+			print_help();
+			exit(0);
+		}
+	}
+
+	if (show_help != 0) {
+		print_help();
+		exit(0);
+	}
+
+	if (show_usage != 0) {
+		print_usage();
+		exit(0);
+	}
+
+	if (optind != argc -1) {
+		print_usage();
+		exit(0);
+	}
+
+	if (argv[optind] != NULL) {
+		url = strdup(argv[optind]);
+	}
+	if (url == NULL) {
+		fprintf(stderr, "You must specify iscsi target portal.\n");
+		print_usage();
+		exit(10);
+	}
+
+	iscsi = new_context();
+	if (debug > 0) {
+		iscsi_set_log_level(iscsi, debug);
+		iscsi_set_log_fn(iscsi, iscsi_log_to_stderr);
+	}
+	iscsi_url = iscsi_parse_full_url(iscsi, url);
+	if (iscsi_url == NULL) {
+		fprintf(stderr, "Failed to parse URL: %s\n",
+			iscsi_get_error(iscsi));
+		exit(10);
+	}
+	free(url);
+
+	printf("Log in and follow the permanent redirect\n");
+	if (iscsi_full_connect_sync(iscsi, iscsi_url->portal,
+				    iscsi_url->lun) != 0) {
+		fprintf(stderr, "Login failed: %s\n", iscsi_get_error(iscsi));
+		exit(10);
+	}
+	if (iscsi->redirect_portal[0] == 0 ||
+	    !strcmp(iscsi->connected_portal, iscsi_url->portal)) {
+		fprintf(stderr, "The login was not redirected permanently, "
+			"connected to %s\n", iscsi->connected_portal);
+		exit(10);
+	}
+	strcpy(moved_to, iscsi->connected_portal);
+
+	printf("Reconnect, straight to %s\n", moved_to);
+	if (iscsi_reconnect_sync(iscsi) != 0) {
+		fprintf(stderr, "Reconnect failed: %s\n",
+			iscsi_get_error(iscsi));
+		exit(10);
+	}
+	if (iscsi_get_target_address(iscsi)[0] ||
+	    strcmp(iscsi->connected_portal, moved_to)) {
+		fprintf(stderr, "The login went to %s and was redirected to "
+			"\"%s\"\n", iscsi->connected_portal,
+			iscsi_get_target_address(iscsi));
+		exit(10);
+	}
+	log_out(iscsi);
+
+	printf("Check that a failed login forgets the redirect\n");
+	retry = new_context();
+	iscsi_set_targetname(retry, iscsi_url->target);
+	/* as if the portal the target moved to went away again */
+	strcpy(retry->portal, iscsi_url->portal);
+	strcpy(retry->redirect_portal, DEAD_PORTAL);
+	if (iscsi_full_connect_sync(retry, iscsi_url->portal,
+				    iscsi_url->lun) == 0) {
+		fprintf(stderr, "Login to %s did not fail\n", DEAD_PORTAL);
+		exit(10);
+	}
+	if (retry->redirect_portal[0]) {
+		fprintf(stderr, "Still redirected to %s after the login "
+			"failed\n", retry->redirect_portal);
+		exit(10);
+	}
+	iscsi_disconnect(retry);
+
+	printf("Retry the same url, it is redirected again\n");
+	if (iscsi_full_connect_sync(retry, iscsi_url->portal,
+				    iscsi_url->lun) != 0) {
+		fprintf(stderr, "Login failed: %s\n", iscsi_get_error(retry));
+		exit(10);
+	}
+	if (strcmp(retry->connected_portal, moved_to)) {
+		fprintf(stderr, "Connected to %s instead of %s\n",
+			retry->connected_portal, moved_to);
+		exit(10);
+	}
+	log_out(retry);
+
+	iscsi_destroy_context(retry);
+
+	iscsi_destroy_url(iscsi_url);
+	iscsi_destroy_context(iscsi);
+
+	printf("Test was successful\n");
+	return 0;
+}
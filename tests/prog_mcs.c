@@ -0,0 +1,323 @@
+/*
+   Copyright (C) 2015 by Ronnie Sahlberg <ronniesahlberg@gmail.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_POLL_H
+#include <poll.h>
+#endif
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "iscsi.h"
+#include "scsi-lowlevel.h"
+
+const char *initiator = "iqn.2007-10.com.github:sahlberg:libiscsi:prog-mcs";
+
+#define BLOCK_SIZE 4096
+#define NUM_CONNECTIONS 4
+/* enough commands in flight to keep all connections busy */
+#define NUM_COMMANDS 64
+#define COMMAND_BLOCKS 16
+
+struct client {
+	int in_flight;
+	int failed;
+	unsigned char *wbuf;
+};
+
+struct command {
+	struct client *client;
+	uint64_t lba;
+};
+
+void print_usage(void)
+{
+	fprintf(stderr, "Usage: prog_mcs [-?|--help] [--usage] "
+		"[-i|--initiator-name=iqn-name]\n"
+		"\t\t<iscsi-portal-url>\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "This command is used to test that a session with "
+		"several connections can write and read back data with "
+		"many commands in flight.\n");
+}
+
+void print_help(void)
+{
+	fprintf(stderr, "Usage: prog_mcs [OPTION...] <iscsi-url>\n");
+	fprintf(stderr, "  -i, --initiator-name=iqn-name     "
+		"Initiatorname to use\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Help options:\n");
+	fprintf(stderr, "  -?, --help                        "
+		"Show this help message\n");
+	fprintf(stderr, "      --usage                       "
+		"Display brief usage message\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "iSCSI Portal URL format : %s\n",
+		ISCSI_PORTAL_URL_SYNTAX);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "<host> is either of:\n");
+	fprintf(stderr, "  \"hostname\"       iscsi.example\n");
+	fprintf(stderr, "  \"ipv4-address\"   10.1.1.27\n");
+	fprintf(stderr, "  \"ipv6-address\"   [fce0::1]\n");
+}
+
+static void command_cb(struct iscsi_context *iscsi, int status,
+		       void *command_data, void *private_data)
+{
+	struct command *cmd = private_data;
+	struct client *client = cmd->client;
+	struct scsi_task *task = command_data;
+
+	client->in_flight--;
+	if (status != SCSI_STATUS_GOOD) {
+		fprintf(stderr, "Command failed: %s\n", iscsi_get_error(iscsi));
+		client->failed++;
+	} else if (task->xfer_dir == SCSI_XFER_READ &&
+		   (task->datain.size != COMMAND_BLOCKS * BLOCK_SIZE ||
+		    memcmp(task->datain.data,
+			   client->wbuf + cmd->lba * BLOCK_SIZE,
+			   COMMAND_BLOCKS * BLOCK_SIZE))) {
+		fprintf(stderr, "Read returned the wrong data\n");
+		client->failed++;
+	}
+	scsi_free_scsi_task(task);
+	free(cmd);
+}
+
+static void run_commands(struct iscsi_context *iscsi, struct client *client,
+			 int lun, int write)
+{
+	struct pollfd pfd[NUM_CONNECTIONS];
+	struct command *cmd;
+	struct scsi_task *task;
+	int i, count, ret;
+
+	for (i = 0; i < NUM_COMMANDS; i++) {
+		cmd = malloc(sizeof(struct command));
+		if (cmd == NULL) {
+			fprintf(stderr, "Failed to allocate command\n");
+			exit(10);
+		}
+		cmd->client = client;
+		cmd->lba = i * COMMAND_BLOCKS;
+		if (write) {
+			task = iscsi_write16_task(iscsi, lun, cmd->lba,
+				client->wbuf + cmd->lba * BLOCK_SIZE,
+				COMMAND_BLOCKS * BLOCK_SIZE, BLOCK_SIZE,
+				0, 0, 0, 0, 0, command_cb, cmd);
+		} else {
+			task = iscsi_read16_task(iscsi, lun, cmd->lba,
+				COMMAND_BLOCKS * BLOCK_SIZE, BLOCK_SIZE,
+				0, 0, 0, 0, 0, command_cb, cmd);
+		}
+		if (task == NULL) {
+			fprintf(stderr, "Failed to send command: %s\n",
+				iscsi_get_error(iscsi));
+			exit(10);
+		}
+		client->in_flight++;
+	}
+
+	while (client->in_flight > 0) {
+		count = iscsi_get_connection_count(iscsi);
+		for (i = 0; i < count; i++) {
+			pfd[i].fd = iscsi_get_connection_fd(iscsi, i);
+			pfd[i].events = iscsi_which_connection_events(iscsi, i);
+		}
+		ret = poll(pfd, count, 1000);
+		if (ret < 0) {
+			fprintf(stderr, "Poll failed\n");
+			exit(10);
+		}
+		for (i = 0; i < count; i++) {
+			if (iscsi_service_connection(iscsi, i, ret == 0 ? 0 :
+						     pfd[i].revents) < 0) {
+				fprintf(stderr, "iscsi_service failed: %s\n",
+					iscsi_get_error(iscsi));
+				exit(10);
+			}
+		}
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct iscsi_context *iscsi;
+	struct iscsi_url *iscsi_url = NULL;
+	struct client client;
+	char *url = NULL;
+	int c, i, lun;
+	static int show_help = 0, show_usage = 0, debug = 0;
+
+	static struct option long_options[] = {
+		{"help",           no_argument,          NULL,        'h'},
+		{"usage",          no_argument,          NULL,        'u'},
+		{"debug",          no_argument,          NULL,        'd'},
+		{"initiator-name", required_argument,    NULL,        'i'},
+		{0, 0, 0, 0}
+	};
+	int option_index;
+
+	while ((c = getopt_long(argc, argv, "h?udi:", long_options,
+			&option_index)) != -1) {
+		switch (c) {
+		case 'h':
+		case '?':
+			show_help = 1;
+			break;
+		case 'u':
+			show_usage = 1;
+			break;
+		case 'd':
+			debug = 1;
+			break;
+		case 'i':
+			initiator = optarg;
+			break;
+		default:
+			fprintf(stderr, "Unrecognized option '%c'\n\n", c);
+			print_help();
+			exit(0);
+		}
+	}
+
+	if (show_help != 0) {
+		print_help();
+		exit(0);
+	}
+
+	if (show_usage != 0) {
+		print_usage();
+		exit(0);
+	}
+
+	if (optind != argc -1) {
+		print_usage();
+		exit(0);
+	}
+
+	if (argv[optind] != NULL) {
+		url = strdup(argv[optind]);
+	}
+	if (url == NULL) {
+		fprintf(stderr, "You must specify iscsi target portal.\n");
+		print_usage();
+		exit(10);
+	}
+
+	iscsi = iscsi_create_context(initiator);
+	if (iscsi == NULL) {
+		printf("Failed to create context\n");
+		exit(10);
+	}
+
+	if (debug > 0) {
+		iscsi_set_log_level(iscsi, debug);
+		iscsi_set_log_fn(iscsi, iscsi_log_to_stderr);
+	}
+
+	iscsi_url = iscsi_parse_full_url(iscsi, url);
+
+	free(url);
+
+	if (iscsi_url == NULL) {
+		fprintf(stderr, "Failed to parse URL: %s\n",
+			iscsi_get_error(iscsi));
+		exit(10);
+	}
+
+	iscsi_set_session_type(iscsi, ISCSI_SESSION_NORMAL);
+	printf("Offer MaxConnections=%d\n", NUM_CONNECTIONS);
+	if (iscsi_set_max_connections(iscsi, NUM_CONNECTIONS) != 0) {
+		fprintf(stderr, "iscsi_set_max_connections failed. %s\n",
+			iscsi_get_error(iscsi));
+		exit(10);
+	}
+
+	printf("Disable iscsi reconnect on session failure\n");
+	iscsi_set_noautoreconnect(iscsi, 1);
+
+	lun = iscsi_url->lun;
+	if (iscsi_full_connect_sync(iscsi, iscsi_url->portal, lun) != 0) {
+		fprintf(stderr, "iscsi_connect failed. %s\n",
+			iscsi_get_error(iscsi));
+		exit(10);
+	}
+
+	if (iscsi_get_max_connections(iscsi) != NUM_CONNECTIONS) {
+		fprintf(stderr, "Target allows %d connections, expected %d\n",
+			iscsi_get_max_connections(iscsi), NUM_CONNECTIONS);
+		exit(10);
+	}
+
+	printf("Add connections to the session\n");
+	for (i = 1; i < NUM_CONNECTIONS; i++) {
+		if (iscsi_add_connection_sync(iscsi) != 0) {
+			fprintf(stderr, "Failed to add connection: %s\n",
+				iscsi_get_error(iscsi));
+			exit(10);
+		}
+	}
+	if (iscsi_get_connection_count(iscsi) != NUM_CONNECTIONS) {
+		fprintf(stderr, "Session has %d connections, expected %d\n",
+			iscsi_get_connection_count(iscsi), NUM_CONNECTIONS);
+		exit(10);
+	}
+	if (iscsi_add_connection_sync(iscsi) == 0) {
+		fprintf(stderr, "Added more connections than negotiated\n");
+		exit(10);
+	}
+
+	memset(&client, 0, sizeof(client));
+	client.wbuf = malloc(NUM_COMMANDS * COMMAND_BLOCKS * BLOCK_SIZE);
+	if (client.wbuf == NULL) {
+		fprintf(stderr, "Failed to allocate buffers\n");
+		exit(10);
+	}
+	for (i = 0; i < NUM_COMMANDS * COMMAND_BLOCKS * BLOCK_SIZE; i++) {
+		client.wbuf[i] = random();
+	}
+
+	printf("Write data over all connections\n");
+	run_commands(iscsi, &client, lun, 1);
+
+	printf("Read it back over all connections\n");
+	run_commands(iscsi, &client, lun, 0);
+
+	if (client.failed) {
+		fprintf(stderr, "%d commands failed\n", client.failed);
+		exit(10);
+	}
+
+	free(client.wbuf);
+	iscsi_destroy_url(iscsi_url);
+	iscsi_logout_sync(iscsi);
+	iscsi_destroy_context(iscsi);
+
+	return 0;
+}
@@ -0,0 +1,364 @@
+/*
+   Copyright (C) 2015 by Ronnie Sahlberg <ronniesahlberg@gmail.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_POLL_H
+#include <poll.h>
+#endif
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "iscsi.h"
+#include "scsi-lowlevel.h"
+
+const char *initiator = "iqn.2007-10.com.github:sahlberg:libiscsi:prog-merge-io";
+
+#define BLOCK_SIZE 4096
+#define NUM_COMMANDS 64
+#define COMMAND_BLOCKS 2
+#define COMMAND_SIZE (COMMAND_BLOCKS * BLOCK_SIZE)
+
+struct client {
+	int in_flight;
+	int failed;
+	int cancelled;
+	unsigned char *wbuf;
+	unsigned char *rbuf;
+};
+
+struct command {
+	struct client *client;
+	int idx;
+	int cancel;
+	struct scsi_task *task;
+	struct scsi_iovec iov[2];
+};
+
+void print_usage(void)
+{
+	fprintf(stderr, "Usage: prog_merge_io [-?|--help] [--usage] "
+		"[-i|--initiator-name=iqn-name]\n"
+		"\t\t<iscsi-url>\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "This command is used to test that adjacent READ16 "
+		"and WRITE16 are merged and still complete one by one.\n");
+}
+
+void print_help(void)
+{
+	fprintf(stderr, "Usage: prog_merge_io [OPTION...] <iscsi-url>\n");
+	fprintf(stderr, "  -i, --initiator-name=iqn-name     "
+		"Initiatorname to use\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Help options:\n");
+	fprintf(stderr, "  -?, --help                        "
+		"Show this help message\n");
+	fprintf(stderr, "      --usage                       "
+		"Display brief usage message\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "iSCSI URL format : %s\n", ISCSI_URL_SYNTAX);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "<host> is either of:\n");
+	fprintf(stderr, "  \"hostname\"       iscsi.example\n");
+	fprintf(stderr, "  \"ipv4-address\"   10.1.1.27\n");
+	fprintf(stderr, "  \"ipv6-address\"   [fce0::1]\n");
+}
+
+static void command_cb(struct iscsi_context *iscsi, int status,
+		       void *command_data, void *private_data)
+{
+	struct command *cmd = private_data;
+	struct client *client = cmd->client;
+	struct scsi_task *task = command_data;
+	unsigned char *data;
+
+	client->in_flight--;
+	if (cmd->cancel) {
+		if (status != SCSI_STATUS_CANCELLED) {
+			fprintf(stderr, "Cancelled command returned 0x%x\n",
+				status);
+			client->failed++;
+		}
+		client->cancelled++;
+	} else if (status != SCSI_STATUS_GOOD) {
+		fprintf(stderr, "Command failed: %s\n", iscsi_get_error(iscsi));
+		client->failed++;
+	} else if (task->xfer_dir == SCSI_XFER_READ) {
+		data = task->datain.data;
+		if (data == NULL) {
+			data = client->rbuf + cmd->idx * COMMAND_SIZE;
+		} else if (task->datain.size != COMMAND_SIZE) {
+			data = NULL;
+		}
+		if (data == NULL || memcmp(data,
+					   client->wbuf + cmd->idx * COMMAND_SIZE,
+					   COMMAND_SIZE)) {
+			fprintf(stderr, "Read %d returned the wrong data\n",
+				cmd->idx);
+			client->failed++;
+		}
+	}
+	scsi_free_scsi_task(task);
+	free(cmd);
+}
+
+static struct command *send_command(struct iscsi_context *iscsi, int lun,
+				    struct client *client, int idx, int write)
+{
+	struct command *cmd;
+	struct scsi_task *task;
+	unsigned char *buf;
+
+	cmd = calloc(1, sizeof(struct command));
+	if (cmd == NULL) {
+		fprintf(stderr, "Failed to allocate command\n");
+		exit(10);
+	}
+	cmd->client = client;
+	cmd->idx = idx;
+
+	/* every other command uses an iovector split in two */
+	buf = (write ? client->wbuf : client->rbuf) + idx * COMMAND_SIZE;
+	cmd->iov[0].iov_base = buf;
+	cmd->iov[0].iov_len  = 1000;
+	cmd->iov[1].iov_base = buf + 1000;
+	cmd->iov[1].iov_len  = COMMAND_SIZE - 1000;
+
+	if (write && idx % 2) {
+		task = iscsi_write16_iov_task(iscsi, lun, idx * COMMAND_BLOCKS,
+				NULL, COMMAND_SIZE, BLOCK_SIZE, 0, 0, 0, 0, 0,
+				command_cb, cmd, cmd->iov, 2);
+	} else if (write) {
+		task = iscsi_write16_task(iscsi, lun, idx * COMMAND_BLOCKS,
+				buf, COMMAND_SIZE, BLOCK_SIZE, 0, 0, 0, 0, 0,
+				command_cb, cmd);
+	} else if (idx % 2) {
+		task = iscsi_read16_iov_task(iscsi, lun, idx * COMMAND_BLOCKS,
+				COMMAND_SIZE, BLOCK_SIZE, 0, 0, 0, 0, 0,
+				command_cb, cmd, cmd->iov, 2);
+	} else {
+		task = iscsi_read16_task(iscsi, lun, idx * COMMAND_BLOCKS,
+				COMMAND_SIZE, BLOCK_SIZE, 0, 0, 0, 0, 0,
+				command_cb, cmd);
+	}
+	if (task == NULL) {
+		fprintf(stderr, "Failed to send command: %s\n",
+			iscsi_get_error(iscsi));
+		exit(10);
+	}
+	cmd->task = task;
+	client->in_flight++;
+	return cmd;
+}
+
+static void wait_for_commands(struct iscsi_context *iscsi,
+			      struct client *client)
+{
+	struct pollfd pfd;
+	int timeout;
+
+	while (client->in_flight > 0) {
+		pfd.fd = iscsi_get_fd(iscsi);
+		pfd.events = iscsi_which_events(iscsi);
+		timeout = iscsi_get_next_timeout_ms(iscsi);
+		if (timeout < 0 || timeout > 1000) {
+			timeout = 1000;
+		}
+		if (poll(&pfd, 1, timeout) < 0) {
+			fprintf(stderr, "Poll failed\n");
+			exit(10);
+		}
+		if (iscsi_service(iscsi, pfd.revents) < 0) {
+			fprintf(stderr, "iscsi_service failed: %s\n",
+				iscsi_get_error(iscsi));
+			exit(10);
+		}
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct iscsi_context *iscsi;
+	struct iscsi_url *iscsi_url = NULL;
+	char *url = NULL;
+	struct client client;
+	struct command *cmd;
+	struct scsi_task *task = NULL;
+	int c, i;
+	static int show_help = 0, show_usage = 0, debug = 0;
+
+	static struct option long_options[] = {
+		{"help",           no_argument,          NULL,        'h'},
+		{"usage",          no_argument,          NULL,        'u'},
+		{"debug",          no_argument,          NULL,        'd'},
+		{"initiator-name", required_argument,    NULL,        'i'},
+		{0, 0, 0, 0}
+	};
+	int option_index;
+
+	while ((c = getopt_long(argc, argv, "h?udi:", long_options,
+			&option_index)) != -1) {
+		switch (c) {
+		case 'h':
+		case '?':
+			show_help = 1;
+			break;
+		case 'u':
+			show_usage = 1;
+			break;
+		case 'd':
+			debug = 1;
+			break;
+		case 'i':
+			initiator = optarg;
+			break;
+		default:
+			fprintf(stderr, "Unrecognized option '%c'\n\n", c);
+			print_help();
+			exit(0);
+		}
+	}
+
+	if (show_help != 0) {
+		print_help();
+		exit(0);
+	}
+
+	if (show_usage != 0) {
+		print_usage();
+		exit(0);
+	}
+
+	if (optind != argc -1) {
+		print_usage();
+		exit(0);
+	}
+
+	if (argv[optind] != NULL) {
+		url = strdup(argv[optind]);
+	}
+	if (url == NULL) {
+		fprintf(stderr, "You must specify iscsi target portal.\n");
+		print_usage();
+		exit(10);
+	}
+
+	iscsi = iscsi_create_context(initiator);
+	if (iscsi == NULL) {
+		printf("Failed to create context\n");
+		exit(10);
+	}
+
+	if (debug > 0) {
+		iscsi_set_log_level(iscsi, debug);
+		iscsi_set_log_fn(iscsi, iscsi_log_to_stderr);
+	}
+
+	iscsi_url = iscsi_parse_full_url(iscsi, url);
+
+	free(url);
+
+	if (iscsi_url == NULL) {
+		fprintf(stderr, "Failed to parse URL: %s\n",
+			iscsi_get_error(iscsi));
+		exit(10);
+	}
+
+	iscsi_set_session_type(iscsi, ISCSI_SESSION_NORMAL);
+
+	if (iscsi_set_merge_io(iscsi, 65536, -1) == 0) {
+		fprintf(stderr, "Accepted a negative hold time\n");
+		exit(10);
+	}
+	if (iscsi_set_merge_io(iscsi, 65536, 0) != 0) {
+		fprintf(stderr, "Failed to enable merging. %s\n",
+			iscsi_get_error(iscsi));
+		exit(10);
+	}
+
+	if (iscsi_full_connect_sync(iscsi, iscsi_url->portal,
+				    iscsi_url->lun) != 0) {
+		fprintf(stderr, "iscsi_connect failed. %s\n",
+			iscsi_get_error(iscsi));
+		exit(10);
+	}
+
+	memset(&client, 0, sizeof(client));
+	client.wbuf = malloc(NUM_COMMANDS * COMMAND_SIZE);
+	client.rbuf = malloc(NUM_COMMANDS * COMMAND_SIZE);
+	if (client.wbuf == NULL || client.rbuf == NULL) {
+		fprintf(stderr, "Failed to allocate buffers\n");
+		exit(10);
+	}
+	for (i = 0; i < NUM_COMMANDS * COMMAND_SIZE; i++) {
+		client.wbuf[i] = random();
+	}
+
+	printf("Write %d adjacent blocks\n", NUM_COMMANDS);
+	for (i = 0; i < NUM_COMMANDS; i++) {
+		send_command(iscsi, iscsi_url->lun, &client, i, 1);
+	}
+	wait_for_commands(iscsi, &client);
+
+	printf("Read them back\n");
+	for (i = 0; i < NUM_COMMANDS; i++) {
+		send_command(iscsi, iscsi_url->lun, &client, i, 0);
+	}
+	wait_for_commands(iscsi, &client);
+
+	printf("Cancel one of the merged reads\n");
+	for (i = 0; i < 4; i++) {
+		cmd = send_command(iscsi, iscsi_url->lun, &client, i, 0);
+		if (i == 2) {
+			cmd->cancel = 1;
+			task = cmd->task;
+		}
+	}
+	if (iscsi_scsi_cancel_task(iscsi, task) != 0) {
+		fprintf(stderr, "Failed to cancel the read\n");
+		exit(10);
+	}
+	wait_for_commands(iscsi, &client);
+	if (client.cancelled != 1) {
+		fprintf(stderr, "%d commands were cancelled\n",
+			client.cancelled);
+		exit(10);
+	}
+
+	if (client.failed) {
+		fprintf(stderr, "%d commands failed\n", client.failed);
+		exit(10);
+	}
+
+	free(client.wbuf);
+	free(client.rbuf);
+	iscsi_destroy_url(iscsi_url);
+	iscsi_logout_sync(iscsi);
+	iscsi_destroy_context(iscsi);
+
+	return 0;
+}
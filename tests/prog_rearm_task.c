@@ -0,0 +1,298 @@
+/*
+   Copyright (C) 2015 by Ronnie Sahlberg <ronniesahlberg@gmail.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_POLL_H
+#include <poll.h>
+#endif
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "iscsi.h"
+#include "scsi-lowlevel.h"
+
+const char *initiator = "iqn.2007-10.com.github:sahlberg:libiscsi:prog-rearm-task";
+
+#define BLOCK_SIZE 4096
+#define DATA_SIZE (16 * BLOCK_SIZE)
+#define ROUNDS 16
+
+void print_usage(void)
+{
+	fprintf(stderr, "Usage: prog_rearm_task [-?|--help] [--usage] "
+		"[-i|--initiator-name=iqn-name]\n"
+		"\t\t<iscsi-portal-url>\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "This command is used to test that a caller owned task "
+		"can be reused for many READ16 and WRITE16 commands and "
+		"that doing so does not grow the allocation cache.\n");
+}
+
+void print_help(void)
+{
+	fprintf(stderr, "Usage: prog_rearm_task [OPTION...] <iscsi-url>\n");
+	fprintf(stderr, "  -i, --initiator-name=iqn-name     "
+		"Initiatorname to use\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Help options:\n");
+	fprintf(stderr, "  -?, --help                        "
+		"Show this help message\n");
+	fprintf(stderr, "      --usage                       "
+		"Display brief usage message\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "iSCSI Portal URL format : %s\n",
+		ISCSI_PORTAL_URL_SYNTAX);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "<host> is either of:\n");
+	fprintf(stderr, "  \"hostname\"       iscsi.example\n");
+	fprintf(stderr, "  \"ipv4-address\"   10.1.1.27\n");
+	fprintf(stderr, "  \"ipv6-address\"   [fce0::1]\n");
+}
+
+void cb(struct iscsi_context *iscsi, int status, void *command_data,
+	void *private_data)
+{
+	if (status != SCSI_STATUS_GOOD) {
+		fprintf(stderr, "command failed: %s\n",
+			iscsi_get_error(iscsi));
+		exit(10);
+	}
+}
+
+static void
+wait_for_task(struct iscsi_context *iscsi, struct scsi_task *task)
+{
+	struct pollfd pfd;
+
+	task->status = -1;
+	while (task->status == -1) {
+		pfd.fd = iscsi_get_fd(iscsi);
+		pfd.events = iscsi_which_events(iscsi);
+		if (poll(&pfd, 1, iscsi_get_next_timeout_ms(iscsi)) < 0) {
+			fprintf(stderr, "poll failed\n");
+			exit(10);
+		}
+		if (iscsi_service(iscsi, pfd.revents) < 0) {
+			fprintf(stderr, "iscsi_service failed: %s\n",
+				iscsi_get_error(iscsi));
+			exit(10);
+		}
+	}
+}
+
+static uint64_t
+alloc_misses(struct iscsi_context *iscsi)
+{
+	struct iscsi_alloc_stats stats[ISCSI_ALLOC_STATS_MAX];
+	uint64_t misses = 0;
+	int i, n;
+
+	n = iscsi_get_alloc_stats(iscsi, stats, ISCSI_ALLOC_STATS_MAX);
+	for (i = 0; i < n; i++) {
+		misses += stats[i].allocs - stats[i].hits;
+	}
+	return misses;
+}
+
+int main(int argc, char *argv[])
+{
+	struct iscsi_context *iscsi;
+	struct iscsi_url *iscsi_url = NULL;
+	struct scsi_task task;
+	struct scsi_iovec iov;
+	unsigned char *wbuf, *rbuf;
+	char *url = NULL;
+	int c, i, lun, round;
+	uint64_t misses = 0;
+	static int show_help = 0, show_usage = 0, debug = 0;
+
+	static struct option long_options[] = {
+		{"help",           no_argument,          NULL,        'h'},
+		{"usage",          no_argument,          NULL,        'u'},
+		{"debug",          no_argument,          NULL,        'd'},
+		{"initiator-name", required_argument,    NULL,        'i'},
+		{0, 0, 0, 0}
+	};
+	int option_index;
+
+	while ((c = getopt_long(argc, argv, "h?udi:", long_options,
+			&option_index)) != -1) {
+		switch (c) {
+		case 'h':
+		case '?':
+			show_help = 1;
+			break;
+		case 'u':
+			show_usage = 1;
+			break;
+		case 'd':
+			debug = 1;
+			break;
+		case 'i':
+			initiator = optarg;
+			break;
+		default:
+			fprintf(stderr, "Unrecognized option '%c'\n\n", c);
+			print_help();
+			exit(0);
+		}
+	}
+
+	if (show_help != 0) {
+		print_help();
+		exit(0);
+	}
+
+	if (show_usage != 0) {
+		print_usage();
+		exit(0);
+	}
+
+	if (optind != argc -1) {
+		print_usage();
+		exit(0);
+	}
+
+	if (argv[optind] != NULL) {
+		url = strdup(argv[optind]);
+	}
+	if (url == NULL) {
+		fprintf(stderr, "You must specify iscsi target portal.\n");
+		print_usage();
+		exit(10);
+	}
+
+	iscsi = iscsi_create_context(initiator);
+	if (iscsi == NULL) {
+		printf("Failed to create context\n");
+		exit(10);
+	}
+
+	if (debug > 0) {
+		iscsi_set_log_level(iscsi, debug);
+		iscsi_set_log_fn(iscsi, iscsi_log_to_stderr);
+	}
+
+	iscsi_url = iscsi_parse_full_url(iscsi, url);
+
+	free(url);
+
+	if (iscsi_url == NULL) {
+		fprintf(stderr, "Failed to parse URL: %s\n",
+			iscsi_get_error(iscsi));
+		exit(10);
+	}
+
+	iscsi_set_session_type(iscsi, ISCSI_SESSION_NORMAL);
+
+	lun = iscsi_url->lun;
+	if (iscsi_full_connect_sync(iscsi, iscsi_url->portal, lun) != 0) {
+		fprintf(stderr, "iscsi_connect failed. %s\n",
+			iscsi_get_error(iscsi));
+		exit(10);
+	}
+
+	wbuf = malloc(DATA_SIZE);
+	rbuf = malloc(DATA_SIZE);
+	if (wbuf == NULL || rbuf == NULL) {
+		fprintf(stderr, "Failed to allocate buffers\n");
+		exit(10);
+	}
+	iov.iov_base = rbuf;
+	iov.iov_len  = DATA_SIZE;
+
+	scsi_task_init(&task);
+
+	printf("Write and read back using a single caller owned task\n");
+	for (round = 0; round < ROUNDS; round++) {
+		for (i = 0; i < DATA_SIZE; i++) {
+			wbuf[i] = random();
+		}
+
+		if (iscsi_write16_rearm_task(iscsi, &task, lun, round * 16,
+					     wbuf, DATA_SIZE, BLOCK_SIZE,
+					     0, 0, 0, 0, 0, cb, NULL,
+					     NULL, 0) != 0) {
+			fprintf(stderr, "write16 failed: %s\n",
+				iscsi_get_error(iscsi));
+			exit(10);
+		}
+		wait_for_task(iscsi, &task);
+
+		/* read it back into task->datain */
+		if (iscsi_read16_rearm_task(iscsi, &task, lun, round * 16,
+					    DATA_SIZE, BLOCK_SIZE,
+					    0, 0, 0, 0, 0, cb, NULL,
+					    NULL, 0) != 0) {
+			fprintf(stderr, "read16 failed: %s\n",
+				iscsi_get_error(iscsi));
+			exit(10);
+		}
+		wait_for_task(iscsi, &task);
+		if (task.datain.size != DATA_SIZE ||
+		    memcmp(task.datain.data, wbuf, DATA_SIZE)) {
+			fprintf(stderr, "read16 returned the wrong data\n");
+			exit(10);
+		}
+
+		/* and into a user iovector */
+		memset(rbuf, 0, DATA_SIZE);
+		if (iscsi_read16_rearm_task(iscsi, &task, lun, round * 16,
+					    DATA_SIZE, BLOCK_SIZE,
+					    0, 0, 0, 0, 0, cb, NULL,
+					    &iov, 1) != 0) {
+			fprintf(stderr, "read16 failed: %s\n",
+				iscsi_get_error(iscsi));
+			exit(10);
+		}
+		wait_for_task(iscsi, &task);
+		if (memcmp(rbuf, wbuf, DATA_SIZE)) {
+			fprintf(stderr, "read16 returned the wrong data\n");
+			exit(10);
+		}
+
+		/* after the first round every pdu should come from the
+		 * allocation cache
+		 */
+		if (round == 0) {
+			misses = alloc_misses(iscsi);
+		}
+	}
+	if (alloc_misses(iscsi) != misses) {
+		fprintf(stderr, "allocation cache kept growing\n");
+		exit(10);
+	}
+	scsi_free_scsi_task(&task);
+
+	free(wbuf);
+	free(rbuf);
+	iscsi_destroy_url(iscsi_url);
+	iscsi_logout_sync(iscsi);
+	iscsi_destroy_context(iscsi);
+
+	return 0;
+}
@@ -197,6 +197,7 @@ int main(int argc, char *argv[])
 	static int show_help = 0, show_usage = 0, debug = 0;
 	struct scsi_readcapacity10 *rc10;
 	struct scsi_task *task;
+	struct iscsi_reconnect_stats stats;
 
 	static struct option long_options[] = {
 		{"help",           no_argument,          NULL,        'h'},
@@ -279,6 +280,17 @@ int main(int argc, char *argv[])
 
 	iscsi_set_session_type(iscsi, ISCSI_SESSION_NORMAL);
 
+	if (iscsi_set_reconnect_backoff(iscsi, 1000, 100, 0) == 0) {
+		fprintf(stderr, "Accepted a reconnect backoff with max < "
+			"initial\n");
+		exit(10);
+	}
+	if (iscsi_set_reconnect_backoff(iscsi, 100, 2000, 20) != 0) {
+		fprintf(stderr, "iscsi_set_reconnect_backoff failed : %s\n",
+			iscsi_get_error(iscsi));
+		exit(10);
+	}
+
 	state.lun = iscsi_url->lun;
 	if (iscsi_full_connect_sync(iscsi, iscsi_url->portal, iscsi_url->lun)
 	    != 0) {
@@ -327,6 +339,18 @@ int main(int argc, char *argv[])
 
 	event_loop(iscsi, &state);
 
+	iscsi_get_reconnect_stats(iscsi, &stats);
+	printf("Reconnects %u, recovered in %llu ms, %llu commands sent "
+	       "again\n", stats.reconnects,
+	       (unsigned long long)stats.last_recovery_ms,
+	       (unsigned long long)stats.replayed);
+	if (stats.reconnects < 1 ||
+	    stats.max_recovery_ms < stats.last_recovery_ms ||
+	    stats.total_recovery_ms < stats.max_recovery_ms) {
+		fprintf(stderr, "Unexpected reconnect statistics\n");
+		exit(10);
+	}
+
 	iscsi_destroy_url(iscsi_url);
 	iscsi_destroy_context(iscsi);
 	return 0;
@@ -0,0 +1,306 @@
+/*
+   Copyright (C) 2015 by Ronnie Sahlberg <ronniesahlberg@gmail.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_POLL_H
+#include <poll.h>
+#endif
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "iscsi.h"
+#include "scsi-lowlevel.h"
+
+const char *initiator = "iqn.2007-10.com.github:sahlberg:libiscsi:prog-session-group";
+
+#define BLOCK_SIZE 4096
+#define NUM_SESSIONS 4
+#define NUM_COMMANDS 64
+#define COMMAND_BLOCKS 16
+
+struct client {
+	int in_flight;
+	int failed;
+	unsigned char *wbuf;
+};
+
+struct command {
+	struct client *client;
+	uint64_t lba;
+};
+
+void print_usage(void)
+{
+	fprintf(stderr, "Usage: prog_session_group [-?|--help] [--usage] "
+		"[-i|--initiator-name=iqn-name]\n"
+		"\t\t<iscsi-url>\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "This command is used to test that a group of "
+		"sessions spreads commands over all sessions and can write "
+		"and read back data.\n");
+}
+
+void print_help(void)
+{
+	fprintf(stderr, "Usage: prog_session_group [OPTION...] <iscsi-url>\n");
+	fprintf(stderr, "  -i, --initiator-name=iqn-name     "
+		"Initiatorname to use\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Help options:\n");
+	fprintf(stderr, "  -?, --help                        "
+		"Show this help message\n");
+	fprintf(stderr, "      --usage                       "
+		"Display brief usage message\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "iSCSI URL format : %s\n", ISCSI_URL_SYNTAX);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "<host> is either of:\n");
+	fprintf(stderr, "  \"hostname\"       iscsi.example\n");
+	fprintf(stderr, "  \"ipv4-address\"   10.1.1.27\n");
+	fprintf(stderr, "  \"ipv6-address\"   [fce0::1]\n");
+}
+
+static void command_cb(struct iscsi_context *iscsi, int status,
+		       void *command_data, void *private_data)
+{
+	struct command *cmd = private_data;
+	struct client *client = cmd->client;
+	struct scsi_task *task = command_data;
+
+	client->in_flight--;
+	if (status != SCSI_STATUS_GOOD) {
+		fprintf(stderr, "Command failed: %s\n", iscsi_get_error(iscsi));
+		client->failed++;
+	} else if (task->xfer_dir == SCSI_XFER_READ &&
+		   (task->datain.size != COMMAND_BLOCKS * BLOCK_SIZE ||
+		    memcmp(task->datain.data,
+			   client->wbuf + cmd->lba * BLOCK_SIZE,
+			   COMMAND_BLOCKS * BLOCK_SIZE))) {
+		fprintf(stderr, "Read returned the wrong data\n");
+		client->failed++;
+	}
+	scsi_free_scsi_task(task);
+	free(cmd);
+}
+
+static void run_commands(struct iscsi_session_group *group,
+			 struct client *client, int lun, int write)
+{
+	struct pollfd pfd[NUM_SESSIONS];
+	struct command *cmd;
+	struct scsi_task *task;
+	int i, ret;
+
+	for (i = 0; i < NUM_COMMANDS; i++) {
+		cmd = malloc(sizeof(struct command));
+		if (cmd == NULL) {
+			fprintf(stderr, "Failed to allocate command\n");
+			exit(10);
+		}
+		cmd->client = client;
+		cmd->lba = i * COMMAND_BLOCKS;
+		if (write) {
+			task = iscsi_session_group_write16_task(group, lun,
+				cmd->lba, client->wbuf + cmd->lba * BLOCK_SIZE,
+				COMMAND_BLOCKS * BLOCK_SIZE, BLOCK_SIZE,
+				0, 0, 0, 0, 0, command_cb, cmd);
+		} else {
+			task = iscsi_session_group_read16_task(group, lun,
+				cmd->lba, COMMAND_BLOCKS * BLOCK_SIZE,
+				BLOCK_SIZE, 0, 0, 0, 0, 0, command_cb, cmd);
+		}
+		if (task == NULL) {
+			fprintf(stderr, "Failed to send command: %s\n",
+				iscsi_session_group_get_error(group));
+			exit(10);
+		}
+		client->in_flight++;
+	}
+
+	/* nothing has completed yet, every session must have its share */
+	for (i = 0; i < NUM_SESSIONS; i++) {
+		if (iscsi_session_group_queue_length(group, i) !=
+		    NUM_COMMANDS / NUM_SESSIONS) {
+			fprintf(stderr, "Session %d has %d commands, "
+				"expected %d\n", i,
+				iscsi_session_group_queue_length(group, i),
+				NUM_COMMANDS / NUM_SESSIONS);
+			exit(10);
+		}
+	}
+
+	while (client->in_flight > 0) {
+		for (i = 0; i < NUM_SESSIONS; i++) {
+			pfd[i].fd = iscsi_session_group_get_fd(group, i);
+			pfd[i].events = iscsi_session_group_which_events(group,
+									 i);
+		}
+		ret = poll(pfd, NUM_SESSIONS, 1000);
+		if (ret < 0) {
+			fprintf(stderr, "Poll failed\n");
+			exit(10);
+		}
+		for (i = 0; i < NUM_SESSIONS; i++) {
+			if (iscsi_session_group_service(group, i, ret == 0 ? 0 :
+							pfd[i].revents) < 0) {
+				fprintf(stderr, "iscsi_service failed: %s\n",
+					iscsi_session_group_get_error(group));
+				exit(10);
+			}
+		}
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct iscsi_session_group *group;
+	struct iscsi_url *iscsi_url = NULL;
+	struct iscsi_context *iscsi;
+	struct client client;
+	char *url = NULL;
+	int c, i, lun;
+	static int show_help = 0, show_usage = 0, debug = 0;
+
+	static struct option long_options[] = {
+		{"help",           no_argument,          NULL,        'h'},
+		{"usage",          no_argument,          NULL,        'u'},
+		{"debug",          no_argument,          NULL,        'd'},
+		{"initiator-name", required_argument,    NULL,        'i'},
+		{0, 0, 0, 0}
+	};
+	int option_index;
+
+	while ((c = getopt_long(argc, argv, "h?udi:", long_options,
+			&option_index)) != -1) {
+		switch (c) {
+		case 'h':
+		case '?':
+			show_help = 1;
+			break;
+		case 'u':
+			show_usage = 1;
+			break;
+		case 'd':
+			debug = 1;
+			break;
+		case 'i':
+			initiator = optarg;
+			break;
+		default:
+			fprintf(stderr, "Unrecognized option '%c'\n\n", c);
+			print_help();
+			exit(0);
+		}
+	}
+
+	if (show_help != 0) {
+		print_help();
+		exit(0);
+	}
+
+	if (show_usage != 0) {
+		print_usage();
+		exit(0);
+	}
+
+	if (optind != argc -1) {
+		print_usage();
+		exit(0);
+	}
+
+	if (argv[optind] != NULL) {
+		url = strdup(argv[optind]);
+	}
+	if (url == NULL) {
+		fprintf(stderr, "You must specify iscsi target portal.\n");
+		print_usage();
+		exit(10);
+	}
+
+	group = iscsi_create_session_group(initiator, NUM_SESSIONS);
+	if (group == NULL) {
+		printf("Failed to create session group\n");
+		exit(10);
+	}
+
+	for (i = 0; i < NUM_SESSIONS; i++) {
+		iscsi = iscsi_session_group_get_context(group, i);
+		if (debug > 0) {
+			iscsi_set_log_level(iscsi, debug);
+			iscsi_set_log_fn(iscsi, iscsi_log_to_stderr);
+		}
+		iscsi_set_noautoreconnect(iscsi, 1);
+	}
+
+	/* only to find the LUN, the group parses the URL itself */
+	iscsi_url = iscsi_parse_full_url(iscsi_session_group_get_context(group,
+							0), url);
+	if (iscsi_url == NULL) {
+		fprintf(stderr, "Failed to parse URL: %s\n",
+			iscsi_get_error(iscsi_session_group_get_context(group,
+							0)));
+		exit(10);
+	}
+	lun = iscsi_url->lun;
+
+	printf("Log in %d sessions\n", NUM_SESSIONS);
+	if (iscsi_session_group_full_connect_sync(group, url) != 0) {
+		fprintf(stderr, "Failed to log in: %s\n",
+			iscsi_session_group_get_error(group));
+		exit(10);
+	}
+	free(url);
+
+	memset(&client, 0, sizeof(client));
+	client.wbuf = malloc(NUM_COMMANDS * COMMAND_BLOCKS * BLOCK_SIZE);
+	if (client.wbuf == NULL) {
+		fprintf(stderr, "Failed to allocate buffers\n");
+		exit(10);
+	}
+	for (i = 0; i < NUM_COMMANDS * COMMAND_BLOCKS * BLOCK_SIZE; i++) {
+		client.wbuf[i] = random();
+	}
+
+	printf("Write data over all sessions\n");
+	run_commands(group, &client, lun, 1);
+
+	printf("Read it back over all sessions, balanced by bytes\n");
+	iscsi_session_group_set_policy(group, ISCSI_SESSION_GROUP_LEAST_BYTES);
+	run_commands(group, &client, lun, 0);
+
+	if (client.failed) {
+		fprintf(stderr, "%d commands failed\n", client.failed);
+		exit(10);
+	}
+
+	free(client.wbuf);
+	iscsi_destroy_url(iscsi_url);
+	iscsi_session_group_logout_sync(group);
+	iscsi_destroy_session_group(group);
+
+	return 0;
+}
@@ -0,0 +1,341 @@
+/*
+   Copyright (C) 2015 by Ronnie Sahlberg <ronniesahlberg@gmail.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_POLL_H
+#include <poll.h>
+#endif
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "iscsi.h"
+#include "scsi-lowlevel.h"
+
+const char *initiator = "iqn.2007-10.com.github:sahlberg:libiscsi:prog-threaded-submit";
+
+#define BLOCK_SIZE 4096
+#define NUM_THREADS 4
+#define NUM_COMMANDS 256
+#define COMMAND_BLOCKS 2
+#define COMMAND_SIZE (COMMAND_BLOCKS * BLOCK_SIZE)
+
+struct client {
+	struct iscsi_context *iscsi;
+	int lun;
+	int write;
+	pthread_t service_thread;
+	int completed;
+	int failed;
+	unsigned char *wbuf;
+};
+
+struct producer {
+	struct client *client;
+	int idx;
+};
+
+void print_usage(void)
+{
+	fprintf(stderr, "Usage: prog_threaded_submit [-?|--help] [--usage] "
+		"[-i|--initiator-name=iqn-name]\n"
+		"\t\t<iscsi-url>\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "This command is used to test that commands can be "
+		"submitted from several threads at once.\n");
+}
+
+void print_help(void)
+{
+	fprintf(stderr, "Usage: prog_threaded_submit [OPTION...] <iscsi-url>\n");
+	fprintf(stderr, "  -i, --initiator-name=iqn-name     "
+		"Initiatorname to use\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Help options:\n");
+	fprintf(stderr, "  -?, --help                        "
+		"Show this help message\n");
+	fprintf(stderr, "      --usage                       "
+		"Display brief usage message\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "iSCSI URL format : %s\n", ISCSI_URL_SYNTAX);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "<host> is either of:\n");
+	fprintf(stderr, "  \"hostname\"       iscsi.example\n");
+	fprintf(stderr, "  \"ipv4-address\"   10.1.1.27\n");
+	fprintf(stderr, "  \"ipv6-address\"   [fce0::1]\n");
+}
+
+/* only ever invoked from the service thread, no locking needed */
+static void command_cb(struct iscsi_context *iscsi, int status,
+		       void *command_data, void *private_data)
+{
+	struct client *client = private_data;
+	struct scsi_task *task = command_data;
+	uint64_t lba;
+
+	client->completed++;
+	if (!pthread_equal(pthread_self(), client->service_thread)) {
+		fprintf(stderr, "Callback invoked from another thread\n");
+		client->failed++;
+	} else if (status != SCSI_STATUS_GOOD) {
+		fprintf(stderr, "Command failed: %s\n", iscsi_get_error(iscsi));
+		client->failed++;
+	} else if (task->xfer_dir == SCSI_XFER_READ) {
+		lba = scsi_get_uint32(&task->cdb[6]);
+		if (task->datain.size != COMMAND_SIZE ||
+		    memcmp(task->datain.data,
+			   client->wbuf + lba * BLOCK_SIZE, COMMAND_SIZE)) {
+			fprintf(stderr, "Read of lba %d returned the wrong "
+				"data\n", (int)lba);
+			client->failed++;
+		}
+	}
+	scsi_free_scsi_task(task);
+}
+
+static void *producer_thread(void *arg)
+{
+	struct producer *p = arg;
+	struct client *client = p->client;
+	struct scsi_task *task;
+	struct iscsi_data data;
+	int i, lba;
+
+	for (i = 0; i < NUM_COMMANDS; i++) {
+		lba = (i * NUM_THREADS + p->idx) * COMMAND_BLOCKS;
+		if (client->write) {
+			task = scsi_cdb_write16(lba, COMMAND_SIZE, BLOCK_SIZE,
+						0, 0, 0, 0, 0);
+			data.size = COMMAND_SIZE;
+			data.data = client->wbuf + lba * BLOCK_SIZE;
+		} else {
+			task = scsi_cdb_read16(lba, COMMAND_SIZE, BLOCK_SIZE,
+					       0, 0, 0, 0, 0);
+		}
+		if (task == NULL) {
+			fprintf(stderr, "Failed to create task\n");
+			exit(10);
+		}
+		if (iscsi_submit_task(client->iscsi, client->lun, task,
+				      command_cb,
+				      client->write ? &data : NULL,
+				      client) != 0) {
+			fprintf(stderr, "Failed to submit task\n");
+			exit(10);
+		}
+	}
+	return NULL;
+}
+
+static void run_threads(struct client *client, int write)
+{
+	pthread_t threads[NUM_THREADS];
+	struct producer producers[NUM_THREADS];
+	struct pollfd pfd[2];
+	int i, timeout, total = NUM_THREADS * NUM_COMMANDS;
+
+	client->write = write;
+	client->completed = 0;
+	for (i = 0; i < NUM_THREADS; i++) {
+		producers[i].client = client;
+		producers[i].idx = i;
+		if (pthread_create(&threads[i], NULL, producer_thread,
+				   &producers[i]) != 0) {
+			fprintf(stderr, "Failed to create thread\n");
+			exit(10);
+		}
+	}
+
+	while (client->completed < total) {
+		pfd[0].fd = iscsi_get_fd(client->iscsi);
+		pfd[0].events = iscsi_which_events(client->iscsi);
+		pfd[0].revents = 0;
+		pfd[1].fd = iscsi_get_submit_fd(client->iscsi);
+		pfd[1].events = POLLIN;
+		pfd[1].revents = 0;
+		timeout = iscsi_get_next_timeout_ms(client->iscsi);
+		if (timeout < 0 || timeout > 1000) {
+			timeout = 1000;
+		}
+		if (poll(pfd, 2, timeout) < 0) {
+			fprintf(stderr, "Poll failed\n");
+			exit(10);
+		}
+		if (iscsi_service(client->iscsi, pfd[0].revents) < 0) {
+			fprintf(stderr, "iscsi_service failed: %s\n",
+				iscsi_get_error(client->iscsi));
+			exit(10);
+		}
+	}
+
+	for (i = 0; i < NUM_THREADS; i++) {
+		pthread_join(threads[i], NULL);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct iscsi_context *iscsi;
+	struct iscsi_url *iscsi_url = NULL;
+	char *url = NULL;
+	struct client client;
+	struct scsi_task *task;
+	int c, i;
+	static int show_help = 0, show_usage = 0, debug = 0;
+
+	static struct option long_options[] = {
+		{"help",           no_argument,          NULL,        'h'},
+		{"usage",          no_argument,          NULL,        'u'},
+		{"debug",          no_argument,          NULL,        'd'},
+		{"initiator-name", required_argument,    NULL,        'i'},
+		{0, 0, 0, 0}
+	};
+	int option_index;
+
+	while ((c = getopt_long(argc, argv, "h?udi:", long_options,
+			&option_index)) != -1) {
+		switch (c) {
+		case 'h':
+		case '?':
+			show_help = 1;
+			break;
+		case 'u':
+			show_usage = 1;
+			break;
+		case 'd':
+			debug = 1;
+			break;
+		case 'i':
+			initiator = optarg;
+			break;
+		default:
+			fprintf(stderr, "Unrecognized option '%c'\n\n", c);
+			print_help();
+			exit(0);
+		}
+	}
+
+	if (show_help != 0) {
+		print_help();
+		exit(0);
+	}
+
+	if (show_usage != 0) {
+		print_usage();
+		exit(0);
+	}
+
+	if (optind != argc -1) {
+		print_usage();
+		exit(0);
+	}
+
+	if (argv[optind] != NULL) {
+		url = strdup(argv[optind]);
+	}
+	if (url == NULL) {
+		fprintf(stderr, "You must specify iscsi target portal.\n");
+		print_usage();
+		exit(10);
+	}
+
+	iscsi = iscsi_create_context(initiator);
+	if (iscsi == NULL) {
+		printf("Failed to create context\n");
+		exit(10);
+	}
+
+	if (debug > 0) {
+		iscsi_set_log_level(iscsi, debug);
+		iscsi_set_log_fn(iscsi, iscsi_log_to_stderr);
+	}
+
+	iscsi_url = iscsi_parse_full_url(iscsi, url);
+
+	free(url);
+
+	if (iscsi_url == NULL) {
+		fprintf(stderr, "Failed to parse URL: %s\n",
+			iscsi_get_error(iscsi));
+		exit(10);
+	}
+
+	iscsi_set_session_type(iscsi, ISCSI_SESSION_NORMAL);
+
+	task = scsi_cdb_testunitready();
+	if (iscsi_submit_task(iscsi, iscsi_url->lun, task, command_cb, NULL,
+			      &client) == 0) {
+		fprintf(stderr, "Submitted without threaded submission\n");
+		exit(10);
+	}
+	scsi_free_scsi_task(task);
+
+	if (iscsi_set_threaded_submit(iscsi, 1) != 0) {
+		fprintf(stderr, "Failed to enable threaded submission. %s\n",
+			iscsi_get_error(iscsi));
+		exit(10);
+	}
+
+	if (iscsi_full_connect_sync(iscsi, iscsi_url->portal,
+				    iscsi_url->lun) != 0) {
+		fprintf(stderr, "iscsi_connect failed. %s\n",
+			iscsi_get_error(iscsi));
+		exit(10);
+	}
+
+	memset(&client, 0, sizeof(client));
+	client.iscsi = iscsi;
+	client.lun = iscsi_url->lun;
+	client.service_thread = pthread_self();
+	client.wbuf = malloc(NUM_THREADS * NUM_COMMANDS * COMMAND_SIZE);
+	if (client.wbuf == NULL) {
+		fprintf(stderr, "Failed to allocate buffers\n");
+		exit(10);
+	}
+	for (i = 0; i < NUM_THREADS * NUM_COMMANDS * COMMAND_SIZE; i++) {
+		client.wbuf[i] = random();
+	}
+
+	printf("Write %d blocks from %d threads\n",
+	       NUM_THREADS * NUM_COMMANDS, NUM_THREADS);
+	run_threads(&client, 1);
+
+	printf("Read them back from %d threads\n", NUM_THREADS);
+	run_threads(&client, 0);
+
+	if (client.failed) {
+		fprintf(stderr, "%d commands failed\n", client.failed);
+		exit(10);
+	}
+
+	free(client.wbuf);
+	iscsi_destroy_url(iscsi_url);
+	iscsi_logout_sync(iscsi);
+	iscsi_destroy_context(iscsi);
+
+	return 0;
+}
@@ -0,0 +1,11 @@
+#!/bin/sh
+
+. ./functions.sh
+
+echo "CRC32C tests"
+
+echo -n "Test that all crc32c implementations agree ..."
+./prog_crc32c > /dev/null || failure
+success
+
+exit 0
@@ -0,0 +1,26 @@
+#!/bin/sh
+
+. ./functions.sh
+
+echo "Login redirect tests"
+
+start_target
+create_lun
+set_redirect 127.0.0.1 3269 Permanent
+
+echo -n "Test that a login redirected to the same portal over and over fails ... "
+../utils/iscsi-inq -i ${IQNINITIATOR} iscsi://${TGTPORTAL}/${IQNTARGET}/1 > /dev/null 2>&1 && failure
+success
+
+start_second_target
+set_redirect 127.0.0.1 3270 Permanent
+
+echo -n "Test that a permanent redirect to another portal is remembered ... "
+./prog_login_redirect -i ${IQNINITIATOR} iscsi://${TGTPORTAL}/${IQNTARGET}/1 > /dev/null || failure
+success
+
+shutdown_second_target
+shutdown_target
+delete_lun
+
+exit 0
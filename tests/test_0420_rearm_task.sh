@@ -0,0 +1,17 @@
+#!/bin/sh
+
+. ./functions.sh
+
+echo "Test reusing a caller owned task"
+
+start_target
+create_lun
+
+echo -n "Test read/write reusing a caller owned task ... "
+./prog_rearm_task -i ${IQNINITIATOR} iscsi://${TGTPORTAL}/${IQNTARGET}/1 > /dev/null || failure
+success
+
+shutdown_target
+delete_lun
+
+exit 0
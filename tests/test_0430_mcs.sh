@@ -0,0 +1,18 @@
+#!/bin/sh
+
+. ./functions.sh
+
+echo "Multiple connections per session tests"
+
+start_target
+set_max_connections 4
+create_lun
+
+echo -n "Test that data is intact with several connections per session ..."
+./prog_mcs -i ${IQNINITIATOR} iscsi://${TGTPORTAL}/${IQNTARGET}/1 > /dev/null || failure
+success
+
+shutdown_target
+delete_lun
+
+exit 0
@@ -0,0 +1,17 @@
+#!/bin/sh
+
+. ./functions.sh
+
+echo "Session group tests"
+
+start_target
+create_lun
+
+echo -n "Test that a session group spreads commands over its sessions ..."
+./prog_session_group -i ${IQNINITIATOR} iscsi://${TGTPORTAL}/${IQNTARGET}/1 > /dev/null || failure
+success
+
+shutdown_target
+delete_lun
+
+exit 0
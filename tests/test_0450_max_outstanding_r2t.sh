@@ -0,0 +1,19 @@
+#!/bin/sh
+
+. ./functions.sh
+
+echo "MaxOutstandingR2T tests"
+
+start_target
+set_max_outstanding_r2t 4
+set_max_burst_length 65536
+create_lun
+
+echo -n "Test overlapping R2T sequences with MaxOutstandingR2T=4 ..."
+./prog_max_outstanding_r2t -i ${IQNINITIATOR} iscsi://${TGTPORTAL}/${IQNTARGET}/1 > /dev/null || failure
+success
+
+shutdown_target
+delete_lun
+
+exit 0
@@ -0,0 +1,17 @@
+#!/bin/sh
+
+. ./functions.sh
+
+echo "Burst and segment length tests"
+
+start_target
+create_lun
+
+echo -n "Test setting, reconnecting and auto-tuning burst lengths ..."
+./prog_burst_length -i ${IQNINITIATOR} iscsi://${TGTPORTAL}/${IQNTARGET}/1 > /dev/null || failure
+success
+
+shutdown_target
+delete_lun
+
+exit 0
@@ -0,0 +1,17 @@
+#!/bin/sh
+
+. ./functions.sh
+
+echo "Split I/O tests"
+
+start_target
+create_lun
+
+echo -n "Test READ16/WRITE16 larger than the maximum transfer length ..."
+./prog_split_io -i ${IQNINITIATOR} iscsi://${TGTPORTAL}/${IQNTARGET}/1 > /dev/null || failure
+success
+
+shutdown_target
+delete_lun
+
+exit 0
@@ -0,0 +1,17 @@
+#!/bin/sh
+
+. ./functions.sh
+
+echo "Merge I/O tests"
+
+start_target
+create_lun
+
+echo -n "Test merging adjacent READ16/WRITE16 ..."
+./prog_merge_io -i ${IQNINITIATOR} iscsi://${TGTPORTAL}/${IQNTARGET}/1 > /dev/null || failure
+success
+
+shutdown_target
+delete_lun
+
+exit 0
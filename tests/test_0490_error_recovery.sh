@@ -0,0 +1,29 @@
+#!/bin/sh
+
+. ./functions.sh
+
+echo "ErrorRecoveryLevel tests"
+
+start_target
+create_lun
+
+echo -n "Test that data is intact when offering ErrorRecoveryLevel=1 ..."
+./prog_error_recovery -i ${IQNINITIATOR} iscsi://${TGTPORTAL}/${IQNTARGET}/1 > /dev/null || failure
+success
+
+echo -n "Test that data is intact when offering ErrorRecoveryLevel=2 ..."
+./prog_error_recovery -i ${IQNINITIATOR} -l 2 iscsi://${TGTPORTAL}/${IQNTARGET}/1 > /dev/null || failure
+success
+
+echo -n "Test that a session continues when its connection drops during I/O ..."
+./prog_error_recovery -i ${IQNINITIATOR} -l 2 -f drop iscsi://${TGTPORTAL}/${IQNTARGET}/1 > /dev/null
+case $? in
+    0) success ;;
+    77) skipped ;;
+    *) failure ;;
+esac
+
+shutdown_target
+delete_lun
+
+exit 0
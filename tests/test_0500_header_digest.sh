@@ -12,6 +12,16 @@ echo -n "Test that we can connect to a target requiring Header Digest ..."
 ./prog_header_digest -i ${IQNINITIATOR} iscsi://${TGTPORTAL}/${IQNTARGET}/1 > /dev/null || failure
 success
 
+enable_data_digest
+
+echo -n "Test that lost and damaged Data-In are asked for again with Header and Data Digest ..."
+./prog_error_recovery -i ${IQNINITIATOR} -f snack iscsi://${TGTPORTAL}/${IQNTARGET}/1 > /dev/null
+case $? in
+    0) success ;;
+    77) skipped ;;
+    *) failure ;;
+esac
+
 shutdown_target
 delete_lun
 
@@ -0,0 +1,18 @@
+#!/bin/sh
+
+. ./functions.sh
+
+echo "Data Digest tests"
+
+start_target
+enable_data_digest
+create_lun
+
+echo -n "Test that data is intact with Data Digest ..."
+./prog_data_digest -i ${IQNINITIATOR} iscsi://${TGTPORTAL}/${IQNTARGET}/1 > /dev/null || failure
+success
+
+shutdown_target
+delete_lun
+
+exit 0
@@ -0,0 +1,17 @@
+#!/bin/sh
+
+. ./functions.sh
+
+echo "Threaded submission tests"
+
+start_target
+create_lun
+
+echo -n "Test submitting commands from several threads ..."
+./prog_threaded_submit -i ${IQNINITIATOR} iscsi://${TGTPORTAL}/${IQNTARGET}/1 > /dev/null || failure
+success
+
+shutdown_target
+delete_lun
+
+exit 0
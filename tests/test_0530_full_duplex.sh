@@ -0,0 +1,17 @@
+#!/bin/sh
+
+. ./functions.sh
+
+echo "Full duplex tests"
+
+start_target
+create_lun
+
+echo -n "Test reading and writing at the same time ..."
+./prog_full_duplex -i ${IQNINITIATOR} iscsi://${TGTPORTAL}/${IQNTARGET}/1 > /dev/null || failure
+success
+
+shutdown_target
+delete_lun
+
+exit 0
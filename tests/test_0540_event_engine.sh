@@ -0,0 +1,17 @@
+#!/bin/sh
+
+. ./functions.sh
+
+echo "Event engine tests"
+
+start_target
+create_lun
+
+echo -n "Test driving many sessions from one event engine ..."
+./prog_event_engine -i ${IQNINITIATOR} -n 64 iscsi://${TGTPORTAL}/${IQNTARGET}/1 > /dev/null || failure
+success
+
+shutdown_target
+delete_lun
+
+exit 0
@@ -0,0 +1,17 @@
+#!/bin/sh
+
+. ./functions.sh
+
+echo "Executor tests"
+
+start_target
+create_lun
+
+echo -n "Test running sessions on the shards of an executor ..."
+./prog_executor -i ${IQNINITIATOR} -n 8 -s 4 iscsi://${TGTPORTAL}/${IQNTARGET}/1 > /dev/null || failure
+success
+
+shutdown_target
+delete_lun
+
+exit 0
@@ -0,0 +1,21 @@
+#!/bin/sh
+
+. ./functions.sh
+
+echo "Completion ring tests"
+
+start_target
+create_lun
+
+echo -n "Test reaping completions from a small completion ring ..."
+./prog_completion_ring -i ${IQNINITIATOR} -r 8 iscsi://${TGTPORTAL}/${IQNTARGET}/1 > /dev/null || failure
+success
+
+echo -n "Test reaping completions from a large completion ring ..."
+./prog_completion_ring -i ${IQNINITIATOR} -r 1024 iscsi://${TGTPORTAL}/${IQNTARGET}/1 > /dev/null || failure
+success
+
+shutdown_target
+delete_lun
+
+exit 0
@@ -47,16 +47,27 @@ int blocks_per_io = 8;
 uint64_t runtime = 0;
 uint64_t finished = 0;
 int logging = 0;
+int num_cores = 0;
+int sessions_per_core = 1;
+int first_cpu = -1;
+struct iscsi_executor *executor = NULL;
 
 struct client {
 	int finished;
 	int in_flight;
 	int random;
 	int random_blocks;
+	unsigned int seed;
+	int shard;
 
 	struct iscsi_context *iscsi;
 	struct scsi_iovec perf_iov;
 
+	/* tasks are reused for every request */
+	struct scsi_task *tasks;
+	struct scsi_task **free_tasks;
+	int num_free_tasks;
+
 	int lun;
 	uint16_t blocksize;
 	uint64_t num_blocks;
@@ -129,7 +140,7 @@ void progress(struct client *client) {
 void cb(struct iscsi_context *iscsi, int status, void *command_data, void *private_data)
 {
 	struct client *client = (struct client *)private_data;
-	struct scsi_task *task = command_data, *task2 = NULL;
+	struct scsi_task *task = command_data;
 	struct scsi_read16_cdb *read16_cdb = NULL;
         uint64_t tmp;
         uint32_t datalen;
@@ -155,19 +166,19 @@ void cb(struct iscsi_context *iscsi, int status, void *command_data, void *priva
 			client->err_cnt++;
 			goto out;
 		}
-		task2 = iscsi_read16_task(client->iscsi,
-                                          client->lun, read16_cdb->lba,
-                                          datalen,
-                                          client->blocksize, 0, 0, 0, 0, 0,
-                                          cb, client);
-		if (task2 == NULL) {
-			fprintf(stderr, "failed to send read16 command\n");
-			client->err_cnt++;
-		}
-		scsi_task_set_iov_in(task2, &client->perf_iov, 1);
 		if (status == SCSI_STATUS_BUSY) {
 			client->busy_cnt++;
 		}
+		if (iscsi_read16_rearm_task(client->iscsi, task,
+					    client->lun, read16_cdb->lba,
+					    datalen,
+					    client->blocksize, 0, 0, 0, 0, 0,
+					    cb, client, &client->perf_iov, 1) != 0) {
+			fprintf(stderr, "failed to send read16 command\n");
+			client->err_cnt++;
+			goto out;
+		}
+		return;
 	} else if (status == SCSI_STATUS_CANCELLED) {
 		client->err_cnt++;
 	} else if (status == SCSI_STATUS_GOOD) {
@@ -181,10 +192,12 @@ void cb(struct iscsi_context *iscsi, int status, void *command_data, void *priva
 	}
 
 out:
-	scsi_free_scsi_task(task);
+	client->free_tasks[client->num_free_tasks++] = task;
 	
 	if (!client->err_cnt) {
-		progress(client);
+		if (executor == NULL) {
+			progress(client);
+		}
 		client->iops++;
 		client->in_flight--;
 		fill_read_queue(client);
@@ -204,7 +217,7 @@ void fill_read_queue(struct client *client)
 		client->in_flight++;
 
 		if (client->random) {
-			client->pos = rand() % client->num_blocks;
+			client->pos = rand_r(&client->seed) % client->num_blocks;
 		}
 
 		num_blocks = client->num_blocks - client->pos;
@@ -213,26 +226,230 @@ void fill_read_queue(struct client *client)
 		}
 		
 		if (client->random_blocks) {
-			num_blocks = rand() % num_blocks + 1;
+			num_blocks = rand_r(&client->seed) % num_blocks + 1;
 		}
 
-		task = iscsi_read16_task(client->iscsi,
-								client->lun, client->pos,
-								(uint32_t)(num_blocks * client->blocksize),
-								client->blocksize, 0, 0, 0, 0, 0,
-								cb, client);
-		if (task == NULL) {
+		task = client->free_tasks[--client->num_free_tasks];
+		if (iscsi_read16_rearm_task(client->iscsi, task,
+					    client->lun, client->pos,
+					    (uint32_t)(num_blocks * client->blocksize),
+					    client->blocksize, 0, 0, 0, 0, 0,
+					    cb, client, &client->perf_iov, 1) != 0) {
 			fprintf(stderr, "failed to send read16 command\n");
 			iscsi_destroy_context(client->iscsi);
 			exit(10);
 		}
-		scsi_task_set_iov_in(task, &client->perf_iov, 1);
 		client->pos += num_blocks;
 	}
 }
 
+void setup_tasks(struct client *client)
+{
+	int i;
+
+	client->perf_iov.iov_base = malloc((size_t)(blocks_per_io * client->blocksize));
+	if (!client->perf_iov.iov_base) {
+		fprintf(stderr, "Out of Memory\n");
+		exit(10);
+	}
+	client->perf_iov.iov_len = (size_t)(blocks_per_io * client->blocksize);
+
+	client->tasks = malloc(max_in_flight * sizeof(struct scsi_task));
+	client->free_tasks = malloc(max_in_flight * sizeof(struct scsi_task *));
+	if (!client->tasks || !client->free_tasks) {
+		fprintf(stderr, "Out of Memory\n");
+		exit(10);
+	}
+	for (i = 0; i < max_in_flight; i++) {
+		scsi_task_init(&client->tasks[i]);
+		client->free_tasks[client->num_free_tasks++] = &client->tasks[i];
+	}
+}
+
+void free_tasks(struct client *client)
+{
+	int i;
+
+	for (i = 0; i < max_in_flight; i++) {
+		scsi_free_scsi_task(&client->tasks[i]);
+	}
+	free(client->tasks);
+	free(client->free_tasks);
+	free(client->perf_iov.iov_base);
+}
+
+/*
+ * With -c every core runs its share of the sessions on a shard of an
+ * executor, each session doing what the single session does without it.
+ * The main thread only adds up and prints the numbers.
+ */
+void session_failed(struct iscsi_context *iscsi, int status, void *command_data, void *private_data)
+{
+	struct client *client = (struct client *)private_data;
+
+	fprintf(stderr, "\nsession failed: %s\n", iscsi_get_error(iscsi));
+	client->err_cnt++;
+	client->in_flight = 0;
+}
+
+void start_client(struct iscsi_executor *ex, int shard, void *private_data)
+{
+	fill_read_queue((struct client *)private_data);
+}
+
+int run_sharded(struct client *first, const char *url)
+{
+	struct client *clients;
+	struct iscsi_url *iscsi_url;
+	uint64_t now, last_ns, iops, last_iops = 0, bytes, last_bytes = 0;
+	uint64_t cur_iops, cur_mbps;
+	int i, n = num_cores * sessions_per_core, in_flight, err_cnt, waited;
+
+	clients = calloc(n, sizeof(struct client));
+	if (clients == NULL) {
+		fprintf(stderr, "Out of Memory\n");
+		exit(10);
+	}
+	clients[0] = *first;
+	for (i = 1; i < n; i++) {
+		struct client *client = &clients[i];
+
+		client->lun = first->lun;
+		client->blocksize = first->blocksize;
+		client->num_blocks = first->num_blocks;
+		client->random = first->random;
+		client->random_blocks = first->random_blocks;
+		client->ignore_errors = first->ignore_errors;
+		client->seed = rand();
+		client->pos = client->num_blocks / n * i;
+
+		client->iscsi = iscsi_create_context(initiator);
+		if (client->iscsi == NULL) {
+			fprintf(stderr, "Failed to create context\n");
+			exit(10);
+		}
+		iscsi_url = iscsi_parse_full_url(client->iscsi, url);
+		if (iscsi_url == NULL) {
+			fprintf(stderr, "Failed to parse URL: %s\n",
+				iscsi_get_error(client->iscsi));
+			exit(10);
+		}
+		iscsi_set_session_type(client->iscsi, ISCSI_SESSION_NORMAL);
+		iscsi_set_header_digest(client->iscsi, ISCSI_HEADER_DIGEST_NONE_CRC32C);
+		if (iscsi_full_connect_sync(client->iscsi, iscsi_url->portal, iscsi_url->lun) != 0) {
+			fprintf(stderr, "Login Failed. %s\n", iscsi_get_error(client->iscsi));
+			exit(10);
+		}
+		iscsi_destroy_url(iscsi_url);
+		iscsi_set_reconnect_max_retries(client->iscsi, first->max_reconnects);
+		setup_tasks(client);
+	}
+
+	executor = iscsi_executor_create(num_cores);
+	if (executor == NULL) {
+		fprintf(stderr, "Failed to create executor\n");
+		exit(10);
+	}
+	for (i = 0; first_cpu >= 0 && i < num_cores; i++) {
+		if (iscsi_executor_set_affinity(executor, i, first_cpu + i) != 0) {
+			fprintf(stderr, "Failed to pin core %d to cpu %d\n", i, first_cpu + i);
+			exit(10);
+		}
+	}
+	for (i = 0; i < n; i++) {
+		clients[i].shard = i % num_cores;
+		if (iscsi_executor_add(executor, clients[i].shard, clients[i].iscsi, -1, session_failed, &clients[i]) != 0) {
+			fprintf(stderr, "Failed to add session: %s\n", iscsi_get_error(clients[i].iscsi));
+			exit(10);
+		}
+	}
+	printf("running %d sessions on %d cores\n\n", n, num_cores);
+
+	first->first_ns = last_ns = get_clock_ns();
+	if (iscsi_executor_start(executor) != 0) {
+		fprintf(stderr, "Failed to start executor\n");
+		exit(10);
+	}
+	for (i = 0; i < n; i++) {
+		iscsi_executor_call(executor, clients[i].shard, start_client, &clients[i]);
+	}
+
+	/* the counters belong to the cores, reading them here is only
+	 * approximately right
+	 */
+	for (waited = 0; waited < 30000; ) {
+		usleep(finished ? 10000 : 100000);
+		if (finished) {
+			waited += 10;
+		}
+		iops = bytes = 0;
+		in_flight = err_cnt = 0;
+		for (i = 0; i < n; i++) {
+			iops += clients[i].iops;
+			bytes += clients[i].bytes;
+			in_flight += clients[i].in_flight;
+			err_cnt += clients[i].err_cnt;
+		}
+		if (err_cnt || finished >= 2 || (finished && !in_flight)) {
+			break;
+		}
+		now = get_clock_ns();
+		if (runtime && now - first->first_ns >= runtime * 1000000000ULL) {
+			finished = 1;
+		}
+		if (finished || now - last_ns < 1000000000ULL) {
+			continue;
+		}
+		cur_iops = 1000000000ULL * (iops - last_iops) / (now - last_ns);
+		cur_mbps = 1000000000ULL * (bytes - last_bytes) / (now - last_ns);
+		printf("\r%02" PRIu64 "s - iops current %" PRIu64 " (%" PRIu64 " MB/s), per core %" PRIu64 ", in_flight %d        ",
+		       (uint64_t)((now - first->first_ns) / 1000000000ULL), cur_iops,
+		       cur_mbps >> 20, cur_iops / num_cores, in_flight);
+		if (logging) {
+			printf("\n");
+		}
+		fflush(stdout);
+		last_ns = now;
+		last_iops = iops;
+		last_bytes = bytes;
+	}
+
+	/* takes the sessions back from the cores */
+	iscsi_executor_destroy(executor);
+
+	now = get_clock_ns();
+	iops = bytes = 0;
+	err_cnt = 0;
+	for (i = 0; i < n; i++) {
+		iops += clients[i].iops;
+		bytes += clients[i].bytes;
+		err_cnt += clients[i].err_cnt;
+	}
+	iops = 1000000000.0 * iops / (now - first->first_ns);
+	printf("\riops average %" PRIu64 " (%" PRIu64 " MB/s), per core %" PRIu64 "                                        \n",
+	       iops, (uint64_t)(1000000000.0 * bytes / (now - first->first_ns)) >> 20, iops / num_cores);
+
+	if (!err_cnt && finished < 2) {
+		printf ("\nfinished.\n");
+	} else {
+		printf ("\nABORTED!\n");
+	}
+	for (i = 0; i < n; i++) {
+		if (!err_cnt && finished < 2) {
+			iscsi_logout_sync(clients[i].iscsi);
+		}
+		if (i > 0) {
+			iscsi_destroy_context(clients[i].iscsi);
+			free_tasks(&clients[i]);
+		}
+	}
+	first->err_cnt = err_cnt;
+	free(clients);
+	return err_cnt ? 1 : 0;
+}
+
 void usage(void) {
-	fprintf(stderr,"Usage: iscsi-perf [-i <initiator-name>] [-m <max_requests>] [-b blocks_per_request] [-t timeout] [-r|--random] [-l|--logging] [-n|--ignore-errors] [-x <max_reconnects>] <LUN>\n");
+	fprintf(stderr,"Usage: iscsi-perf [-i <initiator-name>] [-m <max_requests>] [-b blocks_per_request] [-t timeout] [-r|--random] [-l|--logging] [-n|--ignore-errors] [-x <max_reconnects>] [-c <cores> [-s <sessions_per_core>] [-a <first_cpu>]] <LUN>\n");
 	exit(1);
 }
 
@@ -268,6 +485,9 @@ int main(int argc, char *argv[])
 		{"random-blocks",  no_argument,          NULL,        'R'},
 		{"logging",        no_argument,          NULL,        'l'},
 		{"ignore-errors",  no_argument,          NULL,        'n'},
+		{"cores",          required_argument,    NULL,        'c'},
+		{"sessions",       required_argument,    NULL,        's'},
+		{"affinity",       required_argument,    NULL,        'a'},
 		{0, 0, 0, 0}
 	};
 	int option_index;
@@ -279,7 +499,7 @@ int main(int argc, char *argv[])
 	
 	printf("iscsi-perf version %s - (c) 2014-2015 by Peter Lieven <pl@ĸamp.de>\n\n", PERF_VERSION);
 
-	while ((c = getopt_long(argc, argv, "i:m:b:t:lnrRx:", long_options,
+	while ((c = getopt_long(argc, argv, "i:m:b:t:lnrRx:c:s:a:", long_options,
 			&option_index)) != -1) {
 		switch (c) {
 		case 'i':
@@ -309,6 +529,15 @@ int main(int argc, char *argv[])
 		case 'x':
 			client.max_reconnects = atoi(optarg);
 			break;
+		case 'c':
+			num_cores = atoi(optarg);
+			break;
+		case 's':
+			sessions_per_core = atoi(optarg);
+			break;
+		case 'a':
+			first_cpu = atoi(optarg);
+			break;
 		default:
 			fprintf(stderr, "Unrecognized option '%c'\n\n", c);
 			usage();
@@ -323,6 +552,8 @@ int main(int argc, char *argv[])
 
 	if (url == NULL) usage();
 
+	if (num_cores < 0 || sessions_per_core < 1) usage();
+
 	client.iscsi = iscsi_create_context(initiator);
 	if (client.iscsi == NULL) {
 		fprintf(stderr, "Failed to create context\n");
@@ -347,7 +578,6 @@ int main(int argc, char *argv[])
 	}
 
 	printf("connected to %s\n", url);
-	free(url);
 
 	client.lun = iscsi_url->lun;
 	iscsi_destroy_url(iscsi_url);
@@ -369,12 +599,8 @@ int main(int argc, char *argv[])
 
 	scsi_free_scsi_task(task);
 
-	client.perf_iov.iov_base = malloc((size_t)(blocks_per_io * client.blocksize));
-	if (!client.perf_iov.iov_base) {
-		fprintf(stderr, "Out of Memory\n");
-		exit(10);
-	}
-	client.perf_iov.iov_len = (size_t)(blocks_per_io * client.blocksize);
+	client.seed = rand();
+	setup_tasks(&client);
 
 	printf("capacity is %" PRIu64 " blocks or %" PRIu64 " byte (%" PRIu64 " MB)\n", client.num_blocks, client.num_blocks * client.blocksize,
 	                                                        (client.num_blocks * client.blocksize) >> 20);
@@ -408,6 +634,15 @@ int main(int argc, char *argv[])
 
 	iscsi_set_reconnect_max_retries(client.iscsi, client.max_reconnects);
 
+	if (num_cores > 0) {
+		c = run_sharded(&client, url);
+		free(url);
+		iscsi_destroy_context(client.iscsi);
+		free_tasks(&client);
+		return c;
+	}
+	free(url);
+
 	fill_read_queue(&client);
 
 	alarm(NOP_INTERVAL);
@@ -453,8 +688,7 @@ int main(int argc, char *argv[])
 		printf ("\nABORTED!\n");
 	}
 	iscsi_destroy_context(client.iscsi);
-
-	free(client.perf_iov.iov_base);
+	free_tasks(&client);
 
 	return client.err_cnt ? 1 : 0;
 }